@@ -0,0 +1,885 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "archive.h"
+#include "crc32c.h"
+
+#define ARCHIVE_CHUNK_MAGIC "SCHK"
+#define ARCHIVE_TRAILER_MAGIC "SIDX"
+#define ARCHIVE_CHUNK_CAPACITY ((size_t) ARCHIVE_CHUNK_RECORDS * ARCHIVE_MAX_RECORD_SIZE)
+#define ARCHIVE_INITIAL_INDEX_CAPACITY 64
+#define ARCHIVE_SCAN_WINDOW 65536
+#define ARCHIVE_TEMP_SUFFIX ".tmp"
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8u;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8u * i);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8u * i);
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t) (p[0] | p[1] << 8u);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint8_t type_blocks(uint8_t type) {
+    return type == ARCHIVE_TYPE_SRI512 ? 16 : 128;
+}
+
+// Reference block, blocks past the reference read as erased
+static const uint8_t *reference_block(const uint8_t *reference, uint8_t reference_blocks, uint8_t block) {
+    static const uint8_t erased[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+    return block < reference_blocks ? reference + block * 4 : erased;
+}
+
+static uint32_t image_crc(const struct srix_image *image) {
+    uint32_t crc = crc32c(0, image->bytes, srix_image_size(image));
+    if (image->has_system_block) {
+        crc = crc32c(crc, image->system_block, sizeof(image->system_block));
+    }
+    return crc;
+}
+
+/* Shared by reader and writer */
+static int read_header(FILE *fp, uint8_t *reference, uint8_t *reference_blocks) {
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    if (fseeko(fp, 0, SEEK_SET) != 0 || fread(header, sizeof(header), 1, fp) != 1) {
+        return ARCHIVE_EREAD;
+    }
+    if (memcmp(header, ARCHIVE_MAGIC, 8) != 0 || get_le16(header + 8) != ARCHIVE_VERSION) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    *reference_blocks = header[10];
+    if (*reference_blocks == 0 || *reference_blocks > SRIX_IMAGE_MAX_BLOCKS) {
+        return ARCHIVE_EFORMAT;
+    }
+    if (fread(reference, (size_t) *reference_blocks * 4, 1, fp) != 1) {
+        return ARCHIVE_EREAD;
+    }
+    if (crc32c(0, reference, (size_t) *reference_blocks * 4) != get_le32(header + 12)) {
+        return ARCHIVE_ECRC;
+    }
+
+    return ARCHIVE_SUCCESS;
+}
+
+// Index of the trailer at trailer_offset, which must directly follow it
+static int load_index(FILE *fp, uint64_t trailer_offset, struct archive_index_entry **index, size_t *chunk_count, uint64_t *record_count) {
+    uint8_t trailer[ARCHIVE_TRAILER_SIZE];
+    if (fseeko(fp, (off_t) trailer_offset, SEEK_SET) != 0 || fread(trailer, sizeof(trailer), 1, fp) != 1) {
+        return ARCHIVE_EREAD;
+    }
+    if (memcmp(trailer, ARCHIVE_TRAILER_MAGIC, 4) != 0) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    // A torn trailer must never pass, whatever its last word reads
+    if (get_le32(trailer + 28) != crc32c(0, trailer, 28)) {
+        return ARCHIVE_ECRC;
+    }
+
+    size_t count = get_le32(trailer + 4);
+    uint64_t index_offset = get_le64(trailer + 8);
+    size_t index_size = count * ARCHIVE_INDEX_ENTRY_SIZE;
+    if (index_offset + index_size != trailer_offset) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    uint8_t *raw = malloc(index_size + 1);
+    struct archive_index_entry *entries = calloc(count + 1, sizeof(struct archive_index_entry));
+    if (raw == NULL || entries == NULL) {
+        free(raw);
+        free(entries);
+        return ARCHIVE_ENOMEM;
+    }
+
+    if (fseeko(fp, (off_t) index_offset, SEEK_SET) != 0 || (index_size > 0 && fread(raw, index_size, 1, fp) != 1)) {
+        free(raw);
+        free(entries);
+        return ARCHIVE_EREAD;
+    }
+    if (crc32c(0, raw, index_size) != get_le32(trailer + 24)) {
+        free(raw);
+        free(entries);
+        return ARCHIVE_ECRC;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *entry = raw + i * ARCHIVE_INDEX_ENTRY_SIZE;
+        entries[i].offset = get_le64(entry);
+        entries[i].first_record = get_le64(entry + 8);
+        entries[i].record_count = get_le32(entry + 16);
+        entries[i].size = get_le32(entry + 20);
+    }
+    free(raw);
+
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].size < ARCHIVE_CHUNK_HEADER_SIZE || entries[i].offset + entries[i].size > index_offset) {
+            free(entries);
+            return ARCHIVE_EFORMAT;
+        }
+    }
+
+    *index = entries;
+    *chunk_count = count;
+    *record_count = get_le64(trailer + 16);
+    return ARCHIVE_SUCCESS;
+}
+
+// Last valid trailer, end is where it stops
+static int read_index(FILE *fp, struct archive_index_entry **index, size_t *chunk_count, uint64_t *record_count, uint64_t *end) {
+    if (fseeko(fp, 0, SEEK_END) != 0) {
+        return ARCHIVE_EREAD;
+    }
+    off_t size = ftello(fp);
+    if (size < ARCHIVE_HEADER_SIZE + ARCHIVE_TRAILER_SIZE) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    int result = load_index(fp, (uint64_t) (size - ARCHIVE_TRAILER_SIZE), index, chunk_count, record_count);
+    if (result == ARCHIVE_SUCCESS || result == ARCHIVE_ENOMEM) {
+        *end = (uint64_t) size;
+        return result;
+    }
+
+    // An append cut short leaves its bytes after the trailer it did not replace
+    uint8_t *window = malloc(ARCHIVE_SCAN_WINDOW + 3);
+    if (window == NULL) {
+        return ARCHIVE_ENOMEM;
+    }
+    off_t high = size - ARCHIVE_TRAILER_SIZE;
+    while (high > ARCHIVE_HEADER_SIZE) {
+        off_t low = high - ARCHIVE_SCAN_WINDOW > ARCHIVE_HEADER_SIZE ? high - ARCHIVE_SCAN_WINDOW : ARCHIVE_HEADER_SIZE;
+        size_t length = (size_t) (high - low) + 3;
+        if (fseeko(fp, low, SEEK_SET) != 0 || fread(window, length, 1, fp) != 1) {
+            free(window);
+            return ARCHIVE_EREAD;
+        }
+
+        for (off_t offset = high - 1; offset >= low; offset--) {
+            if (memcmp(window + (offset - low), ARCHIVE_TRAILER_MAGIC, 4) != 0) {
+                continue;
+            }
+            if (load_index(fp, (uint64_t) offset, index, chunk_count, record_count) == ARCHIVE_SUCCESS) {
+                free(window);
+                *end = (uint64_t) offset + ARCHIVE_TRAILER_SIZE;
+                return ARCHIVE_SUCCESS;
+            }
+        }
+        high = low;
+    }
+    free(window);
+
+    return result;
+}
+
+static int load_chunk(FILE *fp, const struct archive_index_entry *entry, uint8_t *buffer, size_t *raw_size) {
+    uint8_t header[ARCHIVE_CHUNK_HEADER_SIZE];
+    if (fseeko(fp, (off_t) entry->offset, SEEK_SET) != 0 || fread(header, sizeof(header), 1, fp) != 1) {
+        return ARCHIVE_EREAD;
+    }
+    if (memcmp(header, ARCHIVE_CHUNK_MAGIC, 4) != 0 || get_le32(header + 4) != entry->record_count) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    uLongf size = get_le32(header + 8);
+    uint32_t compressed_size = get_le32(header + 12);
+    if (size > ARCHIVE_CHUNK_CAPACITY) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    uint8_t *compressed = malloc(compressed_size);
+    if (compressed == NULL) {
+        return ARCHIVE_ENOMEM;
+    }
+    if (fread(compressed, compressed_size, 1, fp) != 1) {
+        free(compressed);
+        return ARCHIVE_EREAD;
+    }
+
+    uLongf expected_size = size;
+    int result = uncompress(buffer, &size, compressed, compressed_size);
+    free(compressed);
+    if (result != Z_OK || size != expected_size) {
+        return ARCHIVE_EZLIB;
+    }
+    if (crc32c(0, buffer, size) != get_le32(header + 16)) {
+        return ARCHIVE_ECRC;
+    }
+
+    *raw_size = size;
+    return ARCHIVE_SUCCESS;
+}
+
+// Size of the record at the start of data, 0 if it does not fit
+static size_t record_size(const uint8_t *data, size_t available) {
+    if (available < ARCHIVE_RECORD_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint8_t blocks = type_blocks(data[16]);
+    size_t size = ARCHIVE_RECORD_HEADER_SIZE + blocks / 8 + (size_t) data[18] * 4;
+    if (data[17] & ARCHIVE_RECORD_SYSTEM_BLOCK) {
+        size += 4;
+    }
+
+    return size <= available ? size : 0;
+}
+
+/* Writer */
+static void writer_discard(struct archive_writer *writer) {
+    if (writer->out != NULL && writer->out != writer->fp) {
+        fclose(writer->out);
+        unlink(writer->temp_path);
+    }
+    if (writer->fp != NULL) {
+        fclose(writer->fp);
+    }
+    free(writer->path);
+    free(writer->temp_path);
+    free(writer->index);
+    free(writer->chunk);
+    writer->fp = NULL;
+    writer->out = NULL;
+    writer->path = NULL;
+    writer->temp_path = NULL;
+    writer->index = NULL;
+    writer->chunk = NULL;
+}
+
+// Renames are durable once their directory is
+static int sync_directory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *directory = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t) (slash - path));
+    if (directory == NULL) {
+        return ARCHIVE_ENOMEM;
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(directory);
+    if (fd < 0) {
+        return ARCHIVE_EWRITE;
+    }
+    int result = fsync(fd) == 0 ? ARCHIVE_SUCCESS : ARCHIVE_EWRITE;
+    close(fd);
+
+    return result;
+}
+
+// Locked for the whole session, a writer that compacted the archive meanwhile replaced the file
+static FILE *open_locked(const char *path, int *result) {
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            *result = ARCHIVE_EOPEN;
+            return NULL;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            *result = ARCHIVE_ELOCK;
+            return NULL;
+        }
+
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(path, &current) == 0 && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+            FILE *fp = fdopen(fd, "r+b");
+            if (fp == NULL) {
+                close(fd);
+                *result = ARCHIVE_EOPEN;
+            }
+            return fp;
+        }
+        close(fd);
+    }
+}
+
+static FILE *open_temp(struct archive_writer *writer) {
+    int fd = open(writer->temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    FILE *fp = fdopen(fd, "w+b");
+    if (fp == NULL) {
+        close(fd);
+        unlink(writer->temp_path);
+    }
+    return fp;
+}
+
+int archive_writer_open(struct archive_writer *writer, const char *path) {
+    memset(writer, 0, sizeof(struct archive_writer));
+
+    writer->chunk = malloc(ARCHIVE_CHUNK_CAPACITY);
+    writer->path = strdup(path);
+    writer->temp_path = malloc(strlen(path) + sizeof(ARCHIVE_TEMP_SUFFIX));
+    if (writer->chunk == NULL || writer->path == NULL || writer->temp_path == NULL) {
+        writer_discard(writer);
+        return ARCHIVE_ENOMEM;
+    }
+    sprintf(writer->temp_path, "%s%s", path, ARCHIVE_TEMP_SUFFIX);
+
+    int result = ARCHIVE_SUCCESS;
+    writer->fp = open_locked(path, &result);
+    if (writer->fp == NULL) {
+        writer_discard(writer);
+        return result;
+    }
+
+    // New archive, built in a temporary file and renamed once complete
+    if (fseeko(writer->fp, 0, SEEK_END) != 0 || ftello(writer->fp) == 0) {
+        writer->out = open_temp(writer);
+        if (writer->out == NULL) {
+            writer_discard(writer);
+            return ARCHIVE_EOPEN;
+        }
+        return ARCHIVE_SUCCESS;
+    }
+    off_t size = ftello(writer->fp);
+
+    result = read_header(writer->fp, writer->reference, &writer->reference_blocks);
+    uint64_t end = 0;
+    if (result == ARCHIVE_SUCCESS) {
+        result = read_index(writer->fp, &writer->index, &writer->chunk_count, &writer->record_count, &end);
+    }
+    if (result != ARCHIVE_SUCCESS) {
+        writer_discard(writer);
+        return result;
+    }
+    writer->index_capacity = writer->chunk_count + 1;
+    writer->out = writer->fp;
+
+    // Nothing after the last trailer was ever committed
+    if (end < (uint64_t) size && ftruncate(fileno(writer->fp), (off_t) end) != 0) {
+        writer_discard(writer);
+        return ARCHIVE_EWRITE;
+    }
+    writer->chunk_offset = end;
+
+    // The last chunk is written again with the new records while it has room
+    if (writer->chunk_count > 0) {
+        struct archive_index_entry *last = &writer->index[writer->chunk_count - 1];
+        if (last->record_count < ARCHIVE_CHUNK_RECORDS) {
+            result = load_chunk(writer->fp, last, writer->chunk, &writer->chunk_size);
+            if (result != ARCHIVE_SUCCESS) {
+                writer_discard(writer);
+                return result;
+            }
+
+            writer->chunk_records = last->record_count;
+            writer->record_count -= last->record_count;
+            writer->chunk_count--;
+        }
+    }
+
+    return ARCHIVE_SUCCESS;
+}
+
+static int write_header(struct archive_writer *writer, FILE *fp) {
+    uint8_t header[ARCHIVE_HEADER_SIZE] = {};
+    size_t reference_size = (size_t) writer->reference_blocks * 4;
+
+    memcpy(header, ARCHIVE_MAGIC, 8);
+    put_le16(header + 8, ARCHIVE_VERSION);
+    header[10] = writer->reference_blocks;
+    put_le32(header + 12, crc32c(0, writer->reference, reference_size));
+
+    if (fseeko(fp, 0, SEEK_SET) != 0 || fwrite(header, sizeof(header), 1, fp) != 1 ||
+            fwrite(writer->reference, reference_size, 1, fp) != 1) {
+        return ARCHIVE_EWRITE;
+    }
+
+    writer->chunk_offset = ARCHIVE_HEADER_SIZE + reference_size;
+    return ARCHIVE_SUCCESS;
+}
+
+static int add_index_entry(struct archive_writer *writer, uint64_t offset, uint32_t size) {
+    if (writer->chunk_count == writer->index_capacity) {
+        size_t capacity = writer->index_capacity == 0 ? ARCHIVE_INITIAL_INDEX_CAPACITY : writer->index_capacity * 2;
+        struct archive_index_entry *index = realloc(writer->index, capacity * sizeof(struct archive_index_entry));
+        if (index == NULL) {
+            return ARCHIVE_ENOMEM;
+        }
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+    writer->index[writer->chunk_count].offset = offset;
+    writer->index[writer->chunk_count].first_record = writer->record_count;
+    writer->index[writer->chunk_count].record_count = writer->chunk_records;
+    writer->index[writer->chunk_count].size = size;
+    writer->chunk_count++;
+
+    return ARCHIVE_SUCCESS;
+}
+
+static int flush_chunk(struct archive_writer *writer) {
+    if (writer->chunk_records == 0) {
+        return ARCHIVE_SUCCESS;
+    }
+
+    uLongf compressed_size = compressBound(writer->chunk_size);
+    uint8_t *compressed = malloc(ARCHIVE_CHUNK_HEADER_SIZE + compressed_size);
+    if (compressed == NULL) {
+        return ARCHIVE_ENOMEM;
+    }
+    if (compress2(compressed + ARCHIVE_CHUNK_HEADER_SIZE, &compressed_size, writer->chunk, writer->chunk_size, Z_BEST_COMPRESSION) != Z_OK) {
+        free(compressed);
+        return ARCHIVE_EZLIB;
+    }
+
+    memcpy(compressed, ARCHIVE_CHUNK_MAGIC, 4);
+    put_le32(compressed + 4, writer->chunk_records);
+    put_le32(compressed + 8, (uint32_t) writer->chunk_size);
+    put_le32(compressed + 12, (uint32_t) compressed_size);
+    put_le32(compressed + 16, crc32c(0, writer->chunk, writer->chunk_size));
+    put_le32(compressed + 20, 0);
+
+    size_t total_size = ARCHIVE_CHUNK_HEADER_SIZE + compressed_size;
+    if (fseeko(writer->out, (off_t) writer->chunk_offset, SEEK_SET) != 0 || fwrite(compressed, total_size, 1, writer->out) != 1) {
+        free(compressed);
+        return ARCHIVE_EWRITE;
+    }
+    free(compressed);
+
+    int result = add_index_entry(writer, writer->chunk_offset, (uint32_t) total_size);
+    if (result != ARCHIVE_SUCCESS) {
+        return result;
+    }
+
+    writer->record_count += writer->chunk_records;
+    writer->chunk_offset += total_size;
+    writer->chunk_size = 0;
+    writer->chunk_records = 0;
+
+    return ARCHIVE_SUCCESS;
+}
+
+/*
+ * Index and trailer after the last chunk. Chunks and index are synced before
+ * the trailer is written, so a trailer that made it to disk only ever points
+ * at complete data. Readers use the last valid trailer.
+ */
+static int commit(struct archive_writer *writer, FILE *fp) {
+    size_t index_size = writer->chunk_count * ARCHIVE_INDEX_ENTRY_SIZE;
+    uint8_t *raw = calloc(1, index_size + ARCHIVE_TRAILER_SIZE);
+    if (raw == NULL) {
+        return ARCHIVE_ENOMEM;
+    }
+
+    for (size_t i = 0; i < writer->chunk_count; i++) {
+        uint8_t *entry = raw + i * ARCHIVE_INDEX_ENTRY_SIZE;
+        put_le64(entry, writer->index[i].offset);
+        put_le64(entry + 8, writer->index[i].first_record);
+        put_le32(entry + 16, writer->index[i].record_count);
+        put_le32(entry + 20, writer->index[i].size);
+    }
+
+    uint8_t *trailer = raw + index_size;
+    memcpy(trailer, ARCHIVE_TRAILER_MAGIC, 4);
+    put_le32(trailer + 4, (uint32_t) writer->chunk_count);
+    put_le64(trailer + 8, writer->chunk_offset);
+    put_le64(trailer + 16, writer->record_count);
+    put_le32(trailer + 24, crc32c(0, raw, index_size));
+    put_le32(trailer + 28, crc32c(0, trailer, 28));
+
+    int result = ARCHIVE_SUCCESS;
+    if (fseeko(fp, (off_t) writer->chunk_offset, SEEK_SET) != 0 ||
+            (index_size > 0 && fwrite(raw, index_size, 1, fp) != 1) ||
+            fflush(fp) != 0 || fsync(fileno(fp)) != 0 ||
+            fwrite(trailer, ARCHIVE_TRAILER_SIZE, 1, fp) != 1 ||
+            fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        result = ARCHIVE_EWRITE;
+    }
+    free(raw);
+
+    return result;
+}
+
+static int replace_archive(struct archive_writer *writer, FILE *fp) {
+    if (fclose(fp) != 0) {
+        unlink(writer->temp_path);
+        return ARCHIVE_EWRITE;
+    }
+    if (rename(writer->temp_path, writer->path) != 0) {
+        unlink(writer->temp_path);
+        return ARCHIVE_EWRITE;
+    }
+    return sync_directory(writer->path);
+}
+
+// Referenced chunks copied as they are to a new file, renamed over the archive
+static int compact(struct archive_writer *writer) {
+    FILE *fp = open_temp(writer);
+    if (fp == NULL) {
+        return ARCHIVE_EOPEN;
+    }
+
+    int result = write_header(writer, fp);
+    uint8_t *buffer = NULL;
+    for (size_t i = 0; i < writer->chunk_count && result == ARCHIVE_SUCCESS; i++) {
+        struct archive_index_entry *entry = &writer->index[i];
+        uint8_t *resized = realloc(buffer, entry->size);
+        if (resized == NULL) {
+            result = ARCHIVE_ENOMEM;
+            break;
+        }
+        buffer = resized;
+
+        if (fseeko(writer->fp, (off_t) entry->offset, SEEK_SET) != 0 || fread(buffer, entry->size, 1, writer->fp) != 1) {
+            result = ARCHIVE_EREAD;
+        } else if (fwrite(buffer, entry->size, 1, fp) != 1) {
+            result = ARCHIVE_EWRITE;
+        }
+        entry->offset = writer->chunk_offset;
+        writer->chunk_offset += entry->size;
+    }
+    free(buffer);
+
+    if (result == ARCHIVE_SUCCESS) {
+        result = commit(writer, fp);
+    }
+    if (result != ARCHIVE_SUCCESS) {
+        fclose(fp);
+        unlink(writer->temp_path);
+        return result;
+    }
+
+    return replace_archive(writer, fp);
+}
+
+int archive_writer_add(struct archive_writer *writer, const struct srix_image *image, int64_t timestamp) {
+    int result;
+
+    // First record of a new archive
+    if (writer->reference_blocks == 0) {
+        writer->reference_blocks = image->blocks;
+        memcpy(writer->reference, image->bytes, srix_image_size(image));
+        if ((result = write_header(writer, writer->out)) != ARCHIVE_SUCCESS) {
+            return result;
+        }
+    }
+
+    uint8_t type = image->blocks == SRIX_IMAGE_MAX_BLOCKS ? ARCHIVE_TYPE_SRIX4K : ARCHIVE_TYPE_SRI512;
+    uint8_t *record = writer->chunk + writer->chunk_size;
+    uint8_t *bitmap = record + ARCHIVE_RECORD_HEADER_SIZE;
+    uint8_t *data = bitmap + image->blocks / 8;
+
+    // Only the blocks that differ from the reference
+    uint8_t changed = 0;
+    memset(bitmap, 0, image->blocks / 8);
+    for (uint8_t block = 0; block < image->blocks; block++) {
+        const uint8_t *bytes = srix_image_block_bytes_const(image, block);
+        if (memcmp(bytes, reference_block(writer->reference, writer->reference_blocks, block), 4) != 0) {
+            bitmap[block / 8] |= 1u << (block % 8);
+            memcpy(data + changed * 4, bytes, 4);
+            changed++;
+        }
+    }
+    data += changed * 4;
+
+    uint8_t flags = 0;
+    if (image->has_system_block) {
+        flags |= ARCHIVE_RECORD_SYSTEM_BLOCK;
+        memcpy(data, image->system_block, 4);
+        data += 4;
+    }
+
+    put_le64(record, image->uid);
+    put_le64(record + 8, (uint64_t) timestamp);
+    record[16] = type;
+    record[17] = flags;
+    record[18] = changed;
+    record[19] = 0;
+    put_le32(record + 20, image_crc(image));
+
+    writer->chunk_size = data - writer->chunk;
+    writer->chunk_records++;
+    writer->added++;
+
+    if (writer->chunk_records == ARCHIVE_CHUNK_RECORDS) {
+        return flush_chunk(writer);
+    }
+    return ARCHIVE_SUCCESS;
+}
+
+int archive_writer_close(struct archive_writer *writer) {
+    int result = ARCHIVE_SUCCESS;
+    if (writer->fp == NULL) {
+        return result;
+    }
+
+    if (writer->added > 0) {
+        result = flush_chunk(writer);
+        if (result == ARCHIVE_SUCCESS) {
+            result = commit(writer, writer->out);
+        }
+    }
+
+    if (result == ARCHIVE_SUCCESS && writer->added > 0 && writer->out != writer->fp) {
+        FILE *out = writer->out;
+        writer->out = NULL;
+        result = replace_archive(writer, out);
+    } else if (result == ARCHIVE_SUCCESS && writer->added > 0) {
+        // Rewritten chunks and old indexes stay behind, compact once they outweigh the rest
+        uint64_t live = ARCHIVE_HEADER_SIZE + (uint64_t) writer->reference_blocks * 4 + writer->chunk_count * ARCHIVE_INDEX_ENTRY_SIZE + ARCHIVE_TRAILER_SIZE;
+        for (size_t i = 0; i < writer->chunk_count; i++) {
+            live += writer->index[i].size;
+        }
+        uint64_t end = writer->chunk_offset + writer->chunk_count * ARCHIVE_INDEX_ENTRY_SIZE + ARCHIVE_TRAILER_SIZE;
+        if (end - live > live && end - live >= ARCHIVE_COMPACT_MIN_BYTES) {
+            // The records are committed already, a failed compaction only leaves the file larger
+            compact(writer);
+        }
+    }
+
+    writer_discard(writer);
+    return result;
+}
+
+int archive_append(const char *path, const struct srix_image *image, int64_t timestamp) {
+    struct archive_writer writer;
+
+    int result = archive_writer_open(&writer, path);
+    if (result != ARCHIVE_SUCCESS) {
+        return result;
+    }
+
+    result = archive_writer_add(&writer, image, timestamp);
+    int close_result = archive_writer_close(&writer);
+
+    return result != ARCHIVE_SUCCESS ? result : close_result;
+}
+
+/* Reader */
+bool archive_is_archive(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    char magic[8];
+    bool is_archive = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, ARCHIVE_MAGIC, 8) == 0;
+    fclose(fp);
+
+    return is_archive;
+}
+
+int archive_reader_open(struct archive_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(struct archive_reader));
+
+    reader->fp = fopen(path, "rb");
+    if (reader->fp == NULL) {
+        return ARCHIVE_EOPEN;
+    }
+
+    uint64_t end;
+    int result = read_header(reader->fp, reader->reference, &reader->reference_blocks);
+    if (result == ARCHIVE_SUCCESS) {
+        result = read_index(reader->fp, &reader->index, &reader->chunk_count, &reader->record_count, &end);
+    }
+    if (result == ARCHIVE_SUCCESS) {
+        reader->chunk = malloc(ARCHIVE_CHUNK_CAPACITY);
+        reader->chunk_capacity = ARCHIVE_CHUNK_CAPACITY;
+        if (reader->chunk == NULL) {
+            result = ARCHIVE_ENOMEM;
+        }
+    }
+
+    if (result != ARCHIVE_SUCCESS) {
+        archive_reader_close(reader);
+    }
+    return result;
+}
+
+static int reader_load_chunk(struct archive_reader *reader, size_t chunk) {
+    int result = load_chunk(reader->fp, &reader->index[chunk], reader->chunk, &reader->chunk_size);
+    if (result != ARCHIVE_SUCCESS) {
+        return result;
+    }
+
+    reader->chunk_position = 0;
+    reader->chunk_records_left = reader->index[chunk].record_count;
+    reader->next_chunk = chunk + 1;
+    reader->next_record = reader->index[chunk].first_record;
+
+    return ARCHIVE_SUCCESS;
+}
+
+// Random access through the index, only the chunk holding the record is read
+int archive_reader_seek(struct archive_reader *reader, uint64_t record_number) {
+    if (record_number >= reader->record_count) {
+        return ARCHIVE_ERANGE;
+    }
+
+    // Last chunk starting at or before the record
+    size_t low = 0, high = reader->chunk_count;
+    while (high - low > 1) {
+        size_t middle = low + (high - low) / 2;
+        if (reader->index[middle].first_record <= record_number) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    int result = reader_load_chunk(reader, low);
+    if (result != ARCHIVE_SUCCESS) {
+        return result;
+    }
+
+    for (uint64_t skip = record_number - reader->index[low].first_record; skip > 0; skip--) {
+        size_t size = record_size(reader->chunk + reader->chunk_position, reader->chunk_size - reader->chunk_position);
+        if (size == 0) {
+            return ARCHIVE_EFORMAT;
+        }
+        reader->chunk_position += size;
+        reader->chunk_records_left--;
+        reader->next_record++;
+    }
+
+    return ARCHIVE_SUCCESS;
+}
+
+int archive_reader_next(struct archive_reader *reader, struct archive_record *record, struct srix_image *image) {
+    while (reader->chunk_records_left == 0) {
+        if (reader->next_chunk >= reader->chunk_count) {
+            return ARCHIVE_END;
+        }
+
+        int result = reader_load_chunk(reader, reader->next_chunk);
+        if (result != ARCHIVE_SUCCESS) {
+            return result;
+        }
+    }
+
+    const uint8_t *data = reader->chunk + reader->chunk_position;
+    size_t size = record_size(data, reader->chunk_size - reader->chunk_position);
+    if (size == 0) {
+        return ARCHIVE_EFORMAT;
+    }
+
+    record->number = reader->next_record;
+    record->uid = get_le64(data);
+    record->timestamp = (int64_t) get_le64(data + 8);
+    record->type = data[16];
+    record->changed_blocks = data[18];
+
+    // Reference plus the changed blocks
+    uint8_t blocks = type_blocks(record->type);
+    const uint8_t *bitmap = data + ARCHIVE_RECORD_HEADER_SIZE;
+    const uint8_t *changed = bitmap + blocks / 8;
+    srix_image_init(image, blocks);
+    for (uint8_t block = 0; block < blocks; block++) {
+        const uint8_t *source;
+        if (bitmap[block / 8] & (1u << (block % 8))) {
+            source = changed;
+            changed += 4;
+        } else {
+            source = reference_block(reader->reference, reader->reference_blocks, block);
+        }
+        memcpy(srix_image_block_bytes(image, block), source, 4);
+    }
+    srix_image_mark_all_present(image);
+    image->uid = record->uid;
+    image->has_uid = true;
+
+    if (data[17] & ARCHIVE_RECORD_SYSTEM_BLOCK) {
+        memcpy(image->system_block, changed, 4);
+        image->has_system_block = true;
+    }
+
+    reader->chunk_position += size;
+    reader->chunk_records_left--;
+    reader->next_record++;
+
+    if (image_crc(image) != get_le32(data + 20)) {
+        return ARCHIVE_ECRC;
+    }
+    return ARCHIVE_SUCCESS;
+}
+
+void archive_reader_close(struct archive_reader *reader) {
+    if (reader->fp != NULL) {
+        fclose(reader->fp);
+        reader->fp = NULL;
+    }
+    free(reader->index);
+    free(reader->chunk);
+    reader->index = NULL;
+    reader->chunk = NULL;
+}
+
+const char *archive_strerror(int result) {
+    switch (result) {
+        case ARCHIVE_SUCCESS:
+            return "success";
+        case ARCHIVE_END:
+            return "end of archive";
+        case ARCHIVE_EOPEN:
+            return "cannot open file";
+        case ARCHIVE_EREAD:
+            return "error encountered while reading file";
+        case ARCHIVE_EWRITE:
+            return "error encountered while writing file";
+        case ARCHIVE_EFORMAT:
+            return "not an archive or corrupted";
+        case ARCHIVE_ECRC:
+            return "CRC mismatch";
+        case ARCHIVE_ENOMEM:
+            return "out of memory";
+        case ARCHIVE_EZLIB:
+            return "cannot decompress chunk";
+        case ARCHIVE_ERANGE:
+            return "record out of range";
+        case ARCHIVE_ELOCK:
+            return "cannot lock file";
+        default:
+            return "unknown error";
+    }
+}
+
+const char *archive_type_name(uint8_t type) {
+    return type == ARCHIVE_TYPE_SRI512 ? "SRI512" : "SRIX4K";
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_ARCHIVE_H__
+#define __NFC_SRIX_ARCHIVE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "srix_image.h"
+
+/*
+ * Archive layout, every integer is little endian:
+ *
+ *   header     "SRIXARC1", version, reference blocks, CRC32C of the reference
+ *   reference  raw image every record is delta encoded against (first tag)
+ *   chunk...   chunk header + zlib stream of up to ARCHIVE_CHUNK_RECORDS records
+ *   index      one entry per chunk: offset, first record number, record count, size
+ *   trailer    "SIDX", chunk count, index offset, record count, CRC32C of the
+ *              index, CRC32C of the trailer itself
+ *
+ * A record is a fixed header (UID, timestamp, tag type, CRC32C of the full
+ * image) followed by a bitmap of the blocks that differ from the reference
+ * and only those blocks.
+ *
+ * Appends never overwrite committed bytes: the last chunk, while it has room,
+ * is written again after the end of the file with the new records, followed
+ * by a new index and trailer, so one record per srix-dump run still ends up
+ * in large chunks. The trailer is written once everything else is synced and
+ * readers use the last valid one, so a crash loses at most the append in
+ * progress. Writers hold flock(LOCK_EX) for the whole session. Once the
+ * superseded bytes outweigh the rest, the archive is compacted into a
+ * temporary file renamed over it. New archives are built the same way.
+ */
+
+/* Macros */
+#define ARCHIVE_MAGIC "SRIXARC1"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 32
+#define ARCHIVE_CHUNK_HEADER_SIZE 24
+#define ARCHIVE_INDEX_ENTRY_SIZE 24
+#define ARCHIVE_TRAILER_SIZE 32
+#define ARCHIVE_RECORD_HEADER_SIZE 24
+#define ARCHIVE_CHUNK_RECORDS 256
+#define ARCHIVE_MAX_RECORD_SIZE (ARCHIVE_RECORD_HEADER_SIZE + SRIX_IMAGE_MAX_BLOCKS / 8 + SRIX_IMAGE_MAX_SIZE + 4)
+#define ARCHIVE_COMPACT_MIN_BYTES (1u << 20) // Superseded bytes that are never worth a compaction
+
+/* Tag types */
+#define ARCHIVE_TYPE_SRIX4K 0
+#define ARCHIVE_TYPE_SRI512 1
+
+/* Record flags */
+#define ARCHIVE_RECORD_SYSTEM_BLOCK 0x01
+
+/* Return values */
+#define ARCHIVE_SUCCESS 0
+#define ARCHIVE_END 1
+#define ARCHIVE_EOPEN -1
+#define ARCHIVE_EREAD -2
+#define ARCHIVE_EWRITE -3
+#define ARCHIVE_EFORMAT -4
+#define ARCHIVE_ECRC -5
+#define ARCHIVE_ENOMEM -6
+#define ARCHIVE_EZLIB -7
+#define ARCHIVE_ERANGE -8
+#define ARCHIVE_ELOCK -9
+
+struct archive_index_entry {
+    uint64_t offset;
+    uint64_t first_record;
+    uint32_t record_count;
+    uint32_t size; // Chunk header and zlib stream
+};
+
+struct archive_record {
+    uint64_t number;
+    uint64_t uid;
+    int64_t timestamp; // Seconds since the epoch
+    uint8_t type;
+    uint8_t changed_blocks;
+};
+
+struct archive_writer {
+    FILE *fp; // Locked until the writer is closed
+    FILE *out; // fp, or the temporary file of a new archive
+    char *path;
+    char *temp_path;
+    uint8_t reference[SRIX_IMAGE_MAX_SIZE];
+    uint8_t reference_blocks;
+
+    struct archive_index_entry *index;
+    size_t chunk_count;
+    size_t index_capacity;
+    uint64_t record_count;
+    uint64_t added;
+
+    // Records of the chunk being built, written at chunk_offset
+    uint8_t *chunk;
+    size_t chunk_size;
+    uint32_t chunk_records;
+    uint64_t chunk_offset;
+};
+
+struct archive_reader {
+    FILE *fp;
+    uint8_t reference[SRIX_IMAGE_MAX_SIZE];
+    uint8_t reference_blocks;
+
+    struct archive_index_entry *index;
+    size_t chunk_count;
+    uint64_t record_count;
+
+    // Current chunk, decompressed
+    uint8_t *chunk;
+    size_t chunk_capacity;
+    size_t chunk_size;
+    size_t chunk_position;
+    uint32_t chunk_records_left;
+    size_t next_chunk;
+    uint64_t next_record;
+};
+
+/* Writer */
+int archive_writer_open(struct archive_writer *writer, const char *path);
+int archive_writer_add(struct archive_writer *writer, const struct srix_image *image, int64_t timestamp);
+int archive_writer_close(struct archive_writer *writer);
+int archive_append(const char *path, const struct srix_image *image, int64_t timestamp);
+
+/* Reader */
+bool archive_is_archive(const char *path);
+int archive_reader_open(struct archive_reader *reader, const char *path);
+int archive_reader_seek(struct archive_reader *reader, uint64_t record_number);
+int archive_reader_next(struct archive_reader *reader, struct archive_record *record, struct srix_image *image);
+void archive_reader_close(struct archive_reader *reader);
+
+const char *archive_strerror(int result);
+const char *archive_type_name(uint8_t type);
+
+#endif // __NFC_SRIX_ARCHIVE_H__
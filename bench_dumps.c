@@ -0,0 +1,263 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "dump_utils.h"
+#include "dump_format.h"
+#include "write_plan.h"
+#include "srix_image.h"
+
+/* Macros */
+#define BENCH_RANDOM_INPUTS 256
+#define BENCH_DEFAULT_OPS 1000000
+
+struct bench_input {
+    int format;
+    size_t size;
+    uint8_t *data;
+};
+
+/*
+ * Heap calls made by the code under test. Linked with --wrap, so only calls
+ * from this program count, not the ones libc makes for itself.
+ */
+static uint64_t allocations;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocations++;
+    return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    allocations++;
+    return __real_aligned_alloc(alignment, size);
+}
+#endif
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s [dump...] [-h] [-n ops] [-t x4k|512] [-s seed]\n", executable);
+    printf("\nOptional arguments:\n");
+    printf("  [dump...]    real dumps, in any format srix-read reads, fed along with the random ones\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -n ops       parse, diff and plan this many dumps [default: %d]\n", BENCH_DEFAULT_OPS);
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  -s seed      seed of the random dumps [default: 1]\n");
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+// Mostly erased, a few blocks written, like a real tag
+static void random_image(struct srix_image *image, uint8_t blocks) {
+    srix_image_init(image, blocks);
+    memset(image->bytes, 0xFF, srix_image_size(image));
+    for (uint8_t i = 0; i < blocks; i++) {
+        if (rand() % 4 == 0) {
+            srix_image_set_block(image, i, (uint32_t) rand() << 16u ^ (uint32_t) rand());
+        }
+    }
+    image->uid = (uint64_t) rand() << 32u | (uint32_t) rand();
+    image->has_uid = true;
+    image->has_system_block = rand() % 2 == 0;
+    memset(image->system_block, 0xFF, sizeof(image->system_block));
+    image->system_block[rand() % 4] = (uint8_t) rand();
+    srix_image_mark_all_present(image);
+}
+
+// Every format, some cut short or garbled so the error paths are timed too
+static bool random_input(struct bench_input *input, uint8_t blocks, unsigned int n, struct format_writer *writer) {
+    static const int formats[] = {FORMAT_BIN, FORMAT_BIN, FORMAT_REVERSED, FORMAT_EML, FORMAT_JSON, FORMAT_NFC, FORMAT_BIN, FORMAT_JSON};
+
+    struct srix_image image;
+    random_image(&image, blocks);
+    input->format = formats[n % 8];
+    if (srix_format_render(&image, input->format, writer) != FORMAT_SUCCESS) {
+        return false;
+    }
+
+    input->size = writer->used;
+    if (n % 8 == 6) {
+        input->size = (size_t) rand() % writer->used;
+    } else if (n % 8 == 7) {
+        writer->buffer[rand() % writer->used] = (char) rand();
+    }
+
+    input->data = malloc(input->size + 1);
+    if (input->data == NULL) {
+        return false;
+    }
+    memcpy(input->data, writer->buffer, input->size);
+    return true;
+}
+
+static bool file_input(struct bench_input *input, const char *path) {
+    input->format = srix_format_from_path(path);
+    if (input->format < 0) {
+        lerror("No format for \"%s\".\n", path);
+        return false;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        lerror("Cannot open \"%s\".\n", path);
+        return false;
+    }
+    input->data = malloc(FORMAT_READ_BUFFER_SIZE);
+    input->size = input->data != NULL ? fread(input->data, 1, FORMAT_READ_BUFFER_SIZE, fp) : 0;
+    bool read_error = ferror(fp) != 0;
+    fclose(fp);
+
+    if (input->data == NULL || read_error) {
+        lerror("Cannot read \"%s\".\n", path);
+        free(input->data);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    uint64_t ops = BENCH_DEFAULT_OPS;
+    unsigned int seed = 1;
+    uint8_t blocks = SRIX4K_EEPROM_BLOCKS;
+
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hn:t:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    blocks = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            case 's':
+                seed = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Inputs are prepared up front, only parse, diff and plan are timed
+    static struct format_reader reader;
+    static struct format_writer writer;
+    size_t file_count = (size_t) (argc - optind);
+    struct bench_input *inputs = calloc(BENCH_RANDOM_INPUTS + file_count, sizeof(struct bench_input));
+    if (inputs == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+
+    srand(seed);
+    size_t count = 0;
+    for (unsigned int i = 0; i < BENCH_RANDOM_INPUTS; i++) {
+        if (random_input(&inputs[count], blocks, i, &writer)) {
+            count++;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (!file_input(&inputs[count], argv[i])) {
+            exit(1);
+        }
+        count++;
+    }
+
+    // The tag the dumps are restored to
+    struct srix_image current, target;
+    random_image(&current, blocks);
+    srix_image_init(&target, blocks);
+    uint8_t mask[DUMP_MAX_BLOCKS * 4];
+    memset(mask, 0xFF, sizeof(mask));
+
+    struct {
+        uint64_t parse_errors;
+        uint64_t different_blocks;
+        uint64_t writes;
+    } totals = {};
+
+    struct write_plan plan;
+    uint64_t allocations_before = allocations;
+    uint64_t start_us = now_us();
+    for (uint64_t op = 0; op < ops; op++) {
+        const struct bench_input *input = &inputs[op % count];
+
+        target.blocks = blocks;
+        if (srix_format_parse(&target, input->data, input->size, input->format, &reader) != FORMAT_SUCCESS) {
+            totals.parse_errors++;
+            continue;
+        }
+
+        uint64_t mismatches[DUMP_BITMAP_WORDS];
+        totals.different_blocks += srix_masked_compare(target.bytes, current.bytes, mask, srix_image_size(&target), mismatches);
+
+        srix_plan_writes(&plan, &current, &target, op & 1u);
+        totals.writes += plan.writes;
+    }
+    uint64_t elapsed_us = now_us() - start_us;
+    uint64_t op_allocations = allocations - allocations_before;
+
+    printf("Inputs: %zu random, %zu files\n", count - file_count, file_count);
+    printf("Operations: %" PRIu64 " in %" PRIu64 " ms\n", ops, elapsed_us / 1000u);
+    printf("├── parse, diff and plan: %.0f ops/s\n", elapsed_us > 0 ? (double) ops * 1e6 / (double) elapsed_us : 0.0);
+    printf("├── parse errors: %" PRIu64 "\n", totals.parse_errors);
+    printf("├── different blocks: %" PRIu64 ", planned writes: %" PRIu64 "\n", totals.different_blocks, totals.writes);
+#ifdef BENCH_COUNT_ALLOCATIONS
+    printf("└── allocations: %.3f per op\n", ops > 0 ? (double) op_allocations / (double) ops : 0.0);
+#else
+    (void) op_allocations;
+    printf("└── allocations: not counted on this platform\n");
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        free(inputs[i].data);
+    }
+    free(inputs);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <sched.h>
+#include <time.h>
+#include "block_queue.h"
+
+#define BLOCK_QUEUE_MASK (BLOCK_QUEUE_SLOTS - 1)
+
+_Static_assert((BLOCK_QUEUE_SLOTS & BLOCK_QUEUE_MASK) == 0, "queue size must be a power of two");
+
+void block_queue_init(struct block_queue *queue) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->max_depth = 0;
+}
+
+// Only spins if the consumer is a whole queue behind, which a single tag never fills
+void block_queue_push(struct block_queue *queue, const struct block_event *event) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail;
+    while (head - (tail = atomic_load_explicit(&queue->tail, memory_order_acquire)) == BLOCK_QUEUE_SLOTS) {
+        sched_yield();
+    }
+
+    queue->slots[head & BLOCK_QUEUE_MASK] = *event;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    if (head + 1 - tail > queue->max_depth) {
+        queue->max_depth = head + 1 - tail;
+    }
+}
+
+void block_queue_pop(struct block_queue *queue, struct block_event *event) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    unsigned int spins = 0;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = BLOCK_QUEUE_SLEEP_US * 1000L};
+    while (atomic_load_explicit(&queue->head, memory_order_acquire) == tail) {
+        if (spins++ < BLOCK_QUEUE_SPINS) {
+            sched_yield();
+        } else {
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    *event = queue->slots[tail & BLOCK_QUEUE_MASK];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
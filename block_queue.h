@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_BLOCK_QUEUE_H__
+#define __NFC_SRIX_BLOCK_QUEUE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Macros */
+#define BLOCK_QUEUE_SLOTS 256 // Power of two, more than a whole SRIX4K with UID and system block
+#define BLOCK_QUEUE_SPINS 64  // Busy polls before the consumer starts sleeping
+#define BLOCK_QUEUE_SLEEP_US 50
+
+/* Events */
+#define BLOCK_EVENT_UID 0
+#define BLOCK_EVENT_BLOCK 1
+#define BLOCK_EVENT_SYSTEM_BLOCK 2
+#define BLOCK_EVENT_END 3   // Every block was read
+#define BLOCK_EVENT_ABORT 4 // Reading stopped, nothing must be written
+
+struct block_event {
+    uint8_t type;
+    uint8_t block;
+    uint8_t data[8]; // 8 bytes for the UID, 4 for blocks
+};
+
+/*
+ * Lock free single producer, single consumer queue between the thread
+ * talking to the reader and the one doing everything else. The producer
+ * never takes a lock or makes a system call, so the time between two RF
+ * commands is only what it takes to copy a block into a slot.
+ */
+struct block_queue {
+    struct block_event slots[BLOCK_QUEUE_SLOTS];
+    _Alignas(64) atomic_size_t head; // Written by the producer only
+    _Alignas(64) atomic_size_t tail; // Written by the consumer only
+    size_t max_depth;                // Producer side statistic
+};
+
+void block_queue_init(struct block_queue *queue);
+void block_queue_push(struct block_queue *queue, const struct block_event *event);
+void block_queue_pop(struct block_queue *queue, struct block_event *event);
+
+#endif // __NFC_SRIX_BLOCK_QUEUE_H__
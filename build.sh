@@ -15,6 +15,13 @@ mv srix-dump ../
 mv srix-read ../
 mv srix-reset ../
 mv srix-restore ../
+mv srix-shell ../
+mv srix-verify ../
+mv srix-stats ../
+mv srix-convert ../
+mv srix-index ../
+mv srix-history ../
+mv srix-top ../
 
 # Cleanup
 cd ../
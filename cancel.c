@@ -0,0 +1,209 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "cancel.h"
+#include "logging.h"
+
+static atomic_int reason;
+static volatile sig_atomic_t signal_number;
+static sem_t wakeup;
+
+// Operation, protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static nfc_device *armed_reader;
+static bool armed;
+static bool paused;
+static unsigned int armed_deadline_ms;
+static uint64_t started_us;
+static uint64_t deadline_us;
+static uint64_t elapsed_us; // Before the last pause
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static void handle_signal(int signo) {
+    // Only async-signal-safe calls here, the watchdog does the rest
+    signal_number = signo;
+    atomic_store(&reason, CANCEL_SIGNAL);
+    sem_post(&wakeup);
+}
+
+static void *watchdog_main(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        uint64_t now = now_us();
+        uint64_t wait_us = CANCEL_IDLE_INTERVAL_MS * 1000u;
+        if (armed && !paused) {
+            if (atomic_load(&reason) != CANCEL_NONE) {
+                wait_us = CANCEL_ABORT_INTERVAL_MS * 1000u;
+            } else if (deadline_us != 0) {
+                wait_us = deadline_us > now ? deadline_us - now : 0;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        // sem_timedwait() only takes CLOCK_REALTIME
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t) (wait_us / 1000000u);
+        until.tv_nsec += (long) (wait_us % 1000000u) * 1000;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&wakeup, &until) != 0 && errno == EINTR);
+
+        pthread_mutex_lock(&lock);
+        if (armed && !paused) {
+            int expected = CANCEL_NONE;
+            if (deadline_us != 0 && now_us() >= deadline_us) {
+                atomic_compare_exchange_strong(&reason, &expected, CANCEL_DEADLINE);
+            }
+            if (atomic_load(&reason) != CANCEL_NONE && armed_reader != NULL) {
+                nfc_abort_command(armed_reader);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+void cancel_init(void) {
+    sem_init(&wakeup, 0, 0);
+
+    // One shot, a second signal falls back to the default action
+    struct sigaction action = {};
+    action.sa_handler = handle_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watchdog_main, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// A deadline of 0 only reacts to signals
+void cancel_arm(nfc_device *reader, unsigned int deadline_ms) {
+    pthread_mutex_lock(&lock);
+    armed_reader = reader;
+    armed = true;
+    paused = false;
+    armed_deadline_ms = deadline_ms;
+    started_us = now_us();
+    elapsed_us = 0;
+    deadline_us = deadline_ms != 0 ? started_us + deadline_ms * 1000ull : 0;
+    pthread_mutex_unlock(&lock);
+
+    sem_post(&wakeup);
+}
+
+// A deadline belongs to its operation, a signal stays until exit
+void cancel_disarm(void) {
+    pthread_mutex_lock(&lock);
+    int expected = CANCEL_DEADLINE;
+    atomic_compare_exchange_strong(&reason, &expected, CANCEL_NONE);
+    armed = false;
+    armed_reader = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+// Time spent waiting for the user does not count
+void cancel_pause(void) {
+    pthread_mutex_lock(&lock);
+    if (armed && !paused) {
+        paused = true;
+        elapsed_us += now_us() - started_us;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void cancel_resume(void) {
+    pthread_mutex_lock(&lock);
+    if (armed && paused) {
+        paused = false;
+        started_us = now_us();
+        if (deadline_us != 0) {
+            uint64_t budget_us = armed_deadline_ms * 1000ull;
+            deadline_us = started_us + (elapsed_us < budget_us ? budget_us - elapsed_us : 0);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    sem_post(&wakeup);
+}
+
+bool cancel_requested(void) {
+    return atomic_load(&reason) != CANCEL_NONE;
+}
+
+int cancel_reason(void) {
+    return atomic_load(&reason);
+}
+
+int cancel_exit_code(void) {
+    switch (atomic_load(&reason)) {
+        case CANCEL_DEADLINE:
+            return CANCEL_EXIT_DEADLINE;
+        case CANCEL_SIGNAL:
+            return 128 + signal_number;
+        default:
+            return 0;
+    }
+}
+
+// One JSON line on stdout, for whatever drives the station
+void cancel_print_partial(const struct srix_image *read, const uint8_t *written, size_t written_count) {
+    pthread_mutex_lock(&lock);
+    uint64_t elapsed = elapsed_us + (paused ? 0 : now_us() - started_us);
+    pthread_mutex_unlock(&lock);
+
+    log_flush();
+    printf("{\"status\":\"cancelled\",\"reason\":\"%s\",\"elapsed_ms\":%" PRIu64 ",\"blocks_read\":[",
+            cancel_reason() == CANCEL_DEADLINE ? "deadline" : "signal", elapsed / 1000u);
+
+    bool first = true;
+    for (uint8_t block = 0; read != NULL && block < read->blocks; block++) {
+        if (srix_image_is_present(read, block)) {
+            printf(first ? "%u" : ",%u", block);
+            first = false;
+        }
+    }
+
+    printf("],\"blocks_written\":[");
+    for (size_t i = 0; i < written_count; i++) {
+        printf(i == 0 ? "%u" : ",%u", written[i]);
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
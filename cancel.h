@@ -0,0 +1,54 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_CANCEL_H__
+#define __NFC_SRIX_CANCEL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <nfc/nfc.h>
+#include "srix_image.h"
+
+/* Macros */
+#define CANCEL_EXIT_DEADLINE 124       // Same as timeout(1), signals exit with 128 + signal
+#define CANCEL_ABORT_INTERVAL_MS 100   // Aborts are repeated until the tool gives up the reader
+#define CANCEL_IDLE_INTERVAL_MS 1000
+
+/* Reasons */
+#define CANCEL_NONE 0
+#define CANCEL_DEADLINE 1
+#define CANCEL_SIGNAL 2
+
+/*
+ * Bounds every tag operation. Between cancel_arm() and cancel_disarm() a
+ * watchdog thread calls nfc_abort_command() on the reader once the deadline
+ * passes, or as soon as SIGINT or SIGTERM arrives. The aborted command
+ * returns an error, the tool sees cancel_requested() and reports what it did
+ * with cancel_print_partial(). The abort is acknowledged by the reader, which
+ * stays usable. A second signal kills the process.
+ */
+void cancel_init(void);
+void cancel_arm(nfc_device *reader, unsigned int deadline_ms);
+void cancel_disarm(void);
+void cancel_pause(void);
+void cancel_resume(void);
+bool cancel_requested(void);
+int cancel_reason(void);
+int cancel_exit_code(void);
+void cancel_print_partial(const struct srix_image *read, const uint8_t *written, size_t written_count);
+
+#endif // __NFC_SRIX_CANCEL_H__
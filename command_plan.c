@@ -0,0 +1,210 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "command_plan.h"
+#include "rf_tuning.h"
+
+static const char *op_names[] = {"get_uid", "read", "write", "verify"};
+
+void command_plan_init(struct command_plan *plan) {
+    memset(plan, 0, sizeof(struct command_plan));
+}
+
+// Writing block 06 triggers the auto erase cycle of blocks 00-04
+void command_plan_add(struct command_plan *plan, uint8_t op, uint8_t block, uint32_t value) {
+    if (plan->count == COMMAND_PLAN_MAX_COMMANDS) {
+        return;
+    }
+
+    struct plan_command *command = &plan->commands[plan->count++];
+    command->op = op;
+    command->block = block;
+    command->value = value;
+    command->erase_cycle = op == COMMAND_WRITE && block == 6;
+
+    switch (op) {
+        case COMMAND_READ:
+            plan->reads++;
+            break;
+        case COMMAND_WRITE:
+            plan->writes++;
+            if (command->erase_cycle) plan->erase_cycles++;
+            break;
+        case COMMAND_VERIFY:
+            plan->verifies++;
+            break;
+    }
+}
+
+// Writes in plan order, then one verification read each, like srix_readback_verify()
+void command_plan_add_writes(struct command_plan *plan, const struct write_plan *writes) {
+    for (size_t i = 0; i < writes->count; i++) {
+        const struct plan_entry *entry = &writes->entries[i];
+        if (entry->action != PLAN_WRITE || plan->count == COMMAND_PLAN_MAX_COMMANDS) {
+            continue;
+        }
+
+        command_plan_add(plan, COMMAND_WRITE, entry->block, entry->to);
+
+        // A block 06 write that keeps the reload counter erases nothing
+        if (entry->block == 6 && !writes->erase_cycle) {
+            plan->commands[plan->count - 1].erase_cycle = false;
+            plan->erase_cycles--;
+        }
+    }
+    for (size_t i = 0; i < writes->count; i++) {
+        const struct plan_entry *entry = &writes->entries[i];
+        if (entry->action == PLAN_WRITE) {
+            command_plan_add(plan, COMMAND_VERIFY, entry->block, entry->to);
+        }
+    }
+}
+
+static uint32_t command_us(const struct plan_command *command, const struct plan_latency *latency) {
+    switch (command->op) {
+        case COMMAND_GET_UID:
+            return latency->get_uid_us;
+        case COMMAND_WRITE:
+            return latency->write_us;
+        default:
+            return latency->read_us;
+    }
+}
+
+uint64_t command_plan_estimate_us(const struct command_plan *plan, const struct plan_latency *latency) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        total += command_us(&plan->commands[i], latency);
+    }
+    return total;
+}
+
+static const char *skip_reason(int action) {
+    switch (action) {
+        case PLAN_SKIP_LOCKED:
+            return "locked";
+        case PLAN_SKIP_IMPOSSIBLE:
+            return "impossible";
+        default:
+            return "excluded";
+    }
+}
+
+void command_plan_print_json(const struct command_plan *plan, const struct plan_latency *latency, const char *source, const char *outcome, const struct write_plan *writes) {
+    printf("{\n");
+    printf("  \"source\": \"%s\",\n", source);
+    if (outcome != NULL) {
+        printf("  \"outcome\": \"%s\",\n", outcome);
+    }
+    printf("  \"latency_us\": {\"source\": \"%s\", \"get_uid\": %" PRIu32 ", \"read\": %" PRIu32 ", \"write\": %" PRIu32 "},\n",
+            latency->source, latency->get_uid_us, latency->read_us, latency->write_us);
+
+    // One command per line
+    printf("  \"commands\": [");
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct plan_command *command = &plan->commands[i];
+        printf("%s\n    {\"op\": \"%s\"", i == 0 ? "" : ",", op_names[command->op]);
+        if (command->op != COMMAND_GET_UID) {
+            printf(", \"block\": %u", command->block);
+        }
+        if (command->op == COMMAND_WRITE || command->op == COMMAND_VERIFY) {
+            printf(", \"value\": \"%08" PRIX32 "\"", command->value);
+        }
+        if (command->erase_cycle) {
+            printf(", \"erase_cycle\": true");
+        }
+        printf(", \"us\": %" PRIu32 "}", command_us(command, latency));
+    }
+    printf("%s],\n", plan->count > 0 ? "\n  " : "");
+
+    // Differences that will not be written
+    if (writes != NULL) {
+        printf("  \"skipped\": [");
+        bool first = true;
+        for (size_t i = 0; i < writes->count; i++) {
+            const struct plan_entry *entry = &writes->entries[i];
+            if (entry->action == PLAN_WRITE) {
+                continue;
+            }
+            printf("%s{\"block\": %u, \"reason\": \"%s\"}", first ? "" : ", ", entry->block, skip_reason(entry->action));
+            first = false;
+        }
+        printf("],\n");
+    }
+
+    printf("  \"reads\": %zu,\n", plan->reads);
+    printf("  \"writes\": %zu,\n", plan->writes);
+    printf("  \"verify_reads\": %zu,\n", plan->verifies);
+    printf("  \"erase_cycles\": %zu,\n", plan->erase_cycles);
+    printf("  \"estimated_us\": %" PRIu64 "\n", command_plan_estimate_us(plan, latency));
+    printf("}\n");
+}
+
+void plan_latency_init(struct plan_latency *latency) {
+    latency->get_uid_us = COMMAND_GET_UID_TIME_US;
+    latency->read_us = PLAN_READ_TIME_US;
+    latency->write_us = PLAN_WRITE_TIME_US;
+    latency->source = "default";
+}
+
+// "uid,read,write" in us, empty fields keep their value
+bool plan_latency_parse(struct plan_latency *latency, const char *spec) {
+    uint32_t *fields[] = {&latency->get_uid_us, &latency->read_us, &latency->write_us};
+    const char *cursor = spec;
+
+    for (int i = 0; i < 3; i++) {
+        char *end;
+        if (*cursor != ',' && *cursor != '\0') {
+            unsigned long value = strtoul(cursor, &end, 10);
+            if (end == cursor) {
+                return false;
+            }
+            *fields[i] = (uint32_t) value;
+            cursor = end;
+        }
+
+        if (*cursor == '\0') {
+            break;
+        }
+        if (*cursor != ',' || i == 2) {
+            return false;
+        }
+        cursor++;
+    }
+
+    latency->source = "configured";
+    return true;
+}
+
+// Median round trip seen on this reader, writes are never measured
+void plan_latency_measure(struct plan_latency *latency, nfc_device *reader) {
+    struct rf_tuning *tuning = rf_tuning_get(reader);
+    if (tuning == NULL) {
+        return;
+    }
+
+    uint32_t get_uid_us = rf_tuning_median_us(&tuning->commands[TUNING_GET_UID]);
+    uint32_t read_us = rf_tuning_median_us(&tuning->commands[TUNING_READ_BLOCK]);
+    if (get_uid_us != 0) latency->get_uid_us = get_uid_us;
+    if (read_us != 0) latency->read_us = read_us;
+    if (get_uid_us != 0 || read_us != 0) latency->source = "measured";
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_COMMAND_PLAN_H__
+#define __NFC_SRIX_COMMAND_PLAN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <nfc/nfc.h>
+#include "write_plan.h"
+
+/* Macros */
+#define COMMAND_PLAN_MAX_COMMANDS 512 // Full read, write and verify of an SRIX4K
+#define COMMAND_GET_UID_TIME_US 2500
+
+/* Operations */
+#define COMMAND_GET_UID 0
+#define COMMAND_READ 1
+#define COMMAND_WRITE 2
+#define COMMAND_VERIFY 3 // READ_BLOCK of a block that was just written
+
+struct plan_command {
+    uint8_t op;
+    uint8_t block;
+    bool erase_cycle;
+    uint32_t value;
+};
+
+/* Expected time of every operation, in us */
+struct plan_latency {
+    uint32_t get_uid_us;
+    uint32_t read_us;
+    uint32_t write_us;
+    const char *source; // "default", "configured" or "measured"
+};
+
+/*
+ * Exact RF command sequence of an operation, built without touching the tag.
+ * Tools fill it with what they would send and print it as JSON, so a batch
+ * can be sized before it is run.
+ */
+struct command_plan {
+    struct plan_command commands[COMMAND_PLAN_MAX_COMMANDS];
+    size_t count;
+
+    size_t reads;
+    size_t writes;
+    size_t verifies;
+    size_t erase_cycles;
+};
+
+void command_plan_init(struct command_plan *plan);
+void command_plan_add(struct command_plan *plan, uint8_t op, uint8_t block, uint32_t value);
+void command_plan_add_writes(struct command_plan *plan, const struct write_plan *writes);
+uint64_t command_plan_estimate_us(const struct command_plan *plan, const struct plan_latency *latency);
+void command_plan_print_json(const struct command_plan *plan, const struct plan_latency *latency, const char *source, const char *outcome, const struct write_plan *writes);
+
+void plan_latency_init(struct plan_latency *latency);
+bool plan_latency_parse(struct plan_latency *latency, const char *spec);
+void plan_latency_measure(struct plan_latency *latency, nfc_device *reader);
+
+#endif // __NFC_SRIX_COMMAND_PLAN_H__
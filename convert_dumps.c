@@ -0,0 +1,383 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "dump_utils.h"
+#include "dump_format.h"
+#include "corpus.h"
+
+/* Conversion results */
+#define CONVERT_DONE 0
+#define CONVERT_SKIPPED 1 // Unknown extension with -i auto
+#define CONVERT_FAILED 2
+
+/* Errors, besides the FORMAT_ ones */
+#define CONVERT_EPATH -100 // Output path too long
+#define CONVERT_ESAME -101 // Output path is the input
+#define CONVERT_EMKDIR -102
+
+struct convert_result {
+    int status;
+    int error;
+    unsigned int line;
+};
+
+// Everything a worker needs, reused for every file
+struct convert_worker {
+    struct srix_image image;
+    struct format_reader reader;
+    struct format_writer writer;
+    char created_dir[PATH_MAX]; // Last output directory made
+};
+
+struct convert_context {
+    uint8_t eeprom_blocks;
+    int input_format;
+    int output_format;
+    const char *output_dir; // NULL to write next to the input
+
+    // Inputs, to mirror directories under output_dir
+    char *const *inputs;
+    bool *input_is_dir;
+    int num_inputs;
+
+    struct convert_result *results;
+    struct convert_worker *workers[CORPUS_MAX_THREADS];
+    size_t converted;
+    size_t skipped;
+    size_t failed;
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s <dump|dir>... -f format [-h] [-v] [-i format] [-o dir] [-j threads] [-t x4k|512] [--shard i/N]\n", executable);
+    printf("\nNecessary arguments:\n");
+    printf("  <dump|dir>   dumps to convert, directories are walked recursively\n");
+    printf("  -f format    output format: bin, reversed, eml, nfc or json\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -i format    input format, or auto to go by the extension and skip other files and files already converted in place [default: auto]\n");
+    printf("  -o dir       write the converted dumps here, directories are mirrored [default: next to the input]\n");
+    printf("  -j threads   number of worker threads [default: number of CPUs]\n");
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  --shard i/N  only convert shard i of N, dumps are split by UID\n");
+}
+
+static const char *convert_strerror(int error) {
+    switch (error) {
+        case CONVERT_EPATH:
+            return "output path too long";
+        case CONVERT_ESAME:
+            return "would overwrite the input, use -o";
+        case CONVERT_EMKDIR:
+            return "cannot create the output directory";
+        default:
+            return srix_format_strerror(error);
+    }
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+// Same relative path under output_dir, or next to the input, with the new extension
+static bool output_path_for(const struct convert_context *context, const char *path, char *output) {
+    const char *relative = path;
+    if (context->output_dir != NULL) {
+        const char *name = strrchr(path, '/');
+        relative = name != NULL ? name + 1 : path;
+        for (int i = 0; i < context->num_inputs; i++) {
+            size_t length = strlen(context->inputs[i]);
+            if (context->input_is_dir[i] && strncmp(path, context->inputs[i], length) == 0 && path[length] == '/') {
+                relative = path + length + 1;
+                break;
+            }
+        }
+    }
+
+    const char *name = strrchr(relative, '/');
+    name = name != NULL ? name + 1 : relative;
+    const char *dot = strrchr(name, '.');
+    int stem = (int) (dot != NULL && dot != name ? (size_t) (dot - relative) : strlen(relative));
+
+    int length;
+    const char *extension = srix_format_extension(context->output_format);
+    if (context->output_dir != NULL) {
+        length = snprintf(output, PATH_MAX, "%s/%.*s%s", context->output_dir, stem, relative, extension);
+    } else {
+        length = snprintf(output, PATH_MAX, "%.*s%s", stem, relative, extension);
+    }
+    return length < PATH_MAX;
+}
+
+// Files of one directory come together, so this is one mkdir() per directory
+static bool make_parent(struct convert_worker *worker, const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash == path) {
+        return true;
+    }
+
+    size_t length = slash - path;
+    memcpy(dir, path, length);
+    dir[length] = '\0';
+    if (strcmp(dir, worker->created_dir) == 0) {
+        return true;
+    }
+
+    for (char *c = dir + 1; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            mkdir(dir, 0755);
+            *c = '/';
+        }
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    memcpy(worker->created_dir, dir, length + 1);
+    return true;
+}
+
+static void convert_process(const char *path, size_t slot, unsigned int worker_index, void *arg) {
+    struct convert_context *context = arg;
+    struct convert_worker *worker = context->workers[worker_index];
+    struct convert_result *result = &context->results[slot];
+    result->status = CONVERT_FAILED;
+    result->error = FORMAT_SUCCESS;
+    result->line = 0;
+
+    int input_format = context->input_format == FORMAT_AUTO ? srix_format_from_path(path) : context->input_format;
+    if (input_format < 0) {
+        result->status = CONVERT_SKIPPED;
+        return;
+    }
+
+    char output_path[PATH_MAX];
+    if (!output_path_for(context, path, output_path)) {
+        result->error = CONVERT_EPATH;
+        return;
+    }
+    if (strcmp(output_path, path) == 0) {
+        // Going by the extension, a file with the one of the output is already converted
+        result->error = CONVERT_ESAME;
+        if (context->input_format == FORMAT_AUTO) {
+            result->status = CONVERT_SKIPPED;
+        }
+        return;
+    }
+
+    struct srix_image *image = &worker->image;
+    image->blocks = context->eeprom_blocks;
+    result->error = srix_format_load(image, path, input_format, &worker->reader);
+    if (result->error != FORMAT_SUCCESS) {
+        result->line = worker->reader.line;
+        return;
+    }
+
+    // Dumps named after their tag keep the UID
+    if (!image->has_uid) {
+        const char *name = strrchr(path, '/');
+        image->has_uid = srix_uid_from_name(name != NULL ? name + 1 : path, &image->uid);
+    }
+
+    if (context->output_dir != NULL && !make_parent(worker, output_path)) {
+        result->error = CONVERT_EMKDIR;
+        return;
+    }
+    result->error = srix_format_save(image, output_path, context->output_format, &worker->writer);
+    if (result->error == FORMAT_SUCCESS) {
+        result->status = CONVERT_DONE;
+    }
+}
+
+static void convert_chunk_done(char *const *paths, size_t count, void *arg) {
+    struct convert_context *context = arg;
+
+    // Only failures are printed, in walk order
+    for (size_t i = 0; i < count; i++) {
+        struct convert_result *result = &context->results[i];
+
+        if (result->status == CONVERT_DONE) {
+            context->converted++;
+        } else if (result->status == CONVERT_SKIPPED) {
+            context->skipped++;
+            lverbose("Skipping \"%s\", %s.\n", paths[i], result->error == CONVERT_ESAME ? "already in the output format" : "unknown extension");
+        } else {
+            context->failed++;
+            log_flush();
+            if (result->error == FORMAT_ESYNTAX) {
+                printf("%s: ERROR %s at line %u\n", paths[i], convert_strerror(result->error), result->line);
+            } else {
+                printf("%s: ERROR %s\n", paths[i], convert_strerror(result->error));
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    // Options
+    unsigned int threads = 0;
+    uint8_t eeprom_blocks = SRIX4K_EEPROM_BLOCKS;
+    int input_format = FORMAT_AUTO;
+    int output_format = FORMAT_EUNKNOWN;
+    char *output_dir = NULL;
+    unsigned int shard_index = 0;
+    unsigned int shard_count = 0;
+
+    // Parse options
+    static const struct option long_options[] = {
+            {"shard", required_argument, NULL, 'H'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hvf:i:o:j:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                if (!corpus_parse_shard(optarg, &shard_index, &shard_count)) {
+                    lerror("Invalid shard \"%s\", expected i/N with i < N.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                output_format = srix_format_from_name(optarg);
+                if (output_format < 0) {
+                    lerror("Invalid output format \"%s\".\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                input_format = srix_format_from_name(optarg);
+                if (input_format == FORMAT_EUNKNOWN) {
+                    lerror("Invalid input format \"%s\".\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 1 || output_format < 0) {
+        lerror("You need to specify at least one dump and the output format.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    // Start background logging
+    log_start();
+
+    if (threads == 0) {
+        threads = corpus_default_threads();
+    }
+    if (threads > CORPUS_MAX_THREADS) {
+        threads = CORPUS_MAX_THREADS;
+    }
+
+    size_t chunk_size = CORPUS_DEFAULT_CHUNK_SIZE;
+    int num_inputs = argc - optind;
+    struct convert_context context = {
+            .eeprom_blocks = eeprom_blocks,
+            .input_format = input_format,
+            .output_format = output_format,
+            .output_dir = output_dir,
+            .inputs = argv + optind,
+            .input_is_dir = calloc(num_inputs, sizeof(bool)),
+            .num_inputs = num_inputs,
+            .results = malloc(sizeof(struct convert_result) * chunk_size),
+    };
+    if (context.input_is_dir == NULL || context.results == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        context.workers[i] = aligned_alloc(SRIX_IMAGE_ALIGNMENT, sizeof(struct convert_worker));
+        if (context.workers[i] == NULL) {
+            lerror("Out of memory. Exiting...\n");
+            exit(1);
+        }
+        context.workers[i]->created_dir[0] = '\0';
+    }
+    for (int i = 0; i < num_inputs; i++) {
+        struct stat input_stat;
+        context.input_is_dir[i] = stat(context.inputs[i], &input_stat) == 0 && S_ISDIR(input_stat.st_mode);
+    }
+
+    if (output_dir != NULL && mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        lerror("Cannot create \"%s\". Exiting...\n", output_dir);
+        exit(1);
+    }
+
+    struct corpus_job job = {
+            .threads = threads,
+            .chunk_size = chunk_size,
+            .process = convert_process,
+            .chunk_done = convert_chunk_done,
+            .arg = &context,
+            .shard_index = shard_index,
+            .shard_count = shard_count,
+    };
+    uint64_t start_us = now_us();
+    size_t total = corpus_run(&job, context.inputs, num_inputs);
+    double seconds = (now_us() - start_us) / 1e6;
+
+    log_flush();
+    printf("Converted %zu dumps to %s, %zu skipped, %zu failed.\n", context.converted, srix_format_name(output_format), context.skipped, context.failed);
+    lverbose("%zu files in %.2f s, %.0f files/s.\n", total, seconds, seconds > 0 ? total / seconds : 0.0);
+
+    for (unsigned int i = 0; i < threads; i++) {
+        free(context.workers[i]);
+    }
+    free(context.input_is_dir);
+    free(context.results);
+
+    return context.failed > 0 ? 1 : 0;
+}
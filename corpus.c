@@ -0,0 +1,311 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "corpus.h"
+#include "logging.h"
+#include "dump_utils.h"
+
+struct corpus_chunk {
+    const struct corpus_job *job;
+
+    // Paths are packed in a single arena
+    char **paths;
+    size_t count;
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+
+    atomic_size_t next;
+    size_t total;
+};
+
+struct corpus_worker {
+    struct corpus_chunk *chunk;
+    unsigned int index;
+};
+
+unsigned int corpus_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    if (cpus > CORPUS_MAX_THREADS) {
+        return CORPUS_MAX_THREADS;
+    }
+    return (unsigned int) cpus;
+}
+
+// "i/N" with i < N
+bool corpus_parse_shard(const char *text, unsigned int *shard_index, unsigned int *shard_count) {
+    char *end;
+    unsigned long index = strtoul(text, &end, 10);
+    if (end == text || *end != '/') {
+        return false;
+    }
+
+    const char *count_text = end + 1;
+    unsigned long count = strtoul(count_text, &end, 10);
+    if (end == count_text || *end != '\0' || count == 0 || index >= count || count > UINT_MAX) {
+        return false;
+    }
+
+    *shard_index = (unsigned int) index;
+    *shard_count = (unsigned int) count;
+    return true;
+}
+
+// splitmix64 finalizer, spreads sequential UIDs evenly
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30u;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27u;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31u;
+    return x;
+}
+
+static bool corpus_in_shard(const struct corpus_job *job, const char *key) {
+    if (job->shard_count <= 1) {
+        return true;
+    }
+
+    const char *name = strrchr(key, '/');
+    name = name != NULL ? name + 1 : key;
+
+    uint64_t hash;
+    if (!srix_uid_from_name(name, &hash)) {
+        // FNV-1a
+        hash = 0xCBF29CE484222325ull;
+        for (const char *c = key; *c != '\0'; c++) {
+            hash = (hash ^ (uint8_t) *c) * 0x100000001B3ull;
+        }
+    }
+
+    return mix64(hash) % job->shard_count == job->shard_index;
+}
+
+static void *corpus_worker_main(void *arg) {
+    struct corpus_worker *worker = arg;
+    struct corpus_chunk *chunk = worker->chunk;
+
+    for (;;) {
+        size_t slot = atomic_fetch_add(&chunk->next, 1);
+        if (slot >= chunk->count) {
+            break;
+        }
+        chunk->job->process(chunk->paths[slot], slot, worker->index, chunk->job->arg);
+    }
+
+    return NULL;
+}
+
+static void corpus_flush(struct corpus_chunk *chunk) {
+    if (chunk->count == 0) {
+        return;
+    }
+
+    unsigned int threads = chunk->job->threads;
+    if (threads > chunk->count) {
+        threads = chunk->count;
+    }
+
+    atomic_store(&chunk->next, 0);
+
+    pthread_t handles[CORPUS_MAX_THREADS];
+    struct corpus_worker workers[CORPUS_MAX_THREADS];
+    unsigned int started = 0;
+    for (unsigned int i = 1; i < threads; i++) {
+        workers[i].chunk = chunk;
+        workers[i].index = i;
+        if (pthread_create(&handles[i], NULL, corpus_worker_main, &workers[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+
+    // The calling thread is worker 0
+    workers[0].chunk = chunk;
+    workers[0].index = 0;
+    corpus_worker_main(&workers[0]);
+
+    for (unsigned int i = 1; i <= started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    if (chunk->job->chunk_done != NULL) {
+        chunk->job->chunk_done(chunk->paths, chunk->count, chunk->job->arg);
+    }
+
+    chunk->total += chunk->count;
+    chunk->count = 0;
+    chunk->arena_used = 0;
+}
+
+static void corpus_add(struct corpus_chunk *chunk, const char *path) {
+    size_t length = strlen(path) + 1;
+
+    if (chunk->count == chunk->job->chunk_size || chunk->arena_used + length > chunk->arena_size) {
+        corpus_flush(chunk);
+    }
+
+    // Oversized path, give it its own arena
+    if (length > chunk->arena_size) {
+        char *arena = realloc(chunk->arena, length);
+        if (arena == NULL) {
+            lerror("Out of memory while walking \"%s\".\n", path);
+            return;
+        }
+        chunk->arena = arena;
+        chunk->arena_size = length;
+    }
+
+    char *slot = chunk->arena + chunk->arena_used;
+    memcpy(slot, path, length);
+    chunk->arena_used += length;
+    chunk->paths[chunk->count++] = slot;
+}
+
+/*
+ * key_offset is where the part of the path used for sharding starts. Symlinks
+ * to directories are only followed for the inputs themselves, inside the tree
+ * they could loop forever.
+ */
+static void corpus_walk(struct corpus_chunk *chunk, const char *path, size_t key_offset, bool input) {
+    struct stat path_stat;
+    int result = stat(path, &path_stat);
+    if (result == 0 && S_ISDIR(path_stat.st_mode) && !input) {
+        struct stat link_stat;
+        if (lstat(path, &link_stat) == 0 && S_ISLNK(link_stat.st_mode)) {
+            lverbose("Not following symlink to directory \"%s\".\n", path);
+            return;
+        }
+    }
+
+    if (result < 0 || !S_ISDIR(path_stat.st_mode)) {
+        // Let the tool report unreadable files
+        if (corpus_in_shard(chunk->job, path + key_offset)) {
+            corpus_add(chunk, path);
+        }
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        lwarning("Cannot open directory \"%s\".\n", path);
+        return;
+    }
+
+    // List it all before handing anything out, files written by the workers must not be walked
+    char *listing = NULL;
+    size_t listing_used = 0, listing_size = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // One type byte, then the name
+        size_t length = strlen(entry->d_name) + 1;
+        if (listing_used + 1 + length > listing_size) {
+            size_t size = listing_size == 0 ? 4096 : listing_size * 2;
+            while (listing_used + 1 + length > size) size *= 2;
+            char *grown = realloc(listing, size);
+            if (grown == NULL) {
+                lerror("Out of memory while walking \"%s\".\n", path);
+                break;
+            }
+            listing = grown;
+            listing_size = size;
+        }
+        listing[listing_used] = (char) entry->d_type;
+        memcpy(listing + listing_used + 1, entry->d_name, length);
+        listing_used += 1 + length;
+    }
+    closedir(dir);
+
+    char child[PATH_MAX];
+    for (size_t offset = 0; offset < listing_used;) {
+        unsigned char type = (unsigned char) listing[offset];
+        const char *name = listing + offset + 1;
+        offset += 1 + strlen(name) + 1;
+
+        if (snprintf(child, sizeof(child), "%s/%s", path, name) >= (int) sizeof(child)) {
+            lwarning("Path too long, skipping \"%s/%s\".\n", path, name);
+            continue;
+        }
+
+        if (type == DT_DIR || type == DT_UNKNOWN || type == DT_LNK) {
+            corpus_walk(chunk, child, key_offset, false);
+        } else if (type == DT_REG && corpus_in_shard(chunk->job, child + key_offset)) {
+            corpus_add(chunk, child);
+        }
+    }
+
+    free(listing);
+}
+
+size_t corpus_run(const struct corpus_job *job, char *const inputs[], int num_inputs) {
+    struct corpus_job defaults = *job;
+    if (defaults.threads == 0) {
+        defaults.threads = corpus_default_threads();
+    }
+    if (defaults.threads > CORPUS_MAX_THREADS) {
+        defaults.threads = CORPUS_MAX_THREADS;
+    }
+    if (defaults.chunk_size == 0) {
+        defaults.chunk_size = CORPUS_DEFAULT_CHUNK_SIZE;
+    }
+
+    struct corpus_chunk chunk = {};
+    chunk.job = &defaults;
+    chunk.paths = malloc(sizeof(char *) * defaults.chunk_size);
+    chunk.arena_size = defaults.chunk_size * CORPUS_AVERAGE_PATH_LEN;
+    chunk.arena = malloc(chunk.arena_size);
+    if (chunk.paths == NULL || chunk.arena == NULL) {
+        lerror("Out of memory.\n");
+        free(chunk.paths);
+        free(chunk.arena);
+        return 0;
+    }
+
+    for (int i = 0; i < num_inputs; i++) {
+        // Directories are keyed from inside, files by their name
+        const char *name = strrchr(inputs[i], '/');
+        size_t key_offset = name != NULL ? (size_t) (name + 1 - inputs[i]) : 0;
+        struct stat input_stat;
+        if (stat(inputs[i], &input_stat) == 0 && S_ISDIR(input_stat.st_mode)) {
+            key_offset = strlen(inputs[i]) + 1;
+        }
+        corpus_walk(&chunk, inputs[i], key_offset, true);
+    }
+    corpus_flush(&chunk);
+
+    free(chunk.paths);
+    free(chunk.arena);
+
+    return chunk.total;
+}
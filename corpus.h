@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_CORPUS_H__
+#define __NFC_SRIX_CORPUS_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Macros */
+#define CORPUS_MAX_THREADS 64
+#define CORPUS_DEFAULT_CHUNK_SIZE 4096
+#define CORPUS_AVERAGE_PATH_LEN 128
+
+/*
+ * Walks files and directories (recursively) and hands the paths to a pool of
+ * workers, one chunk at a time. Only one chunk of paths is held in memory,
+ * with the names of the directories being walked. A directory is listed in
+ * full before any of its files is handed out, so files the workers write
+ * next to their inputs are never walked.
+ *
+ * process() runs on the worker threads, slot is the index of the path in the
+ * current chunk. chunk_done() runs on the calling thread after every chunk,
+ * with the paths in walk order.
+ *
+ * With shard_count set only the files of shard shard_index are handed out.
+ * A file belongs to the shard of its UID when its name starts with one, of
+ * its path relative to the walked input otherwise, so every process and
+ * host given the same inputs splits them the same way.
+ */
+typedef void (*corpus_process_fn)(const char *path, size_t slot, unsigned int worker, void *arg);
+typedef void (*corpus_chunk_fn)(char *const *paths, size_t count, void *arg);
+
+struct corpus_job {
+    unsigned int threads;
+    size_t chunk_size;
+    corpus_process_fn process;
+    corpus_chunk_fn chunk_done;
+    void *arg;
+    unsigned int shard_index;
+    unsigned int shard_count; // 0 = every file
+};
+
+unsigned int corpus_default_threads(void);
+bool corpus_parse_shard(const char *text, unsigned int *shard_index, unsigned int *shard_count);
+size_t corpus_run(const struct corpus_job *job, char *const inputs[], int num_inputs);
+
+#endif // __NFC_SRIX_CORPUS_H__
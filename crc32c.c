@@ -0,0 +1,64 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Reversed
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1u ? (crc >> 1u) ^ CRC32C_POLYNOMIAL : crc >> 1u;
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    // Slicing by 8
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t previous = crc32c_table[slice - 1][i];
+            crc32c_table[slice][i] = (previous >> 8u) ^ crc32c_table[0][previous & 0xFFu];
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&crc32c_table_once, crc32c_init_table);
+
+    const uint8_t *bytes = data;
+    crc = ~crc;
+
+    while (size >= 8) {
+        uint32_t low = crc ^ ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8u | (uint32_t) bytes[2] << 16u | (uint32_t) bytes[3] << 24u);
+        crc = crc32c_table[7][low & 0xFFu] ^ crc32c_table[6][(low >> 8u) & 0xFFu] ^
+              crc32c_table[5][(low >> 16u) & 0xFFu] ^ crc32c_table[4][low >> 24u] ^
+              crc32c_table[3][bytes[4]] ^ crc32c_table[2][bytes[5]] ^
+              crc32c_table[1][bytes[6]] ^ crc32c_table[0][bytes[7]];
+        bytes += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = (crc >> 8u) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFFu];
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_CRC32C_H__
+#define __NFC_SRIX_CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32C (Castagnoli), start with crc = 0
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif // __NFC_SRIX_CRC32C_H__
@@ -0,0 +1,848 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "dump_format.h"
+#include "dump_utils.h"
+
+static const char *const format_names[FORMAT_COUNT] = {"bin", "reversed", "eml", "nfc", "json"};
+static const char *const format_extensions[FORMAT_COUNT] = {".bin", ".bin", ".eml", ".nfc", ".json"};
+
+/*
+ * Names
+ */
+
+int srix_format_from_name(const char *name) {
+    if (strcmp(name, "auto") == 0) {
+        return FORMAT_AUTO;
+    }
+    for (int i = 0; i < FORMAT_COUNT; i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return FORMAT_EUNKNOWN;
+}
+
+// A .bin file is taken as raw, reversed dumps cannot be told apart
+int srix_format_from_path(const char *path) {
+    const char *name = strrchr(path, '/');
+    const char *extension = strrchr(name != NULL ? name + 1 : path, '.');
+    if (extension == NULL) {
+        return FORMAT_EUNKNOWN;
+    }
+
+    for (int i = 0; i < FORMAT_COUNT; i++) {
+        if (i != FORMAT_REVERSED && strcasecmp(extension, format_extensions[i]) == 0) {
+            return i;
+        }
+    }
+
+    return FORMAT_EUNKNOWN;
+}
+
+const char *srix_format_name(int format) {
+    return format >= 0 && format < FORMAT_COUNT ? format_names[format] : "unknown";
+}
+
+const char *srix_format_extension(int format) {
+    return format >= 0 && format < FORMAT_COUNT ? format_extensions[format] : "";
+}
+
+/*
+ * Reading
+ */
+
+// Appends to the buffer, returns false once nothing more can be read
+static bool reader_fill(struct format_reader *reader) {
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    }
+    if (reader->eof || reader->end == sizeof(reader->buffer)) {
+        return false;
+    }
+
+    // Same chunking as a file, so parsers see the same buffer boundaries
+    if (reader->memory != NULL) {
+        size_t size = reader->memory_size - reader->memory_offset;
+        if (size > sizeof(reader->buffer) - reader->end) {
+            size = sizeof(reader->buffer) - reader->end;
+        }
+        if (size == 0) {
+            reader->eof = true;
+            return false;
+        }
+
+        memcpy(reader->buffer + reader->end, reader->memory + reader->memory_offset, size);
+        reader->memory_offset += size;
+        reader->end += size;
+        return true;
+    }
+
+    for (;;) {
+        ssize_t size = read(reader->fd, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            reader->error = size < 0;
+            reader->eof = true;
+            return false;
+        }
+
+        reader->end += size;
+        return true;
+    }
+}
+
+static inline int reader_getc(struct format_reader *reader) {
+    if (reader->start == reader->end && !reader_fill(reader)) {
+        return -1;
+    }
+    return reader->buffer[reader->start++];
+}
+
+/*
+ * Next line without its terminator into line (FORMAT_MAX_LINE bytes). Returns
+ * its length, -1 at the end of the file and -2 when it does not fit.
+ */
+static int reader_line(struct format_reader *reader, char *line) {
+    size_t length = 0;
+    bool too_long = false;
+    bool found = false;
+
+    while (!found) {
+        if (reader->start == reader->end && !reader_fill(reader)) {
+            if (length == 0 && !too_long) {
+                return -1;
+            }
+            break;
+        }
+
+        const uint8_t *begin = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        const uint8_t *newline = memchr(begin, '\n', available);
+        size_t take = newline != NULL ? (size_t) (newline - begin) : available;
+        if (length + take < FORMAT_MAX_LINE) {
+            memcpy(line + length, begin, take);
+            length += take;
+        } else {
+            too_long = true;
+        }
+
+        found = newline != NULL;
+        reader->start += take + found;
+    }
+
+    reader->line++;
+    if (too_long) {
+        return -2;
+    }
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    line[length] = '\0';
+    return (int) length;
+}
+
+static char *trim(char *text) {
+    while (*text == ' ' || *text == '\t') text++;
+    size_t length = strlen(text);
+    while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t')) length--;
+    text[length] = '\0';
+    return text;
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Exactly count bytes in hex, spaces between bytes are allowed
+static bool parse_hex_bytes(const char *text, uint8_t *bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        while (*text == ' ') text++;
+        int high = hex_value(text[0]);
+        int low = high < 0 ? -1 : hex_value(text[1]);
+        if (low < 0) {
+            return false;
+        }
+        bytes[i] = (uint8_t) (high << 4 | low);
+        text += 2;
+    }
+
+    while (*text == ' ') text++;
+    return *text == '\0';
+}
+
+static void reverse_system_block(struct srix_image *image) {
+    uint32_t word;
+    memcpy(&word, image->system_block, sizeof(word));
+    word = __builtin_bswap32(word);
+    memcpy(image->system_block, &word, sizeof(word));
+}
+
+// Same layout as srix_image_load(), except that any other size is refused
+static int load_binary(struct srix_image *image, struct format_reader *reader, bool reversed) {
+    while (reader->end <= DUMP_MAX_FILE_SIZE && reader_fill(reader)) {
+    }
+    if (reader->error) {
+        return FORMAT_EREAD;
+    }
+
+    size_t size = reader->end;
+    if (size != srix_image_size(image) && size != srix_image_size(image) + DUMP_SYSTEM_BLOCK_SIZE) {
+        return FORMAT_ESIZE;
+    }
+    srix_image_parse(image, reader->buffer, size);
+
+    if (reversed) {
+        image->order = SRIX_ORDER_REVERSED;
+        srix_image_reverse(image);
+        if (image->has_system_block) {
+            reverse_system_block(image);
+        }
+    }
+
+    return FORMAT_SUCCESS;
+}
+
+// One block per line, one more line is the system block
+static int load_eml(struct srix_image *image, struct format_reader *reader) {
+    char line[FORMAT_MAX_LINE];
+    size_t count = 0;
+    int length;
+
+    while ((length = reader_line(reader, line)) != -1) {
+        char *text = trim(line);
+        if (length == -2) {
+            return FORMAT_ESYNTAX;
+        }
+        if (*text == '\0') {
+            continue;
+        }
+        if (count > image->blocks) {
+            return FORMAT_ESIZE;
+        }
+
+        uint8_t *bytes = count < image->blocks ? srix_image_block_bytes(image, count) : image->system_block;
+        if (!parse_hex_bytes(text, bytes, 4)) {
+            return FORMAT_ESYNTAX;
+        }
+        count++;
+    }
+
+    if (count < image->blocks) {
+        return FORMAT_ESIZE;
+    }
+    image->has_system_block = count > image->blocks;
+    return FORMAT_SUCCESS;
+}
+
+// "Key: value" lines, keys of other devices and comments are skipped
+static int load_nfc(struct srix_image *image, struct format_reader *reader) {
+    char line[FORMAT_MAX_LINE];
+    uint64_t seen[SRIX_IMAGE_MAX_BLOCKS / 64] = {};
+    bool st25tb = false;
+    int length;
+
+    while ((length = reader_line(reader, line)) != -1) {
+        char *key = trim(line);
+        if (length == -2) {
+            return FORMAT_ESYNTAX;
+        }
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+
+        char *value = strchr(key, ':');
+        if (value == NULL) {
+            return FORMAT_ESYNTAX;
+        }
+        *value++ = '\0';
+        key = trim(key);
+        value = trim(value);
+
+        if (strcmp(key, "Device type") == 0) {
+            if (strcmp(value, "ST25TB") != 0) {
+                return FORMAT_EDEVICE;
+            }
+            st25tb = true;
+        } else if (strcmp(key, "UID") == 0) {
+            uint8_t uid[8];
+            if (!parse_hex_bytes(value, uid, sizeof(uid))) {
+                return FORMAT_ESYNTAX;
+            }
+            image->uid = 0;
+            for (size_t i = 0; i < sizeof(uid); i++) {
+                image->uid = image->uid << 8u | uid[i];
+            }
+            image->has_uid = true;
+        } else if (strncmp(key, "Block ", 6) == 0) {
+            char *end;
+            unsigned long block = strtoul(key + 6, &end, 10);
+            if (end == key + 6 || *end != '\0') {
+                return FORMAT_ESYNTAX;
+            }
+            if (block >= image->blocks) {
+                return FORMAT_ESIZE;
+            }
+            if (!parse_hex_bytes(value, srix_image_block_bytes(image, block), 4)) {
+                return FORMAT_ESYNTAX;
+            }
+            seen[block / 64] |= 1ull << (block % 64);
+        } else if (strcmp(key, "System OTP Block") == 0) {
+            if (!parse_hex_bytes(value, image->system_block, 4)) {
+                return FORMAT_ESYNTAX;
+            }
+            image->has_system_block = true;
+        }
+    }
+
+    if (!st25tb) {
+        return FORMAT_EDEVICE;
+    }
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        if (!srix_bitmap_test(seen, i)) {
+            return FORMAT_ESIZE;
+        }
+    }
+    return FORMAT_SUCCESS;
+}
+
+/*
+ * Just enough JSON for one object: known keys are parsed as they stream by,
+ * any other value is skipped without being kept.
+ */
+struct json_parser {
+    struct format_reader *reader;
+    int c; // Lookahead, -1 at the end
+    unsigned int line;
+};
+
+static void json_advance(struct json_parser *parser) {
+    if (parser->c == '\n') {
+        parser->line++;
+    }
+    parser->c = reader_getc(parser->reader);
+}
+
+static void json_skip_space(struct json_parser *parser) {
+    while (parser->c == ' ' || parser->c == '\t' || parser->c == '\n' || parser->c == '\r') {
+        json_advance(parser);
+    }
+}
+
+static bool json_expect(struct json_parser *parser, int c) {
+    json_skip_space(parser);
+    if (parser->c != c) {
+        return false;
+    }
+
+    json_advance(parser);
+    return true;
+}
+
+// Longer strings are cut to size - 1 bytes, escapes are kept as the escaped character
+static bool json_string(struct json_parser *parser, char *text, size_t size) {
+    size_t length = 0;
+
+    if (!json_expect(parser, '"')) {
+        return false;
+    }
+    while (parser->c != '"') {
+        if (parser->c == '\\') {
+            json_advance(parser);
+        }
+        if (parser->c < 0x20) {
+            return false;
+        }
+        if (length + 1 < size) {
+            text[length++] = (char) parser->c;
+        }
+        json_advance(parser);
+    }
+    json_advance(parser);
+
+    text[length] = '\0';
+    return true;
+}
+
+static bool json_skip_value(struct json_parser *parser, unsigned int depth) {
+    char scratch[1];
+
+    json_skip_space(parser);
+    if (depth > FORMAT_MAX_DEPTH) {
+        return false;
+    }
+
+    if (parser->c == '"') {
+        return json_string(parser, scratch, sizeof(scratch));
+    }
+    if (parser->c == '{' || parser->c == '[') {
+        int close = parser->c == '{' ? '}' : ']';
+        json_advance(parser);
+        json_skip_space(parser);
+        if (parser->c == close) {
+            json_advance(parser);
+            return true;
+        }
+
+        for (;;) {
+            if (close == '}' && (!json_string(parser, scratch, sizeof(scratch)) || !json_expect(parser, ':'))) {
+                return false;
+            }
+            if (!json_skip_value(parser, depth + 1)) {
+                return false;
+            }
+            json_skip_space(parser);
+            if (parser->c == close) {
+                json_advance(parser);
+                return true;
+            }
+            if (parser->c != ',') {
+                return false;
+            }
+            json_advance(parser);
+        }
+    }
+
+    // Numbers, true, false, null
+    size_t length = 0;
+    while ((parser->c >= '0' && parser->c <= '9') || (parser->c >= 'a' && parser->c <= 'z') || parser->c == '-' || parser->c == '+' || parser->c == '.' || parser->c == 'E') {
+        json_advance(parser);
+        length++;
+    }
+    return length > 0;
+}
+
+static int json_blocks(struct json_parser *parser, struct srix_image *image, size_t *count) {
+    char text[16];
+
+    if (!json_expect(parser, '[')) {
+        return FORMAT_ESYNTAX;
+    }
+    json_skip_space(parser);
+    if (parser->c == ']') {
+        json_advance(parser);
+        return FORMAT_SUCCESS;
+    }
+
+    for (;;) {
+        if (!json_string(parser, text, sizeof(text))) {
+            return FORMAT_ESYNTAX;
+        }
+        if (*count == image->blocks) {
+            return FORMAT_ESIZE;
+        }
+        if (!parse_hex_bytes(text, srix_image_block_bytes(image, *count), 4)) {
+            return FORMAT_ESYNTAX;
+        }
+        (*count)++;
+
+        json_skip_space(parser);
+        if (parser->c == ']') {
+            json_advance(parser);
+            return FORMAT_SUCCESS;
+        }
+        if (!json_expect(parser, ',')) {
+            return FORMAT_ESYNTAX;
+        }
+    }
+}
+
+static int json_object(struct json_parser *parser, struct srix_image *image) {
+    char key[32];
+    char text[32];
+    size_t count = 0;
+
+    if (!json_expect(parser, '{')) {
+        return FORMAT_ESYNTAX;
+    }
+    json_skip_space(parser);
+    if (parser->c == '}') {
+        return FORMAT_ESIZE;
+    }
+
+    for (;;) {
+        if (!json_string(parser, key, sizeof(key)) || !json_expect(parser, ':')) {
+            return FORMAT_ESYNTAX;
+        }
+
+        json_skip_space(parser);
+        if (strcmp(key, "blocks") == 0) {
+            int result = json_blocks(parser, image, &count);
+            if (result != FORMAT_SUCCESS) {
+                return result;
+            }
+        } else if (strcmp(key, "uid") == 0 && parser->c == '"') {
+            if (!json_string(parser, text, sizeof(text)) || strlen(text) != 16 || !srix_uid_from_name(text, &image->uid)) {
+                return FORMAT_ESYNTAX;
+            }
+            image->has_uid = true;
+        } else if (strcmp(key, "system_block") == 0 && parser->c == '"') {
+            if (!json_string(parser, text, sizeof(text)) || !parse_hex_bytes(text, image->system_block, 4)) {
+                return FORMAT_ESYNTAX;
+            }
+            image->has_system_block = true;
+        } else if (!json_skip_value(parser, 1)) {
+            return FORMAT_ESYNTAX;
+        }
+
+        json_skip_space(parser);
+        if (parser->c == '}') {
+            json_advance(parser);
+            break;
+        }
+        if (!json_expect(parser, ',')) {
+            return FORMAT_ESYNTAX;
+        }
+    }
+
+    // Nothing but space after the object
+    json_skip_space(parser);
+    if (parser->c != -1) {
+        return FORMAT_ESYNTAX;
+    }
+    return count == image->blocks ? FORMAT_SUCCESS : FORMAT_ESIZE;
+}
+
+static int load_json(struct srix_image *image, struct format_reader *reader) {
+    struct json_parser parser = {.reader = reader, .line = 1};
+    parser.c = reader_getc(reader);
+
+    int result = json_object(&parser, image);
+    reader->line = parser.line;
+    return result;
+}
+
+static int load(struct srix_image *image, int format, struct format_reader *reader) {
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    reader->error = false;
+    reader->line = 0;
+    srix_image_init(image, image->blocks);
+
+    int result;
+    switch (format) {
+        case FORMAT_BIN:
+        case FORMAT_REVERSED:
+            result = load_binary(image, reader, format == FORMAT_REVERSED);
+            break;
+        case FORMAT_EML:
+            result = load_eml(image, reader);
+            break;
+        case FORMAT_NFC:
+            result = load_nfc(image, reader);
+            break;
+        default:
+            result = load_json(image, reader);
+            break;
+    }
+
+    // A syntax error may only be the file cut short
+    if (reader->error) {
+        return FORMAT_EREAD;
+    }
+    if (result == FORMAT_SUCCESS) {
+        srix_image_mark_all_present(image);
+    }
+
+    return result;
+}
+
+// Loads image->blocks blocks, the system block and the UID when the file has them
+int srix_format_load(struct srix_image *image, const char *path, int format, struct format_reader *reader) {
+    if (format == FORMAT_AUTO) {
+        format = srix_format_from_path(path);
+    }
+    if (format < 0 || format >= FORMAT_COUNT) {
+        return FORMAT_EUNKNOWN;
+    }
+
+    reader->memory = NULL;
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        return FORMAT_EOPEN;
+    }
+
+    int result = load(image, format, reader);
+    close(reader->fd);
+
+    return result;
+}
+
+// Same as srix_format_load(), from a file already in memory
+int srix_format_parse(struct srix_image *image, const uint8_t *data, size_t size, int format, struct format_reader *reader) {
+    if (format < 0 || format >= FORMAT_COUNT) {
+        return FORMAT_EUNKNOWN;
+    }
+
+    reader->fd = -1;
+    reader->memory = data;
+    reader->memory_size = size;
+    reader->memory_offset = 0;
+
+    int result = load(image, format, reader);
+    reader->memory = NULL;
+
+    return result;
+}
+
+/*
+ * Writing
+ */
+
+static void put(struct format_writer *writer, const void *data, size_t size) {
+    if (writer->used + size > sizeof(writer->buffer)) {
+        writer->overflow = true;
+        return;
+    }
+
+    memcpy(writer->buffer + writer->used, data, size);
+    writer->used += size;
+}
+
+static void put_text(struct format_writer *writer, const char *text) {
+    put(writer, text, strlen(text));
+}
+
+static void put_hex(struct format_writer *writer, const uint8_t *bytes, size_t count, bool spaced, bool lowercase) {
+    const char *digits = lowercase ? "0123456789abcdef" : "0123456789ABCDEF";
+    char text[3 * 8];
+    size_t length = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (spaced && i > 0) text[length++] = ' ';
+        text[length++] = digits[bytes[i] >> 4u];
+        text[length++] = digits[bytes[i] & 0xFu];
+    }
+    put(writer, text, length);
+}
+
+static void put_uint(struct format_writer *writer, unsigned int value) {
+    char text[16];
+    size_t length = sizeof(text);
+
+    do {
+        text[--length] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    put(writer, text + length, sizeof(text) - length);
+}
+
+static void uid_bytes(const struct srix_image *image, uint8_t *bytes) {
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = image->uid >> (56u - i * 8u);
+    }
+}
+
+static void save_binary(const struct srix_image *image, struct format_writer *writer, bool reversed) {
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        const uint8_t *bytes = srix_image_block_bytes_const(image, i);
+        uint8_t block[4] = {bytes[0], bytes[1], bytes[2], bytes[3]};
+        if (reversed) {
+            block[0] = bytes[3];
+            block[1] = bytes[2];
+            block[2] = bytes[1];
+            block[3] = bytes[0];
+        }
+        put(writer, block, sizeof(block));
+    }
+
+    if (image->has_system_block) {
+        const uint8_t *bytes = image->system_block;
+        uint8_t block[4] = {bytes[3], bytes[2], bytes[1], bytes[0]};
+        put(writer, reversed ? block : bytes, sizeof(block));
+    }
+}
+
+static void save_eml(const struct srix_image *image, struct format_writer *writer) {
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        put_hex(writer, srix_image_block_bytes_const(image, i), 4, false, true);
+        put_text(writer, "\n");
+    }
+    if (image->has_system_block) {
+        put_hex(writer, image->system_block, 4, false, true);
+        put_text(writer, "\n");
+    }
+}
+
+static void save_nfc(const struct srix_image *image, struct format_writer *writer) {
+    uint8_t uid[8];
+    uid_bytes(image, uid);
+
+    put_text(writer, "Filetype: Flipper NFC device\n");
+    put_text(writer, "Version: 4\n");
+    put_text(writer, "# Device type can be ISO14443-3A, ISO14443-3B, ISO14443-4A, ISO14443-4B, ISO15693-3, FeliCa, NTAG/Ultralight, Mifare Classic, Mifare Plus, Mifare DESFire, SLIX, ST25TB\n");
+    put_text(writer, "Device type: ST25TB\n");
+    put_text(writer, "# UID is common for all formats\n");
+    put_text(writer, "UID: ");
+    put_hex(writer, uid, sizeof(uid), true, false);
+    put_text(writer, "\n# ST25TB specific data\n");
+    put_text(writer, image->blocks == SRIX_IMAGE_MAX_BLOCKS ? "ST25TB Type: X4K\n" : "ST25TB Type: X512\n");
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        put_text(writer, "Block ");
+        put_uint(writer, i);
+        put_text(writer, ": ");
+        put_hex(writer, srix_image_block_bytes_const(image, i), 4, true, false);
+        put_text(writer, "\n");
+    }
+    if (image->has_system_block) {
+        put_text(writer, "System OTP Block: ");
+        put_hex(writer, image->system_block, 4, true, false);
+        put_text(writer, "\n");
+    }
+}
+
+static void save_json(const struct srix_image *image, struct format_writer *writer) {
+    put_text(writer, "{\n");
+    if (image->has_uid) {
+        uint8_t uid[8];
+        uid_bytes(image, uid);
+        put_text(writer, "  \"uid\": \"");
+        put_hex(writer, uid, sizeof(uid), false, false);
+        put_text(writer, "\",\n");
+    }
+
+    put_text(writer, "  \"blocks\": [\n");
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        put_text(writer, "    \"");
+        put_hex(writer, srix_image_block_bytes_const(image, i), 4, false, false);
+        put_text(writer, i + 1 < image->blocks ? "\",\n" : "\"\n");
+    }
+    put_text(writer, image->has_system_block ? "  ],\n" : "  ]\n");
+
+    if (image->has_system_block) {
+        put_text(writer, "  \"system_block\": \"");
+        put_hex(writer, image->system_block, 4, false, false);
+        put_text(writer, "\"\n");
+    }
+    put_text(writer, "}\n");
+}
+
+// Written next to path and renamed, a reader never sees half a file
+static int write_file(const char *path, const char *data, size_t size) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        return FORMAT_EOPEN;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return FORMAT_EOPEN;
+    }
+
+    int result = FORMAT_SUCCESS;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            result = FORMAT_EWRITE;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+
+    if (close(fd) != 0 && result == FORMAT_SUCCESS) {
+        result = FORMAT_EWRITE;
+    }
+    if (result == FORMAT_SUCCESS && rename(tmp_path, path) != 0) {
+        result = FORMAT_EWRITE;
+    }
+    if (result != FORMAT_SUCCESS) {
+        unlink(tmp_path);
+    }
+
+    return result;
+}
+
+// Into writer->buffer, writer->used bytes
+int srix_format_render(const struct srix_image *image, int format, struct format_writer *writer) {
+    writer->used = 0;
+    writer->overflow = false;
+
+    switch (format) {
+        case FORMAT_BIN:
+        case FORMAT_REVERSED:
+            save_binary(image, writer, format == FORMAT_REVERSED);
+            break;
+        case FORMAT_EML:
+            save_eml(image, writer);
+            break;
+        case FORMAT_NFC:
+            if (!image->has_uid) {
+                return FORMAT_ENOUID;
+            }
+            save_nfc(image, writer);
+            break;
+        case FORMAT_JSON:
+            save_json(image, writer);
+            break;
+        default:
+            return FORMAT_EUNKNOWN;
+    }
+
+    return writer->overflow ? FORMAT_EWRITE : FORMAT_SUCCESS;
+}
+
+int srix_format_save(const struct srix_image *image, const char *path, int format, struct format_writer *writer) {
+    int result = srix_format_render(image, format, writer);
+    if (result != FORMAT_SUCCESS) {
+        return result;
+    }
+    return write_file(path, writer->buffer, writer->used);
+}
+
+const char *srix_format_strerror(int error) {
+    switch (error) {
+        case FORMAT_SUCCESS:
+            return "success";
+        case FORMAT_EOPEN:
+            return "cannot open file";
+        case FORMAT_EREAD:
+            return "error encountered while reading file";
+        case FORMAT_EWRITE:
+            return "error encountered while writing file";
+        case FORMAT_ESIZE:
+            return "wrong number of blocks";
+        case FORMAT_ESYNTAX:
+            return "syntax error";
+        case FORMAT_EDEVICE:
+            return "not an ST25TB device";
+        case FORMAT_ENOUID:
+            return "the UID is missing";
+        case FORMAT_EUNKNOWN:
+            return "unknown format";
+        default:
+            return "unknown error";
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_DUMP_FORMAT_H__
+#define __NFC_SRIX_DUMP_FORMAT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "srix_image.h"
+
+/*
+ * Dump interchange formats. Every format holds the EEPROM and optionally the
+ * system block; the text formats can carry the UID too.
+ *
+ *   bin       raw dump, as written by srix-dump
+ *   reversed  raw dump with every block reversed, as printed by srix-dump -r
+ *   eml       Proxmark, one block per line in hex, then the system block
+ *   nfc       Flipper Zero, ST25TB device
+ *   json      {"uid": "...", "blocks": ["01020304", ...], "system_block": "..."}
+ *
+ * Blocks are always kept in the byte order of the tag (raw) in memory, text
+ * formats print them that way too. Files are parsed as they are read through
+ * a fixed buffer and written from a single buffer, both owned by the caller,
+ * so converting many files allocates nothing per file.
+ */
+
+/* Macros */
+#define FORMAT_READ_BUFFER_SIZE (64 * 1024)
+#define FORMAT_WRITE_BUFFER_SIZE (8 * 1024) // Largest output is nfc for SRIX4K, about 3.5 KiB
+#define FORMAT_MAX_LINE 256
+#define FORMAT_MAX_DEPTH 32 // JSON nesting
+
+/* Formats */
+#define FORMAT_AUTO -1 // From the file extension
+#define FORMAT_BIN 0
+#define FORMAT_REVERSED 1
+#define FORMAT_EML 2
+#define FORMAT_NFC 3
+#define FORMAT_JSON 4
+#define FORMAT_COUNT 5
+
+/* Return values */
+#define FORMAT_SUCCESS 0
+#define FORMAT_EOPEN -1
+#define FORMAT_EREAD -2
+#define FORMAT_EWRITE -3
+#define FORMAT_ESIZE -4    // Not the number of blocks of the tag type
+#define FORMAT_ESYNTAX -5  // See format_reader.line
+#define FORMAT_EDEVICE -6  // Not an ST25TB Flipper file
+#define FORMAT_ENOUID -7   // The output format needs the UID
+#define FORMAT_EUNKNOWN -8 // No format for this extension
+
+struct format_reader {
+    int fd;
+    const uint8_t *memory; // Parsed from memory instead of fd when set
+    size_t memory_size;
+    size_t memory_offset;
+    size_t start;
+    size_t end;
+    bool eof;
+    bool error;
+    unsigned int line; // Of the last syntax error
+    uint8_t buffer[FORMAT_READ_BUFFER_SIZE];
+};
+
+struct format_writer {
+    size_t used;
+    bool overflow;
+    char buffer[FORMAT_WRITE_BUFFER_SIZE];
+};
+
+/* Names */
+int srix_format_from_name(const char *name);
+int srix_format_from_path(const char *path);
+const char *srix_format_name(int format);
+const char *srix_format_extension(int format);
+
+/* Files */
+int srix_format_load(struct srix_image *image, const char *path, int format, struct format_reader *reader);
+int srix_format_parse(struct srix_image *image, const uint8_t *data, size_t size, int format, struct format_reader *reader);
+int srix_format_save(const struct srix_image *image, const char *path, int format, struct format_writer *writer);
+int srix_format_render(const struct srix_image *image, int format, struct format_writer *writer);
+const char *srix_format_strerror(int error);
+
+#endif // __NFC_SRIX_DUMP_FORMAT_H__
@@ -0,0 +1,462 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "dump_utils.h"
+#include "corpus.h"
+#include "partial.h"
+
+/* Macros */
+#define STATS_RESETS_BUCKETS 2048 // 11 bit reload counter
+#define STATS_COUNTER_BUCKETS 33  // log2 buckets, 0 has its own
+#define STATS_LOCK_PATTERNS 256
+#define STATS_TOP_PATTERNS 16
+#define STATS_DEFAULT_NEAR_EXHAUSTION 2
+#define STATS_PARTIAL_TOOL "srix-stats"
+
+/* Partial entries */
+#define STATS_ENTRY_ERROR 0 // value = load result
+#define STATS_ENTRY_NEAR 1  // value = resets remaining
+
+/* Partial config words */
+#define STATS_CONFIG_EEPROM_BLOCKS 0
+#define STATS_CONFIG_NEAR_EXHAUSTION 1
+
+struct stats_totals {
+    uint64_t dumps;
+    uint64_t errors;
+    uint64_t with_system_block;
+    uint64_t near_exhaustion;
+    uint64_t resets[STATS_RESETS_BUCKETS];
+    uint64_t counter_5[STATS_COUNTER_BUCKETS];
+    uint64_t counter_6[STATS_COUNTER_BUCKETS];
+    uint64_t lock_patterns[STATS_LOCK_PATTERNS];
+    uint64_t locked_blocks[16];
+};
+
+// Stored as the counters of a partial result
+#define STATS_TOTALS_COUNTERS (sizeof(struct stats_totals) / sizeof(uint64_t))
+_Static_assert(sizeof(struct stats_totals) % sizeof(uint64_t) == 0, "totals are an array of counters");
+
+struct stats_result {
+    int load_result;
+    uint32_t resets_remaining;
+};
+
+struct stats_context {
+    uint8_t eeprom_blocks;
+    uint32_t near_exhaustion;
+    bool list_near_exhaustion;
+    bool list_errors;
+    struct partial *partial; // NULL unless -o was given
+
+    struct stats_result *results;
+    struct stats_totals workers[CORPUS_MAX_THREADS];
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s <dump.bin|dir>... [-h] [-v] [-l] [-e] [-n resets] [-j threads] [-t x4k|512] [--shard i/N] [-o partial]\n", executable);
+    printf("       %s merge <partial>... [-h] [-l] [-e]\n", executable);
+    printf("\nNecessary arguments:\n");
+    printf("  <dump.bin|dir>  dumps to analyze, directories are walked recursively\n");
+    printf("  <partial>       partial results written with -o, one per shard\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -l           list tags near exhaustion\n");
+    printf("  -e           list unreadable dumps\n");
+    printf("  -n resets    near exhaustion threshold [default: %d]\n", STATS_DEFAULT_NEAR_EXHAUSTION);
+    printf("  -j threads   number of worker threads [default: number of CPUs]\n");
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  --shard i/N  only analyze shard i of N, dumps are split by UID\n");
+    printf("  -o partial   write partial results to be merged instead of the report\n");
+}
+
+static uint8_t log2_bucket(uint32_t value) {
+    uint8_t bucket = 0;
+    while (value != 0) {
+        bucket++;
+        value >>= 1u;
+    }
+    return bucket;
+}
+
+static void stats_process(const char *path, size_t slot, unsigned int worker, void *arg) {
+    struct stats_context *context = arg;
+    struct stats_totals *totals = &context->workers[worker];
+    struct stats_result *result = &context->results[slot];
+
+    struct srix_image image;
+    srix_image_init(&image, context->eeprom_blocks);
+
+    result->load_result = srix_image_load(&image, path, NULL);
+    if (result->load_result != DUMP_SUCCESS) {
+        totals->errors++;
+        return;
+    }
+    totals->dumps++;
+
+    // Count down counter
+    uint32_t block_5 = srix_image_value(&image, 5);
+    uint32_t block_6 = srix_image_value(&image, 6);
+    result->resets_remaining = srix_otp_resets_remaining(block_6);
+    totals->resets[result->resets_remaining]++;
+    totals->counter_5[log2_bucket(block_5)]++;
+    totals->counter_6[log2_bucket(block_6 & ((1u << SRIX_OTP_RESETS_SHIFT) - 1))]++;
+    if (result->resets_remaining <= context->near_exhaustion) {
+        totals->near_exhaustion++;
+    }
+
+    // Lock bits
+    if (image.has_system_block) {
+        uint32_t system_block = srix_image_system_value(&image);
+        totals->with_system_block++;
+        totals->lock_patterns[system_block >> 24u]++;
+        for (uint8_t block = 7; block < 16; block++) {
+            if (srix_block_is_locked(system_block, block)) {
+                totals->locked_blocks[block]++;
+            }
+        }
+    }
+}
+
+static void stats_chunk_done(char *const *paths, size_t count, void *arg) {
+    struct stats_context *context = arg;
+
+    for (size_t i = 0; i < count; i++) {
+        struct stats_result *result = &context->results[i];
+
+        // Partials keep every listed file, merge decides what to print
+        if (context->partial != NULL) {
+            int add_result = PARTIAL_SUCCESS;
+            if (result->load_result != DUMP_SUCCESS) {
+                add_result = partial_add_entry(context->partial, paths[i], STATS_ENTRY_ERROR, (uint32_t) result->load_result);
+            } else if (result->resets_remaining <= context->near_exhaustion) {
+                add_result = partial_add_entry(context->partial, paths[i], STATS_ENTRY_NEAR, result->resets_remaining);
+            }
+            if (add_result != PARTIAL_SUCCESS) {
+                lerror("Cannot record \"%s\": %s. Exiting...\n", paths[i], partial_strerror(add_result));
+                exit(1);
+            }
+            continue;
+        }
+
+        if (result->load_result != DUMP_SUCCESS) {
+            if (context->list_errors) {
+                printf("ERROR %s: %s\n", paths[i], srix_dump_strerror(result->load_result));
+            }
+        } else if (context->list_near_exhaustion && result->resets_remaining <= context->near_exhaustion) {
+            printf("NEAR %s: %" PRIu32 " resets remaining\n", paths[i], result->resets_remaining);
+        }
+    }
+
+    fflush(stdout);
+}
+
+static void merge_totals(struct stats_totals *into, const struct stats_totals *from) {
+    into->dumps += from->dumps;
+    into->errors += from->errors;
+    into->with_system_block += from->with_system_block;
+    into->near_exhaustion += from->near_exhaustion;
+    for (int i = 0; i < STATS_RESETS_BUCKETS; i++) into->resets[i] += from->resets[i];
+    for (int i = 0; i < STATS_COUNTER_BUCKETS; i++) into->counter_5[i] += from->counter_5[i];
+    for (int i = 0; i < STATS_COUNTER_BUCKETS; i++) into->counter_6[i] += from->counter_6[i];
+    for (int i = 0; i < STATS_LOCK_PATTERNS; i++) into->lock_patterns[i] += from->lock_patterns[i];
+    for (int i = 0; i < 16; i++) into->locked_blocks[i] += from->locked_blocks[i];
+}
+
+static void print_counter_histogram(const char *title, const uint64_t *buckets) {
+    int last = -1;
+    for (int i = 0; i < STATS_COUNTER_BUCKETS; i++) {
+        if (buckets[i] != 0) last = i;
+    }
+
+    printf("%s:\n", title);
+    for (int i = 0; i <= last; i++) {
+        if (buckets[i] == 0) continue;
+
+        printf("%s ", i == last ? "└──" : "├──");
+        if (i == 0) {
+            printf("%23s", "0");
+        } else {
+            printf("[%10" PRIu32 ", %10" PRIu64 "]", (uint32_t) 1u << (i - 1), ((uint64_t) 1u << i) - 1);
+        }
+        printf(": %" PRIu64 "\n", buckets[i]);
+    }
+}
+
+static void print_lock_pattern(uint8_t pattern) {
+    // One character per lock bit: blocks 07-08, 09, ..., 0F
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        printf("%c", ((pattern >> bit) & 1u) ? '-' : 'L');
+    }
+}
+
+static void print_report(const struct stats_totals *totals, uint32_t near_exhaustion) {
+    printf("Dumps: %" PRIu64 " (%" PRIu64 " unreadable)\n", totals->dumps, totals->errors);
+    if (totals->dumps == 0) {
+        return;
+    }
+
+    // Remaining resets
+    uint32_t min_resets = STATS_RESETS_BUCKETS, max_resets = 0;
+    uint64_t sum_resets = 0;
+    for (uint32_t i = 0; i < STATS_RESETS_BUCKETS; i++) {
+        if (totals->resets[i] == 0) continue;
+        if (i < min_resets) min_resets = i;
+        if (i > max_resets) max_resets = i;
+        sum_resets += (uint64_t) i * totals->resets[i];
+    }
+
+    printf("OTP resets remaining:\n");
+    printf("├── min: %" PRIu32 "\n", min_resets);
+    printf("├── max: %" PRIu32 "\n", max_resets);
+    printf("├── mean: %.2f\n", (double) sum_resets / (double) totals->dumps);
+    printf("├── near exhaustion (<= %" PRIu32 "): %" PRIu64 "\n", near_exhaustion, totals->near_exhaustion);
+    printf("└── distribution:\n");
+    for (uint32_t i = min_resets; i <= max_resets; i++) {
+        if (totals->resets[i] == 0) continue;
+        printf("    %s %4" PRIu32 ": %" PRIu64 "\n", i == max_resets ? "└──" : "├──", i, totals->resets[i]);
+    }
+
+    // Counters
+    print_counter_histogram("Block 05 counter", totals->counter_5);
+    print_counter_histogram("Block 06 counter (low 21 bits)", totals->counter_6);
+
+    // Lock bits
+    printf("Lock bits (%" PRIu64 " dumps with system block):\n", totals->with_system_block);
+    if (totals->with_system_block == 0) {
+        printf("└── dump with \"srix-dump --with-system-block\" to include the system block\n");
+        return;
+    }
+
+    printf("├── locked blocks:\n");
+    for (uint8_t block = 7; block < 16; block++) {
+        printf("│   %s [%02X] %" PRIu64 "\n", block == 15 ? "└──" : "├──", block, totals->locked_blocks[block]);
+    }
+
+    // Most common patterns first
+    bool printed[STATS_LOCK_PATTERNS] = {};
+    printf("└── patterns (blocks 07/08 09 0A 0B 0C 0D 0E 0F, L = locked):\n");
+    for (int n = 0; n < STATS_TOP_PATTERNS; n++) {
+        int best = -1;
+        for (int i = 0; i < STATS_LOCK_PATTERNS; i++) {
+            if (printed[i] || totals->lock_patterns[i] == 0) continue;
+            if (best < 0 || totals->lock_patterns[i] > totals->lock_patterns[best]) best = i;
+        }
+        if (best < 0) break;
+
+        printed[best] = true;
+        printf("    ");
+        print_lock_pattern(best);
+        printf(": %" PRIu64 "\n", totals->lock_patterns[best]);
+    }
+}
+
+static void print_entry(const struct partial_entry *entry, bool list_near_exhaustion, bool list_errors) {
+    if (entry->kind == STATS_ENTRY_ERROR && list_errors) {
+        printf("ERROR %s: %s\n", entry->path, srix_dump_strerror((int32_t) entry->value));
+    } else if (entry->kind == STATS_ENTRY_NEAR && list_near_exhaustion) {
+        printf("NEAR %s: %" PRIu32 " resets remaining\n", entry->path, entry->value);
+    }
+}
+
+/*
+ * Combines the partials of every shard. Lists come out sorted by path, so the
+ * output is the same however the corpus was split.
+ */
+static int run_merge(int argc, char *argv[]) {
+    bool list_near_exhaustion = false;
+    bool list_errors = false;
+
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hle")) != -1) {
+        switch (opt) {
+            case 'l':
+                list_near_exhaustion = true;
+                break;
+            case 'e':
+                list_errors = true;
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 1) {
+        lerror("You need to specify at least one partial result.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    struct partial merged;
+    int merge_result = partial_merge(&merged, STATS_PARTIAL_TOOL, STATS_TOTALS_COUNTERS, argv + optind, argc - optind);
+    if (merge_result != PARTIAL_SUCCESS) {
+        lerror("Cannot merge partial results: %s.\n", partial_strerror(merge_result));
+        exit(1);
+    }
+    lverbose("Merged %" PRIu32 " shards.\n", merged.shard_count);
+
+    for (size_t i = 0; i < merged.entry_count; i++) {
+        print_entry(&merged.entries[i], list_near_exhaustion, list_errors);
+    }
+
+    struct stats_totals totals;
+    memcpy(&totals, merged.counters, sizeof(totals));
+    print_report(&totals, merged.config[STATS_CONFIG_NEAR_EXHAUSTION]);
+
+    partial_free(&merged);
+    return 0;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        // Keep the executable name for the usage message
+        argv[1] = argv[0];
+        return run_merge(argc - 1, argv + 1);
+    }
+
+    // Options
+    unsigned int threads = 0;
+    uint8_t eeprom_blocks = SRIX4K_EEPROM_BLOCKS;
+    uint32_t near_exhaustion = STATS_DEFAULT_NEAR_EXHAUSTION;
+    bool list_near_exhaustion = false;
+    bool list_errors = false;
+    unsigned int shard_index = 0;
+    unsigned int shard_count = 0;
+    char *partial_path = NULL;
+
+    // Parse options
+    static const struct option long_options[] = {
+            {"shard", required_argument, NULL, 'H'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hvlen:j:t:o:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                if (!corpus_parse_shard(optarg, &shard_index, &shard_count)) {
+                    lerror("Invalid shard \"%s\", expected i/N with i < N.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                partial_path = optarg;
+                break;
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'l':
+                list_near_exhaustion = true;
+                break;
+            case 'e':
+                list_errors = true;
+                break;
+            case 'n':
+                near_exhaustion = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 1) {
+        lerror("You need to specify at least one dump or directory.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    size_t chunk_size = CORPUS_DEFAULT_CHUNK_SIZE;
+    struct stats_context *context = calloc(1, sizeof(struct stats_context));
+    if (context == NULL || (context->results = malloc(sizeof(struct stats_result) * chunk_size)) == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+    context->eeprom_blocks = eeprom_blocks;
+    context->near_exhaustion = near_exhaustion;
+    context->list_near_exhaustion = list_near_exhaustion;
+    context->list_errors = list_errors;
+
+    struct partial partial;
+    if (partial_path != NULL) {
+        if (partial_init(&partial, STATS_PARTIAL_TOOL, STATS_TOTALS_COUNTERS) != PARTIAL_SUCCESS) {
+            lerror("Out of memory. Exiting...\n");
+            exit(1);
+        }
+        partial.shard_index = shard_index;
+        partial.shard_count = shard_count > 0 ? shard_count : 1;
+        partial.config[STATS_CONFIG_EEPROM_BLOCKS] = eeprom_blocks;
+        partial.config[STATS_CONFIG_NEAR_EXHAUSTION] = near_exhaustion;
+        context->partial = &partial;
+    }
+
+    struct corpus_job job = {
+            .threads = threads,
+            .chunk_size = chunk_size,
+            .process = stats_process,
+            .chunk_done = stats_chunk_done,
+            .arg = context,
+            .shard_index = shard_index,
+            .shard_count = shard_count,
+    };
+    size_t total = corpus_run(&job, argv + optind, argc - optind);
+    lverbose("Processed %zu files.\n", total);
+
+    // Per worker totals, merged once at the end
+    struct stats_totals totals = {};
+    for (int i = 0; i < CORPUS_MAX_THREADS; i++) {
+        merge_totals(&totals, &context->workers[i]);
+    }
+
+    if (partial_path != NULL) {
+        memcpy(partial.counters, &totals, sizeof(totals));
+        int write_result = partial_write(&partial, partial_path);
+        if (write_result != PARTIAL_SUCCESS) {
+            lerror("Cannot write \"%s\": %s.\n", partial_path, partial_strerror(write_result));
+            exit(1);
+        }
+        partial_free(&partial);
+        return 0;
+    }
+
+    print_report(&totals, near_exhaustion);
+
+    return 0;
+}
@@ -18,16 +18,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
 #include <stdbool.h>
 #include <nfc/nfc.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include "logging.h"
 #include "nfc_utils.h"
+#include "srix_image.h"
+#include "archive.h"
+#include "cancel.h"
+#include "block_queue.h"
+#include "crc32c.h"
+#include "telemetry.h"
+#include "reader_pool.h"
+#include "durable.h"
+
+/* Tag results */
+#define TAG_DONE 0
+#define TAG_EREAD -1
+#define TAG_EWRITE -2 // Dump file or archive
+#define TAG_CANCELLED -3
+#define TAG_ETHREAD -4
 
 static void print_usage(const char *executable) {
-    printf("Usage: %s [dump.bin] [-h] [-v] [-u] [-s] [-a] [-r] [-y] [-t x4k|512]\n", executable);
+    printf("Usage: %s [dump.bin] [-h] [-v] [-u] [-s] [-a] [-r] [-y] [-l] [-t x4k|512] [--with-system-block] [--append-archive archive] [--deadline-ms ms] [--sync-ms ms]\n", executable);
     printf("\nOptional arguments:\n");
-    printf("  [dump.bin]   dump EEPROM to file\n");
+    printf("  [dump.bin]   dump EEPROM to file, in loop mode a directory for <UID>.bin dumps\n");
     printf("\nOptions:\n");
     printf("  -h           show this help message\n");
     printf("  -v           enable verbose - print debugging data\n");
@@ -36,71 +56,369 @@ static void print_usage(const char *executable) {
     printf("  -a           enable -s and -u flags together\n");
     printf("  -r           fix read direction\n");
     printf("  -y           answer YES to all questions\n");
+    printf("  -l           loop mode - dump every presented tag until every reader has failed\n");
     printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  --with-system-block\n");
+    printf("               append the system block to the dump file, for srix-stats\n");
+    printf("  --append-archive archive\n");
+    printf("               append the dump to an archive, created if missing\n");
+    printf("  --deadline-ms ms\n");
+    printf("               give up waiting for and reading the tag after this long\n");
+    printf("  --sync-ms ms\n");
+    printf("               in loop mode, longest a dump waits to be synced to disk [default: %d]\n", DURABLE_DEFAULT_COMMIT_MS);
 }
 
-int main(int argc, char *argv[], char *envp[]) {
-    bool print_system_block = false;
-    bool print_uid = false;
-    bool fix_read_direction = false;
-    bool skip_confirmation = false;
-    char *output_path = NULL;
-    uint32_t eeprom_size = SRIX4K_EEPROM_SIZE;
-    uint32_t eeprom_blocks_amount = SRIX4K_EEPROM_BLOCKS;
+/*
+ * The main thread only talks to the reader and pushes what it reads. The
+ * output thread renders it, writes the dump and the archive, and computes
+ * the CRC32C of the dump. Options are kept from one tag to the next.
+ */
+struct dump_output {
+    struct block_queue queue;
+    pthread_t thread;
+    struct srix_image *image; // Owned by the output thread until it is joined
+
+    // Options
+    bool print_uid;
+    bool print_system_block;
+    bool append_system_block;
+    bool fix_read_direction;
+    const char *output_path;
+    const char *output_directory; // Loop mode, one <UID>.bin per tag
+    const char *archive_path;
+    struct durable *durable;
+
+    // Results
+    bool aborted;
+    char path[4096];
+    int write_result;
+    int archive_result;
+    uint32_t crc;
+};
+
+struct rf_timing {
+    uint64_t last_end_us;
+    uint64_t commands;
+    uint64_t rf_us;
+    uint64_t gaps;
+    uint64_t gap_us;
+    uint64_t max_gap_us;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
 
-    // Parse options
-    int opt = 0;
-    while ((opt = getopt(argc, argv, "hvusaryt:")) != -1) {
-        switch (opt) {
-            case 'v':
-                set_verbose(true);
-                break;
-            case 'a':
-                print_system_block = true;
-                print_uid = true;
-                break;
-            case 's':
-                print_system_block = true;
-                break;
-            case 'u':
-                print_uid = true;
-                break;
-            case 'r':
-                fix_read_direction = true;
+static void print_uid_details(uint64_t uid) {
+    printf("UID: %016" PRIX64 "\n", uid);
+
+    // Convert uint64 to binary char array
+    char uid_binary[65] = {};
+    for (unsigned int i = 0; i < sizeof(uid); i++) {
+        uint8_t tmp = (uid >> (sizeof(uid) - 1 - i) * 8u) & 0xFFu;
+        sprintf(uid_binary + i * 8 + 0, "%c", tmp & 0x80u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 1, "%c", tmp & 0x40u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 2, "%c", tmp & 0x20u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 3, "%c", tmp & 0x10u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 4, "%c", tmp & 0x08u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 5, "%c", tmp & 0x04u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 6, "%c", tmp & 0x02u ? '1' : '0');
+        sprintf(uid_binary + i * 8 + 7, "%c", tmp & 0x01u ? '1' : '0');
+    }
+
+    printf("├── Prefix: %02" PRIX64 "\n", uid >> 56u);
+    printf("├── IC manufacturer code: %02" PRIX64, (uid >> 48u) & 0xFFu);
+    switch ((uid >> 48u) & 0xFFu) {
+        case 0x02:
+            printf(" (STMicroelectronics)\n");
+            break;
+        default:
+            printf(" (unknown)\n");
+    }
+
+    // Print 6bit IC code
+    char ic_code[7] = {};
+    memcpy(ic_code, uid_binary + 16, 6);
+    printf("├── IC code: %s [%" PRIu64 "]\n", ic_code, (uid >> 42u) & 0x7u);
+
+    // Print 42bit unique serial number
+    char unique_serial_number[43] = {};
+    memcpy(unique_serial_number, uid_binary + 22, 42);
+    printf("└── 42bit unique serial number: %s [%" PRIu64 "]\n", unique_serial_number, uid & 0x3FFFFFFFFFFu);
+}
+
+static void print_block(const struct srix_image *image, uint8_t i, bool fix_read_direction) {
+    uint32_t block = fix_read_direction ? srix_image_value(image, i) : srix_image_block(image, i);
+    printf("[%02X] ", i);
+    printf("%02X %02X %02X %02X ", block >> 24u, (block >> 16u) & 0xFFu, (block >> 8u) & 0xFFu, block & 0xFFu);
+    printf(DIM);
+    printf("--- %s\n", srix_get_block_type(i));
+    printf(RESET);
+}
+
+static void print_system_block_details(const struct srix_image *image) {
+    const uint8_t *system_block_bytes = image->system_block;
+    uint32_t system_block = srix_image_system_value(image);
+
+    printf("System block: %02X %02X %02X %02X\n", system_block_bytes[3], system_block_bytes[2], system_block_bytes[1], system_block_bytes[0]);
+    printf("├── CHIP_ID: %02X\n", system_block_bytes[0]);
+    printf("├── ST reserved: %02X%02X\n", system_block_bytes[1], system_block_bytes[2]);
+    printf("└── OTP_Lock_Reg:\n");
+    for (uint8_t i = 24; i < 32; i++) {
+        if (i == 31) {
+            printf("    └── b%d = %d - ", i, (system_block >> i) & 1u);
+        } else {
+            printf("    ├── b%d = %d - ", i, (system_block >> i) & 1u);
+        }
+
+        if (i == 24) {
+            printf("Block 07 and 08 are ");
+        } else {
+            printf("Block %02X is ", i - 16);
+        }
+
+        if (((system_block >> i) & 1u) == 0) {
+            printf(RED);
+            printf("LOCKED\n");
+            printf(RESET);
+        } else {
+            printf(GREEN);
+            printf("unlocked\n");
+            printf(RESET);
+        }
+    }
+}
+
+// Dumps are at most 516 bytes, written in one go once the tag is read
+static void *output_main(void *arg) {
+    struct dump_output *output = arg;
+    struct srix_image *image = output->image;
+
+    output->crc = 0;
+    struct block_event event;
+    for (;;) {
+        block_queue_pop(&output->queue, &event);
+        if (event.type == BLOCK_EVENT_END || event.type == BLOCK_EVENT_ABORT) {
+            break;
+        }
+
+        switch (event.type) {
+            case BLOCK_EVENT_UID:
+                srix_image_set_uid_bytes(image, event.data);
+                if (output->print_uid) {
+                    print_uid_details(image->uid);
+                }
                 break;
-            case 'y':
-                skip_confirmation = true;
+            case BLOCK_EVENT_BLOCK:
+                memcpy(srix_image_block_bytes(image, event.block), event.data, 4);
+                srix_image_mark_present(image, event.block);
+                output->crc = crc32c(output->crc, event.data, 4);
+                print_block(image, event.block, output->fix_read_direction);
                 break;
-            case 't':
-                if (strcmp(optarg, "512") == 0) {
-                    eeprom_size = SRI512_EEPROM_SIZE;
-                    eeprom_blocks_amount = SRI512_EEPROM_BLOCKS;
+            case BLOCK_EVENT_SYSTEM_BLOCK:
+                memcpy(image->system_block, event.data, 4);
+                image->has_system_block = true;
+                if (output->print_system_block) {
+                    print_system_block_details(image);
                 }
                 break;
-            default:
-            case 'h':
-                print_usage(argv[0]);
-                exit(0);
         }
     }
+    output->aborted = event.type == BLOCK_EVENT_ABORT;
+
+    // Dump to file, a single dump is synced before the tool moves on
+    output->write_result = DURABLE_SUCCESS;
+    output->path[0] = '\0';
+    if (!output->aborted && output->output_directory != NULL) {
+        snprintf(output->path, sizeof(output->path), "%s/%016" PRIX64 ".bin", output->output_directory, image->uid);
+    } else if (!output->aborted && output->output_path != NULL) {
+        snprintf(output->path, sizeof(output->path), "%s", output->output_path);
+    }
+    if (output->path[0] != '\0') {
+        // Only on request, a plain dump is the raw EEPROM other tools expect
+        uint8_t bytes[SRIX_IMAGE_MAX_SIZE + sizeof(image->system_block)];
+        size_t size = srix_image_size(image);
+        memcpy(bytes, image->bytes, size);
+        if (output->append_system_block && image->has_system_block) {
+            memcpy(bytes + size, image->system_block, sizeof(image->system_block));
+            size += sizeof(image->system_block);
+        }
 
-    // Check arguments
-    if ((argc - optind) > 0) {
-        output_path = argv[optind];
+        output->write_result = durable_write(output->durable, output->path, bytes, size);
+        if (output->write_result == DURABLE_SUCCESS && output->output_directory == NULL) {
+            output->write_result = durable_flush(output->durable);
+        }
+        if (output->write_result == DURABLE_SUCCESS && output->output_directory == NULL) {
+            printf("Written dump to \"%s\".\n", output->path);
+        } else if (output->write_result == DURABLE_SUCCESS) {
+            printf("Queued dump for \"%s\".\n", output->path);
+        }
     }
 
-    // Initialize NFC
-    nfc_context *context = NULL;
-    nfc_device *reader = NULL;
-    nfc_init(&context);
-    if (context == NULL) {
-        lerror("Unable to init libnfc. Exiting...\n");
-        exit(1);
+    // Append to archive
+    output->archive_result = ARCHIVE_SUCCESS;
+    if (output->archive_path != NULL && !output->aborted) {
+        output->archive_result = archive_append(output->archive_path, image, (int64_t) time(NULL));
+        if (output->archive_result == ARCHIVE_SUCCESS) {
+            printf("Appended dump to \"%s\".\n", output->archive_path);
+        }
     }
 
-    // Display libnfc version
-    lverbose("libnfc version: %s\n", nfc_version());
+    fflush(stdout);
+    return NULL;
+}
 
+static void output_push(struct dump_output *output, uint8_t type, uint8_t block, const uint8_t *data, size_t size) {
+    struct block_event event = {.type = type, .block = block};
+    if (data != NULL) {
+        memcpy(event.data, data, size);
+    }
+    block_queue_push(&output->queue, &event);
+}
+
+// Stops the output thread, the image can be used again afterwards
+static void output_finish(struct dump_output *output, bool abort) {
+    output_push(output, abort ? BLOCK_EVENT_ABORT : BLOCK_EVENT_END, 0, NULL, 0);
+    pthread_join(output->thread, NULL);
+}
+
+static void print_rf_timing(const struct rf_timing *timing, const struct dump_output *output) {
+    uint64_t gaps = timing->gaps > 0 ? timing->gaps : 1;
+    lverbose("Pipeline:\n");
+    lverbose("├── RF commands: %" PRIu64 " in %" PRIu64 " us\n", timing->commands, timing->rf_us);
+    lverbose("├── between reader calls: %" PRIu64 " us mean, %" PRIu64 " us max\n", timing->gap_us / gaps, timing->max_gap_us);
+    lverbose("├── max queue depth: %zu\n", output->queue.max_depth);
+    lverbose("└── CRC32C: %08" PRIX32 "\n", output->crc);
+}
+
+// Time spent outside the reader since the previous command
+static void rf_command_start(struct rf_timing *timing, uint64_t start_us) {
+    if (timing->commands > 0) {
+        uint64_t gap = start_us - timing->last_end_us;
+        timing->gaps++;
+        timing->gap_us += gap;
+        if (gap > timing->max_gap_us) timing->max_gap_us = gap;
+    }
+}
+
+static void rf_command_end(struct rf_timing *timing, uint64_t start_us, unsigned int commands) {
+    timing->last_end_us = now_us();
+    timing->rf_us += timing->last_end_us - start_us;
+    timing->commands += commands;
+}
+
+
+static int read_tag(nfc_device *reader, struct dump_output *output, uint8_t blocks, bool read_system_block, struct rf_timing *timing) {
+    uint64_t start_us = now_us();
+
+    // Read UID
+    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
+    rf_command_start(timing, start_us);
+    uint8_t uid_bytes_read = nfc_srix_get_uid(reader, uid_rx_bytes);
+    rf_command_end(timing, start_us, 1);
+
+    // Check for errors
+    if (uid_bytes_read != 8) {
+        if (cancel_requested()) return TAG_CANCELLED;
+        lerror("Error while reading UID.\n");
+        lverbose("Received %d bytes instead of 8.\n", uid_bytes_read);
+        return TAG_EREAD;
+    }
+    output_push(output, BLOCK_EVENT_UID, 0, uid_rx_bytes, 8);
+
+    // Read EEPROM
+    lverbose("Reading %d blocks...\n", blocks);
+    for (int i = 0; i < blocks; i += SRIX_READ_BATCH_BLOCKS) {
+        if (cancel_requested()) return TAG_CANCELLED;
+
+        // Small batches, the output thread renders one while the next is read
+        uint8_t count = blocks - i < SRIX_READ_BATCH_BLOCKS ? blocks - i : SRIX_READ_BATCH_BLOCKS;
+        uint8_t batch_bytes[SRIX_READ_BATCH_BLOCKS * 4];
+        start_us = now_us();
+        rf_command_start(timing, start_us);
+        uint8_t blocks_read = nfc_srix_read_blocks(reader, batch_bytes, i, count);
+        rf_command_end(timing, start_us, count);
+
+        for (uint8_t j = 0; j < blocks_read; j++) {
+            output_push(output, BLOCK_EVENT_BLOCK, i + j, batch_bytes + j * 4, 4);
+        }
+
+        // Check for errors
+        if (blocks_read != count) {
+            if (cancel_requested()) return TAG_CANCELLED;
+            lerror("Error while reading block %d.\n", i + blocks_read);
+            return TAG_EREAD;
+        }
+    }
+
+    if (read_system_block) {
+        uint8_t system_block_bytes[MAX_RESPONSE_LEN];
+        start_us = now_us();
+        rf_command_start(timing, start_us);
+        uint8_t system_block_bytes_read = nfc_srix_read_block(reader, system_block_bytes, SRIX_SYSTEM_BLOCK);
+        rf_command_end(timing, start_us, 1);
+
+        // Check for errors
+        if (system_block_bytes_read != 4) {
+            if (cancel_requested()) return TAG_CANCELLED;
+            lerror("Error while reading block %d.\n", 0xFF);
+            lverbose("Received %d bytes instead of 4.\n", system_block_bytes_read);
+            return TAG_EREAD;
+        }
+
+        output_push(output, BLOCK_EVENT_SYSTEM_BLOCK, SRIX_SYSTEM_BLOCK, system_block_bytes, 4);
+    }
+
+    return TAG_DONE;
+}
+
+// Reads the selected tag while the output thread writes it out
+static int dump_tag(nfc_device *reader, struct dump_output *output, uint8_t blocks, bool read_system_block) {
+    // Setup messages go out before the tag data
+    log_flush();
+
+    block_queue_init(&output->queue);
+    output->image = srix_image_acquire(blocks);
+    if (pthread_create(&output->thread, NULL, output_main, output) != 0) {
+        srix_image_release(output->image);
+        lerror("Cannot start output thread.\n");
+        return TAG_ETHREAD;
+    }
+
+    // From here on this thread only sends commands
+    struct rf_timing timing = {};
+    int result = read_tag(reader, output, blocks, read_system_block, &timing);
+    output_finish(output, result != TAG_DONE);
+
+    if (result == TAG_CANCELLED) {
+        cancel_print_partial(output->image, NULL, 0);
+    } else if (result == TAG_DONE) {
+        print_rf_timing(&timing, output);
+        if (output->write_result != DURABLE_SUCCESS) {
+            lerror("Cannot write \"%s\": %s.\n", output->path, durable_strerror(output->write_result));
+            result = TAG_EWRITE;
+        } else if (output->archive_result != ARCHIVE_SUCCESS) {
+            lerror("Cannot append to \"%s\": %s.\n", output->archive_path, archive_strerror(output->archive_result));
+            result = TAG_EWRITE;
+        }
+    }
+
+    srix_image_release(output->image);
+    output->image = NULL;
+    return result;
+}
+
+static void print_durable_stats(const struct durable *durable) {
+    lverbose("Durable output:\n");
+    lverbose("├── files: %" PRIu64 " committed, %" PRIu64 " failed\n", durable->files, durable->failed);
+    lverbose("├── commits: %" PRIu64 "\n", durable->commits);
+    lverbose("└── write to commit: %" PRIu64 " ms max\n", durable->max_latency_us / 1000u);
+}
+
+// Single tag on the first reader, the deadline covers waiting for the tag too
+static int dump_single(nfc_context *context, struct dump_output *output, uint8_t blocks, bool read_system_block, unsigned int deadline_ms) {
     // Search for readers
     lverbose("Searching for readers... ");
     nfc_connstring connstrings[MAX_DEVICE_COUNT] = {};
@@ -110,8 +428,7 @@ int main(int argc, char *argv[], char *envp[]) {
     // Check if no readers are available
     if (num_readers == 0) {
         lerror("No readers available. Exiting...\n");
-        close_nfc(context, reader);
-        exit(1);
+        return 1;
     }
 
     // Print out readers
@@ -126,22 +443,24 @@ int main(int argc, char *argv[], char *envp[]) {
     lverbose("Opening %s...\n", connstrings[0]);
 
     // Open first reader
-    reader = nfc_open(context, connstrings[0]);
+    nfc_device *reader = nfc_open(context, connstrings[0]);
     if (reader == NULL) {
         lerror("Unable to open NFC device. Exiting...\n");
-        close_nfc(context, reader);
-        exit(1);
+        return 1;
     }
 
     // Set opened NFC device to initiator mode
     if (nfc_initiator_init(reader) < 0) {
         lerror("nfc_initiator_init => %s\n", nfc_strerror(reader));
-        close_nfc(context, reader);
-        exit(1);
+        close_nfc(NULL, reader);
+        return 1;
     }
 
     lverbose("NFC reader: %s\n", nfc_device_get_name(reader));
 
+    // Deadline covers waiting for the tag too
+    cancel_arm(reader, deadline_ms);
+
     nfc_target target_key[MAX_TARGET_COUNT];
 
     /*
@@ -150,180 +469,283 @@ int main(int argc, char *argv[], char *envp[]) {
      *
      * https://github.com/nfc-tools/libnfc/issues/436#issuecomment-326686914
      */
-    lverbose("Searching for ISO14443B targets... found %d.\n", nfc_initiator_list_passive_targets(reader, nmISO14443B, target_key, MAX_TARGET_COUNT));
+    int ISO14443B_targets = nfc_initiator_list_passive_targets(reader, nmISO14443B, target_key, MAX_TARGET_COUNT);
+    lverbose("Searching for ISO14443B targets... found %d.\n", ISO14443B_targets);
 
     lverbose("Searching for ISO14443B2SR targets...");
     int ISO14443B2SR_targets = nfc_initiator_list_passive_targets(reader, nmISO14443B2SR, target_key, MAX_TARGET_COUNT);
     lverbose(" found %d.\n", ISO14443B2SR_targets);
 
     // Check for tags
+    int result = TAG_DONE;
     if (ISO14443B2SR_targets == 0) {
+        log_flush();
         printf("Waiting for tag...\n");
 
         // Infinite select for tag
+        telemetry_operation(reader, TELEMETRY_OP_WAITING);
         if (nfc_initiator_select_passive_target(reader, nmISO14443B2SR, NULL, 0, target_key) <= 0) {
-            lerror("nfc_initiator_select_passive_target => %s\n", nfc_strerror(reader));
-            close_nfc(context, reader);
-            exit(1);
+            if (cancel_requested()) {
+                cancel_print_partial(NULL, NULL, 0);
+                result = TAG_CANCELLED;
+            } else {
+                lerror("nfc_initiator_select_passive_target => %s\n", nfc_strerror(reader));
+                result = TAG_EREAD;
+            }
         }
     }
 
-    // Read UID
-    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
-    uint8_t uid_bytes_read = nfc_srix_get_uid(reader, uid_rx_bytes);
+    if (result == TAG_DONE) {
+        result = dump_tag(reader, output, blocks, read_system_block);
+    }
 
-    // Check for errors
-    if (uid_bytes_read != 8) {
-        lerror("Error while reading UID. Exiting...\n");
-        lverbose("Received %d bytes instead of 8.\n", uid_bytes_read);
-        close_nfc(context, reader);
-        exit(1);
+    // Read before cancel_disarm() forgets the deadline
+    int exit_code = result == TAG_CANCELLED ? cancel_exit_code() : result == TAG_DONE ? 0 : 1;
+    cancel_disarm();
+    if (result == TAG_DONE) {
+        telemetry_tag_done(reader);
     }
+    close_nfc(NULL, reader);
 
-    // Convert to uint64
-    uint64_t uid = (uint64_t) uid_rx_bytes[7] << 56u | (uint64_t) uid_rx_bytes[6] << 48u |
-                   (uint64_t) uid_rx_bytes[5] << 40u | (uint64_t) uid_rx_bytes[4] << 32u |
-                   (uint64_t) uid_rx_bytes[3] << 24u | (uint64_t) uid_rx_bytes[2] << 16u |
-                   (uint64_t) uid_rx_bytes[1] << 8u | (uint64_t) uid_rx_bytes[0];
-
-    // Print UID
-    if (print_uid) {
-        printf("UID: %016" PRIX64 "\n", uid);
-
-        // Convert uint64 to binary char array
-        char uid_binary[65] = {};
-        for (unsigned int i = 0; i < sizeof(uid); i++) {
-            uint8_t tmp = (uid >> (sizeof(uid) - 1 - i) * 8u) & 0xFFu;
-            sprintf(uid_binary + i * 8 + 0, "%c", tmp & 0x80u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 1, "%c", tmp & 0x40u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 2, "%c", tmp & 0x20u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 3, "%c", tmp & 0x10u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 4, "%c", tmp & 0x08u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 5, "%c", tmp & 0x04u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 6, "%c", tmp & 0x02u ? '1' : '0');
-            sprintf(uid_binary + i * 8 + 7, "%c", tmp & 0x01u ? '1' : '0');
-        }
+    return exit_code;
+}
 
-        printf("├── Prefix: %02" PRIX64 "\n", uid >> 56u);
-        printf("├── IC manufacturer code: %02" PRIX64, (uid >> 48u) & 0xFFu);
-        switch ((uid >> 48u) & 0xFFu) {
-            case 0x02:
-                printf(" (STMicroelectronics)\n");
-                break;
-            default:
-                printf(" (unknown)\n");
-        }
+// Every presented tag on every reader, dumps are committed in groups
+static int dump_loop(nfc_context *context, struct dump_output *output, uint8_t blocks, bool read_system_block, unsigned int deadline_ms) {
+    // Open every reader
+    struct reader_pool pool;
+    if (reader_pool_open(&pool, context) == 0) {
+        lerror("No readers available. Exiting...\n");
+        reader_pool_close(&pool);
+        return 1;
+    }
 
-        // Print 6bit IC code
-        char ic_code[7] = {};
-        memcpy(ic_code, uid_binary + 16, 6);
-        printf("├── IC code: %s [%" PRIu64 "]\n", ic_code, (uid >> 42u) & 0x7u);
+    struct {
+        unsigned int done;
+        unsigned int failed;
+        unsigned int cancelled;
+    } totals = {};
 
-        // Print 42bit unique serial number
-        char unique_serial_number[43] = {};
-        memcpy(unique_serial_number, uid_binary + 22, 42);
-        printf("└── 42bit unique serial number: %s [%" PRIu64 "]\n", unique_serial_number, uid & 0x3FFFFFFFFFFu);
-    }
+    bool readers_failed = false;
+    for (;;) {
+        // Check for tags
+        log_flush();
+        printf("Waiting for tag...\n");
+        struct pool_reader *reader = reader_pool_wait_for_tag(&pool);
+        if (reader == NULL && cancel_requested()) {
+            break;
+        }
+        if (reader == NULL) {
+            lerror("Every reader has failed.\n");
+            readers_failed = true;
+            break;
+        }
+        lverbose("Tag on %s.\n", reader->connstring);
+
+        // The deadline is per tag
+        cancel_arm(reader->device, deadline_ms);
+        int result = dump_tag(reader->device, output, blocks, read_system_block);
+        cancel_disarm();
+        telemetry_tag_done(reader->device);
+
+        if (result == TAG_DONE) {
+            totals.done++;
+        } else if (result == TAG_CANCELLED) {
+            totals.cancelled++;
+        } else {
+            totals.failed++;
+        }
 
-    // Read EEPROM
-    uint8_t *eeprom_bytes = malloc(sizeof(uint8_t) * eeprom_size);
-    lverbose("Reading %d blocks...\n", eeprom_blocks_amount);
-    for (int i = 0; i < eeprom_blocks_amount; i++) {
-        uint8_t *current_block = eeprom_bytes + (i * 4);
-        uint8_t block_bytes_read = nfc_srix_read_block(reader, current_block, i);
+        // Aborted commands leave the reader idle, make sure it still answers
+        if (result == TAG_CANCELLED) {
+            reader_pool_recover(&pool, reader);
+        }
 
-        // Check for errors
-        if (block_bytes_read != 4) {
-            lerror("Error while reading block %d. Exiting...\n", i);
-            lverbose("Received %d bytes instead of 4.\n", block_bytes_read);
-            close_nfc(context, reader);
-            exit(1);
+        if (!cancel_requested()) {
+            log_flush();
+            reader_pool_wait_for_removal(reader);
         }
 
-        printf("[%02X] ", i);
-        if (fix_read_direction) {
-            printf("%02X %02X %02X %02X ", current_block[3], current_block[2], current_block[1], current_block[0]);
-        } else {
-            printf("%02X %02X %02X %02X ", current_block[0], current_block[1], current_block[2], current_block[3]);
+        // Only RF errors count against the reader
+        reader_pool_report(&pool, reader, result != TAG_EREAD);
+
+        // A signal stops the loop, a deadline only the tag
+        if (cancel_requested()) {
+            break;
         }
-        printf(DIM);
-        printf("--- %s\n", srix_get_block_type(i));
-        printf(RESET);
     }
 
-    if (print_system_block) {
-        uint8_t system_block_bytes[4] = {};
-        uint8_t system_block_bytes_read = nfc_srix_read_block(reader, system_block_bytes, 0xFF);
+    log_flush();
+    printf("Tags: %u dumped, %u failed, %u cancelled.\n", totals.done, totals.failed, totals.cancelled);
+    reader_pool_print_health(&pool);
+    reader_pool_close(&pool);
 
-        // Check for errors
-        if (system_block_bytes_read != 4) {
-            lerror("Error while reading block %d. Exiting...\n", 0xFF);
-            lverbose("Received %d bytes instead of 4.\n", system_block_bytes_read);
-            close_nfc(context, reader);
-            exit(1);
+    if (cancel_requested()) {
+        return cancel_exit_code();
+    }
+    return totals.failed > 0 || totals.cancelled > 0 || readers_failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    bool print_system_block = false;
+    bool append_system_block = false;
+    bool print_uid = false;
+    bool fix_read_direction = false;
+    bool skip_confirmation = false;
+    bool loop = false;
+    char *output_path = NULL;
+    char *archive_path = NULL;
+    unsigned int deadline_ms = 0;
+    unsigned int commit_ms = DURABLE_DEFAULT_COMMIT_MS;
+    uint32_t eeprom_blocks_amount = SRIX4K_EEPROM_BLOCKS;
+
+    // Parse options
+    static const struct option long_options[] = {
+            {"append-archive", required_argument, NULL, 'A'},
+            {"with-system-block", no_argument, NULL, 'S'},
+            {"deadline-ms", required_argument, NULL, 'D'},
+            {"sync-ms", required_argument, NULL, 'F'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hvusarylt:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'A':
+                archive_path = optarg;
+                break;
+            case 'S':
+                append_system_block = true;
+                break;
+            case 'D':
+                deadline_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                commit_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'a':
+                print_system_block = true;
+                print_uid = true;
+                break;
+            case 's':
+                print_system_block = true;
+                break;
+            case 'u':
+                print_uid = true;
+                break;
+            case 'r':
+                fix_read_direction = true;
+                break;
+            case 'y':
+                skip_confirmation = true;
+                break;
+            case 'l':
+                loop = true;
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks_amount = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
         }
+    }
 
-        uint32_t system_block = system_block_bytes[3] << 24u | system_block_bytes[2] << 16u | system_block_bytes[1] << 8u | system_block_bytes[0];
+    // Check arguments
+    if ((argc - optind) > 0) {
+        output_path = argv[optind];
+    }
 
-        printf("System block: %02X %02X %02X %02X\n", system_block_bytes[3], system_block_bytes[2], system_block_bytes[1], system_block_bytes[0]);
-        printf("├── CHIP_ID: %02X\n", system_block_bytes[0]);
-        printf("├── ST reserved: %02X%02X\n", system_block_bytes[1], system_block_bytes[2]);
-        printf("└── OTP_Lock_Reg:\n");
-        for (uint8_t i = 24; i < 32; i++) {
-            if (i == 31) {
-                printf("    └── b%d = %d - ", i, (system_block >> i) & 1u);
-            } else {
-                printf("    ├── b%d = %d - ", i, (system_block >> i) & 1u);
-            }
+    // Start background logging
+    log_start();
+    cancel_init();
 
-            if (i == 24) {
-                printf("Block 07 and 08 are ");
-            } else {
-                printf("Block %02X is ", i - 16);
-            }
+    struct stat output_stat;
+    bool output_exists = output_path != NULL && stat(output_path, &output_stat) == 0;
+    if (loop && output_path != NULL && (!output_exists || !S_ISDIR(output_stat.st_mode))) {
+        lerror("\"%s\" is not a directory. Exiting...\n", output_path);
+        exit(1);
+    }
 
-            if (((system_block >> i) & 1u) == 0) {
-                printf(RED);
-                printf("LOCKED\n");
-                printf(RESET);
-            } else {
-                printf(GREEN);
-                printf("unlocked\n");
-                printf(RESET);
-            }
+    // Check if file already exists, before the tag is read
+    if (!loop && output_exists && !skip_confirmation) {
+        printf("\"%s\" already exists.\n", output_path);
+        log_flush();
+        printf("Do you want to overwrite it? [Y/N] ");
+        char c = 'n';
+        scanf(" %c", &c);
+        if (c != 'Y' && c != 'y') {
+            printf("Exiting...\n");
+            exit(0);
         }
     }
 
-    // Check if file already exists
-    FILE *file = fopen(output_path, "r");
-    if (file) {
-        fclose(file);
-
-        // Ask for confirmation
-        if (!skip_confirmation) {
-            printf("\"%s\" already exists.\n", output_path);
-            printf("Do you want to overwrite it? [Y/N] ");
-            char c = 'n';
-            scanf(" %c", &c);
-            if (c != 'Y' && c != 'y') {
-                printf("Exiting...\n");
-                close_nfc(context, reader);
-                exit(0);
-            }
+    // Dumps are written under a temporary name and renamed once synced
+    static struct durable durable;
+    bool durable_output = output_path != NULL;
+    if (durable_output) {
+        int durable_result = durable_open(&durable, commit_ms);
+        if (durable_result != DURABLE_SUCCESS) {
+            lerror("Cannot open output: %s. Exiting...\n", durable_strerror(durable_result));
+            exit(1);
         }
     }
 
-    // Dump to file
-    if (output_path != NULL) {
-        FILE *fp = fopen(output_path, "w");
-        fwrite(eeprom_bytes, eeprom_size, 1, fp);
-        fclose(fp);
+    struct dump_output *output = calloc(1, sizeof(struct dump_output));
+    if (output == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+    output->print_uid = print_uid;
+    output->print_system_block = print_system_block;
+    output->append_system_block = append_system_block;
+    output->fix_read_direction = fix_read_direction;
+    output->output_path = loop ? NULL : output_path;
+    output->output_directory = loop ? output_path : NULL;
+    output->archive_path = archive_path;
+    output->durable = durable_output ? &durable : NULL;
+
+    // Initialize NFC
+    telemetry_open("srix-dump");
+    nfc_context *context = NULL;
+    nfc_init(&context);
+    if (context == NULL) {
+        lerror("Unable to init libnfc. Exiting...\n");
+        exit(1);
+    }
 
-        printf("Written dump to \"%s\".\n", output_path);
+    // Display libnfc version
+    lverbose("libnfc version: %s\n", nfc_version());
+
+    int exit_code;
+    if (loop) {
+        exit_code = dump_loop(context, output, eeprom_blocks_amount, print_system_block || append_system_block, deadline_ms);
+    } else {
+        exit_code = dump_single(context, output, eeprom_blocks_amount, print_system_block || append_system_block, deadline_ms);
+    }
+
+    // Whatever is still queued is committed before exiting, also after a signal
+    if (durable_output) {
+        int durable_result = durable_close(&durable);
+        if (loop) {
+            log_flush();
+            printf("Dumps: %" PRIu64 " written, %" PRIu64 " failed.\n", durable.files, durable.failed);
+        }
+        print_durable_stats(&durable);
+        if (durable_result != DURABLE_SUCCESS) {
+            lerror("Cannot write dumps: %s.\n", durable_strerror(durable_result));
+            if (exit_code == 0) exit_code = 1;
+        }
     }
 
     // Close NFC
-    close_nfc(context, reader);
+    free(output);
+    close_nfc(context, NULL);
 
-    return 0;
-}
\ No newline at end of file
+    return exit_code;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "dump_utils.h"
+
+/*
+ * Splits a dump file already in memory. Needs at least dump_size bytes; the
+ * system block is only taken when exactly 4 more bytes follow, anything else
+ * after the dump is ignored.
+ */
+int srix_dump_parse(const uint8_t *data, size_t size, uint8_t *dump, size_t dump_size, uint8_t *system_block, bool *has_system_block) {
+    if (has_system_block != NULL) {
+        *has_system_block = false;
+    }
+    if (size < dump_size) {
+        return DUMP_ESIZE;
+    }
+
+    memcpy(dump, data, dump_size);
+    if (system_block != NULL && size == dump_size + DUMP_SYSTEM_BLOCK_SIZE) {
+        memcpy(system_block, data + dump_size, DUMP_SYSTEM_BLOCK_SIZE);
+        *has_system_block = true;
+    }
+
+    return DUMP_SUCCESS;
+}
+
+// Sizes come from what was actually read, the file may change or not be a regular file
+int srix_load_dump_ex(const char *path, uint8_t *dump, size_t dump_size, size_t *file_size, uint8_t *system_block, bool *has_system_block) {
+    if (file_size != NULL) {
+        *file_size = 0;
+    }
+    if (has_system_block != NULL) {
+        *has_system_block = false;
+    }
+    if (dump_size > DUMP_MAX_BLOCKS * 4) {
+        return DUMP_ESIZE;
+    }
+
+    // Open file
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return DUMP_EOPEN;
+    }
+
+    // One byte more than the largest dump tells a longer file apart
+    uint8_t buffer[DUMP_MAX_FILE_SIZE + 1];
+    size_t size = fread(buffer, 1, sizeof(buffer), fp);
+    bool read_error = ferror(fp) != 0;
+    fclose(fp);
+    if (read_error) {
+        return DUMP_EREAD;
+    }
+    if (file_size != NULL) {
+        *file_size = size;
+    }
+
+    return srix_dump_parse(buffer, size, dump, dump_size, system_block, has_system_block);
+}
+
+int srix_load_dump(const char *path, uint8_t *dump, size_t dump_size, size_t *file_size) {
+    return srix_load_dump_ex(path, dump, dump_size, file_size, NULL, NULL);
+}
+
+int srix_image_parse(struct srix_image *image, const uint8_t *data, size_t size) {
+    int parse_result = srix_dump_parse(data, size, image->bytes, srix_image_size(image), image->system_block, &image->has_system_block);
+    if (parse_result == DUMP_SUCCESS) {
+        image->order = SRIX_ORDER_RAW;
+        srix_image_mark_all_present(image);
+    }
+
+    return parse_result;
+}
+
+// Loads image->blocks blocks, and the system block when the dump has it
+int srix_image_load(struct srix_image *image, const char *path, size_t *file_size) {
+    int load_result = srix_load_dump_ex(path, image->bytes, srix_image_size(image), file_size, image->system_block, &image->has_system_block);
+    if (load_result == DUMP_SUCCESS) {
+        image->order = SRIX_ORDER_RAW;
+        srix_image_mark_all_present(image);
+    }
+
+    return load_result;
+}
+
+// Dumps named after their tag start with the 16 hex digits UID, as printed by the tools
+bool srix_uid_from_name(const char *name, uint64_t *uid) {
+    uint64_t value = 0;
+    for (int i = 0; i < 16; i++) {
+        char c = name[i];
+        uint8_t digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else return false;
+        value = value << 4u | digit;
+    }
+
+    *uid = value;
+    return true;
+}
+
+const char *srix_dump_strerror(int error) {
+    switch (error) {
+        case DUMP_SUCCESS:
+            return "success";
+        case DUMP_EOPEN:
+            return "cannot open file";
+        case DUMP_ESTAT:
+            return "error doing fstat";
+        case DUMP_ESIZE:
+            return "file wrong size";
+        case DUMP_EREAD:
+            return "error encountered while reading file";
+        default:
+            return "unknown error";
+    }
+}
+
+#if defined(__GNUC__)
+typedef uint64_t dump_vector __attribute__((vector_size(32)));
+#endif
+
+/*
+ * Compares dump against reference, only where mask bits are set.
+ * Returns the number of mismatching 4 byte blocks and sets their bits in
+ * mismatches (DUMP_BITMAP_WORDS words). dump_size must be a multiple of 4.
+ */
+unsigned int srix_masked_compare(const uint8_t *dump, const uint8_t *reference, const uint8_t *mask, size_t dump_size, uint64_t *mismatches) {
+    memset(mismatches, 0, sizeof(uint64_t) * DUMP_BITMAP_WORDS);
+
+    // Fast path, most dumps match: 32 bytes at a time
+    uint64_t difference = 0;
+    size_t offset = 0;
+#if defined(__GNUC__)
+    dump_vector accumulator = {0, 0, 0, 0};
+    for (; offset + sizeof(dump_vector) <= dump_size; offset += sizeof(dump_vector)) {
+        dump_vector a, b, m;
+        memcpy(&a, dump + offset, sizeof(a));
+        memcpy(&b, reference + offset, sizeof(b));
+        memcpy(&m, mask + offset, sizeof(m));
+        accumulator |= (a ^ b) & m;
+    }
+    difference = accumulator[0] | accumulator[1] | accumulator[2] | accumulator[3];
+#endif
+    for (; offset + 4 <= dump_size; offset += 4) {
+        uint32_t a, b, m;
+        memcpy(&a, dump + offset, sizeof(a));
+        memcpy(&b, reference + offset, sizeof(b));
+        memcpy(&m, mask + offset, sizeof(m));
+        difference |= (a ^ b) & m;
+    }
+
+    if (difference == 0) {
+        return 0;
+    }
+
+    // Find the failing blocks
+    unsigned int count = 0;
+    for (size_t block = 0; block < dump_size / 4 && block < DUMP_MAX_BLOCKS; block++) {
+        uint32_t a, b, m;
+        memcpy(&a, dump + block * 4, sizeof(a));
+        memcpy(&b, reference + block * 4, sizeof(b));
+        memcpy(&m, mask + block * 4, sizeof(m));
+        if ((a ^ b) & m) {
+            mismatches[block / 64] |= 1ull << (block % 64);
+            count++;
+        }
+    }
+
+    return count;
+}
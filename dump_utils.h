@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_DUMP_UTILS_H__
+#define __NFC_SRIX_DUMP_UTILS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "srix_image.h"
+
+/* Macros */
+#define DUMP_MAX_BLOCKS 128
+#define DUMP_BITMAP_WORDS (DUMP_MAX_BLOCKS / 64)
+
+/* Errors */
+#define DUMP_SUCCESS 0
+#define DUMP_EOPEN -1
+#define DUMP_ESTAT -2
+#define DUMP_ESIZE -3
+#define DUMP_EREAD -4
+
+/*
+ * A dump is the raw EEPROM, optionally followed by the 4 raw bytes of the
+ * system block (srix-dump --with-system-block).
+ */
+#define DUMP_SYSTEM_BLOCK_SIZE 4
+#define DUMP_MAX_FILE_SIZE (DUMP_MAX_BLOCKS * 4 + DUMP_SYSTEM_BLOCK_SIZE)
+
+/* Parsing, no I/O */
+int srix_dump_parse(const uint8_t *data, size_t size, uint8_t *dump, size_t dump_size, uint8_t *system_block, bool *has_system_block);
+int srix_image_parse(struct srix_image *image, const uint8_t *data, size_t size);
+bool srix_uid_from_name(const char *name, uint64_t *uid);
+
+/* Loading */
+int srix_load_dump(const char *path, uint8_t *dump, size_t dump_size, size_t *file_size);
+int srix_load_dump_ex(const char *path, uint8_t *dump, size_t dump_size, size_t *file_size, uint8_t *system_block, bool *has_system_block);
+int srix_image_load(struct srix_image *image, const char *path, size_t *file_size);
+const char *srix_dump_strerror(int error);
+
+/* Comparison */
+unsigned int srix_masked_compare(const uint8_t *dump, const uint8_t *reference, const uint8_t *mask, size_t dump_size, uint64_t *mismatches);
+static inline bool srix_bitmap_test(const uint64_t *bitmap, uint8_t block) {
+    return (bitmap[block / 64] >> (block % 64)) & 1u;
+}
+
+#endif // __NFC_SRIX_DUMP_UTILS_H__
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "durable.h"
+#include "logging.h"
+
+#define DURABLE_MAX_DIRECTORY_PATH 4096
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static void free_file(struct durable_file *file) {
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+    free(file->path);
+    free(file->temp_path);
+    file->fd = -1;
+    file->path = NULL;
+    file->temp_path = NULL;
+}
+
+// Only the files of the batch, a sync of the whole file system would wait for everyone else's data
+static int sync_files(struct durable_file *batch, size_t count, bool *failed) {
+    int result = DURABLE_SUCCESS;
+
+    for (size_t i = 0; i < count; i++) {
+        if (fdatasync(batch[i].fd) != 0) {
+            lwarning("Cannot sync \"%s\": %s.\n", batch[i].temp_path, strerror(errno));
+            failed[i] = true;
+            result = DURABLE_ESYNC;
+        }
+    }
+
+    return result;
+}
+
+// Makes the renames durable, each directory once
+static int sync_directories(struct durable_file *batch, size_t count, const bool *failed) {
+    int result = DURABLE_SUCCESS;
+
+    for (size_t i = 0; i < count; i++) {
+        if (failed[i]) {
+            continue;
+        }
+
+        // Up to and including the last slash, empty for the working directory
+        const char *slash = strrchr(batch[i].path, '/');
+        size_t length = slash != NULL ? (size_t) (slash - batch[i].path) + 1 : 0;
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++) {
+            const char *other = strrchr(batch[j].path, '/');
+            size_t other_length = other != NULL ? (size_t) (other - batch[j].path) + 1 : 0;
+            seen = !failed[j] && other_length == length && memcmp(batch[j].path, batch[i].path, length) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        char directory[DURABLE_MAX_DIRECTORY_PATH];
+        snprintf(directory, sizeof(directory), "%.*s", (int) length, batch[i].path);
+        if (length == 0) {
+            strcpy(directory, ".");
+        }
+
+        int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) != 0) {
+            lwarning("Cannot sync directory \"%s\": %s.\n", directory, strerror(errno));
+            result = DURABLE_ESYNC;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    return result;
+}
+
+static int commit_batch(struct durable *durable, struct durable_file *batch, size_t count) {
+    bool failed[DURABLE_MAX_PENDING] = {};
+
+    // Data first, a rename must never point at blocks still in the page cache
+    int result = sync_files(batch, count, failed);
+
+    for (size_t i = 0; i < count; i++) {
+        close(batch[i].fd);
+        batch[i].fd = -1;
+        if (failed[i]) {
+            unlink(batch[i].temp_path);
+            continue;
+        }
+        if (rename(batch[i].temp_path, batch[i].path) != 0) {
+            lwarning("Cannot rename \"%s\": %s.\n", batch[i].temp_path, strerror(errno));
+            unlink(batch[i].temp_path);
+            failed[i] = true;
+            result = DURABLE_ERENAME;
+        }
+    }
+
+    int directories_result = sync_directories(batch, count, failed);
+    if (result == DURABLE_SUCCESS) {
+        result = directories_result;
+    }
+
+    uint64_t end_us = now_us();
+    for (size_t i = 0; i < count; i++) {
+        if (failed[i]) {
+            durable->failed++;
+        } else {
+            durable->files++;
+        }
+        if (end_us - batch[i].written_us > durable->max_latency_us) {
+            durable->max_latency_us = end_us - batch[i].written_us;
+        }
+        free_file(&batch[i]);
+    }
+    durable->commits++;
+
+    return result;
+}
+
+static void *durable_main(void *arg) {
+    struct durable *durable = arg;
+
+    pthread_mutex_lock(&durable->lock);
+    for (;;) {
+        while (durable->pending_count == 0 && !durable->stopping) {
+            pthread_cond_wait(&durable->cond, &durable->lock);
+        }
+        if (durable->pending_count == 0) {
+            break;
+        }
+
+        // The oldest file bounds the wait, a flush or a full group commits right away
+        uint64_t deadline_us = durable->pending[0].written_us + (uint64_t) durable->commit_ms * 1000u;
+        struct timespec deadline = {
+                .tv_sec = (time_t) (deadline_us / 1000000u),
+                .tv_nsec = (long) (deadline_us % 1000000u) * 1000L,
+        };
+        while (!durable->stopping && durable->flushes == 0 && durable->pending_count < DURABLE_MAX_PENDING) {
+            if (pthread_cond_timedwait(&durable->cond, &durable->lock, &deadline) == ETIMEDOUT) break;
+        }
+
+        // Take the whole group, writers fill the pending list again meanwhile
+        size_t count = durable->pending_count;
+        uint64_t written = durable->written;
+        memcpy(durable->batch, durable->pending, count * sizeof(struct durable_file));
+        durable->pending_count = 0;
+        pthread_cond_broadcast(&durable->committed);
+        pthread_mutex_unlock(&durable->lock);
+
+        int result = commit_batch(durable, durable->batch, count);
+
+        pthread_mutex_lock(&durable->lock);
+        if (result != DURABLE_SUCCESS && durable->error == DURABLE_SUCCESS) {
+            durable->error = result;
+        }
+        durable->done = written;
+        pthread_cond_broadcast(&durable->committed);
+    }
+    pthread_mutex_unlock(&durable->lock);
+
+    return NULL;
+}
+
+int durable_open(struct durable *durable, unsigned int commit_ms) {
+    memset(durable, 0, sizeof(struct durable));
+    durable->commit_ms = commit_ms;
+
+    // Same clock as the commit deadline
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&durable->cond, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_cond_init(&durable->committed, NULL);
+    pthread_mutex_init(&durable->lock, NULL);
+
+    if (pthread_create(&durable->thread, NULL, durable_main, durable) != 0) {
+        pthread_cond_destroy(&durable->cond);
+        pthread_cond_destroy(&durable->committed);
+        pthread_mutex_destroy(&durable->lock);
+        return DURABLE_ETHREAD;
+    }
+
+    return DURABLE_SUCCESS;
+}
+
+// Writes the temporary file, the committer syncs and renames it later
+int durable_write(struct durable *durable, const char *path, const void *data, size_t size) {
+    pthread_mutex_lock(&durable->lock);
+    uint64_t sequence = durable->names++;
+    pthread_mutex_unlock(&durable->lock);
+
+    // Unique, so the same path can be pending twice
+    struct durable_file file = {.fd = -1};
+    file.path = strdup(path);
+    file.temp_path = malloc(strlen(path) + 48);
+    if (file.path == NULL || file.temp_path == NULL) {
+        free_file(&file);
+        return DURABLE_ENOMEM;
+    }
+    sprintf(file.temp_path, "%s.%ld-%" PRIu64 DURABLE_TEMP_SUFFIX, path, (long) getpid(), sequence);
+
+    file.fd = open(file.temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file.fd < 0) {
+        free_file(&file);
+        return DURABLE_EOPEN;
+    }
+
+    const uint8_t *bytes = data;
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t ret = write(file.fd, bytes + offset, size - offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            unlink(file.temp_path);
+            free_file(&file);
+            return DURABLE_EWRITE;
+        }
+        offset += (size_t) ret;
+    }
+
+    file.written_us = now_us();
+
+    pthread_mutex_lock(&durable->lock);
+    while (durable->pending_count == DURABLE_MAX_PENDING) {
+        pthread_cond_signal(&durable->cond);
+        pthread_cond_wait(&durable->committed, &durable->lock);
+    }
+    durable->pending[durable->pending_count++] = file;
+    durable->written++;
+    if (durable->pending_count == 1 || durable->pending_count == DURABLE_MAX_PENDING) {
+        pthread_cond_signal(&durable->cond);
+    }
+    pthread_mutex_unlock(&durable->lock);
+
+    return DURABLE_SUCCESS;
+}
+
+// Commits everything written so far and waits for it
+int durable_flush(struct durable *durable) {
+    pthread_mutex_lock(&durable->lock);
+    uint64_t target = durable->written;
+    durable->flushes++;
+    pthread_cond_signal(&durable->cond);
+    while (durable->done < target) {
+        pthread_cond_wait(&durable->committed, &durable->lock);
+    }
+    durable->flushes--;
+    int result = durable->error;
+    pthread_mutex_unlock(&durable->lock);
+
+    return result;
+}
+
+int durable_close(struct durable *durable) {
+    pthread_mutex_lock(&durable->lock);
+    durable->stopping = true;
+    pthread_cond_signal(&durable->cond);
+    pthread_mutex_unlock(&durable->lock);
+
+    pthread_join(durable->thread, NULL);
+    pthread_cond_destroy(&durable->cond);
+    pthread_cond_destroy(&durable->committed);
+    pthread_mutex_destroy(&durable->lock);
+
+    return durable->error;
+}
+
+const char *durable_strerror(int result) {
+    switch (result) {
+        case DURABLE_SUCCESS:
+            return "success";
+        case DURABLE_ENOMEM:
+            return "out of memory";
+        case DURABLE_EOPEN:
+            return "cannot open file";
+        case DURABLE_EWRITE:
+            return "cannot write file";
+        case DURABLE_ESYNC:
+            return "cannot sync file";
+        case DURABLE_ERENAME:
+            return "cannot rename file";
+        case DURABLE_ETHREAD:
+            return "cannot start committer thread";
+        default:
+            return "unknown error";
+    }
+}
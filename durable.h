@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_DURABLE_H__
+#define __NFC_SRIX_DURABLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Macros */
+#define DURABLE_DEFAULT_COMMIT_MS 200 // Longest a written file waits for its commit
+#define DURABLE_MAX_PENDING 64        // Files per commit, writers wait for the committer beyond this
+#define DURABLE_TEMP_SUFFIX ".tmp"
+
+/* Return values */
+#define DURABLE_SUCCESS 0
+#define DURABLE_ENOMEM -1
+#define DURABLE_EOPEN -2
+#define DURABLE_EWRITE -3
+#define DURABLE_ESYNC -4
+#define DURABLE_ERENAME -5
+#define DURABLE_ETHREAD -6
+
+struct durable_file {
+    char *path;
+    char *temp_path;
+    int fd; // Kept open until the commit has synced it
+    uint64_t written_us;
+};
+
+/*
+ * Files are written under a temporary name right away and made durable by a
+ * background committer in groups: the data of every file in the group is
+ * synced, then every file is renamed over its final name and each directory
+ * is synced once. A file waits at most commit_ms for its group, so a crash
+ * leaves either the previous file or the complete new one, never a truncated
+ * one, and writers never wait for the disk.
+ */
+struct durable {
+    unsigned int commit_ms;
+
+    // Files waiting for the committer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // Wakes the committer
+    pthread_cond_t committed; // Wakes durable_flush() and writers waiting for room
+    pthread_t thread;
+    struct durable_file pending[DURABLE_MAX_PENDING];
+    size_t pending_count;
+    uint64_t names;     // Makes temporary names unique
+    uint64_t written;   // Files queued so far
+    uint64_t done;      // Files committed or failed
+    unsigned int flushes;
+    bool stopping;
+
+    int error; // First error, returned by durable_flush() and durable_close()
+
+    // Committer only
+    struct durable_file batch[DURABLE_MAX_PENDING];
+    uint64_t commits;
+    uint64_t files;
+    uint64_t failed;
+    uint64_t max_latency_us; // From the write to the end of its commit
+};
+
+int durable_open(struct durable *durable, unsigned int commit_ms);
+int durable_write(struct durable *durable, const char *path, const void *data, size_t size);
+int durable_flush(struct durable *durable);
+int durable_close(struct durable *durable);
+const char *durable_strerror(int result);
+
+#endif // __NFC_SRIX_DURABLE_H__
@@ -0,0 +1,390 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fingerprint.h"
+#include "crc32c.h"
+
+_Static_assert(sizeof(struct fingerprint_header) == 64, "header is 64 bytes");
+_Static_assert(FINGERPRINT_HASHES % FINGERPRINT_BANDS == 0, "bands must split the signature evenly");
+
+// splitmix64 finalizer, one independent hash function per seed
+static uint32_t mix(uint32_t value, uint32_t seed) {
+    uint64_t z = value + (seed + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+    return (uint32_t) (z ^ (z >> 31u));
+}
+
+static uint32_t band_key(const struct fingerprint *fingerprint, uint32_t band) {
+    return crc32c(band, fingerprint->signature + band * FINGERPRINT_ROWS, FINGERPRINT_ROWS * sizeof(uint32_t));
+}
+
+// The block number is part of the hash: same data somewhere else is not a copy
+void fingerprint_compute(struct fingerprint *fingerprint, const struct srix_image *image) {
+    memset(fingerprint, 0, sizeof(struct fingerprint));
+    fingerprint->blocks = image->blocks > FINGERPRINT_FIRST_BLOCK ? image->blocks - FINGERPRINT_FIRST_BLOCK : 0;
+    for (int i = 0; i < FINGERPRINT_HASHES; i++) {
+        fingerprint->signature[i] = UINT32_MAX;
+    }
+
+    for (uint8_t i = 0; i < fingerprint->blocks; i++) {
+        uint8_t block = FINGERPRINT_FIRST_BLOCK + i;
+        uint32_t value = srix_image_block(image, block);
+        if (value == 0xFFFFFFFF || value == 0x00000000) {
+            fingerprint->block_hashes[i] = FINGERPRINT_EMPTY_BLOCK;
+            continue;
+        }
+
+        uint32_t hash = crc32c(block, srix_image_block_bytes_const(image, block), 4);
+        if (hash == FINGERPRINT_EMPTY_BLOCK) hash = 1;
+        fingerprint->block_hashes[i] = hash;
+        fingerprint->distinct++;
+
+        for (int j = 0; j < FINGERPRINT_HASHES; j++) {
+            uint32_t h = mix(hash, j);
+            if (h < fingerprint->signature[j]) fingerprint->signature[j] = h;
+        }
+    }
+}
+
+// Exact Jaccard index, from the block hashes
+double fingerprint_similarity(const struct fingerprint *a, const struct fingerprint *b, uint32_t *identical) {
+    uint8_t blocks = a->blocks < b->blocks ? a->blocks : b->blocks;
+    uint32_t same = 0;
+    for (uint8_t i = 0; i < blocks; i++) {
+        if (a->block_hashes[i] != FINGERPRINT_EMPTY_BLOCK && a->block_hashes[i] == b->block_hashes[i]) {
+            same++;
+        }
+    }
+
+    if (identical != NULL) *identical = same;
+    uint32_t total = a->distinct + b->distinct - same;
+    return total == 0 ? 0.0 : (double) same / (double) total;
+}
+
+int fingerprint_writer_open(struct fingerprint_writer *writer, const char *path) {
+    memset(writer, 0, sizeof(struct fingerprint_writer));
+
+    writer->path = strdup(path);
+    writer->temp_path = malloc(strlen(path) + 5);
+    if (writer->path == NULL || writer->temp_path == NULL) {
+        free(writer->path);
+        free(writer->temp_path);
+        return FINGERPRINT_ENOMEM;
+    }
+    sprintf(writer->temp_path, "%s.tmp", path);
+
+    writer->fp = fopen(writer->temp_path, "wb");
+    if (writer->fp == NULL) {
+        free(writer->path);
+        free(writer->temp_path);
+        return FINGERPRINT_EOPEN;
+    }
+
+    // Header is written last
+    struct fingerprint_header header = {};
+    if (fwrite(&header, sizeof(header), 1, writer->fp) != 1) {
+        fingerprint_writer_close(writer);
+        return FINGERPRINT_EWRITE;
+    }
+
+    return FINGERPRINT_SUCCESS;
+}
+
+int fingerprint_writer_add(struct fingerprint_writer *writer, struct fingerprint *fingerprint, const char *dump_path) {
+    size_t path_size = strlen(dump_path) + 1;
+
+    // Grow both buffers
+    if (writer->paths_size + path_size > writer->paths_capacity) {
+        size_t capacity = writer->paths_capacity == 0 ? 65536 : writer->paths_capacity * 2;
+        while (capacity < writer->paths_size + path_size) capacity *= 2;
+        char *paths = realloc(writer->paths, capacity);
+        if (paths == NULL) return FINGERPRINT_ENOMEM;
+        writer->paths = paths;
+        writer->paths_capacity = capacity;
+    }
+    if ((writer->count + 1) * FINGERPRINT_BANDS > writer->keys_capacity) {
+        size_t capacity = writer->keys_capacity == 0 ? 4096 * FINGERPRINT_BANDS : writer->keys_capacity * 2;
+        uint32_t *keys = realloc(writer->keys, capacity * sizeof(uint32_t));
+        if (keys == NULL) return FINGERPRINT_ENOMEM;
+        writer->keys = keys;
+        writer->keys_capacity = capacity;
+    }
+
+    fingerprint->path_offset = writer->paths_size;
+    if (fwrite(fingerprint, sizeof(struct fingerprint), 1, writer->fp) != 1) {
+        return FINGERPRINT_EWRITE;
+    }
+
+    memcpy(writer->paths + writer->paths_size, dump_path, path_size);
+    writer->paths_size += path_size;
+    for (uint32_t band = 0; band < FINGERPRINT_BANDS; band++) {
+        writer->keys[writer->count * FINGERPRINT_BANDS + band] = band_key(fingerprint, band);
+    }
+    writer->count++;
+
+    return FINGERPRINT_SUCCESS;
+}
+
+static int compare_band_entries(const void *a, const void *b) {
+    const struct fingerprint_band_entry *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static int write_sections(struct fingerprint_writer *writer) {
+    struct fingerprint_header header = {};
+    memcpy(header.magic, FINGERPRINT_MAGIC, sizeof(header.magic));
+    header.byte_order = FINGERPRINT_BYTE_ORDER;
+    header.version = FINGERPRINT_VERSION;
+    header.hashes = FINGERPRINT_HASHES;
+    header.bands = FINGERPRINT_BANDS;
+    header.count = writer->count;
+    header.entries_offset = sizeof(struct fingerprint_header);
+    header.bands_offset = header.entries_offset + writer->count * sizeof(struct fingerprint);
+    header.paths_offset = header.bands_offset + writer->count * FINGERPRINT_BANDS * sizeof(struct fingerprint_band_entry);
+    header.paths_size = writer->paths_size;
+
+    // One band at a time, sorted by key
+    struct fingerprint_band_entry *band_entries = malloc((writer->count > 0 ? writer->count : 1) * sizeof(struct fingerprint_band_entry));
+    if (band_entries == NULL) {
+        return FINGERPRINT_ENOMEM;
+    }
+    for (uint32_t band = 0; band < FINGERPRINT_BANDS; band++) {
+        for (uint64_t i = 0; i < writer->count; i++) {
+            band_entries[i].key = writer->keys[i * FINGERPRINT_BANDS + band];
+            band_entries[i].entry = (uint32_t) i;
+        }
+        qsort(band_entries, writer->count, sizeof(struct fingerprint_band_entry), compare_band_entries);
+        if (fwrite(band_entries, sizeof(struct fingerprint_band_entry), writer->count, writer->fp) != writer->count) {
+            free(band_entries);
+            return FINGERPRINT_EWRITE;
+        }
+    }
+    free(band_entries);
+
+    if (fwrite(writer->paths, 1, writer->paths_size, writer->fp) != writer->paths_size) {
+        return FINGERPRINT_EWRITE;
+    }
+    if (fseek(writer->fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer->fp) != 1) {
+        return FINGERPRINT_EWRITE;
+    }
+
+    return FINGERPRINT_SUCCESS;
+}
+
+// Builds the band tables, then replaces the index in one rename
+int fingerprint_writer_close(struct fingerprint_writer *writer) {
+    int result = write_sections(writer);
+    if (fclose(writer->fp) != 0 && result == FINGERPRINT_SUCCESS) {
+        result = FINGERPRINT_EWRITE;
+    }
+    if (result == FINGERPRINT_SUCCESS && rename(writer->temp_path, writer->path) != 0) {
+        result = FINGERPRINT_EWRITE;
+    }
+    if (result != FINGERPRINT_SUCCESS) {
+        unlink(writer->temp_path);
+    }
+
+    free(writer->keys);
+    free(writer->paths);
+    free(writer->path);
+    free(writer->temp_path);
+    writer->fp = NULL;
+
+    return result;
+}
+
+int fingerprint_index_open(struct fingerprint_index *index, const char *path) {
+    memset(index, 0, sizeof(struct fingerprint_index));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return FINGERPRINT_EOPEN;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return FINGERPRINT_EREAD;
+    }
+    if ((size_t) st.st_size < sizeof(struct fingerprint_header)) {
+        close(fd);
+        return FINGERPRINT_EFORMAT;
+    }
+
+    index->size = st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        return FINGERPRINT_EREAD;
+    }
+
+    // Queries jump around, readahead would only waste memory
+    madvise(index->map, index->size, MADV_RANDOM);
+
+    const struct fingerprint_header *header = index->map;
+    uint64_t entries_size = header->count * sizeof(struct fingerprint);
+    uint64_t bands_size = header->count * FINGERPRINT_BANDS * sizeof(struct fingerprint_band_entry);
+    if (memcmp(header->magic, FINGERPRINT_MAGIC, sizeof(header->magic)) != 0 || header->byte_order != FINGERPRINT_BYTE_ORDER ||
+            header->version != FINGERPRINT_VERSION || header->hashes != FINGERPRINT_HASHES || header->bands != FINGERPRINT_BANDS ||
+            header->entries_offset + entries_size > header->bands_offset || header->bands_offset + bands_size > header->paths_offset ||
+            header->paths_offset + header->paths_size > index->size) {
+        fingerprint_index_close(index);
+        return FINGERPRINT_EFORMAT;
+    }
+
+    index->header = header;
+    index->entries = (const struct fingerprint *) ((const uint8_t *) index->map + header->entries_offset);
+    index->bands = (const struct fingerprint_band_entry *) ((const uint8_t *) index->map + header->bands_offset);
+    index->paths = (const char *) index->map + header->paths_offset;
+
+    return FINGERPRINT_SUCCESS;
+}
+
+const char *fingerprint_index_path(const struct fingerprint_index *index, uint64_t entry) {
+    uint64_t offset = index->entries[entry].path_offset;
+    return offset < index->header->paths_size ? index->paths + offset : "?";
+}
+
+// Keeps matches sorted, best first
+static size_t insert_match(struct fingerprint_match *matches, size_t count, size_t k, uint64_t entry, double similarity, uint32_t identical) {
+    size_t position = count;
+    while (position > 0 && (matches[position - 1].similarity < similarity ||
+            (matches[position - 1].similarity == similarity && matches[position - 1].identical < identical))) {
+        position--;
+    }
+    if (position >= k) {
+        return count;
+    }
+
+    size_t moved = (count < k ? count : k - 1) - position;
+    memmove(matches + position + 1, matches + position, moved * sizeof(struct fingerprint_match));
+    matches[position].entry = entry;
+    matches[position].similarity = similarity;
+    matches[position].identical = identical;
+    return count < k ? count + 1 : k;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Top k dumps sharing data blocks with query. Candidates are the dumps
+ * colliding with it in at least one LSH band, ranked by their exact
+ * similarity; exhaustive ranks every dump instead.
+ */
+size_t fingerprint_index_query(const struct fingerprint_index *index, const struct fingerprint *query, struct fingerprint_match *matches, size_t k, bool exhaustive, size_t *candidates) {
+    uint64_t count = index->header->count;
+    size_t found = 0;
+    *candidates = 0;
+    if (k == 0 || query->distinct == 0) {
+        return 0;
+    }
+
+    if (exhaustive) {
+        for (uint64_t i = 0; i < count; i++) {
+            uint32_t identical;
+            double similarity = fingerprint_similarity(query, &index->entries[i], &identical);
+            if (identical > 0) {
+                found = insert_match(matches, found, k, i, similarity, identical);
+            }
+        }
+        *candidates = count;
+        return found;
+    }
+
+    uint32_t *entries = malloc(FINGERPRINT_BANDS * FINGERPRINT_MAX_BUCKET * sizeof(uint32_t));
+    if (entries == NULL) {
+        return 0;
+    }
+
+    size_t entry_count = 0;
+    for (uint32_t band = 0; band < FINGERPRINT_BANDS; band++) {
+        const struct fingerprint_band_entry *table = index->bands + band * count;
+        uint32_t key = band_key(query, band);
+
+        // Lower bound
+        uint64_t low = 0, high = count;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (table[middle].key < key) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        for (uint64_t i = low, n = 0; i < count && table[i].key == key && n < FINGERPRINT_MAX_BUCKET; i++, n++) {
+            entries[entry_count++] = table[i].entry;
+        }
+    }
+
+    // Every candidate once
+    qsort(entries, entry_count, sizeof(uint32_t), compare_u32);
+    for (size_t i = 0; i < entry_count; i++) {
+        if (i > 0 && entries[i] == entries[i - 1]) {
+            continue;
+        }
+        (*candidates)++;
+
+        uint32_t identical;
+        double similarity = fingerprint_similarity(query, &index->entries[entries[i]], &identical);
+        if (identical > 0) {
+            found = insert_match(matches, found, k, entries[i], similarity, identical);
+        }
+    }
+
+    free(entries);
+    return found;
+}
+
+void fingerprint_index_close(struct fingerprint_index *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->size);
+    }
+    memset(index, 0, sizeof(struct fingerprint_index));
+}
+
+const char *fingerprint_strerror(int result) {
+    switch (result) {
+        case FINGERPRINT_SUCCESS:
+            return "success";
+        case FINGERPRINT_EOPEN:
+            return "cannot open file";
+        case FINGERPRINT_EREAD:
+            return "read error";
+        case FINGERPRINT_EWRITE:
+            return "write error";
+        case FINGERPRINT_EFORMAT:
+            return "not a fingerprint index";
+        case FINGERPRINT_ENOMEM:
+            return "out of memory";
+        default:
+            return "unknown error";
+    }
+}
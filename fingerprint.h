@@ -0,0 +1,135 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_FINGERPRINT_H__
+#define __NFC_SRIX_FINGERPRINT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "srix_image.h"
+
+/*
+ * Fingerprint index layout, mapped as is, so in host byte order (the header
+ * records it and other hosts refuse the file):
+ *
+ *   header   "SRIXFPI1", byte order mark, entry count, section offsets
+ *   entries  one fixed size entry per dump: MinHash signature and the hash
+ *            of every data block, in walk order
+ *   bands    for every LSH band, (band key, entry) pairs sorted by key
+ *   paths    NUL terminated dump paths, referenced by the entries
+ *
+ * Only data blocks (07 and above, "Lockable EEPROM" and "EEPROM") are
+ * fingerprinted: the OTP area and the counters differ on every copy. Erased
+ * (FFFFFFFF) and zeroed blocks are left out of the set, every tag has plenty.
+ */
+
+/* Macros */
+#define FINGERPRINT_MAGIC "SRIXFPI1"
+#define FINGERPRINT_VERSION 1
+#define FINGERPRINT_BYTE_ORDER 0x01020304
+#define FINGERPRINT_FIRST_BLOCK 7
+#define FINGERPRINT_MAX_BLOCKS (SRIX_IMAGE_MAX_BLOCKS - FINGERPRINT_FIRST_BLOCK)
+#define FINGERPRINT_HASHES 64  // MinHash signature size
+#define FINGERPRINT_BANDS 16   // LSH bands of FINGERPRINT_ROWS hashes each
+#define FINGERPRINT_ROWS (FINGERPRINT_HASHES / FINGERPRINT_BANDS)
+#define FINGERPRINT_MAX_BUCKET 4096 // Entries looked at per band, huge buckets are all alike anyway
+#define FINGERPRINT_EMPTY_BLOCK 0   // Block hash of erased and zeroed blocks
+
+/* Return values */
+#define FINGERPRINT_SUCCESS 0
+#define FINGERPRINT_EOPEN -1
+#define FINGERPRINT_EREAD -2
+#define FINGERPRINT_EWRITE -3
+#define FINGERPRINT_EFORMAT -4
+#define FINGERPRINT_ENOMEM -5
+
+struct fingerprint_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint16_t version;
+    uint16_t hashes;
+    uint16_t bands;
+    uint16_t reserved[3];
+    uint64_t count;
+    uint64_t entries_offset;
+    uint64_t bands_offset;
+    uint64_t paths_offset;
+    uint64_t paths_size;
+};
+
+struct fingerprint {
+    uint64_t path_offset; // Into the paths section
+    uint8_t blocks;       // Data blocks
+    uint8_t distinct;     // Data blocks that are not erased or zeroed
+    uint8_t reserved[6];
+    uint32_t signature[FINGERPRINT_HASHES];
+    uint32_t block_hashes[FINGERPRINT_MAX_BLOCKS];
+};
+
+struct fingerprint_band_entry {
+    uint32_t key;
+    uint32_t entry;
+};
+
+struct fingerprint_match {
+    uint64_t entry;
+    uint32_t identical; // Data blocks equal in both dumps, empty ones excluded
+    double similarity;  // Jaccard index of the two block sets
+};
+
+struct fingerprint_writer {
+    FILE *fp;
+    char *path;
+    char *temp_path;
+    uint64_t count;
+
+    // Kept until close: band keys of every entry and the paths
+    uint32_t *keys;
+    size_t keys_capacity;
+    char *paths;
+    size_t paths_size;
+    size_t paths_capacity;
+};
+
+struct fingerprint_index {
+    void *map;
+    size_t size;
+    const struct fingerprint_header *header;
+    const struct fingerprint *entries;
+    const struct fingerprint_band_entry *bands;
+    const char *paths;
+};
+
+void fingerprint_compute(struct fingerprint *fingerprint, const struct srix_image *image);
+double fingerprint_similarity(const struct fingerprint *a, const struct fingerprint *b, uint32_t *identical);
+
+/* Writer */
+int fingerprint_writer_open(struct fingerprint_writer *writer, const char *path);
+int fingerprint_writer_add(struct fingerprint_writer *writer, struct fingerprint *fingerprint, const char *dump_path);
+int fingerprint_writer_close(struct fingerprint_writer *writer);
+
+/* Index */
+int fingerprint_index_open(struct fingerprint_index *index, const char *path);
+size_t fingerprint_index_query(const struct fingerprint_index *index, const struct fingerprint *query, struct fingerprint_match *matches, size_t k, bool exhaustive, size_t *candidates);
+const char *fingerprint_index_path(const struct fingerprint_index *index, uint64_t entry);
+void fingerprint_index_close(struct fingerprint_index *index);
+
+const char *fingerprint_strerror(int result);
+
+#endif // __NFC_SRIX_FINGERPRINT_H__
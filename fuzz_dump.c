@@ -0,0 +1,54 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <nfc/nfc.h>
+#include "dump_utils.h"
+#include "srix_image.h"
+#include "nfc_utils.h"
+
+/*
+ * srix_dump_parse() and srix_image_parse() on any input, both tag types. The
+ * first byte picks the tag type, the rest is the file.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    uint8_t blocks = data[0] & 1u ? SRI512_EEPROM_BLOCKS : SRIX4K_EEPROM_BLOCKS;
+    data++;
+    size--;
+
+    uint8_t dump[DUMP_MAX_BLOCKS * 4];
+    uint8_t system_block[DUMP_SYSTEM_BLOCK_SIZE];
+    bool has_system_block = true;
+    int result = srix_dump_parse(data, size, dump, (size_t) blocks * 4, system_block, &has_system_block);
+    if (result == DUMP_SUCCESS) {
+        if (memcmp(dump, data, (size_t) blocks * 4) != 0) __builtin_trap();
+        if (has_system_block != (size == (size_t) blocks * 4 + DUMP_SYSTEM_BLOCK_SIZE)) __builtin_trap();
+    } else if (result != DUMP_ESIZE || has_system_block) {
+        __builtin_trap();
+    }
+
+    struct srix_image image;
+    srix_image_init(&image, blocks);
+    if ((srix_image_parse(&image, data, size) == DUMP_SUCCESS) != (result == DUMP_SUCCESS)) __builtin_trap();
+
+    return 0;
+}
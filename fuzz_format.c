@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <nfc/nfc.h>
+#include "dump_format.h"
+#include "srix_image.h"
+#include "nfc_utils.h"
+
+/*
+ * srix_format_parse() on any input. The first byte picks the format and the
+ * tag type, the rest is the file. Whatever parses must render again.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static struct format_reader reader;
+    static struct format_writer writer;
+
+    if (size == 0) {
+        return 0;
+    }
+    int format = (data[0] & 0x7Fu) % FORMAT_COUNT;
+    uint8_t blocks = data[0] & 0x80u ? SRI512_EEPROM_BLOCKS : SRIX4K_EEPROM_BLOCKS;
+
+    struct srix_image image;
+    srix_image_init(&image, blocks);
+    int result = srix_format_parse(&image, data + 1, size - 1, format, &reader);
+    if (result != FORMAT_SUCCESS) {
+        return 0;
+    }
+    if (image.blocks != blocks) __builtin_trap();
+
+    for (int output = 0; output < FORMAT_COUNT; output++) {
+        result = srix_format_render(&image, output, &writer);
+        if (result != FORMAT_SUCCESS && !(result == FORMAT_ENOUID && !image.has_uid)) __builtin_trap();
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <nfc/nfc.h>
+#include "write_plan.h"
+#include "dump_utils.h"
+#include "srix_image.h"
+#include "nfc_utils.h"
+
+/*
+ * srix_plan_writes() between any two images. The first byte picks the tag
+ * types, the system blocks and include_otp_area, then come the current and
+ * the target dump. The plan must stay within its own bounds and never write
+ * what the tag cannot take.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    uint8_t flags = data[0];
+    struct srix_image current, target;
+    srix_image_init(&current, flags & 0x01u ? SRI512_EEPROM_BLOCKS : SRIX4K_EEPROM_BLOCKS);
+    srix_image_init(&target, flags & 0x02u ? SRI512_EEPROM_BLOCKS : SRIX4K_EEPROM_BLOCKS);
+    bool include_otp_area = flags & 0x04u;
+    data++;
+    size--;
+
+    size_t current_size = srix_image_size(&current) + (flags & 0x08u ? DUMP_SYSTEM_BLOCK_SIZE : 0);
+    if (size < current_size || srix_image_parse(&current, data, current_size) != DUMP_SUCCESS) {
+        return 0;
+    }
+    if (srix_image_parse(&target, data + current_size, size - current_size) != DUMP_SUCCESS) {
+        return 0;
+    }
+
+    struct write_plan plan;
+    srix_plan_writes(&plan, &current, &target, include_otp_area);
+
+    uint8_t blocks = current.blocks < target.blocks ? current.blocks : target.blocks;
+    if (plan.count > PLAN_MAX_ENTRIES) __builtin_trap();
+    if (plan.writes + plan.skipped_locked + plan.skipped_impossible + plan.skipped_excluded != plan.count) __builtin_trap();
+
+    bool seen[PLAN_MAX_ENTRIES] = {};
+    for (size_t i = 0; i < plan.count; i++) {
+        const struct plan_entry *entry = &plan.entries[i];
+        if (entry->block >= blocks || seen[entry->block] || entry->from == entry->to) __builtin_trap();
+        seen[entry->block] = true;
+
+        if (entry->action != PLAN_WRITE) {
+            continue;
+        }
+        if (!include_otp_area && entry->block < 7) __builtin_trap();
+        if (entry->block < 5 && (entry->to & ~entry->from) != 0) __builtin_trap();
+        if (entry->block == 6 && i != 0) __builtin_trap();
+        if ((entry->block == 5 || entry->block == 6) && srix_image_value(&target, entry->block) > srix_image_value(&current, entry->block)) __builtin_trap();
+    }
+
+    // Only a lower reload counter erases blocks 00-04
+    if (plan.erase_cycle && srix_otp_resets_remaining(srix_image_value(&target, 6)) >= srix_otp_resets_remaining(srix_image_value(&current, 6))) __builtin_trap();
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Stand-in for libFuzzer on compilers without -fsanitize=fuzzer: runs every
+ * file given on the command line through the target once, so a corpus or a
+ * crash reproducer can be replayed as a regression test.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp == NULL) {
+            fprintf(stderr, "Cannot open \"%s\".\n", argv[i]);
+            return 1;
+        }
+
+        size_t capacity = 4096, size = 0;
+        uint8_t *data = malloc(capacity);
+        size_t read;
+        while (data != NULL && (read = fread(data + size, 1, capacity - size, fp)) > 0) {
+            size += read;
+            if (size == capacity) {
+                uint8_t *resized = realloc(data, capacity * 2);
+                if (resized == NULL) {
+                    free(data);
+                    data = NULL;
+                    break;
+                }
+                data = resized;
+                capacity *= 2;
+            }
+        }
+        fclose(fp);
+        if (data == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+
+    printf("Replayed %d inputs.\n", argc - 1);
+    return 0;
+}
@@ -0,0 +1,934 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "crc32c.h"
+#include "logging.h"
+
+#define HISTORY_DATA_OFFSET (2 * HISTORY_INDEX_SLOT_SIZE)
+#define HISTORY_MERGE_BUFFER_ENTRIES 4096
+
+_Static_assert(sizeof(struct history_index_header) <= HISTORY_INDEX_SLOT_SIZE, "index header fits its slot");
+
+struct history_entries {
+    struct history_index_entry *data;
+    size_t count;
+    size_t capacity;
+};
+
+// Index file being updated, the log lock is held
+struct history_index {
+    int fd;
+    uint64_t size;
+    struct history_index_header header;
+};
+
+typedef int (*history_scan_fn)(uint64_t offset, const struct history_entry *entry, void *arg);
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8u * i);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8u * i);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint32_t bytes_to_block(const uint8_t *bytes) {
+    return (uint32_t) bytes[0] << 24u | (uint32_t) bytes[1] << 16u | (uint32_t) bytes[2] << 8u | bytes[3];
+}
+
+static int write_all(int fd, const void *data, size_t size, uint64_t offset) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, p, size, (off_t) offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return HISTORY_EWRITE;
+        p += written;
+        size -= written;
+        offset += written;
+    }
+    return HISTORY_SUCCESS;
+}
+
+void history_entry_init(struct history_entry *entry, uint8_t tool, uint64_t uid, const char *reader) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    memset(entry, 0, offsetof(struct history_entry, blocks));
+    entry->timestamp_us = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    entry->uid = uid;
+    entry->tool = tool;
+    entry->outcome = HISTORY_OUTCOME_DONE;
+    snprintf(entry->reader, sizeof(entry->reader), "%s", reader != NULL ? reader : "");
+}
+
+void history_entry_add_write(struct history_entry *entry, const struct srix_write *write, uint32_t before) {
+    if (entry->block_count == HISTORY_MAX_BLOCKS) {
+        return;
+    }
+
+    struct history_block *block = &entry->blocks[entry->block_count++];
+    block->block = write->block;
+    block->status = (uint8_t) write->status;
+    block->before = before;
+    block->written = bytes_to_block(write->data);
+    block->read_back = bytes_to_block(write->read_back);
+}
+
+static size_t serialize_entry(const struct history_entry *entry, uint8_t *p) {
+    size_t reader_length = strnlen(entry->reader, HISTORY_READER_SIZE - 1);
+    size_t size = HISTORY_RECORD_HEADER_SIZE + reader_length + (size_t) entry->block_count * HISTORY_BLOCK_SIZE;
+
+    put_le32(p, (uint32_t) size);
+    put_le64(p + 8, (uint64_t) entry->timestamp_us);
+    put_le64(p + 16, entry->uid);
+    p[24] = entry->tool;
+    p[25] = entry->outcome;
+    p[26] = (uint8_t) reader_length;
+    p[27] = entry->block_count;
+    memcpy(p + HISTORY_RECORD_HEADER_SIZE, entry->reader, reader_length);
+
+    uint8_t *q = p + HISTORY_RECORD_HEADER_SIZE + reader_length;
+    for (uint8_t i = 0; i < entry->block_count; i++, q += HISTORY_BLOCK_SIZE) {
+        const struct history_block *block = &entry->blocks[i];
+        q[0] = block->block;
+        q[1] = block->status;
+        put_le32(q + 2, block->before);
+        put_le32(q + 6, block->written);
+        put_le32(q + 10, block->read_back);
+    }
+
+    put_le32(p + 4, crc32c(0, p + 8, size - 8));
+    return size;
+}
+
+// HISTORY_EREAD when the record goes past available, HISTORY_EFORMAT when it is not one
+static int parse_record(const uint8_t *p, size_t available, struct history_entry *entry, size_t *size) {
+    if (available < HISTORY_RECORD_HEADER_SIZE) {
+        return HISTORY_EREAD;
+    }
+
+    uint32_t record_size = get_le32(p);
+    if (record_size < HISTORY_RECORD_HEADER_SIZE || record_size > HISTORY_MAX_RECORD_SIZE) {
+        return HISTORY_EFORMAT;
+    }
+    if (record_size > available) {
+        return HISTORY_EREAD;
+    }
+
+    uint8_t reader_length = p[26];
+    uint8_t block_count = p[27];
+    if (crc32c(0, p + 8, record_size - 8) != get_le32(p + 4) || reader_length >= HISTORY_READER_SIZE || block_count > HISTORY_MAX_BLOCKS ||
+            HISTORY_RECORD_HEADER_SIZE + reader_length + (size_t) block_count * HISTORY_BLOCK_SIZE != record_size) {
+        return HISTORY_EFORMAT;
+    }
+
+    entry->timestamp_us = (int64_t) get_le64(p + 8);
+    entry->uid = get_le64(p + 16);
+    entry->tool = p[24];
+    entry->outcome = p[25];
+    memcpy(entry->reader, p + HISTORY_RECORD_HEADER_SIZE, reader_length);
+    entry->reader[reader_length] = '\0';
+    entry->block_count = block_count;
+
+    const uint8_t *q = p + HISTORY_RECORD_HEADER_SIZE + reader_length;
+    for (uint8_t i = 0; i < block_count; i++, q += HISTORY_BLOCK_SIZE) {
+        struct history_block *block = &entry->blocks[i];
+        block->block = q[0];
+        block->status = q[1];
+        block->before = get_le32(q + 2);
+        block->written = get_le32(q + 6);
+        block->read_back = get_le32(q + 10);
+    }
+
+    *size = record_size;
+    return HISTORY_SUCCESS;
+}
+
+/*
+ * Calls back every record in [start, end). valid_end is where the valid
+ * records stop: end, or the start of a torn or corrupted record.
+ */
+static int scan_log(int fd, uint64_t start, uint64_t end, uint64_t *valid_end, history_scan_fn callback, void *arg) {
+    uint8_t *buffer = malloc(HISTORY_SCAN_BUFFER_SIZE);
+    struct history_entry *entry = malloc(sizeof(struct history_entry));
+    if (buffer == NULL || entry == NULL) {
+        free(buffer);
+        free(entry);
+        return HISTORY_ENOMEM;
+    }
+
+    int result = HISTORY_SUCCESS;
+    uint64_t position = start; // File offset of buffer[0]
+    size_t filled = 0;
+    *valid_end = start;
+    while (position + filled < end) {
+        size_t wanted = HISTORY_SCAN_BUFFER_SIZE - filled;
+        if (wanted > end - position - filled) wanted = end - position - filled;
+        ssize_t read_size = pread(fd, buffer + filled, wanted, (off_t) (position + filled));
+        if (read_size < 0 && errno == EINTR) continue;
+        if (read_size <= 0) {
+            result = read_size < 0 ? HISTORY_EREAD : HISTORY_SUCCESS;
+            break;
+        }
+        filled += read_size;
+
+        size_t consumed = 0, size = 0;
+        int parse_result;
+        while ((parse_result = parse_record(buffer + consumed, filled - consumed, entry, &size)) == HISTORY_SUCCESS) {
+            if ((result = callback(position + consumed, entry, arg)) != HISTORY_SUCCESS) break;
+            consumed += size;
+        }
+        *valid_end = position + consumed;
+        if (result != HISTORY_SUCCESS || parse_result == HISTORY_EFORMAT) {
+            break;
+        }
+
+        // Keep the start of the next record
+        memmove(buffer, buffer + consumed, filled - consumed);
+        position += consumed;
+        filled -= consumed;
+    }
+
+    free(buffer);
+    free(entry);
+    return result;
+}
+
+static int check_log_header(int fd, bool create) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return HISTORY_EREAD;
+    }
+
+    uint8_t header[HISTORY_LOG_HEADER_SIZE] = {};
+    if (st.st_size == 0 && create) {
+        memcpy(header, HISTORY_LOG_MAGIC, 8);
+        put_le32(header + 8, HISTORY_VERSION);
+        if (write_all(fd, header, sizeof(header), 0) != HISTORY_SUCCESS || fdatasync(fd) != 0) {
+            return HISTORY_EWRITE;
+        }
+        return HISTORY_SUCCESS;
+    }
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+        return HISTORY_EFORMAT;
+    }
+    if (memcmp(header, HISTORY_LOG_MAGIC, 8) != 0 || get_le32(header + 8) != HISTORY_VERSION) {
+        return HISTORY_EFORMAT;
+    }
+    return HISTORY_SUCCESS;
+}
+
+static bool header_valid(const struct history_index_header *header, uint64_t size) {
+    if (memcmp(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->byte_order != HISTORY_BYTE_ORDER ||
+            header->version != HISTORY_VERSION || header->run_count > HISTORY_MAX_RUNS || header->log_end < HISTORY_LOG_HEADER_SIZE ||
+            crc32c(0, header, offsetof(struct history_index_header, crc)) != header->crc) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->run_count; i++) {
+        const struct history_run *run = &header->runs[i];
+        if (run->offset < HISTORY_DATA_OFFSET || run->offset % sizeof(struct history_index_entry) != 0 ||
+                run->count > (size - run->offset) / sizeof(struct history_index_entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The valid slot with the highest generation, false when there is none
+static bool read_index_header(int fd, struct history_index_header *header, uint64_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < HISTORY_DATA_OFFSET) {
+        return false;
+    }
+    *size = st.st_size;
+
+    bool found = false;
+    struct history_index_header slot;
+    for (int i = 0; i < 2; i++) {
+        if (pread(fd, &slot, sizeof(slot), (off_t) i * HISTORY_INDEX_SLOT_SIZE) != sizeof(slot) || !header_valid(&slot, *size)) {
+            continue;
+        }
+        if (!found || slot.generation > header->generation) {
+            *header = slot;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static void empty_index_header(struct history_index_header *header) {
+    memset(header, 0, sizeof(struct history_index_header));
+    memcpy(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic));
+    header->byte_order = HISTORY_BYTE_ORDER;
+    header->version = HISTORY_VERSION;
+    header->log_end = HISTORY_LOG_HEADER_SIZE;
+}
+
+// The slot not holding the current header, so a torn write keeps the previous one
+static int write_index_header(int fd, struct history_index_header *header) {
+    header->generation++;
+    header->crc = crc32c(0, header, offsetof(struct history_index_header, crc));
+
+    uint8_t slot[HISTORY_INDEX_SLOT_SIZE] = {};
+    memcpy(slot, header, sizeof(struct history_index_header));
+    if (write_all(fd, slot, sizeof(slot), (header->generation % 2) * HISTORY_INDEX_SLOT_SIZE) != HISTORY_SUCCESS || fdatasync(fd) != 0) {
+        return HISTORY_EWRITE;
+    }
+    return HISTORY_SUCCESS;
+}
+
+static int compare_index_entries(const void *a, const void *b) {
+    const struct history_index_entry *x = a, *y = b;
+    if (x->uid != y->uid) return x->uid < y->uid ? -1 : 1;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Merges sorted runs of map and the sorted extra entries into one run
+ * written at offset of out_fd.
+ */
+static int merge_runs(const uint8_t *map, const struct history_run *runs, uint32_t run_count, const struct history_entries *extra, int out_fd, uint64_t offset) {
+    const struct history_index_entry *next[HISTORY_MAX_RUNS + 1];
+    const struct history_index_entry *last[HISTORY_MAX_RUNS + 1];
+    uint32_t sources = 0;
+    for (uint32_t i = 0; i < run_count; i++) {
+        if (runs[i].count == 0) continue;
+        next[sources] = (const struct history_index_entry *) (map + runs[i].offset);
+        last[sources++] = (const struct history_index_entry *) (map + runs[i].offset) + runs[i].count;
+    }
+    if (extra != NULL && extra->count > 0) {
+        next[sources] = extra->data;
+        last[sources++] = extra->data + extra->count;
+    }
+
+    struct history_index_entry *buffer = malloc(HISTORY_MERGE_BUFFER_ENTRIES * sizeof(struct history_index_entry));
+    if (buffer == NULL) {
+        return HISTORY_ENOMEM;
+    }
+
+    // Only a handful of runs take part, a linear pick is enough
+    size_t buffered = 0;
+    int result = HISTORY_SUCCESS;
+    for (;;) {
+        int best = -1;
+        for (uint32_t i = 0; i < sources; i++) {
+            if (next[i] == last[i]) continue;
+            if (best < 0 || compare_index_entries(next[i], next[best]) < 0) best = (int) i;
+        }
+        if (best < 0 || buffered == HISTORY_MERGE_BUFFER_ENTRIES) {
+            if ((result = write_all(out_fd, buffer, buffered * sizeof(struct history_index_entry), offset)) != HISTORY_SUCCESS) break;
+            offset += buffered * sizeof(struct history_index_entry);
+            buffered = 0;
+        }
+        if (best < 0) break;
+
+        buffer[buffered++] = *next[best]++;
+    }
+
+    free(buffer);
+    return result;
+}
+
+static uint64_t live_entries(const struct history_index_header *header) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < header->run_count; i++) {
+        count += header->runs[i].count;
+    }
+    return count;
+}
+
+// Rewrites the index as a single run, dropping the space of merged runs
+static int compact_index(const char *index_path, struct history_index *index, const uint8_t *map) {
+    char tmp_path[strlen(index_path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return HISTORY_EOPEN;
+    }
+
+    struct history_index_header header;
+    empty_index_header(&header);
+    header.log_end = index->header.log_end;
+    header.run_count = 1;
+    header.runs[0].offset = HISTORY_DATA_OFFSET;
+    header.runs[0].count = live_entries(&index->header);
+
+    int result = merge_runs(map, index->header.runs, index->header.run_count, NULL, fd, HISTORY_DATA_OFFSET);
+    if (result == HISTORY_SUCCESS && fdatasync(fd) != 0) result = HISTORY_EWRITE;
+    if (result == HISTORY_SUCCESS) result = write_index_header(fd, &header);
+    if (result == HISTORY_SUCCESS && rename(tmp_path, index_path) != 0) result = HISTORY_EWRITE;
+    if (result != HISTORY_SUCCESS) {
+        close(fd);
+        unlink(tmp_path);
+        return result;
+    }
+
+    close(index->fd);
+    index->fd = fd;
+    index->header = header;
+    index->size = HISTORY_DATA_OFFSET + header.runs[0].count * sizeof(struct history_index_entry);
+    return HISTORY_SUCCESS;
+}
+
+/*
+ * Adds the entries (sorted) as a new run, merged with the newer runs while
+ * the one before is not more than twice as big. The merged run goes after
+ * everything else, the header switches to it once it is on disk.
+ */
+static int update_index(const char *index_path, struct history_index *index, const struct history_entries *entries, uint64_t log_end) {
+    struct history_index_header *header = &index->header;
+    uint64_t count = entries->count;
+    uint32_t keep = header->run_count;
+    while (keep > 0 && (header->runs[keep - 1].count <= 2 * count || keep == HISTORY_MAX_RUNS)) {
+        count += header->runs[--keep].count;
+    }
+
+    uint8_t *map = NULL;
+    uint64_t map_size = index->size;
+    if (map_size > HISTORY_DATA_OFFSET) {
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, index->fd, 0);
+        if (map == MAP_FAILED) {
+            return HISTORY_EREAD;
+        }
+    }
+
+    uint64_t offset = index->size;
+    offset += (sizeof(struct history_index_entry) - offset % sizeof(struct history_index_entry)) % sizeof(struct history_index_entry);
+    int result = HISTORY_SUCCESS;
+    if (count > 0) {
+        result = merge_runs(map, header->runs + keep, header->run_count - keep, entries, index->fd, offset);
+        if (result == HISTORY_SUCCESS && fdatasync(index->fd) != 0) result = HISTORY_EWRITE;
+    }
+
+    if (result == HISTORY_SUCCESS) {
+        struct history_index_header next = *header;
+        next.run_count = keep;
+        if (count > 0) {
+            next.runs[next.run_count].offset = offset;
+            next.runs[next.run_count++].count = count;
+        }
+        next.log_end = log_end;
+        result = write_index_header(index->fd, &next);
+        if (result == HISTORY_SUCCESS) {
+            *header = next;
+            if (count > 0) index->size = offset + count * sizeof(struct history_index_entry);
+        }
+    }
+
+    if (map != NULL) {
+        munmap(map, map_size);
+    }
+
+    // Merged runs leave their old space behind
+    uint64_t live = live_entries(header) * sizeof(struct history_index_entry);
+    if (result == HISTORY_SUCCESS && index->size - HISTORY_DATA_OFFSET > 2 * live + HISTORY_COMPACT_SLACK) {
+        map = mmap(NULL, index->size, PROT_READ, MAP_SHARED, index->fd, 0);
+        if (map == MAP_FAILED) {
+            return HISTORY_EREAD;
+        }
+        map_size = index->size;
+        result = compact_index(index_path, index, map);
+        munmap(map, map_size);
+    }
+
+    return result;
+}
+
+static int collect_entry(uint64_t offset, const struct history_entry *entry, void *arg) {
+    struct history_entries *entries = arg;
+    if (entries->count == entries->capacity) {
+        size_t capacity = entries->capacity == 0 ? 1024 : entries->capacity * 2;
+        struct history_index_entry *data = realloc(entries->data, capacity * sizeof(struct history_index_entry));
+        if (data == NULL) {
+            return HISTORY_ENOMEM;
+        }
+        entries->data = data;
+        entries->capacity = capacity;
+    }
+
+    entries->data[entries->count++] = (struct history_index_entry) {.uid = entry->uid, .offset = offset};
+    return HISTORY_SUCCESS;
+}
+
+/*
+ * Appends data to the log and indexes it, along with anything a previous
+ * writer left unindexed. A torn record at the end of the log (a writer that
+ * died mid append) is cut off first. Must be called with the log locked.
+ */
+static int append_locked(int log_fd, const char *index_path, const uint8_t *data, size_t size, uint64_t *indexed) {
+    off_t log_size = lseek(log_fd, 0, SEEK_END);
+    if (log_size < 0) {
+        return HISTORY_EREAD;
+    }
+    uint64_t end = log_size;
+
+    // A missing or unusable index is rebuilt from the whole log
+    struct history_index index = {.fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+    if (index.fd < 0) {
+        return HISTORY_EOPEN;
+    }
+    if (!read_index_header(index.fd, &index.header, &index.size) || index.header.log_end > end) {
+        empty_index_header(&index.header);
+        if (ftruncate(index.fd, HISTORY_DATA_OFFSET) != 0) {
+            close(index.fd);
+            return HISTORY_EWRITE;
+        }
+        index.size = HISTORY_DATA_OFFSET;
+    }
+
+    struct history_entries entries = {};
+    uint64_t valid_end;
+    int result = scan_log(log_fd, index.header.log_end, end, &valid_end, collect_entry, &entries);
+    if (result == HISTORY_SUCCESS && valid_end < end) {
+        lwarning("Dropping %" PRIu64 " bytes of a torn record at the end of the history log.\n", end - valid_end);
+        if (ftruncate(log_fd, (off_t) valid_end) != 0) result = HISTORY_EWRITE;
+        end = valid_end;
+    }
+
+    if (result == HISTORY_SUCCESS && size > 0) {
+        result = write_all(log_fd, data, size, end);
+        if (result == HISTORY_SUCCESS && fdatasync(log_fd) != 0) result = HISTORY_EWRITE;
+        if (result == HISTORY_SUCCESS) result = scan_log(log_fd, end, end + size, &valid_end, collect_entry, &entries);
+        if (result != HISTORY_SUCCESS) {
+            // Nothing half written stays behind
+            if (ftruncate(log_fd, (off_t) end) != 0) lwarning("Cannot truncate the history log.\n");
+        } else {
+            end += size;
+        }
+    }
+
+    if (result == HISTORY_SUCCESS) {
+        qsort(entries.data, entries.count, sizeof(struct history_index_entry), compare_index_entries);
+        result = update_index(index_path, &index, &entries, end);
+    }
+    if (indexed != NULL) {
+        *indexed = entries.count;
+    }
+
+    free(entries.data);
+    close(index.fd);
+    return result;
+}
+
+static int append_batch(struct history *history, const uint8_t *data, size_t size) {
+    if (flock(history->log_fd, LOCK_EX) != 0) {
+        return HISTORY_ELOCK;
+    }
+    int result = append_locked(history->log_fd, history->index_path, data, size, NULL);
+    flock(history->log_fd, LOCK_UN);
+    return result;
+}
+
+static void set_error(struct history *history, int result) {
+    pthread_mutex_lock(&history->lock);
+    if (history->error == HISTORY_SUCCESS) {
+        history->error = result;
+    }
+    pthread_mutex_unlock(&history->lock);
+}
+
+static void *history_main(void *arg) {
+    struct history *history = arg;
+
+    pthread_mutex_lock(&history->lock);
+    for (;;) {
+        while (history->pending_size == 0 && !history->stopping) {
+            pthread_cond_wait(&history->cond, &history->lock);
+        }
+        if (history->pending_size == 0) {
+            break;
+        }
+
+        // Let the batch fill up, a closing tool flushes right away
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += HISTORY_BATCH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+        }
+        while (!history->stopping && history->pending_size < HISTORY_BATCH_BYTES) {
+            if (pthread_cond_timedwait(&history->cond, &history->lock, &deadline) == ETIMEDOUT) break;
+        }
+
+        // Swap buffers, tools keep appending to the other one
+        uint8_t *batch = history->pending;
+        size_t batch_size = history->pending_size;
+        size_t batch_capacity = history->pending_capacity;
+        history->pending = history->batch;
+        history->pending_capacity = history->batch_capacity;
+        history->pending_size = 0;
+        history->batch = batch;
+        history->batch_capacity = batch_capacity;
+        pthread_mutex_unlock(&history->lock);
+
+        int result = append_batch(history, batch, batch_size);
+        if (result != HISTORY_SUCCESS) {
+            lwarning("Cannot append to \"%s\": %s.\n", history->path, history_strerror(result));
+            set_error(history, result);
+        }
+        history->batches++;
+
+        pthread_mutex_lock(&history->lock);
+    }
+    pthread_mutex_unlock(&history->lock);
+
+    return NULL;
+}
+
+static void free_history(struct history *history) {
+    if (history->log_fd >= 0) {
+        close(history->log_fd);
+    }
+    free(history->path);
+    free(history->index_path);
+    free(history->pending);
+    free(history->batch);
+    history->log_fd = -1;
+    history->path = NULL;
+    history->index_path = NULL;
+    history->pending = NULL;
+    history->batch = NULL;
+}
+
+int history_open(struct history *history, const char *path) {
+    memset(history, 0, sizeof(struct history));
+    history->log_fd = -1;
+
+    history->path = strdup(path);
+    history->index_path = malloc(strlen(path) + sizeof(HISTORY_INDEX_SUFFIX));
+    if (history->path == NULL || history->index_path == NULL) {
+        free_history(history);
+        return HISTORY_ENOMEM;
+    }
+    sprintf(history->index_path, "%s%s", path, HISTORY_INDEX_SUFFIX);
+
+    history->log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (history->log_fd < 0) {
+        free_history(history);
+        return HISTORY_EOPEN;
+    }
+    if (flock(history->log_fd, LOCK_EX) != 0) {
+        free_history(history);
+        return HISTORY_ELOCK;
+    }
+    int result = check_log_header(history->log_fd, true);
+    flock(history->log_fd, LOCK_UN);
+    if (result != HISTORY_SUCCESS) {
+        free_history(history);
+        return result;
+    }
+
+    // Same clock as the batch deadline
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&history->cond, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&history->lock, NULL);
+
+    if (pthread_create(&history->thread, NULL, history_main, history) != 0) {
+        pthread_cond_destroy(&history->cond);
+        pthread_mutex_destroy(&history->lock);
+        free_history(history);
+        return HISTORY_ETHREAD;
+    }
+
+    return HISTORY_SUCCESS;
+}
+
+// Only copies the record, the writer thread does the I/O
+void history_record(struct history *history, const struct history_entry *entry) {
+    uint8_t record[HISTORY_MAX_RECORD_SIZE];
+    size_t size = serialize_entry(entry, record);
+
+    pthread_mutex_lock(&history->lock);
+    if (history->pending_size + size > history->pending_capacity) {
+        size_t capacity = history->pending_capacity == 0 ? HISTORY_BATCH_BYTES : history->pending_capacity * 2;
+        while (capacity < history->pending_size + size) capacity *= 2;
+        uint8_t *pending = realloc(history->pending, capacity);
+        if (pending == NULL) {
+            if (history->error == HISTORY_SUCCESS) history->error = HISTORY_ENOMEM;
+            pthread_mutex_unlock(&history->lock);
+            return;
+        }
+        history->pending = pending;
+        history->pending_capacity = capacity;
+    }
+
+    bool wake = history->pending_size == 0 || history->pending_size + size >= HISTORY_BATCH_BYTES;
+    memcpy(history->pending + history->pending_size, record, size);
+    history->pending_size += size;
+    if (wake) {
+        pthread_cond_signal(&history->cond);
+    }
+    pthread_mutex_unlock(&history->lock);
+}
+
+// Flushes every recorded entry, returns the first error of the writer
+int history_close(struct history *history) {
+    if (history->log_fd < 0) {
+        return HISTORY_SUCCESS;
+    }
+
+    pthread_mutex_lock(&history->lock);
+    history->stopping = true;
+    pthread_cond_signal(&history->cond);
+    pthread_mutex_unlock(&history->lock);
+    pthread_join(history->thread, NULL);
+
+    int result = history->error;
+    lverbose("History: %" PRIu64 " batches appended to \"%s\".\n", history->batches, history->path);
+    pthread_cond_destroy(&history->cond);
+    pthread_mutex_destroy(&history->lock);
+    free_history(history);
+    return result;
+}
+
+struct query_state {
+    uint64_t uid;
+    struct history_entries offsets;
+    size_t scanned;
+};
+
+static int collect_offset(uint64_t offset, const struct history_entry *entry, void *arg) {
+    struct query_state *state = arg;
+    state->scanned++;
+    return entry->uid == state->uid ? collect_entry(offset, entry, &state->offsets) : HISTORY_SUCCESS;
+}
+
+// Offsets of uid in the runs of the index, false when there is no usable index
+static bool query_index(const char *index_path, uint64_t log_size, struct query_state *state, uint64_t *log_end) {
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct history_index_header header;
+    uint64_t size;
+    if (!read_index_header(fd, &header, &size) || header.log_end > log_size) {
+        close(fd);
+        return false;
+    }
+    const uint8_t *map = size > HISTORY_DATA_OFFSET ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    // One binary search per run
+    for (uint32_t i = 0; i < header.run_count; i++) {
+        const struct history_index_entry *run = (const struct history_index_entry *) (map + header.runs[i].offset);
+        size_t low = 0, high = header.runs[i].count;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (run[middle].uid < state->uid) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        for (size_t j = low; j < header.runs[i].count && run[j].uid == state->uid; j++) {
+            struct history_entry entry = {.uid = state->uid};
+            if (collect_entry(run[j].offset, &entry, &state->offsets) != HISTORY_SUCCESS) {
+                munmap((void *) map, size);
+                return false;
+            }
+        }
+    }
+
+    if (map != NULL) {
+        munmap((void *) map, size);
+    }
+    *log_end = header.log_end;
+    return true;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const struct history_index_entry *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Calls back every record of uid, oldest first. Records the index does not
+ * cover yet are scanned, unindexed tells how many there were.
+ */
+int history_query(const char *path, uint64_t uid, history_entry_fn callback, void *arg, size_t *unindexed) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return HISTORY_EOPEN;
+    }
+    int result = check_log_header(fd, false);
+    struct stat st;
+    if (result == HISTORY_SUCCESS && fstat(fd, &st) != 0) {
+        result = HISTORY_EREAD;
+    }
+    if (result != HISTORY_SUCCESS) {
+        close(fd);
+        return result;
+    }
+
+    char index_path[strlen(path) + sizeof(HISTORY_INDEX_SUFFIX)];
+    sprintf(index_path, "%s%s", path, HISTORY_INDEX_SUFFIX);
+
+    struct query_state state = {.uid = uid};
+    uint64_t log_end = HISTORY_LOG_HEADER_SIZE;
+    if (!query_index(index_path, st.st_size, &state, &log_end)) {
+        state.offsets.count = 0;
+        log_end = HISTORY_LOG_HEADER_SIZE;
+    }
+
+    // A torn record at the end is left for the next writer to cut off
+    uint64_t valid_end;
+    result = scan_log(fd, log_end, st.st_size, &valid_end, collect_offset, &state);
+    if (unindexed != NULL) {
+        *unindexed = state.scanned;
+    }
+
+    struct history_entry *entry = malloc(sizeof(struct history_entry));
+    uint8_t *record = malloc(HISTORY_MAX_RECORD_SIZE);
+    if (result == HISTORY_SUCCESS && (entry == NULL || record == NULL)) {
+        result = HISTORY_ENOMEM;
+    }
+
+    qsort(state.offsets.data, state.offsets.count, sizeof(struct history_index_entry), compare_offsets);
+    for (size_t i = 0; i < state.offsets.count && result == HISTORY_SUCCESS; i++) {
+        uint64_t offset = state.offsets.data[i].offset;
+        ssize_t read_size = pread(fd, record, HISTORY_MAX_RECORD_SIZE, (off_t) offset);
+        size_t size;
+        if (read_size < 0) {
+            result = HISTORY_EREAD;
+        } else if (parse_record(record, read_size, entry, &size) != HISTORY_SUCCESS || entry->uid != uid) {
+            result = HISTORY_EFORMAT;
+        } else {
+            entry->offset = offset;
+            callback(entry, arg);
+        }
+    }
+
+    free(entry);
+    free(record);
+    free(state.offsets.data);
+    close(fd);
+    return result;
+}
+
+// Drops the index and indexes the whole log again as a single run
+int history_reindex(const char *path, uint64_t *records) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return HISTORY_EOPEN;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return HISTORY_ELOCK;
+    }
+
+    char index_path[strlen(path) + sizeof(HISTORY_INDEX_SUFFIX)];
+    sprintf(index_path, "%s%s", path, HISTORY_INDEX_SUFFIX);
+
+    int result = check_log_header(fd, false);
+    if (result == HISTORY_SUCCESS && unlink(index_path) != 0 && errno != ENOENT) {
+        result = HISTORY_EWRITE;
+    }
+    if (result == HISTORY_SUCCESS) {
+        result = append_locked(fd, index_path, NULL, 0, records);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    return result;
+}
+
+const char *history_tool_name(uint8_t tool) {
+    switch (tool) {
+        case HISTORY_TOOL_RESTORE:
+            return "restore";
+        case HISTORY_TOOL_RESET:
+            return "reset";
+        case HISTORY_TOOL_WRITE:
+            return "write";
+        default:
+            return "unknown";
+    }
+}
+
+const char *history_outcome_name(uint8_t outcome) {
+    switch (outcome) {
+        case HISTORY_OUTCOME_DONE:
+            return "done";
+        case HISTORY_OUTCOME_FAILED:
+            return "failed";
+        case HISTORY_OUTCOME_CANCELLED:
+            return "cancelled";
+        case HISTORY_OUTCOME_INCOMPLETE:
+            return "incomplete";
+        default:
+            return "unknown";
+    }
+}
+
+const char *history_strerror(int result) {
+    switch (result) {
+        case HISTORY_SUCCESS:
+            return "success";
+        case HISTORY_EOPEN:
+            return "cannot open file";
+        case HISTORY_EREAD:
+            return "error encountered while reading file";
+        case HISTORY_EWRITE:
+            return "cannot write file";
+        case HISTORY_EFORMAT:
+            return "not a history log";
+        case HISTORY_ENOMEM:
+            return "out of memory";
+        case HISTORY_ELOCK:
+            return "cannot lock file";
+        case HISTORY_ETHREAD:
+            return "cannot start writer thread";
+        default:
+            return "unknown error";
+    }
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_HISTORY_H__
+#define __NFC_SRIX_HISTORY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <nfc/nfc.h>
+#include "readback.h"
+
+/*
+ * Write history, one append-only log per site. Every integer is little endian:
+ *
+ *   header  "SRIXHLG1", version
+ *   record  size, CRC32C of the rest, timestamp, UID, tool, outcome, reader,
+ *           then for every written block: block, read back status, value
+ *           before, value written, value read back
+ *
+ * Records are appended in batches by a background thread, tools only copy
+ * them into memory. Appends hold an exclusive flock() on the log, so several
+ * tools can share one.
+ *
+ * The UID index lives next to the log ("<log>.idx") and is mapped as is, so
+ * in host byte order like the fingerprint index. It is a short list of
+ * sorted runs of (UID, record offset) pairs: every batch adds a run and
+ * merges it with the newer runs until each run is more than twice the size
+ * of the next one, so there are never more than log2(n) of them. A query is
+ * one binary search per run. Runs are only ever appended and the list lives
+ * in two header slots written alternately, so a crash keeps the previous
+ * list. The index can always be rebuilt from the log: records past the part
+ * it covers are indexed by the next append, or scanned by queries.
+ */
+
+/* Macros */
+#define HISTORY_LOG_MAGIC "SRIXHLG1"
+#define HISTORY_INDEX_MAGIC "SRIXHIX1"
+#define HISTORY_VERSION 1
+#define HISTORY_BYTE_ORDER 0x01020304
+#define HISTORY_INDEX_SUFFIX ".idx"
+#define HISTORY_LOG_HEADER_SIZE 16
+#define HISTORY_RECORD_HEADER_SIZE 28
+#define HISTORY_BLOCK_SIZE 14
+#define HISTORY_READER_SIZE 64
+#define HISTORY_MAX_BLOCKS 128
+#define HISTORY_MAX_RECORD_SIZE (HISTORY_RECORD_HEADER_SIZE + HISTORY_READER_SIZE + HISTORY_MAX_BLOCKS * HISTORY_BLOCK_SIZE)
+#define HISTORY_MAX_RUNS 64
+#define HISTORY_INDEX_SLOT_SIZE 4096 // Two header slots, then the runs
+#define HISTORY_BATCH_INTERVAL_MS 200
+#define HISTORY_BATCH_BYTES (256 * 1024)
+#define HISTORY_SCAN_BUFFER_SIZE (1024 * 1024)
+#define HISTORY_COMPACT_SLACK (1024 * 1024) // Dead index bytes tolerated on top of the live ones
+
+/* Tools */
+#define HISTORY_TOOL_RESTORE 1
+#define HISTORY_TOOL_RESET 2
+#define HISTORY_TOOL_WRITE 3 // Single block, srix-shell
+
+/* Outcomes */
+#define HISTORY_OUTCOME_DONE 0
+#define HISTORY_OUTCOME_FAILED 1     // Blocks still differ after the retries
+#define HISTORY_OUTCOME_CANCELLED 2  // Deadline or signal during the writes
+#define HISTORY_OUTCOME_INCOMPLETE 3 // Blocks that cannot be written were skipped
+
+/* Return values */
+#define HISTORY_SUCCESS 0
+#define HISTORY_EOPEN -1
+#define HISTORY_EREAD -2
+#define HISTORY_EWRITE -3
+#define HISTORY_EFORMAT -4
+#define HISTORY_ENOMEM -5
+#define HISTORY_ELOCK -6
+#define HISTORY_ETHREAD -7
+
+struct history_block {
+    uint8_t block;
+    uint8_t status;     // READBACK_*
+    uint32_t before;    // Every value in storage order, as srix_image_block()
+    uint32_t written;
+    uint32_t read_back; // Only meaningful for READBACK_PASS and READBACK_MISMATCH
+};
+
+struct history_entry {
+    uint64_t offset; // In the log, set by queries
+    int64_t timestamp_us;
+    uint64_t uid;
+    uint8_t tool;
+    uint8_t outcome;
+    char reader[HISTORY_READER_SIZE];
+    uint8_t block_count;
+    struct history_block blocks[HISTORY_MAX_BLOCKS];
+};
+
+struct history_run {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct history_index_entry {
+    uint64_t uid;
+    uint64_t offset;
+};
+
+struct history_index_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint64_t generation;
+    uint64_t log_end; // Log bytes covered by the runs
+    uint32_t run_count;
+    uint32_t reserved;
+    struct history_run runs[HISTORY_MAX_RUNS];
+    uint32_t crc; // CRC32C of everything before it
+};
+
+struct history {
+    char *path;
+    char *index_path;
+    int log_fd;
+
+    // Records waiting for the writer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint8_t *pending;
+    size_t pending_size;
+    size_t pending_capacity;
+    bool stopping;
+
+    int error; // First error, returned by history_close()
+
+    // Writer only
+    uint8_t *batch;
+    size_t batch_capacity;
+    uint64_t batches;
+};
+
+typedef void (*history_entry_fn)(const struct history_entry *entry, void *arg);
+
+/* Entries */
+void history_entry_init(struct history_entry *entry, uint8_t tool, uint64_t uid, const char *reader);
+void history_entry_add_write(struct history_entry *entry, const struct srix_write *write, uint32_t before);
+
+/* Writer */
+int history_open(struct history *history, const char *path);
+void history_record(struct history *history, const struct history_entry *entry);
+int history_close(struct history *history);
+
+/* Queries */
+int history_query(const char *path, uint64_t uid, history_entry_fn callback, void *arg, size_t *unindexed);
+int history_reindex(const char *path, uint64_t *records);
+const char *history_tool_name(uint8_t tool);
+const char *history_outcome_name(uint8_t outcome);
+const char *history_strerror(int result);
+
+#endif // __NFC_SRIX_HISTORY_H__
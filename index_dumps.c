@@ -0,0 +1,238 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "dump_utils.h"
+#include "corpus.h"
+#include "fingerprint.h"
+
+/* Macros */
+#define INDEX_DEFAULT_TOP 10
+
+struct index_result {
+    int load_result;
+    struct fingerprint fingerprint;
+};
+
+struct index_context {
+    uint8_t eeprom_blocks;
+    struct index_result *results;
+    struct fingerprint_writer writer;
+    int write_result;
+    size_t errors;
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s <index.sfp> [dump.bin|dir]... [-h] [-v] [-q dump.bin] [-k count] [-x] [-j threads] [-t x4k|512]\n", executable);
+    printf("\nNecessary arguments:\n");
+    printf("  <index.sfp>     fingerprint index, rebuilt when dumps are given\n");
+    printf("  [dump.bin|dir]  dumps to index, directories are walked recursively\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -q dump.bin  print the dumps of the index most similar to this one\n");
+    printf("  -k count     number of similar dumps to print [default: %d]\n", INDEX_DEFAULT_TOP);
+    printf("  -x           compare against every dump instead of the LSH candidates\n");
+    printf("  -j threads   number of worker threads [default: number of CPUs]\n");
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static void index_process(const char *path, size_t slot, unsigned int worker, void *arg) {
+    struct index_context *context = arg;
+    struct index_result *result = &context->results[slot];
+
+    struct srix_image image;
+    srix_image_init(&image, context->eeprom_blocks);
+    result->load_result = srix_image_load(&image, path, NULL);
+    if (result->load_result == DUMP_SUCCESS) {
+        fingerprint_compute(&result->fingerprint, &image);
+    }
+}
+
+// Entries are written in walk order
+static void index_chunk_done(char *const *paths, size_t count, void *arg) {
+    struct index_context *context = arg;
+
+    for (size_t i = 0; i < count && context->write_result == FINGERPRINT_SUCCESS; i++) {
+        struct index_result *result = &context->results[i];
+        if (result->load_result != DUMP_SUCCESS) {
+            context->errors++;
+            lverbose("%s: %s\n", paths[i], srix_dump_strerror(result->load_result));
+            continue;
+        }
+
+        context->write_result = fingerprint_writer_add(&context->writer, &result->fingerprint, paths[i]);
+    }
+}
+
+static int build_index(const char *index_path, char *const inputs[], int num_inputs, unsigned int threads, uint8_t eeprom_blocks) {
+    size_t chunk_size = CORPUS_DEFAULT_CHUNK_SIZE;
+    struct index_context *context = calloc(1, sizeof(struct index_context));
+    if (context == NULL || (context->results = malloc(sizeof(struct index_result) * chunk_size)) == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        return 1;
+    }
+    context->eeprom_blocks = eeprom_blocks;
+
+    int open_result = fingerprint_writer_open(&context->writer, index_path);
+    if (open_result != FINGERPRINT_SUCCESS) {
+        lerror("Cannot create \"%s\": %s.\n", index_path, fingerprint_strerror(open_result));
+        return 1;
+    }
+
+    uint64_t start = now_us();
+    struct corpus_job job = {
+            .threads = threads,
+            .chunk_size = chunk_size,
+            .process = index_process,
+            .chunk_done = index_chunk_done,
+            .arg = context,
+    };
+    size_t total = corpus_run(&job, inputs, num_inputs);
+
+    uint64_t count = context->writer.count;
+    int close_result = fingerprint_writer_close(&context->writer);
+    if (context->write_result == FINGERPRINT_SUCCESS) {
+        context->write_result = close_result;
+    }
+    if (context->write_result != FINGERPRINT_SUCCESS) {
+        lerror("Cannot write \"%s\": %s.\n", index_path, fingerprint_strerror(context->write_result));
+        return 1;
+    }
+
+    log_flush();
+    printf("Indexed %" PRIu64 " of %zu dumps (%zu unreadable) in %.3f s.\n", count, total, context->errors, (double) (now_us() - start) / 1e6);
+    return 0;
+}
+
+static int query_index(const char *index_path, const char *dump_path, size_t top, bool exhaustive, uint8_t eeprom_blocks) {
+    struct srix_image image;
+    srix_image_init(&image, eeprom_blocks);
+    int load_result = srix_image_load(&image, dump_path, NULL);
+    if (load_result != DUMP_SUCCESS) {
+        lerror("Cannot load \"%s\": %s.\n", dump_path, srix_dump_strerror(load_result));
+        return 1;
+    }
+
+    struct fingerprint query;
+    fingerprint_compute(&query, &image);
+
+    struct fingerprint_index index;
+    int open_result = fingerprint_index_open(&index, index_path);
+    if (open_result != FINGERPRINT_SUCCESS) {
+        lerror("Cannot open \"%s\": %s.\n", index_path, fingerprint_strerror(open_result));
+        return 1;
+    }
+
+    struct fingerprint_match *matches = malloc(sizeof(struct fingerprint_match) * (top > 0 ? top : 1));
+    if (matches == NULL) {
+        lerror("Out of memory.\n");
+        return 1;
+    }
+
+    uint64_t start = now_us();
+    size_t candidates = 0;
+    size_t found = fingerprint_index_query(&index, &query, matches, top, exhaustive, &candidates);
+    lverbose("Compared %zu of %" PRIu64 " dumps in %" PRIu64 " us.\n", candidates, index.header->count, now_us() - start);
+    if (query.distinct == 0) {
+        lwarning("\"%s\" has only erased or zeroed data blocks.\n", dump_path);
+    }
+
+    log_flush();
+    printf("Dumps similar to \"%s\" (%u data blocks in use): %zu\n", dump_path, query.distinct, found);
+    for (size_t i = 0; i < found; i++) {
+        printf("%s %.3f %3u identical blocks  %s\n", i == found - 1 ? "└──" : "├──", matches[i].similarity, matches[i].identical,
+                fingerprint_index_path(&index, matches[i].entry));
+    }
+
+    free(matches);
+    fingerprint_index_close(&index);
+    return 0;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    // Options
+    unsigned int threads = 0;
+    uint8_t eeprom_blocks = SRIX4K_EEPROM_BLOCKS;
+    char *query_path = NULL;
+    size_t top = INDEX_DEFAULT_TOP;
+    bool exhaustive = false;
+
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hvq:k:xj:t:")) != -1) {
+        switch (opt) {
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'q':
+                query_path = optarg;
+                break;
+            case 'k':
+                top = strtoul(optarg, NULL, 10);
+                break;
+            case 'x':
+                exhaustive = true;
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 1 || (query_path == NULL && (argc - optind) < 2)) {
+        lerror("You need to specify <index.sfp> and either dumps to index or -q.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    // Build first, so one run can index and query
+    int result = 0;
+    if ((argc - optind) > 1) {
+        result = build_index(argv[optind], argv + optind + 1, argc - optind - 1, threads, eeprom_blocks);
+    }
+    if (result == 0 && query_path != NULL) {
+        result = query_index(argv[optind], query_path, top, exhaustive, eeprom_blocks);
+    }
+
+    return result;
+}
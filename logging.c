@@ -15,13 +15,44 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "logging.h"
 
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+
+struct log_slot {
+    atomic_size_t sequence;
+    enum log_level level;
+    struct timespec timestamp;
+    int length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
 bool verbose_status = false;
 int verbosity_level = 0;
 
+static bool timestamps_enabled = false;
+
+// Ring buffer (bounded MPMC queue, producers never block)
+static struct log_slot ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;
+static atomic_uint_fast64_t dropped_messages;
+static uint64_t reported_dropped_messages;
+
+// Flusher
+static pthread_t flusher_thread;
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool flusher_running;
+
 void set_verbose(bool setting) {
     verbose_status = setting;
 }
@@ -30,6 +61,201 @@ void set_verbosity(int level) {
     verbosity_level = level;
 }
 
+void set_log_timestamps(bool setting) {
+    timestamps_enabled = setting;
+}
+
+uint64_t log_dropped_count(void) {
+    return atomic_load(&dropped_messages);
+}
+
+static void write_message(enum log_level level, const struct timespec *timestamp, const char *text, int length) {
+    FILE *stream = level <= LOG_LEVEL_WARNING ? stderr : stdout;
+
+    // Build the whole line so it reaches the stream in a single write
+    char line[LOG_MESSAGE_SIZE + 64];
+    int offset = 0;
+
+    if (timestamps_enabled) {
+        struct tm tm;
+        localtime_r(&timestamp->tv_sec, &tm);
+        offset += snprintf(line + offset, sizeof(line) - offset, DIM "[%02d:%02d:%02d.%03ld] " RESET,
+                tm.tm_hour, tm.tm_min, tm.tm_sec, timestamp->tv_nsec / 1000000);
+    }
+
+    if (level == LOG_LEVEL_ERROR) {
+        offset += snprintf(line + offset, sizeof(line) - offset, BOLD RED "ERROR: " RESET);
+    } else if (level == LOG_LEVEL_WARNING) {
+        offset += snprintf(line + offset, sizeof(line) - offset, BOLD YELLOW "WARNING: " RESET);
+    }
+
+    if (length > LOG_MESSAGE_SIZE - 1) {
+        length = LOG_MESSAGE_SIZE - 1;
+    }
+    memcpy(line + offset, text, length);
+    offset += length;
+
+    fwrite(line, 1, offset, stream);
+}
+
+static int format_message(char *text, const char * restrict format, va_list args) {
+    int ret = vsnprintf(text, LOG_MESSAGE_SIZE, format, args);
+
+    // Mark truncated messages
+    if (ret >= LOG_MESSAGE_SIZE) {
+        memcpy(text + LOG_MESSAGE_SIZE - 5, "...\n", 5);
+    }
+
+    return ret;
+}
+
+// Drain every published slot. Must be called with consumer_lock held.
+static void drain_ring(void) {
+    bool wrote_stdout = false;
+    bool wrote_stderr = false;
+
+    for (;;) {
+        struct log_slot *slot = &ring[dequeue_pos & LOG_RING_MASK];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != dequeue_pos + 1) {
+            break;
+        }
+
+        write_message(slot->level, &slot->timestamp, slot->text, slot->length);
+        if (slot->level <= LOG_LEVEL_WARNING) {
+            wrote_stderr = true;
+        } else {
+            wrote_stdout = true;
+        }
+
+        atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        dequeue_pos++;
+    }
+
+    uint64_t dropped = atomic_load(&dropped_messages);
+    if (dropped != reported_dropped_messages) {
+        fprintf(stderr, BOLD YELLOW "WARNING: " RESET "%" PRIu64 " log messages dropped.\n", dropped - reported_dropped_messages);
+        reported_dropped_messages = dropped;
+        wrote_stderr = true;
+    }
+
+    if (wrote_stdout) fflush(stdout);
+    if (wrote_stderr) fflush(stderr);
+}
+
+static void *flusher_main(void *arg) {
+    (void) arg;
+
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_US * 1000L};
+    while (atomic_load(&flusher_running)) {
+        pthread_mutex_lock(&consumer_lock);
+        drain_ring();
+        pthread_mutex_unlock(&consumer_lock);
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+void log_start(void) {
+    if (atomic_load(&flusher_running)) {
+        return;
+    }
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+
+    atomic_store(&flusher_running, true);
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0) {
+        atomic_store(&flusher_running, false);
+        return;
+    }
+
+    // Tools exit() from everywhere, make sure nothing is lost
+    static bool registered = false;
+    if (!registered) {
+        atexit(log_stop);
+        registered = true;
+    }
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&flusher_running, false)) {
+        return;
+    }
+
+    pthread_join(flusher_thread, NULL);
+    log_flush();
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&consumer_lock);
+    drain_ring();
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+int vllog(enum log_level level, const char * restrict format, va_list args) {
+    struct timespec timestamp = {};
+    if (timestamps_enabled) {
+        clock_gettime(CLOCK_REALTIME, &timestamp);
+    }
+
+    // Synchronous path
+    if (!atomic_load_explicit(&flusher_running, memory_order_relaxed)) {
+        char text[LOG_MESSAGE_SIZE];
+        int ret = format_message(text, format, args);
+        if (ret < 0) {
+            return ret;
+        }
+
+        write_message(level, &timestamp, text, ret);
+        return ret;
+    }
+
+    // Claim a slot
+    struct log_slot *slot;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        slot = &ring[pos & LOG_RING_MASK];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring is full
+            atomic_fetch_add_explicit(&dropped_messages, 1, memory_order_relaxed);
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    // Fill and publish
+    int ret = format_message(slot->text, format, args);
+    slot->level = level;
+    slot->timestamp = timestamp;
+    slot->length = ret < 0 ? 0 : ret;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+    return ret;
+}
+
+int llog(enum log_level level, const char * restrict format, ...) {
+    va_list args;
+    va_start(args, format);
+    int ret = vllog(level, format, args);
+    va_end(args);
+
+    return ret;
+}
+
+#ifndef LOGGING_NO_VERBOSE
 int lverbose(const char * restrict format, ...) {
     if (!verbose_status) {
         return 0;
@@ -37,7 +263,7 @@ int lverbose(const char * restrict format, ...) {
 
     va_list args;
     va_start(args, format);
-    int ret = vprintf(format, args);
+    int ret = vllog(LOG_LEVEL_VERBOSE, format, args);
     va_end(args);
 
     return ret;
@@ -50,36 +276,32 @@ int lverbose_lvl(int level, const char * restrict format, ...) {
 
     va_list args;
     va_start(args, format);
-    int ret = vprintf(format, args);
+    int ret = vllog(LOG_LEVEL_VERBOSE, format, args);
     va_end(args);
 
     return ret;
 }
+#endif
 
 int lerror(const char * restrict format, ...) {
-    fprintf(stderr, BOLD);
-    fprintf(stderr, RED);
-    fprintf(stderr, "ERROR: ");
-    fprintf(stderr, RESET);
-
     va_list args;
     va_start(args, format);
-    int ret = vfprintf(stderr, format, args);
+    int ret = vllog(LOG_LEVEL_ERROR, format, args);
     va_end(args);
 
+    // Errors are usually followed by exit() or a prompt
+    log_flush();
+
     return ret;
 }
 
 int lwarning(const char * restrict format, ...) {
-    fprintf(stderr, BOLD);
-    fprintf(stderr, YELLOW);
-    fprintf(stderr, "WARNING: ");
-    fprintf(stderr, RESET);
-
     va_list args;
     va_start(args, format);
-    int ret = vfprintf(stderr, format, args);
+    int ret = vllog(LOG_LEVEL_WARNING, format, args);
     va_end(args);
 
+    log_flush();
+
     return ret;
-}
\ No newline at end of file
+}
@@ -17,6 +17,10 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 // Foreground
 #define RED "\033[31m"
 #define GREEN "\033[32m"
@@ -27,13 +31,52 @@
 #define BOLD "\033[1m"
 #define DIM "\033[2m"
 
+// Ring buffer
+#define LOG_RING_SLOTS 256 // Must be a power of two
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_INTERVAL_US 1000
+
+enum log_level {
+    LOG_LEVEL_ERROR,   // stderr, "ERROR: " prefix
+    LOG_LEVEL_WARNING, // stderr, "WARNING: " prefix
+    LOG_LEVEL_INFO,    // stdout
+    LOG_LEVEL_VERBOSE, // stdout, only with set_verbose(true)
+    LOG_LEVEL_FRAME,   // stdout, raw TX/RX frames
+};
+
 extern bool verbose_status;
 extern int verbosity_level;
 void set_verbose(bool);
 void set_verbosity(int);
-int lverbose(const char * restrict, ...);
-int lverbose_lvl(int, const char * restrict, ...);
+void set_log_timestamps(bool);
+
+/*
+ * Messages are formatted by the caller into a lock-free ring buffer and written
+ * out by a background thread started with log_start(). Before log_start() (or
+ * after log_stop()) every message is written synchronously.
+ * When the ring is full new messages are dropped and counted.
+ */
+void log_start(void);
+void log_stop(void);
+void log_flush(void);
+uint64_t log_dropped_count(void);
+
+int llog(enum log_level, const char * restrict, ...);
+int vllog(enum log_level, const char * restrict, va_list);
 int lerror(const char * restrict, ...);
 int lwarning(const char * restrict, ...);
 
+/*
+ * Configure with -DSRIX_VERBOSE_LOGGING=OFF to compile out every verbose call.
+ * Arguments are not evaluated, so they must not have side effects. They stay
+ * in a dead call so they are still referenced and type checked.
+ */
+int lverbose(const char * restrict, ...);
+int lverbose_lvl(int, const char * restrict, ...);
+
+#ifdef LOGGING_NO_VERBOSE
+#define lverbose(...) ((void) (0 && lverbose(__VA_ARGS__)))
+#define lverbose_lvl(...) ((void) (0 && lverbose_lvl(__VA_ARGS__)))
+#endif
+
 #endif // LOGGING_H
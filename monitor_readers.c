@@ -0,0 +1,233 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "telemetry.h"
+
+/* Macros */
+#define TOP_DEFAULT_INTERVAL_MS 1000
+#define TOP_MAX_PROCESSES 64
+#define TOP_SHM_DIR "/dev/shm"
+
+// Counters seen at the previous refresh, for the rates
+struct top_previous {
+    pid_t pid;
+    uint64_t commands[TELEMETRY_MAX_READERS];
+    uint64_t blocks_read[TELEMETRY_MAX_READERS];
+    uint64_t blocks_written[TELEMETRY_MAX_READERS];
+};
+
+struct top_state {
+    struct top_previous previous[TOP_MAX_PROCESSES];
+    size_t previous_count;
+    double interval_s;
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s [pid]... [-h] [-i ms] [-1]\n", executable);
+    printf("\nOptional arguments:\n");
+    printf("  [pid]        processes to watch [default: every tool running]\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -i ms        refresh interval [default: %d]\n", TOP_DEFAULT_INTERVAL_MS);
+    printf("  -1           print once and exit\n");
+}
+
+// Every segment in /dev/shm, stale ones of crashed tools included
+static size_t find_processes(pid_t *pids, size_t max) {
+    DIR *dir = opendir(TOP_SHM_DIR);
+    if (dir == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    size_t prefix_len = strlen(TELEMETRY_NAME_PREFIX);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < max) {
+        if (strncmp(entry->d_name, TELEMETRY_NAME_PREFIX, prefix_len) == 0) {
+            pids[count++] = (pid_t) strtol(entry->d_name + prefix_len, NULL, 10);
+        }
+    }
+    closedir(dir);
+
+    return count;
+}
+
+// Upper bound of the bucket holding the given fraction of the commands
+static uint64_t latency_percentile(const struct telemetry_reader *reader, double fraction) {
+    uint64_t buckets[TELEMETRY_LATENCY_BUCKETS], total = 0;
+    for (int i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++) {
+        buckets[i] = atomic_load_explicit(&reader->latency_us[i], memory_order_relaxed);
+        total += buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t) ((double) total * fraction), seen = 0;
+    for (int i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target || seen == total) {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (TELEMETRY_LATENCY_BUCKETS - 1);
+}
+
+static struct top_previous *previous_of(struct top_state *state, pid_t pid) {
+    for (size_t i = 0; i < state->previous_count; i++) {
+        if (state->previous[i].pid == pid) {
+            return &state->previous[i];
+        }
+    }
+    if (state->previous_count == TOP_MAX_PROCESSES) {
+        return NULL;
+    }
+
+    struct top_previous *previous = &state->previous[state->previous_count++];
+    memset(previous, 0, sizeof(struct top_previous));
+    previous->pid = pid;
+    return previous;
+}
+
+static double rate(uint64_t now, uint64_t *previous, double interval_s) {
+    double value = *previous != 0 && interval_s > 0 ? (double) (now - *previous) / interval_s : 0;
+    *previous = now;
+    return value;
+}
+
+static void print_process(struct top_state *state, const struct telemetry_segment *segment) {
+    bool alive = kill(segment->pid, 0) == 0 || errno != ESRCH;
+    uint64_t uptime = (uint64_t) time(NULL) - segment->started_unix;
+    printf(BOLD "%s" RESET " [%d] up %02" PRIu64 ":%02" PRIu64 ":%02" PRIu64 "%s\n", segment->tool, segment->pid,
+            uptime / 3600, uptime / 60 % 60, uptime % 60, alive ? "" : RED " (exited)" RESET);
+
+    int last = -1;
+    for (int i = 0; i < TELEMETRY_MAX_READERS; i++) {
+        if (atomic_load(&segment->readers[i].in_use)) last = i;
+    }
+    if (last < 0) {
+        printf("└── no reader opened yet\n");
+        return;
+    }
+
+    struct top_previous *previous = previous_of(state, segment->pid);
+    for (int i = 0; i <= last; i++) {
+        const struct telemetry_reader *reader = &segment->readers[i];
+        if (!atomic_load(&reader->in_use)) continue;
+
+        uint64_t commands = atomic_load_explicit(&reader->commands, memory_order_relaxed);
+        uint64_t blocks_read = atomic_load_explicit(&reader->blocks_read, memory_order_relaxed);
+        uint64_t blocks_written = atomic_load_explicit(&reader->blocks_written, memory_order_relaxed);
+        double commands_rate = 0, read_rate = 0, write_rate = 0;
+        if (previous != NULL) {
+            commands_rate = rate(commands, &previous->commands[i], state->interval_s);
+            read_rate = rate(blocks_read, &previous->blocks_read[i], state->interval_s);
+            write_rate = rate(blocks_written, &previous->blocks_written[i], state->interval_s);
+        }
+
+        const char *branch = i == last ? "└──" : "├──";
+        const char *indent = i == last ? "   " : "│  ";
+        printf("%s %s: %s\n", branch, reader->connstring, telemetry_operation_name(atomic_load(&reader->operation)));
+        printf("%s ├── tags: %" PRIu64 ", errors: %" PRIu64 "\n", indent,
+                atomic_load_explicit(&reader->tags, memory_order_relaxed), atomic_load_explicit(&reader->errors, memory_order_relaxed));
+        printf("%s ├── commands: %" PRIu64 " (%.0f/s), blocks read: %" PRIu64 " (%.0f/s), written: %" PRIu64 " (%.0f/s)\n", indent,
+                commands, commands_rate, blocks_read, read_rate, blocks_written, write_rate);
+        printf("%s └── round trip: p50 < %" PRIu64 " us, p99 < %" PRIu64 " us\n", indent,
+                latency_percentile(reader, 0.50), latency_percentile(reader, 0.99));
+    }
+}
+
+static void refresh(struct top_state *state, pid_t *pids, size_t count, bool scan) {
+    pid_t found[TOP_MAX_PROCESSES];
+    if (scan) {
+        count = find_processes(found, TOP_MAX_PROCESSES);
+        pids = found;
+    }
+
+    size_t shown = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct telemetry_segment *segment = telemetry_attach(pids[i]);
+        if (segment == NULL) {
+            if (!scan) printf("[%d] no telemetry\n", pids[i]);
+            continue;
+        }
+
+        print_process(state, segment);
+        telemetry_detach(segment);
+        shown++;
+    }
+
+    if (shown == 0 && scan) {
+        printf("No tool running.\n");
+    }
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    // Options
+    unsigned int interval_ms = TOP_DEFAULT_INTERVAL_MS;
+    bool once = false;
+
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hi:1")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                if (interval_ms == 0) interval_ms = TOP_DEFAULT_INTERVAL_MS;
+                break;
+            case '1':
+                once = true;
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Watched processes
+    size_t count = (size_t) (argc - optind);
+    if (count > TOP_MAX_PROCESSES) count = TOP_MAX_PROCESSES;
+    pid_t pids[TOP_MAX_PROCESSES];
+    for (size_t i = 0; i < count; i++) {
+        pids[i] = (pid_t) strtol(argv[optind + i], NULL, 10);
+    }
+
+    static struct top_state state;
+    state.interval_s = interval_ms / 1000.0;
+    for (;;) {
+        if (!once) printf("\033[H\033[2J");
+        refresh(&state, pids, count, count == 0);
+        fflush(stdout);
+        if (once) break;
+        usleep(interval_ms * 1000u);
+    }
+
+    return 0;
+}
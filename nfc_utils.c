@@ -14,9 +14,15 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
 #include <nfc/nfc.h>
 #include "nfc_utils.h"
 #include "logging.h"
+#include "rf_tuning.h"
+#include "telemetry.h"
 
 const nfc_modulation nmISO14443B = {
         .nmt = NMT_ISO14443B,
@@ -28,19 +34,35 @@ const nfc_modulation nmISO14443B2SR = {
         .nbr = NBR_106,
 };
 
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+#ifndef LOGGING_NO_VERBOSE
+static void log_frame(const char *prefix, const uint8_t *command, size_t num_bytes) {
+    char line[8 + MAX_FRAME_LOG_LEN * 3 + 2];
+    int offset = snprintf(line, sizeof(line), "%s", prefix);
+    for (unsigned int i = 0; i < num_bytes && i < MAX_FRAME_LOG_LEN; i++) {
+        offset += snprintf(line + offset, sizeof(line) - offset, "%02X ", command[i]);
+    }
+    llog(LOG_LEVEL_FRAME, "%s\n", line);
+}
+#endif
+
 void log_command_sent(const uint8_t *command, size_t num_bytes) {
+#ifndef LOGGING_NO_VERBOSE
     if (verbosity_level < 2) {
         return;
     }
 
-    printf("TX >> ");
-    for (unsigned int i = 0; i < num_bytes; i++) {
-        printf("%02X ", command[i]);
-    }
-    printf("\n");
+    log_frame("TX >> ", command, num_bytes);
+#endif
 }
 
 void log_command_received(const uint8_t *command, size_t num_bytes) {
+#ifndef LOGGING_NO_VERBOSE
     if (verbosity_level < 2) {
         return;
     }
@@ -49,17 +71,17 @@ void log_command_received(const uint8_t *command, size_t num_bytes) {
         return;
     }
 
-    printf("RX << ");
-    for (unsigned int i = 0; i < num_bytes; i++) {
-        printf("%02X ", command[i]);
-    }
-    printf("\n");
+    log_frame("RX << ", command, num_bytes);
+#endif
 }
 
 size_t nfc_transceive_bytes(nfc_device *reader, const uint8_t *tx_data, size_t tx_size, uint8_t *rx_data) {
     log_command_sent(tx_data, tx_size);
 
-    size_t rx_size = nfc_initiator_transceive_bytes(reader, tx_data, tx_size, rx_data, sizeof(rx_data), 0);
+    struct telemetry_reader *telemetry = telemetry_command_start(reader, tx_data, tx_size);
+    uint64_t start_us = telemetry != NULL ? now_us() : 0;
+    size_t rx_size = rf_tuning_transceive(reader, tx_data, tx_size, rx_data, sizeof(rx_data));
+    telemetry_command_end(telemetry, tx_data, tx_size, rx_size, telemetry != NULL ? (uint32_t) (now_us() - start_us) : 0);
 
     if (rx_data != NULL) {
         log_command_received(rx_data, rx_size);
@@ -79,6 +101,29 @@ size_t nfc_srix_read_block(nfc_device *reader, uint8_t *rx_data, uint8_t block)
     return nfc_transceive_bytes(reader, cmd, sizeof(cmd), rx_data);
 }
 
+/*
+ * Reads count consecutive blocks into rx_data, 4 bytes each, and returns how
+ * many were read before the first failure.
+ *
+ * SR tags have no multi block read and libnfc only exposes one frame per
+ * nfc_initiator_transceive_bytes(): the PN53x drivers wrap every frame in its
+ * own InDataExchange/InCommunicateThru and there is no public way to chain
+ * several of them in one host round trip. Until a driver offers one, this is
+ * the per block loop, with each answer copied out of a scratch buffer so a
+ * malformed frame never spills into the next block.
+ */
+uint8_t nfc_srix_read_blocks(nfc_device *reader, uint8_t *rx_data, uint8_t start, uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t block_bytes[MAX_RESPONSE_LEN];
+        if (nfc_srix_read_block(reader, block_bytes, start + i) != 4) {
+            return i;
+        }
+        memcpy(rx_data + i * 4, block_bytes, 4);
+    }
+
+    return count;
+}
+
 size_t nfc_srix_write_block(nfc_device *reader, uint8_t *rx_data, uint8_t block, const uint8_t *data) {
     uint8_t cmd[6] = {SR_WRITE_BLOCK_COMMAND};
     cmd[1] = block;
@@ -119,11 +164,28 @@ char *srix_get_block_type(uint8_t block_num) {
     }
 }
 
-uint32_t eeprom_bytes_to_block(uint8_t *dump, uint8_t block) {
-    return (dump[(block*4)] << 24u) + (dump[(block*4)+1] << 16u) + (dump[(block*4)+2] << 8u) + dump[(block*4)+3];
+uint32_t srix_otp_resets_remaining(uint32_t block_6) {
+    return block_6 >> SRIX_OTP_RESETS_SHIFT;
+}
+
+/*
+ * OTP_Lock_Reg is in the upper byte of the system block. A bit set to 0 locks:
+ * b24 -> blocks 07 and 08, b25..b31 -> blocks 09..0F.
+ */
+bool srix_block_is_locked(uint32_t system_block, uint8_t block_num) {
+    if (block_num < 7 || block_num > 15) {
+        return false;
+    }
+
+    uint8_t bit = block_num <= 8 ? 24 : block_num + 16;
+    return ((system_block >> bit) & 1u) == 0;
 }
 
 void close_nfc(nfc_context *context, nfc_device *reader) {
-    if (reader != NULL) nfc_close(reader);
+    if (reader != NULL) {
+        telemetry_close_reader(reader);
+        rf_tuning_close(reader);
+        nfc_close(reader);
+    }
     if (context != NULL) nfc_exit(context);
 }
\ No newline at end of file
@@ -21,6 +21,8 @@
 #define MAX_DEVICE_COUNT 16
 #define MAX_TARGET_COUNT 1
 #define MAX_RESPONSE_LEN 10
+#define MAX_FRAME_LOG_LEN 16
+#define SRIX_READ_BATCH_BLOCKS 8 // Blocks per nfc_srix_read_blocks() call in pipelined loops
 #define SRIX4K_EEPROM_SIZE 512
 #define SRIX4K_EEPROM_BLOCKS 128
 #define SRI512_EEPROM_SIZE 64
@@ -28,6 +30,8 @@
 #define SR_GET_UID_COMMAND 0x0B
 #define SR_READ_BLOCK_COMMAND 0x08
 #define SR_WRITE_BLOCK_COMMAND 0x09
+#define SRIX_SYSTEM_BLOCK 0xFF
+#define SRIX_OTP_RESETS_SHIFT 21
 
 /* Constants */
 extern const nfc_modulation nmISO14443B;
@@ -41,13 +45,15 @@ void log_command_received(const uint8_t *command, size_t num_bytes);
 size_t nfc_transceive_bytes(nfc_device *reader, const uint8_t *tx_data, size_t tx_size, uint8_t *rx_data);
 size_t nfc_srix_get_uid(nfc_device *reader, uint8_t *rx_data);
 size_t nfc_srix_read_block(nfc_device *reader, uint8_t *rx_data, uint8_t block);
+uint8_t nfc_srix_read_blocks(nfc_device *reader, uint8_t *rx_data, uint8_t start, uint8_t count);
 size_t nfc_srix_write_block(nfc_device *reader, uint8_t *rx_data, uint8_t block, const uint8_t *data);
 void nfc_write_block(nfc_device *pnd, uint32_t block, uint8_t block_num);
 void nfc_write_block_bytes(nfc_device *pnd, uint8_t *block, uint8_t block_num);
 
 /* Utilities */
 char *srix_get_block_type(uint8_t block_num);
-uint32_t eeprom_bytes_to_block(uint8_t *dump, uint8_t block);
+uint32_t srix_otp_resets_remaining(uint32_t block_6);
+bool srix_block_is_locked(uint32_t system_block, uint8_t block_num);
 void close_nfc(nfc_context *context, nfc_device *reader);
 
 #endif // __NFC_SRIX_UTILS_H__
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "otp_budget.h"
+
+#define BUDGET_INITIAL_CAPACITY 64
+
+// A missing file is an empty budget
+int otp_budget_load(struct otp_budget *budget, const char *path) {
+    budget->path = path;
+    budget->entries = NULL;
+    budget->count = 0;
+    budget->capacity = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? BUDGET_SUCCESS : BUDGET_EOPEN;
+    }
+
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        uint64_t uid;
+        uint32_t remaining;
+        if (sscanf(line, "%" SCNx64 " %" SCNu32, &uid, &remaining) != 2) {
+            fclose(fp);
+            return BUDGET_EFORMAT;
+        }
+
+        int result = otp_budget_set(budget, uid, remaining);
+        if (result != BUDGET_SUCCESS) {
+            fclose(fp);
+            return result;
+        }
+    }
+    fclose(fp);
+
+    return BUDGET_SUCCESS;
+}
+
+int otp_budget_set(struct otp_budget *budget, uint64_t uid, uint32_t remaining) {
+    for (size_t i = 0; i < budget->count; i++) {
+        if (budget->entries[i].uid == uid) {
+            budget->entries[i].remaining = remaining;
+            return BUDGET_SUCCESS;
+        }
+    }
+
+    if (budget->count == budget->capacity) {
+        size_t capacity = budget->capacity == 0 ? BUDGET_INITIAL_CAPACITY : budget->capacity * 2;
+        struct otp_budget_entry *entries = realloc(budget->entries, capacity * sizeof(struct otp_budget_entry));
+        if (entries == NULL) {
+            return BUDGET_ENOMEM;
+        }
+        budget->entries = entries;
+        budget->capacity = capacity;
+    }
+
+    budget->entries[budget->count].uid = uid;
+    budget->entries[budget->count].remaining = remaining;
+    budget->count++;
+
+    return BUDGET_SUCCESS;
+}
+
+int otp_budget_save(const struct otp_budget *budget) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", budget->path) >= (int) sizeof(tmp_path)) {
+        return BUDGET_EOPEN;
+    }
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return BUDGET_EOPEN;
+    }
+
+    fprintf(fp, "# UID remaining_resets\n");
+    for (size_t i = 0; i < budget->count; i++) {
+        fprintf(fp, "%016" PRIX64 " %" PRIu32 "\n", budget->entries[i].uid, budget->entries[i].remaining);
+    }
+
+    if (ferror(fp) || fclose(fp) != 0) {
+        remove(tmp_path);
+        return BUDGET_EWRITE;
+    }
+
+    if (rename(tmp_path, budget->path) != 0) {
+        remove(tmp_path);
+        return BUDGET_EWRITE;
+    }
+
+    return BUDGET_SUCCESS;
+}
+
+void otp_budget_free(struct otp_budget *budget) {
+    free(budget->entries);
+    budget->entries = NULL;
+    budget->count = 0;
+    budget->capacity = 0;
+}
+
+const char *otp_budget_strerror(int result) {
+    switch (result) {
+        case BUDGET_SUCCESS:
+            return "success";
+        case BUDGET_EOPEN:
+            return "cannot open file";
+        case BUDGET_EFORMAT:
+            return "malformed line";
+        case BUDGET_EWRITE:
+            return "cannot write file";
+        case BUDGET_ENOMEM:
+            return "out of memory";
+        default:
+            return "unknown error";
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_OTP_BUDGET_H__
+#define __NFC_SRIX_OTP_BUDGET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Return values */
+#define BUDGET_SUCCESS 0
+#define BUDGET_EOPEN -1
+#define BUDGET_EFORMAT -2
+#define BUDGET_EWRITE -3
+#define BUDGET_ENOMEM -4
+
+struct otp_budget_entry {
+    uint64_t uid;
+    uint32_t remaining;
+};
+
+/*
+ * Remaining OTP resets of every tag seen, one "UID RESETS" line per tag. The
+ * file is rewritten as a whole and renamed over the old one, so an operator
+ * reading it never sees a half written table.
+ */
+struct otp_budget {
+    const char *path;
+    struct otp_budget_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+int otp_budget_load(struct otp_budget *budget, const char *path);
+int otp_budget_set(struct otp_budget *budget, uint64_t uid, uint32_t remaining);
+int otp_budget_save(const struct otp_budget *budget);
+void otp_budget_free(struct otp_budget *budget);
+const char *otp_budget_strerror(int result);
+
+#endif // __NFC_SRIX_OTP_BUDGET_H__
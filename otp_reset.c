@@ -18,26 +18,344 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <nfc/nfc.h>
 #include <inttypes.h>
 #include "logging.h"
 #include "nfc_utils.h"
+#include "readback.h"
+#include "srix_image.h"
+#include "otp_budget.h"
+#include "reader_pool.h"
+#include "cancel.h"
+#include "command_plan.h"
+#include "dump_utils.h"
+#include "telemetry.h"
+#include "history.h"
+
+/* Macros */
+#define RESET_DEFAULT_RESERVE 1
+
+/* Return values */
+#define RESET_DONE 0
+#define RESET_ALREADY_RESET 1
+#define RESET_REFUSED 2
+#define RESET_DECLINED 3
+#define RESET_EREAD -1
+#define RESET_EWRITE -2
+#define RESET_CANCELLED -3
+
+// Write history, NULL unless --history was given
+static struct history *history = NULL;
 
 static void print_usage(const char *executable) {
-    printf("Usage: %s [-h] [-v] [-y]\n", executable);
+    printf("Usage: %s [-h] [-v] [-y] [-l] [-b budget.txt] [-k resets] [--deadline-ms ms] [--history log] [--plan] [--current current.bin] [--latency-us uid,read,write]\n", executable);
     printf("\nOptions:\n");
     printf("  -h           show this help message\n");
     printf("  -v           enable verbose - print debugging data\n");
     printf("  -y           answer YES to all questions\n");
+    printf("  -l           loop mode - reset every presented tag until every reader has failed\n");
+    printf("  -b budget    record the remaining OTP resets of every tag to this file\n");
+    printf("  -k resets    refuse tags that would be left with less resets [default: %d]\n", RESET_DEFAULT_RESERVE);
+    printf("  --deadline-ms ms\n");
+    printf("               give up on a tag after this long, time spent on questions excluded\n");
+    printf("  --history log\n");
+    printf("               append every write to this history log, see srix-history\n");
+    printf("  --plan       print the RF commands and the expected time as JSON, write nothing\n");
+    printf("  --current current.bin\n");
+    printf("               plan against this dump instead of the tag on the reader\n");
+    printf("  --latency-us uid,read,write\n");
+    printf("               command times used by --plan [default: measured on the tag, or %d,%d,%d]\n",
+            COMMAND_GET_UID_TIME_US, PLAN_READ_TIME_US, PLAN_WRITE_TIME_US);
+}
+
+static bool ask_confirmation(const char *message) {
+    printf("%s\n", message);
+    log_flush();
+    printf("Are you sure? [Y/N] ");
+    cancel_pause();
+    char c = 'n';
+    scanf(" %c", &c);
+    cancel_resume();
+    return c == 'Y' || c == 'y';
+}
+
+static bool read_blocks(nfc_device *reader, struct srix_image *image, uint8_t start, uint8_t count) {
+    uint8_t blocks_read = nfc_srix_read_blocks(reader, srix_image_block_bytes(image, start), start, count);
+    for (uint8_t i = start; i < start + blocks_read; i++) {
+        srix_image_mark_present(image, i);
+        printf("%08X\n", srix_image_block(image, i));
+    }
+
+    // Check for errors
+    if (blocks_read != count) {
+        if (cancel_requested()) return false;
+        lerror("Error while reading block %d.\n", start + blocks_read);
+        return false;
+    }
+
+    return true;
+}
+
+static void record_budget(struct otp_budget *budget, uint64_t uid, uint32_t remaining) {
+    if (budget == NULL) {
+        return;
+    }
+
+    int result = otp_budget_set(budget, uid, remaining);
+    if (result == BUDGET_SUCCESS) {
+        result = otp_budget_save(budget);
+    }
+    if (result != BUDGET_SUCCESS) {
+        lwarning("Cannot update \"%s\": %s.\n", budget->path, otp_budget_strerror(result));
+    }
+}
+
+// Block 06 is already the new value in image, its old one is passed along
+static void record_history(nfc_device *reader, const struct srix_image *image, uint32_t current_block_6, const struct srix_write *writes, size_t writes_count, size_t failed) {
+    if (history == NULL || writes_count == 0) {
+        return;
+    }
+
+    static struct history_entry entry;
+    history_entry_init(&entry, HISTORY_TOOL_RESET, image->uid, nfc_device_get_connstring(reader));
+    for (size_t i = 0; i < writes_count; i++) {
+        history_entry_add_write(&entry, &writes[i], writes[i].block == 0x06 ? current_block_6 : srix_image_block(image, writes[i].block));
+    }
+
+    if (cancel_requested()) {
+        entry.outcome = HISTORY_OUTCOME_CANCELLED;
+    } else if (failed > 0) {
+        entry.outcome = HISTORY_OUTCOME_FAILED;
+    }
+    history_record(history, &entry);
+}
+
+static void close_history(void) {
+    int result = history_close(history);
+    if (result != HISTORY_SUCCESS) {
+        lwarning("History incomplete: %s.\n", history_strerror(result));
+    }
+}
+
+static int cancelled(const struct srix_image *image, const struct srix_write *writes, size_t writes_count) {
+    uint8_t written[6];
+    for (size_t i = 0; i < writes_count; i++) {
+        written[i] = writes[i].block;
+    }
+
+    cancel_print_partial(image, written, writes_count);
+    return RESET_CANCELLED;
+}
+
+static int reset_tag(nfc_device *reader, struct srix_image *image, uint32_t reserve, bool confirm, struct otp_budget *budget) {
+    // Read UID
+    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
+    uint8_t uid_bytes_read = nfc_srix_get_uid(reader, uid_rx_bytes);
+    if (uid_bytes_read != 8) {
+        if (cancel_requested()) return cancelled(image, NULL, 0);
+        lerror("Error while reading UID.\n");
+        lverbose("Received %d bytes instead of 8.\n", uid_bytes_read);
+        return RESET_EREAD;
+    }
+    srix_image_set_uid_bytes(image, uid_rx_bytes);
+    printf("UID: %016" PRIX64 "\n", image->uid);
+
+    // Read OTP area first, a tag that is already reset needs nothing else
+    lverbose("Reading 5 blocks...\n");
+    log_flush();
+    if (!read_blocks(reader, image, 0, 5)) {
+        return cancel_requested() ? cancelled(image, NULL, 0) : RESET_EREAD;
+    }
+
+    // Check if already reset
+    bool otp_already_reset = true;
+    for (uint8_t i = 0; i < 5; i++) {
+        if (srix_image_block(image, i) != 0xFFFFFFFF) otp_already_reset = false;
+    }
+
+    if (otp_already_reset) {
+        printf("OTP area already reset.\n");
+        return RESET_ALREADY_RESET;
+    }
+
+    // Read reset counter
+    if (!read_blocks(reader, image, 0x06, 1)) {
+        return cancel_requested() ? cancelled(image, NULL, 0) : RESET_EREAD;
+    }
+
+    uint32_t block_6 = srix_image_value(image, 6);
+    uint32_t resets_available = srix_otp_resets_remaining(block_6);
+    printf("OTP resets available: %u\n", resets_available);
+
+    // Keep the reserve
+    if (resets_available < reserve + 1) {
+        lerror("Only %u resets left and %u must be kept, skipping tag.\n", resets_available, reserve);
+        record_budget(budget, image->uid, resets_available);
+        return RESET_REFUSED;
+    }
+
+    block_6 -= (1u << SRIX_OTP_RESETS_SHIFT);
+    printf("OTP resets remaining after this operation: %u\n", srix_otp_resets_remaining(block_6));
+
+    // Back to the order it is written in
+    uint32_t current_block_6 = srix_image_block(image, 6);
+    srix_image_set_value(image, 6, block_6);
+    uint32_t new_block_6 = srix_image_block(image, 6);
+
+    // Show differences
+    for (uint8_t i = 0; i < 5; i++) {
+        printf("[%02X] %08X -> FFFFFFFF\n", i, srix_image_block(image, i));
+    }
+    printf("[%02X] %08X -> %08X\n", 0x06, current_block_6, new_block_6);
+
+    // Ask for confirmation
+    if (confirm && !ask_confirmation("This action is irreversible.")) {
+        return cancel_requested() ? cancelled(image, NULL, 0) : RESET_DECLINED;
+    }
+    if (cancel_requested()) {
+        return cancelled(image, NULL, 0);
+    }
+
+    // Write Block 06 first to trigger an Auto erase cycle
+    struct srix_write writes[6];
+    size_t writes_count = 0;
+    nfc_write_block(reader, new_block_6, 0x06);
+    srix_write_init(&writes[writes_count++], 0x06, new_block_6);
+    for (uint8_t i = 0; i < 5; i++) {
+        if (cancel_requested()) {
+            record_history(reader, image, current_block_6, writes, writes_count, writes_count);
+            return cancelled(image, writes, writes_count);
+        }
+        nfc_write_block(reader, 0xFFFFFFFF, i);
+        srix_write_init(&writes[writes_count++], i, 0xFFFFFFFF);
+    }
+
+    // Read back the written blocks
+    size_t failed = srix_readback_verify(reader, writes, 6, READBACK_MAX_RETRIES, READBACK_BASE_DELAY_US);
+    record_history(reader, image, current_block_6, writes, writes_count, failed);
+
+    // Only a verified counter is worth recording
+    if (writes[0].status == READBACK_PASS) {
+        record_budget(budget, image->uid, srix_otp_resets_remaining(block_6));
+    }
+    if (cancel_requested()) {
+        return cancelled(image, writes, writes_count);
+    }
+
+    log_flush();
+    srix_readback_print_summary(writes, 6);
+
+    if (failed > 0) {
+        lerror("%zu blocks could not be written.\n", failed);
+        return RESET_EWRITE;
+    }
+
+    return RESET_DONE;
+}
+
+// Same decisions as reset_tag(), on an image that already holds blocks 00-06
+static int plan_reset(const struct srix_image *image, uint32_t reserve, struct command_plan *plan) {
+    command_plan_init(plan);
+    command_plan_add(plan, COMMAND_GET_UID, 0, 0);
+    for (uint8_t i = 0; i < 5; i++) {
+        command_plan_add(plan, COMMAND_READ, i, 0);
+    }
+
+    bool otp_already_reset = true;
+    for (uint8_t i = 0; i < 5; i++) {
+        if (srix_image_block(image, i) != 0xFFFFFFFF) otp_already_reset = false;
+    }
+    if (otp_already_reset) {
+        return RESET_ALREADY_RESET;
+    }
+
+    command_plan_add(plan, COMMAND_READ, 0x06, 0);
+    uint32_t block_6 = srix_image_value(image, 6);
+    if (srix_otp_resets_remaining(block_6) < reserve + 1) {
+        return RESET_REFUSED;
+    }
+
+    // Block 06 first, then blocks 00-04, then the read back in the same order
+    uint32_t new_block_6 = __builtin_bswap32(block_6 - (1u << SRIX_OTP_RESETS_SHIFT)); // Back to the order it is written in
+
+    command_plan_add(plan, COMMAND_WRITE, 0x06, new_block_6);
+    for (uint8_t i = 0; i < 5; i++) {
+        command_plan_add(plan, COMMAND_WRITE, i, 0xFFFFFFFF);
+    }
+    command_plan_add(plan, COMMAND_VERIFY, 0x06, new_block_6);
+    for (uint8_t i = 0; i < 5; i++) {
+        command_plan_add(plan, COMMAND_VERIFY, i, 0xFFFFFFFF);
+    }
+
+    return RESET_DONE;
+}
+
+static void print_plan(const struct srix_image *image, uint32_t reserve, const struct plan_latency *latency, const char *source) {
+    static struct command_plan plan;
+    const char *outcome;
+
+    switch (plan_reset(image, reserve, &plan)) {
+        case RESET_ALREADY_RESET:
+            outcome = "already_reset";
+            break;
+        case RESET_REFUSED:
+            outcome = "refused";
+            break;
+        default:
+            outcome = "reset";
+            break;
+    }
+
+    log_flush();
+    command_plan_print_json(&plan, latency, source, outcome, NULL);
+}
+
+// Reads blocks 00-06 quietly, stdout is left to the plan
+static bool read_for_plan(nfc_device *reader, struct srix_image *image) {
+    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
+    if (nfc_srix_get_uid(reader, uid_rx_bytes) != 8) {
+        lerror("Error while reading UID.\n");
+        return false;
+    }
+    srix_image_set_uid_bytes(image, uid_rx_bytes);
+
+    uint8_t blocks_read = nfc_srix_read_blocks(reader, image->bytes, 0, 7);
+    for (uint8_t i = 0; i < blocks_read; i++) {
+        srix_image_mark_present(image, i);
+    }
+    if (blocks_read != 7) {
+        lerror("Error while reading block %d.\n", blocks_read);
+        return false;
+    }
+
+    return true;
 }
 
 int main(int argc, char *argv[], char *envp[]) {
     bool skip_confirmation = false;
+    bool loop = false;
+    char *budget_path = NULL;
+    uint32_t reserve = RESET_DEFAULT_RESERVE;
+    unsigned int deadline_ms = 0;
+    bool plan_only = false;
+    char *current_path = NULL;
+    char *history_path = NULL;
+    struct plan_latency latency;
+    plan_latency_init(&latency);
 
     // Parse options
+    static const struct option long_options[] = {
+            {"deadline-ms", required_argument, NULL, 'D'},
+            {"plan", no_argument, NULL, 'P'},
+            {"current", required_argument, NULL, 'C'},
+            {"latency-us", required_argument, NULL, 'L'},
+            {"history", required_argument, NULL, 'W'},
+            {NULL, 0, NULL, 0},
+    };
     int opt = 0;
-    while ((opt = getopt(argc, argv, "hvy")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvylb:k:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'v':
                 set_verbose(true);
@@ -45,6 +363,35 @@ int main(int argc, char *argv[], char *envp[]) {
             case 'y':
                 skip_confirmation = true;
                 break;
+            case 'l':
+                loop = true;
+                break;
+            case 'b':
+                budget_path = optarg;
+                break;
+            case 'k':
+                reserve = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                deadline_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'W':
+                history_path = optarg;
+                break;
+            case 'P':
+                plan_only = true;
+                break;
+            case 'C':
+                current_path = optarg;
+                plan_only = true;
+                break;
+            case 'L':
+                if (!plan_latency_parse(&latency, optarg)) {
+                    lerror("Invalid latencies \"%s\", expected uid,read,write in us.\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
             default:
             case 'h':
                 print_usage(argv[0]);
@@ -52,159 +399,202 @@ int main(int argc, char *argv[], char *envp[]) {
         }
     }
 
-    // Initialize NFC
-    nfc_context *context = NULL;
-    nfc_device *reader = NULL;
-    nfc_init(&context);
-    if (context == NULL) {
-        lerror("Unable to init libnfc. Exiting...\n");
-        exit(1);
-    }
+    // Start background logging
+    log_start();
+    cancel_init();
 
-    // Display libnfc version
-    lverbose("libnfc version: %s\n", nfc_version());
-
-    // Search for readers
-    lverbose("Searching for readers... ");
-    nfc_connstring connstrings[MAX_DEVICE_COUNT] = {};
-    size_t num_readers = nfc_list_devices(context, connstrings, MAX_DEVICE_COUNT);
-    lverbose("found %zu.\n", num_readers);
-
-    // Check if no readers are available
-    if (num_readers == 0) {
-        lerror("No readers available. Exiting...\n");
-        close_nfc(context, reader);
+    // Plans are for one tag
+    if (plan_only && loop) {
+        lerror("--plan cannot be used in loop mode.\n\n");
+        print_usage(argv[0]);
         exit(1);
     }
 
-    // Print out readers
-    for (unsigned int i = 0; i < num_readers; i++) {
-        if (i == num_readers - 1) {
-            lverbose("└── ");
-        } else {
-            lverbose("├── ");
+    // Planning against a dump needs no reader
+    if (current_path != NULL) {
+        struct srix_image *image = srix_image_acquire(SRIX4K_EEPROM_BLOCKS);
+        int load_result = srix_image_load(image, current_path, NULL);
+        if (load_result == DUMP_ESIZE) {
+            srix_image_init(image, SRI512_EEPROM_BLOCKS);
+            load_result = srix_image_load(image, current_path, NULL);
+        }
+        if (load_result != DUMP_SUCCESS) {
+            lerror("Cannot load \"%s\": %s. Exiting...\n", current_path, srix_dump_strerror(load_result));
+            exit(1);
         }
-        lverbose("[%d] %s\n", i, connstrings[i]);
-    }
-    lverbose("Opening %s...\n", connstrings[0]);
-
-    // Open first reader
-    reader = nfc_open(context, connstrings[0]);
-    if (reader == NULL) {
-        lerror("Unable to open NFC device. Exiting...\n");
-        close_nfc(context, reader);
-        exit(1);
-    }
 
-    // Set opened NFC device to initiator mode
-    if (nfc_initiator_init(reader) < 0) {
-        lerror("nfc_initiator_init => %s\n", nfc_strerror(reader));
-        close_nfc(context, reader);
-        exit(1);
+        print_plan(image, reserve, &latency, "dump");
+        exit(0);
     }
 
-    lverbose("NFC reader: %s\n", nfc_device_get_name(reader));
-
-    nfc_target target_key[MAX_TARGET_COUNT];
-
-    /*
-     * This is a known bug from libnfc.
-     * To read ISO14443B2SR you have to initiate first ISO14443B to configure internal registers.
-     *
-     * https://github.com/nfc-tools/libnfc/issues/436#issuecomment-326686914
-     */
-    lverbose("Searching for ISO14443B targets... found %d.\n", nfc_initiator_list_passive_targets(reader, nmISO14443B, target_key, MAX_TARGET_COUNT));
-
-    lverbose("Searching for ISO14443B2SR targets...");
-    int ISO14443B2SR_targets = nfc_initiator_list_passive_targets(reader, nmISO14443B2SR, target_key, MAX_TARGET_COUNT);
-    lverbose(" found %d.\n", ISO14443B2SR_targets);
-
-    // Check for tags
-    if (ISO14443B2SR_targets == 0) {
-        printf("Waiting for tag...\n");
-
-        // Infinite select for tag
-        if (nfc_initiator_select_passive_target(reader, nmISO14443B2SR, NULL, 0, target_key) <= 0) {
-            lerror("nfc_initiator_select_passive_target => %s\n", nfc_strerror(reader));
-            close_nfc(context, reader);
+    // Load budget
+    struct otp_budget budget_table;
+    struct otp_budget *budget = NULL;
+    if (budget_path != NULL) {
+        int load_result = otp_budget_load(&budget_table, budget_path);
+        if (load_result != BUDGET_SUCCESS) {
+            lerror("Cannot load \"%s\": %s. Exiting...\n", budget_path, otp_budget_strerror(load_result));
             exit(1);
         }
+        lverbose("Loaded %zu budget entries.\n", budget_table.count);
+        budget = &budget_table;
     }
 
-    // Read necessary blocks
-    uint32_t otp_blocks[6] = {};
-    lverbose("Reading 6 blocks...\n");
-    for (uint8_t i = 0; i < 6; i++) {
-        // Skip block 0x05
-        if (i == 5) i++;
-
-        uint8_t block_bytes[4] = {};
-        uint8_t block_bytes_read = nfc_srix_read_block(reader, block_bytes, i);
-
-        // Check for errors
-        if (block_bytes_read != 4) {
-            lerror("Error while reading block %d. Exiting...\n", i);
-            lverbose("Received %d bytes instead of 4.\n", block_bytes_read);
-            close_nfc(context, reader);
+    // Flushed on every exit, after the last write
+    static struct history history_log;
+    if (history_path != NULL && !plan_only) {
+        int history_result = history_open(&history_log, history_path);
+        if (history_result != HISTORY_SUCCESS) {
+            lerror("Cannot open \"%s\": %s. Exiting...\n", history_path, history_strerror(history_result));
             exit(1);
         }
+        history = &history_log;
+        atexit(close_history);
+    }
 
-        otp_blocks[i] = block_bytes[0] << 24u | block_bytes[1] << 16u | block_bytes[2] << 8u | block_bytes[3];
-
-        printf("%08X\n", otp_blocks[i]);
+    // In loop mode the only question is asked once, before the first tag
+    if (loop && !skip_confirmation) {
+        if (!ask_confirmation("The OTP area of every presented tag will be reset. This action is irreversible.")) {
+            printf("Exiting...\n");
+            exit(0);
+        }
+        skip_confirmation = true;
     }
 
-    // Check if already reset
-    bool otp_already_reset = true;
-    for (uint8_t i = 0; i < 5; i++) {
-        if (otp_blocks[i] != 0xFFFFFFFF) otp_already_reset = false;
+    // Initialize NFC
+    telemetry_open("srix-reset");
+    nfc_context *context = NULL;
+    nfc_init(&context);
+    if (context == NULL) {
+        lerror("Unable to init libnfc. Exiting...\n");
+        exit(1);
     }
 
-    if (otp_already_reset) {
-        printf("OTP area already reset.\n");
-        close_nfc(context, reader);
-        exit(0);
+    // Display libnfc version
+    lverbose("libnfc version: %s\n", nfc_version());
+
+    // Open every reader
+    struct reader_pool pool;
+    if (reader_pool_open(&pool, context) == 0) {
+        lerror("No readers available. Exiting...\n");
+        reader_pool_close(&pool);
+        close_nfc(context, NULL);
+        exit(1);
     }
 
-    uint32_t block_6 = (otp_blocks[5] << 24u) | (otp_blocks[5] << 16u) | (otp_blocks[5] << 8u) | otp_blocks[5];
-    printf("OTP resets available: %u\n", block_6 >> 21u);
+    struct {
+        unsigned int done;
+        unsigned int already_reset;
+        unsigned int refused;
+        unsigned int failed;
+        unsigned int cancelled;
+    } totals = {};
+
+    int result = RESET_DONE;
+    bool readers_failed = false;
+    for (;;) {
+        // Check for tags, with --plan stdout is left to the plan
+        if (!plan_only) {
+            log_flush();
+            printf("Waiting for tag...\n");
+        }
+        struct pool_reader *reader = reader_pool_wait_for_tag(&pool);
+        if (reader == NULL && cancel_requested()) {
+            result = RESET_CANCELLED;
+            break;
+        }
+        if (reader == NULL) {
+            lerror("Every reader has failed.\n");
+            readers_failed = true;
+            result = RESET_EREAD;
+            break;
+        }
+        lverbose("Tag on %s.\n", reader->connstring);
+
+        // The deadline is per tag
+        struct srix_image *image = srix_image_acquire(7);
+        if (plan_only) {
+            cancel_arm(reader->device, deadline_ms);
+            bool read = read_for_plan(reader->device, image);
+            cancel_disarm();
+            if (read) {
+                if (strcmp(latency.source, "configured") != 0) {
+                    plan_latency_measure(&latency, reader->device);
+                }
+                print_plan(image, reserve, &latency, "tag");
+            }
+
+            srix_image_release(image);
+            result = read ? RESET_DONE : RESET_EREAD;
+            break;
+        }
+        cancel_arm(reader->device, deadline_ms);
+        result = reset_tag(reader->device, image, reserve, !skip_confirmation, budget);
+        cancel_disarm();
+        srix_image_release(image);
+        telemetry_tag_done(reader->device);
+
+        switch (result) {
+            case RESET_DONE:
+                totals.done++;
+                break;
+            case RESET_ALREADY_RESET:
+                totals.already_reset++;
+                break;
+            case RESET_REFUSED:
+                totals.refused++;
+                break;
+            case RESET_DECLINED:
+                printf("Exiting...\n");
+                break;
+            case RESET_CANCELLED:
+                totals.cancelled++;
+                break;
+            default:
+                totals.failed++;
+                break;
+        }
 
-    block_6 -= (1u << 21u);
-    printf("OTP resets remaining after this operation: %u\n", block_6 >> 21u);
+        // Aborted commands leave the reader idle, make sure it still answers
+        if (result == RESET_CANCELLED) {
+            reader_pool_recover(&pool, reader);
+        }
 
-    // Reverse
-    block_6 = (otp_blocks[5] << 24u) | (otp_blocks[5] << 16u) | (otp_blocks[5] << 8u) | otp_blocks[5];
+        if (loop && !cancel_requested()) {
+            log_flush();
+            reader_pool_wait_for_removal(reader);
+        }
 
-    // Show differences
-    printf("[%02X] %08X -> FFFFFFFF\n", 0x00, otp_blocks[0]);
-    printf("[%02X] %08X -> FFFFFFFF\n", 0x01, otp_blocks[1]);
-    printf("[%02X] %08X -> FFFFFFFF\n", 0x02, otp_blocks[2]);
-    printf("[%02X] %08X -> FFFFFFFF\n", 0x03, otp_blocks[3]);
-    printf("[%02X] %08X -> FFFFFFFF\n", 0x04, otp_blocks[4]);
-    printf("[%02X] %08X -> %08X\n", 0x06, otp_blocks[5], block_6);
+        // Only RF errors count against the reader
+        reader_pool_report(&pool, reader, result != RESET_EREAD && result != RESET_EWRITE);
 
-    // Ask for confirmation
-    if (!skip_confirmation) {
-        printf("This action is irreversible.\n");
-        printf("Are you sure? [Y/N] ");
-        char c = 'n';
-        scanf(" %c", &c);
-        if (c != 'Y' && c != 'y') {
-            printf("Exiting...\n");
-            exit(0);
+        // A signal stops the loop, a deadline only the tag
+        if (!loop || cancel_requested()) {
+            break;
         }
     }
 
-    // Write Block 06 first to trigger an Auto erase cycle
-    nfc_write_block(reader, block_6, 0x06);
-    nfc_write_block(reader, 0xFFFFFFFF, 0x00);
-    nfc_write_block(reader, 0xFFFFFFFF, 0x01);
-    nfc_write_block(reader, 0xFFFFFFFF, 0x02);
-    nfc_write_block(reader, 0xFFFFFFFF, 0x03);
-    nfc_write_block(reader, 0xFFFFFFFF, 0x04);
+    if (loop) {
+        log_flush();
+        printf("Tags: %u reset, %u already reset, %u refused, %u failed, %u cancelled.\n", totals.done, totals.already_reset, totals.refused, totals.failed, totals.cancelled);
+        reader_pool_print_health(&pool);
+    }
 
     // Close NFC
-    close_nfc(context, reader);
+    if (budget != NULL) {
+        otp_budget_free(budget);
+    }
+    reader_pool_close(&pool);
+    close_nfc(context, NULL);
 
-    return 0;
-}
\ No newline at end of file
+    if (cancel_requested()) {
+        return cancel_exit_code();
+    }
+    if (loop) {
+        return totals.failed > 0 || totals.cancelled > 0 || readers_failed ? 1 : 0;
+    }
+    if (result == RESET_CANCELLED) {
+        return CANCEL_EXIT_DEADLINE;
+    }
+    return result < 0 || result == RESET_REFUSED ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "partial.h"
+#include "crc32c.h"
+
+#define PARTIAL_HEADER_SIZE (8 + 4 + PARTIAL_TOOL_SIZE + 4 + 4 + PARTIAL_CONFIG_WORDS * 4 + 8 + 8)
+#define PARTIAL_ENTRY_HEADER_SIZE 12
+
+// Serialized file, built in memory so the CRC covers all of it
+struct partial_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+};
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8u * i);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8u * i);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = v << 8u | p[i];
+    return v;
+}
+
+static uint8_t *buffer_reserve(struct partial_buffer *buffer, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (capacity < buffer->size + size) capacity *= 2;
+        uint8_t *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    uint8_t *p = buffer->data + buffer->size;
+    buffer->size += size;
+    return p;
+}
+
+int partial_init(struct partial *partial, const char *tool, size_t counter_count) {
+    memset(partial, 0, sizeof(struct partial));
+    strncpy(partial->tool, tool, PARTIAL_TOOL_SIZE - 1);
+    partial->shard_count = 1;
+    partial->counter_count = counter_count;
+    partial->counters = calloc(counter_count > 0 ? counter_count : 1, sizeof(uint64_t));
+    return partial->counters != NULL ? PARTIAL_SUCCESS : PARTIAL_ENOMEM;
+}
+
+int partial_add_entry(struct partial *partial, const char *path, uint32_t kind, uint32_t value) {
+    if (partial->entry_count == partial->entry_capacity) {
+        size_t capacity = partial->entry_capacity == 0 ? 64 : partial->entry_capacity * 2;
+        struct partial_entry *entries = realloc(partial->entries, capacity * sizeof(struct partial_entry));
+        if (entries == NULL) {
+            return PARTIAL_ENOMEM;
+        }
+        partial->entries = entries;
+        partial->entry_capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return PARTIAL_ENOMEM;
+    }
+    partial->entries[partial->entry_count++] = (struct partial_entry) {.path = copy, .kind = kind, .value = value};
+    return PARTIAL_SUCCESS;
+}
+
+int partial_write(const struct partial *partial, const char *path) {
+    struct partial_buffer buffer = {};
+    uint8_t *p = buffer_reserve(&buffer, PARTIAL_HEADER_SIZE + partial->counter_count * 8);
+    if (p == NULL) {
+        return PARTIAL_ENOMEM;
+    }
+
+    // Header
+    memcpy(p, PARTIAL_MAGIC, 8);
+    put_le32(p + 8, PARTIAL_VERSION);
+    memset(p + 12, 0, PARTIAL_TOOL_SIZE);
+    memcpy(p + 12, partial->tool, strnlen(partial->tool, PARTIAL_TOOL_SIZE));
+    p += 12 + PARTIAL_TOOL_SIZE;
+    put_le32(p, partial->shard_index);
+    put_le32(p + 4, partial->shard_count);
+    p += 8;
+    for (int i = 0; i < PARTIAL_CONFIG_WORDS; i++, p += 4) {
+        put_le32(p, partial->config[i]);
+    }
+    put_le64(p, partial->counter_count);
+    put_le64(p + 8, partial->entry_count);
+    p += 16;
+
+    // Counters and entries
+    for (size_t i = 0; i < partial->counter_count; i++, p += 8) {
+        put_le64(p, partial->counters[i]);
+    }
+    for (size_t i = 0; i < partial->entry_count; i++) {
+        const struct partial_entry *entry = &partial->entries[i];
+        size_t length = strlen(entry->path);
+        if ((p = buffer_reserve(&buffer, PARTIAL_ENTRY_HEADER_SIZE + length)) == NULL) {
+            free(buffer.data);
+            return PARTIAL_ENOMEM;
+        }
+        put_le32(p, entry->kind);
+        put_le32(p + 4, entry->value);
+        put_le32(p + 8, (uint32_t) length);
+        memcpy(p + PARTIAL_ENTRY_HEADER_SIZE, entry->path, length);
+    }
+
+    // Trailer
+    uint32_t crc = crc32c(0, buffer.data, buffer.size);
+    if ((p = buffer_reserve(&buffer, 4)) == NULL) {
+        free(buffer.data);
+        return PARTIAL_ENOMEM;
+    }
+    put_le32(p, crc);
+
+    // Renamed in place, a partial is either complete or absent
+    char tmp_path[PARTIAL_MAX_PATH + 8];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        free(buffer.data);
+        return PARTIAL_EOPEN;
+    }
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(buffer.data);
+        return PARTIAL_EOPEN;
+    }
+    bool written = fwrite(buffer.data, 1, buffer.size, fp) == buffer.size;
+    free(buffer.data);
+    if (fclose(fp) != 0 || !written || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return PARTIAL_EWRITE;
+    }
+
+    return PARTIAL_SUCCESS;
+}
+
+static int read_file(const char *path, struct partial_buffer *buffer) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return PARTIAL_EOPEN;
+    }
+
+    for (;;) {
+        uint8_t *p = buffer_reserve(buffer, 65536);
+        if (p == NULL) {
+            fclose(fp);
+            return PARTIAL_ENOMEM;
+        }
+        size_t read = fread(p, 1, 65536, fp);
+        buffer->size -= 65536 - read;
+        if (read < 65536) break;
+    }
+
+    bool failed = ferror(fp);
+    fclose(fp);
+    return failed ? PARTIAL_EREAD : PARTIAL_SUCCESS;
+}
+
+int partial_read(struct partial *partial, const char *path) {
+    memset(partial, 0, sizeof(struct partial));
+    struct partial_buffer buffer = {};
+    int result = read_file(path, &buffer);
+    if (result != PARTIAL_SUCCESS) {
+        free(buffer.data);
+        return result;
+    }
+
+    // Header and trailer
+    const uint8_t *p = buffer.data, *end = buffer.data + buffer.size;
+    if (buffer.size < PARTIAL_HEADER_SIZE + 4 || memcmp(p, PARTIAL_MAGIC, 8) != 0 || get_le32(p + 8) != PARTIAL_VERSION) {
+        free(buffer.data);
+        return PARTIAL_EFORMAT;
+    }
+    end -= 4;
+    if (crc32c(0, buffer.data, buffer.size - 4) != get_le32(end)) {
+        free(buffer.data);
+        return PARTIAL_ECRC;
+    }
+
+    memcpy(partial->tool, p + 12, PARTIAL_TOOL_SIZE - 1);
+    p += 12 + PARTIAL_TOOL_SIZE;
+    partial->shard_index = get_le32(p);
+    partial->shard_count = get_le32(p + 4);
+    p += 8;
+    for (int i = 0; i < PARTIAL_CONFIG_WORDS; i++, p += 4) {
+        partial->config[i] = get_le32(p);
+    }
+    uint64_t counter_count = get_le64(p);
+    uint64_t entry_count = get_le64(p + 8);
+    p += 16;
+
+    // Counters
+    if (counter_count > (uint64_t) (end - p) / 8) {
+        free(buffer.data);
+        return PARTIAL_EFORMAT;
+    }
+    partial->counter_count = counter_count;
+    partial->counters = calloc(counter_count > 0 ? counter_count : 1, sizeof(uint64_t));
+    if (partial->counters == NULL) {
+        free(buffer.data);
+        return PARTIAL_ENOMEM;
+    }
+    for (size_t i = 0; i < counter_count; i++, p += 8) {
+        partial->counters[i] = get_le64(p);
+    }
+
+    // Entries
+    result = PARTIAL_SUCCESS;
+    char entry_path[PARTIAL_MAX_PATH + 1];
+    for (uint64_t i = 0; i < entry_count && result == PARTIAL_SUCCESS; i++) {
+        if (end - p < PARTIAL_ENTRY_HEADER_SIZE) {
+            result = PARTIAL_EFORMAT;
+            break;
+        }
+        uint32_t length = get_le32(p + 8);
+        if (length > PARTIAL_MAX_PATH || length > (size_t) (end - p) - PARTIAL_ENTRY_HEADER_SIZE) {
+            result = PARTIAL_EFORMAT;
+            break;
+        }
+        memcpy(entry_path, p + PARTIAL_ENTRY_HEADER_SIZE, length);
+        entry_path[length] = '\0';
+        result = partial_add_entry(partial, entry_path, get_le32(p), get_le32(p + 4));
+        p += PARTIAL_ENTRY_HEADER_SIZE + length;
+    }
+    if (result == PARTIAL_SUCCESS && p != end) {
+        result = PARTIAL_EFORMAT;
+    }
+
+    free(buffer.data);
+    if (result != PARTIAL_SUCCESS) {
+        partial_free(partial);
+    }
+    return result;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct partial_entry *x = a, *y = b;
+    int result = strcmp(x->path, y->path);
+    if (result != 0) return result;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+/*
+ * Sums the counters of every shard and sorts the entries by path, so the
+ * result does not depend on how the corpus was split or in which order the
+ * partials are given. Every shard must be there exactly once.
+ */
+int partial_merge(struct partial *merged, const char *tool, size_t counter_count, char *const paths[], int count) {
+    int result = partial_init(merged, tool, counter_count);
+    if (result != PARTIAL_SUCCESS) {
+        return result;
+    }
+
+    bool *seen = NULL;
+    for (int i = 0; i < count && result == PARTIAL_SUCCESS; i++) {
+        struct partial shard;
+        if ((result = partial_read(&shard, paths[i])) != PARTIAL_SUCCESS) {
+            break;
+        }
+
+        // The first partial sets what the others must match
+        if (i == 0) {
+            merged->shard_count = shard.shard_count;
+            memcpy(merged->config, shard.config, sizeof(merged->config));
+            seen = calloc(shard.shard_count, sizeof(bool));
+            if (seen == NULL) result = PARTIAL_ENOMEM;
+        }
+        if (result == PARTIAL_SUCCESS && (strcmp(shard.tool, tool) != 0 || shard.counter_count != counter_count ||
+                shard.shard_count != merged->shard_count || memcmp(shard.config, merged->config, sizeof(merged->config)) != 0)) {
+            result = PARTIAL_EMISMATCH;
+        }
+        if (result == PARTIAL_SUCCESS && (shard.shard_index >= merged->shard_count || seen[shard.shard_index])) {
+            result = PARTIAL_ESHARDS;
+        }
+
+        if (result == PARTIAL_SUCCESS) {
+            seen[shard.shard_index] = true;
+            for (size_t j = 0; j < counter_count; j++) {
+                merged->counters[j] += shard.counters[j];
+            }
+            for (size_t j = 0; j < shard.entry_count && result == PARTIAL_SUCCESS; j++) {
+                result = partial_add_entry(merged, shard.entries[j].path, shard.entries[j].kind, shard.entries[j].value);
+            }
+        }
+        partial_free(&shard);
+    }
+
+    for (uint32_t i = 0; result == PARTIAL_SUCCESS && i < merged->shard_count; i++) {
+        if (!seen[i]) result = PARTIAL_ESHARDS;
+    }
+    free(seen);
+
+    if (result != PARTIAL_SUCCESS) {
+        partial_free(merged);
+        return result;
+    }
+
+    qsort(merged->entries, merged->entry_count, sizeof(struct partial_entry), compare_entries);
+    merged->shard_index = 0;
+    return PARTIAL_SUCCESS;
+}
+
+void partial_free(struct partial *partial) {
+    for (size_t i = 0; i < partial->entry_count; i++) {
+        free(partial->entries[i].path);
+    }
+    free(partial->entries);
+    free(partial->counters);
+    partial->entries = NULL;
+    partial->counters = NULL;
+    partial->entry_count = 0;
+    partial->entry_capacity = 0;
+}
+
+const char *partial_strerror(int result) {
+    switch (result) {
+        case PARTIAL_SUCCESS:
+            return "success";
+        case PARTIAL_EOPEN:
+            return "cannot open file";
+        case PARTIAL_EREAD:
+            return "error encountered while reading file";
+        case PARTIAL_EWRITE:
+            return "cannot write file";
+        case PARTIAL_EFORMAT:
+            return "not a partial result";
+        case PARTIAL_ECRC:
+            return "CRC mismatch";
+        case PARTIAL_ENOMEM:
+            return "out of memory";
+        case PARTIAL_EMISMATCH:
+            return "partials of a different tool, options or shard count";
+        case PARTIAL_ESHARDS:
+            return "a shard is missing or given twice";
+        default:
+            return "unknown error";
+    }
+}
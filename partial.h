@@ -0,0 +1,83 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_PARTIAL_H__
+#define __NFC_SRIX_PARTIAL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Partial result of one shard of a corpus run, every integer is little endian:
+ *
+ *   header   "SRIXPRT1", version, tool, shard index, shard count, config words,
+ *            counter count, entry count
+ *   counters summed when merging
+ *   entries  kind, value, path length, path: the files a tool lists
+ *   trailer  CRC32C of everything before it
+ *
+ * Config words hold the options that change the counters (tag type,
+ * thresholds, template); partials only merge when they match.
+ */
+
+/* Macros */
+#define PARTIAL_MAGIC "SRIXPRT1"
+#define PARTIAL_VERSION 1
+#define PARTIAL_TOOL_SIZE 16
+#define PARTIAL_CONFIG_WORDS 4
+#define PARTIAL_MAX_PATH 4096
+
+/* Return values */
+#define PARTIAL_SUCCESS 0
+#define PARTIAL_EOPEN -1
+#define PARTIAL_EREAD -2
+#define PARTIAL_EWRITE -3
+#define PARTIAL_EFORMAT -4
+#define PARTIAL_ECRC -5
+#define PARTIAL_ENOMEM -6
+#define PARTIAL_EMISMATCH -7 // Different tool, options or shard count
+#define PARTIAL_ESHARDS -8   // A shard is missing or given twice
+
+struct partial_entry {
+    char *path;
+    uint32_t kind;
+    uint32_t value;
+};
+
+struct partial {
+    char tool[PARTIAL_TOOL_SIZE];
+    uint32_t shard_index;
+    uint32_t shard_count;
+    uint32_t config[PARTIAL_CONFIG_WORDS];
+
+    uint64_t *counters;
+    size_t counter_count;
+
+    struct partial_entry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+};
+
+int partial_init(struct partial *partial, const char *tool, size_t counter_count);
+int partial_add_entry(struct partial *partial, const char *path, uint32_t kind, uint32_t value);
+int partial_write(const struct partial *partial, const char *path);
+int partial_read(struct partial *partial, const char *path);
+int partial_merge(struct partial *merged, const char *tool, size_t counter_count, char *const paths[], int count);
+void partial_free(struct partial *partial);
+const char *partial_strerror(int result);
+
+#endif // __NFC_SRIX_PARTIAL_H__
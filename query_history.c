@@ -0,0 +1,152 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "history.h"
+
+struct query_totals {
+    size_t entries;
+    uint64_t blocks;
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s <history.log> [uid] [-h] [-v] [-r]\n", executable);
+    printf("\nNecessary arguments:\n");
+    printf("  <history.log>  log written by srix-restore, srix-reset and srix-shell with --history\n");
+    printf("\nOptional arguments:\n");
+    printf("  [uid]          tag to print the history of, 16 hex digits\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -r           rebuild the UID index from the log\n");
+}
+
+static const char *block_status(const struct history_block *block) {
+    switch (block->status) {
+        case READBACK_PASS:
+            return "verified";
+        case READBACK_MISMATCH:
+            return "mismatch";
+        case READBACK_EREAD:
+            return "read back failed";
+        default:
+            return "not verified";
+    }
+}
+
+static void print_entry(const struct history_entry *entry, void *arg) {
+    struct query_totals *totals = arg;
+    totals->entries++;
+    totals->blocks += entry->block_count;
+
+    time_t seconds = (time_t) (entry->timestamp_us / 1000000);
+    struct tm tm;
+    char date[32];
+    localtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%03" PRId64 " %s on %s: %s\n", date, (entry->timestamp_us % 1000000) / 1000, history_tool_name(entry->tool),
+           entry->reader[0] != '\0' ? entry->reader : "?", history_outcome_name(entry->outcome));
+    for (uint8_t i = 0; i < entry->block_count; i++) {
+        const struct history_block *block = &entry->blocks[i];
+        printf("%s [%02X] %08X -> %08X %s", i + 1 == entry->block_count ? "└──" : "├──", block->block, block->before, block->written, block_status(block));
+        if (block->status == READBACK_MISMATCH) {
+            printf(", read %08X", block->read_back);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    bool reindex = false;
+
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hvr")) != -1) {
+        switch (opt) {
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'r':
+                reindex = true;
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    int arguments = argc - optind;
+    if (arguments < 1 || arguments > 2 || (arguments == 1 && !reindex)) {
+        lerror("You need to specify <history.log> and a UID, or -r.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+    const char *path = argv[optind];
+
+    if (reindex) {
+        uint64_t records = 0;
+        int result = history_reindex(path, &records);
+        if (result != HISTORY_SUCCESS) {
+            lerror("Cannot index \"%s\": %s.\n", path, history_strerror(result));
+            exit(1);
+        }
+        printf("Indexed %" PRIu64 " records.\n", records);
+        if (arguments == 1) {
+            return 0;
+        }
+    }
+
+    char *end;
+    uint64_t uid = strtoull(argv[optind + 1], &end, 16);
+    if (end == argv[optind + 1] || *end != '\0') {
+        lerror("Invalid UID \"%s\".\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct query_totals totals = {};
+    size_t unindexed = 0;
+    int result = history_query(path, uid, print_entry, &totals, &unindexed);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (result != HISTORY_SUCCESS) {
+        lerror("Cannot read \"%s\": %s.\n", path, history_strerror(result));
+        exit(1);
+    }
+
+    lverbose("Query took %.3f ms, %zu records past the index scanned.\n",
+             (double) (stop.tv_sec - start.tv_sec) * 1e3 + (double) (stop.tv_nsec - start.tv_nsec) / 1e6, unindexed);
+    log_flush();
+    if (totals.entries == 0) {
+        printf("No history for %016" PRIX64 ".\n", uid);
+    } else {
+        printf("%zu entries, %" PRIu64 " blocks written.\n", totals.entries, totals.blocks);
+    }
+
+    return 0;
+}
@@ -19,32 +19,120 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
 #include <nfc/nfc.h>
-#include <sys/stat.h>
 #include "logging.h"
 #include "nfc_utils.h"
+#include "dump_utils.h"
+#include "dump_format.h"
+#include "archive.h"
 
 static void print_usage(const char *executable) {
-    printf("Usage: %s <dump.bin> [-h] [-v] [-c 1|2] [-t x4k|512]\n", executable);
+    printf("Usage: %s <dump.bin|archive> [-h] [-v] [-c 1|2] [-t x4k|512] [-n record] [-i format]\n", executable);
     printf("\nNecessary arguments:\n");
-    printf("  <dump.bin>   path to the dump file\n");
+    printf("  <dump.bin>   path to the dump file, .eml, .nfc and .json dumps are read too\n");
+    printf("  <archive>    path to an archive written by srix-dump --append-archive\n");
     printf("\nOptions:\n");
     printf("  -h           show this help message\n");
     printf("  -v           enable verbose - print debugging data\n");
     printf("  -c 1|2       erint on one or two columns [default: 1]\n");
     printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  -n record    print only this archive record\n");
+    printf("  -i format    dump format: bin, reversed, eml, nfc or json [default: from the extension]\n");
+}
+
+static void print_image(struct srix_image *image, int print_columns) {
+    uint8_t eeprom_blocks_amount = image->blocks;
+
+    if (print_columns == 1) { // Single column print
+        for (int i = 0; i < eeprom_blocks_amount; i++) {
+            uint8_t *block = srix_image_block_bytes(image, i);
+            printf("[%02X] %02X %02X %02X %02X" DIM " --- %s\n" RESET, i, block[0], block[1], block[2], block[3], srix_get_block_type(i));
+        }
+    } else { // Double column print
+        for (int i = 0; i < eeprom_blocks_amount; i += 2) {
+            uint8_t *block_1 = srix_image_block_bytes(image, i);
+            uint8_t *block_2 = srix_image_block_bytes(image, i + 1);
+            printf(DIM "%19s --- " RESET "[%02X] %02X %02X %02X %02X  %02X %02X %02X %02X [%02X]" DIM " --- %s\n" RESET,
+                    srix_get_block_type(i), i, block_1[0], block_1[1], block_1[2], block_1[3], block_2[0], block_2[1], block_2[2], block_2[3], i+1, srix_get_block_type(i+1));
+        }
+    }
+}
+
+// Streams the records one chunk at a time, nothing is extracted to disk
+static int print_archive(const char *path, int print_columns, bool single_record, uint64_t record_number) {
+    struct archive_reader reader;
+    int result = archive_reader_open(&reader, path);
+    if (result != ARCHIVE_SUCCESS) {
+        lerror("Cannot open archive \"%s\": %s.\n", path, archive_strerror(result));
+        return 1;
+    }
+    lverbose("Archive has %" PRIu64 " records in %zu chunks.\n", reader.record_count, reader.chunk_count);
+
+    if (single_record && (result = archive_reader_seek(&reader, record_number)) != ARCHIVE_SUCCESS) {
+        lerror("Cannot seek to record %" PRIu64 ": %s.\n", record_number, archive_strerror(result));
+        archive_reader_close(&reader);
+        return 1;
+    }
+
+    int exit_code = 0;
+    struct srix_image *image = srix_image_acquire(SRIX_IMAGE_MAX_BLOCKS);
+    struct archive_record record;
+    while ((result = archive_reader_next(&reader, &record, image)) != ARCHIVE_END) {
+        if (result == ARCHIVE_ECRC) {
+            lerror("Record %" PRIu64 ": %s.\n", record.number, archive_strerror(result));
+            exit_code = 1;
+            continue;
+        } else if (result != ARCHIVE_SUCCESS) {
+            lerror("Cannot read archive: %s.\n", archive_strerror(result));
+            exit_code = 1;
+            break;
+        }
+
+        char date[32];
+        time_t timestamp = (time_t) record.timestamp;
+        struct tm tm;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp, &tm));
+        log_flush();
+        printf("Record %" PRIu64 ": UID %016" PRIX64 ", %s, %s, %u blocks changed\n", record.number, record.uid,
+                archive_type_name(record.type), date, record.changed_blocks);
+        print_image(image, print_columns);
+
+        if (single_record) {
+            break;
+        }
+    }
+
+    srix_image_release(image);
+    archive_reader_close(&reader);
+    return exit_code;
 }
 
 int main(int argc, char *argv[], char *envp[]) {
     // Options
     int print_columns = 1;
-    uint32_t eeprom_size = SRIX4K_EEPROM_SIZE;
     uint32_t eeprom_blocks_amount = SRIX4K_EEPROM_BLOCKS;
+    bool single_record = false;
+    uint64_t record_number = 0;
+    int format = FORMAT_AUTO;
 
     // Parse options
     int opt = 0;
-    while ((opt = getopt(argc, argv, "hvc:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "hvc:t:n:i:")) != -1) {
         switch (opt) {
+            case 'i':
+                format = srix_format_from_name(optarg);
+                if (format == FORMAT_EUNKNOWN) {
+                    lerror("Invalid format \"%s\".\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                single_record = true;
+                record_number = strtoull(optarg, NULL, 10);
+                break;
             case 'v':
                 set_verbose(true);
                 break;
@@ -53,7 +141,6 @@ int main(int argc, char *argv[], char *envp[]) {
                 break;
             case 't':
                 if (strcmp(optarg, "512") == 0) {
-                    eeprom_size = SRI512_EEPROM_SIZE;
                     eeprom_blocks_amount = SRI512_EEPROM_BLOCKS;
                 }
                 break;
@@ -77,49 +164,51 @@ int main(int argc, char *argv[], char *envp[]) {
     }
 
     char *file_path = argv[optind];
-    uint8_t *eeprom_bytes = malloc(sizeof(uint8_t) * eeprom_size);
+    if (archive_is_archive(file_path)) {
+        return print_archive(file_path, print_columns, single_record, record_number);
+    }
 
-    // Open file
+    struct srix_image *image = srix_image_acquire(eeprom_blocks_amount);
+
+    // Interchange formats, anything else is a raw dump
+    if (format == FORMAT_AUTO) {
+        format = srix_format_from_path(file_path);
+    }
+    if (format > FORMAT_BIN) {
+        lverbose("Reading \"%s\" as %s...\n", file_path, srix_format_name(format));
+        static struct format_reader reader;
+        int load_result = srix_format_load(image, file_path, format, &reader);
+        if (load_result == FORMAT_ESYNTAX) {
+            lerror("Cannot read \"%s\": %s at line %u. Exiting...\n", file_path, srix_format_strerror(load_result), reader.line);
+            exit(1);
+        } else if (load_result != FORMAT_SUCCESS) {
+            lerror("Cannot read \"%s\": %s. Exiting...\n", file_path, srix_format_strerror(load_result));
+            exit(1);
+        }
+
+        print_image(image, print_columns);
+        srix_image_release(image);
+        return 0;
+    }
+
+    // Load file
     lverbose("Reading \"%s\"...\n", file_path);
-    FILE *fp = fopen(file_path, "rb");
-    if (fp == NULL) {
+    size_t file_size = 0;
+    int load_result = srix_image_load(image, file_path, &file_size);
+    if (load_result == DUMP_EOPEN) {
         lerror("Cannot open \"%s\". Exiting...\n", file_path);
         exit(1);
-    }
-
-    // Check file size
-    int fd = fileno(fp);
-    struct stat file_stat;
-    if (fstat(fd, &file_stat) < 0) {
-        lerror("Error doing fstat. Exiting...\n");
+    } else if (load_result == DUMP_ESIZE) {
+        lerror("File wrong size, expected %zu but read %zu. Exiting...\n", srix_image_size(image), file_size);
         exit(1);
-    }
-    if (file_stat.st_size < eeprom_size) {
-        lerror("File wrong size, expected %llu but read %llu. Exiting...\n", eeprom_size, file_stat.st_size);
+    } else if (load_result != DUMP_SUCCESS) {
+        lerror("Error encountered while reading file: %s. Exiting...\n", srix_dump_strerror(load_result));
         exit(1);
     }
 
-    // Read file
-    fseek(fp, 0, SEEK_SET);
-    if (fread(eeprom_bytes, eeprom_size, 1, fp) != 1) {
-        lerror("Error encountered while reading file. Exiting...\n");
-        exit(1);
-    }
-    fclose(fp);
+    print_image(image, print_columns);
 
-    if (print_columns == 1) { // Single column print
-        for (int i = 0; i < eeprom_blocks_amount; i++) {
-            uint8_t *block = eeprom_bytes + (i * 4);
-            printf("[%02X] %02X %02X %02X %02X" DIM " --- %s\n" RESET, i, block[0], block[1], block[2], block[3], srix_get_block_type(i));
-        }
-    } else { // Double column print
-        for (int i = 0; i < eeprom_blocks_amount; i += 2) {
-            uint8_t *block_1 = eeprom_bytes + (i * 4);
-            uint8_t *block_2 = eeprom_bytes + ((i+1) * 4);
-            printf(DIM "%19s --- " RESET "[%02X] %02X %02X %02X %02X  %02X %02X %02X %02X [%02X]" DIM " --- %s\n" RESET,
-                    srix_get_block_type(i), i, block_1[0], block_1[1], block_1[2], block_1[3], block_2[0], block_2[1], block_2[2], block_2[3], i+1, srix_get_block_type(i+1));
-        }
-    }
+    srix_image_release(image);
 
     return 0;
 }
\ No newline at end of file
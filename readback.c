@@ -0,0 +1,132 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <nfc/nfc.h>
+#include "readback.h"
+#include "nfc_utils.h"
+#include "logging.h"
+#include "cancel.h"
+
+void srix_write_init(struct srix_write *write, uint8_t block, uint32_t value) {
+    write->block = block;
+    write->data[0] = value >> 24u;
+    write->data[1] = value >> 16u;
+    write->data[2] = value >> 8u;
+    write->data[3] = value >> 0u;
+    write->retry = block < 5 || block > 6;
+    write->status = READBACK_PENDING;
+    write->attempts = 1;
+    memset(write->read_back, 0, sizeof(write->read_back));
+}
+
+// Read back every block that is not verified yet, returns how many still differ
+static size_t readback_pass(nfc_device *reader, struct srix_write *writes, size_t count) {
+    size_t failed = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct srix_write *write = &writes[i];
+        if (write->status == READBACK_PASS) {
+            continue;
+        }
+        if (cancel_requested()) {
+            failed++;
+            continue;
+        }
+
+        // libnfc may write a whole response, read_back only holds the block
+        uint8_t rx_bytes[MAX_RESPONSE_LEN] = {};
+        uint8_t block_bytes_read = nfc_srix_read_block(reader, rx_bytes, write->block);
+        memcpy(write->read_back, rx_bytes, sizeof(write->read_back));
+        if (block_bytes_read != 4) {
+            lverbose("Received %d bytes instead of 4 while verifying block %02X.\n", block_bytes_read, write->block);
+            write->status = READBACK_EREAD;
+            failed++;
+        } else if (memcmp(write->read_back, write->data, sizeof(write->data)) != 0) {
+            write->status = READBACK_MISMATCH;
+            failed++;
+        } else {
+            write->status = READBACK_PASS;
+        }
+    }
+
+    return failed;
+}
+
+/*
+ * Reads back exactly the written blocks, then rewrites only the ones that
+ * differ, waiting base_delay_us, 2 * base_delay_us, ... between rounds.
+ * Returns the number of blocks that still fail.
+ */
+size_t srix_readback_verify(nfc_device *reader, struct srix_write *writes, size_t count, unsigned int max_retries, unsigned int base_delay_us) {
+    lverbose("Verifying %zu blocks...\n", count);
+    size_t failed = readback_pass(reader, writes, count);
+
+    unsigned int delay_us = base_delay_us;
+    for (unsigned int retry = 0; retry < max_retries && failed > 0 && !cancel_requested(); retry++) {
+        lverbose("%zu blocks differ, retrying in %u us...\n", failed, delay_us);
+        usleep(delay_us);
+        delay_us *= 2;
+
+        bool rewritten = false;
+        for (size_t i = 0; i < count; i++) {
+            struct srix_write *write = &writes[i];
+            if (write->status == READBACK_PASS || !write->retry) {
+                continue;
+            }
+
+            nfc_srix_write_block(reader, NULL, write->block, write->data);
+            write->attempts++;
+            rewritten = true;
+        }
+
+        if (!rewritten) {
+            break;
+        }
+        failed = readback_pass(reader, writes, count);
+    }
+
+    return failed;
+}
+
+void srix_readback_print_summary(const struct srix_write *writes, size_t count) {
+    size_t passed = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct srix_write *write = &writes[i];
+
+        printf("[%02X] %02X%02X%02X%02X ", write->block, write->data[0], write->data[1], write->data[2], write->data[3]);
+        if (write->status == READBACK_PASS) {
+            passed++;
+            printf(GREEN "OK" RESET);
+        } else if (write->status == READBACK_EREAD) {
+            printf(RED "FAILED" RESET " (read error)");
+        } else {
+            printf(RED "FAILED" RESET " (read %02X%02X%02X%02X)", write->read_back[0], write->read_back[1], write->read_back[2], write->read_back[3]);
+        }
+
+        if (write->attempts > 1) {
+            printf(DIM " --- %u writes" RESET, write->attempts);
+        } else if (!write->retry && write->status != READBACK_PASS) {
+            printf(DIM " --- not retried, %s" RESET, srix_get_block_type(write->block));
+        }
+        printf("\n");
+    }
+
+    printf("Verified %zu blocks: %zu passed, %zu failed.\n", count, passed, count - passed);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_READBACK_H__
+#define __NFC_SRIX_READBACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Macros */
+#define READBACK_MAX_RETRIES 3
+#define READBACK_BASE_DELAY_US 5000
+
+/* Status */
+#define READBACK_PENDING 0
+#define READBACK_PASS 1
+#define READBACK_MISMATCH 2
+#define READBACK_EREAD 3
+
+/*
+ * One block written during the write phase. Counter blocks (05 and 06) are
+ * never rewritten automatically: a second write of block 06 would trigger
+ * another auto erase cycle and consume another OTP reset.
+ */
+struct srix_write {
+    uint8_t block;
+    uint8_t data[4];
+    bool retry;
+
+    // Filled by srix_readback_verify()
+    int status;
+    unsigned int attempts;
+    uint8_t read_back[4];
+};
+
+void srix_write_init(struct srix_write *write, uint8_t block, uint32_t value);
+size_t srix_readback_verify(nfc_device *reader, struct srix_write *writes, size_t count, unsigned int max_retries, unsigned int base_delay_us);
+void srix_readback_print_summary(const struct srix_write *writes, size_t count);
+
+#endif // __NFC_SRIX_READBACK_H__
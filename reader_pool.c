@@ -0,0 +1,337 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "reader_pool.h"
+#include "rf_tuning.h"
+#include "logging.h"
+#include "cancel.h"
+#include "telemetry.h"
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static const char *state_name(int state) {
+    switch (state) {
+        case READER_HEALTHY:
+            return "healthy";
+        case READER_QUARANTINED:
+            return "quarantined";
+        case READER_FAILED:
+            return "failed";
+        default:
+            return "?";
+    }
+}
+
+static bool init_reader(nfc_context *context, struct pool_reader *reader) {
+    reader->device = nfc_open(context, reader->connstring);
+    if (reader->device == NULL) {
+        lverbose("Unable to open %s.\n", reader->connstring);
+        return false;
+    }
+
+    // Set opened NFC device to initiator mode
+    if (nfc_initiator_init(reader->device) < 0) {
+        lverbose("nfc_initiator_init(%s) => %s\n", reader->connstring, nfc_strerror(reader->device));
+        nfc_close(reader->device);
+        reader->device = NULL;
+        return false;
+    }
+
+    // Poll every reader in turn instead of blocking on one
+    nfc_device_set_property_bool(reader->device, NP_INFINITE_SELECT, false);
+
+    /*
+     * This is a known bug from libnfc.
+     * To read ISO14443B2SR you have to initiate first ISO14443B to configure internal registers.
+     *
+     * https://github.com/nfc-tools/libnfc/issues/436#issuecomment-326686914
+     */
+    nfc_target target_key[MAX_TARGET_COUNT];
+    nfc_initiator_list_passive_targets(reader->device, nmISO14443B, target_key, MAX_TARGET_COUNT);
+
+    reader->baseline_p99 = 0;
+    reader->consecutive_errors = 0;
+    return true;
+}
+
+// First re-init after the base delay, under the pool lock once the thread runs
+static void schedule_reinit(struct pool_reader *reader, const char *reason) {
+    atomic_store(&reader->state, READER_QUARANTINED);
+    reader->quarantines++;
+    snprintf(reader->quarantine_reason, sizeof(reader->quarantine_reason), "%s", reason);
+    reader->reinit_attempts = 0;
+    reader->reinit_delay_ms = HEALTH_REINIT_BASE_DELAY_MS;
+    reader->next_reinit_us = now_us() + HEALTH_REINIT_BASE_DELAY_MS * 1000u;
+}
+
+static void quarantine(struct reader_pool *pool, struct pool_reader *reader, const char *reason) {
+    pthread_mutex_lock(&pool->lock);
+    schedule_reinit(reader, reason);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    lwarning("Reader %s quarantined: %s.\n", reader->connstring, reason);
+}
+
+// Background re-init of quarantined readers
+static void *reinit_main(void *arg) {
+    struct reader_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running) {
+        uint64_t now = now_us();
+        uint64_t next_wakeup = now + HEALTH_REINIT_MAX_DELAY_MS * 1000ull;
+
+        for (size_t i = 0; i < pool->count; i++) {
+            struct pool_reader *reader = &pool->readers[i];
+            if (atomic_load(&reader->state) != READER_QUARANTINED) {
+                continue;
+            }
+            if (reader->next_reinit_us > now) {
+                if (reader->next_reinit_us < next_wakeup) next_wakeup = reader->next_reinit_us;
+                continue;
+            }
+
+            // Nobody else touches a quarantined reader, open it without the lock
+            pthread_mutex_unlock(&pool->lock);
+            if (reader->device != NULL) {
+                close_nfc(NULL, reader->device);
+                reader->device = NULL;
+            }
+            bool ok = init_reader(pool->context, reader);
+            pthread_mutex_lock(&pool->lock);
+
+            reader->reinit_attempts++;
+            if (ok) {
+                reader->reinits++;
+                atomic_store(&reader->state, READER_HEALTHY);
+                lverbose("Reader %s re-initialized.\n", reader->connstring);
+            } else if (reader->reinit_attempts >= HEALTH_MAX_REINIT_ATTEMPTS) {
+                atomic_store(&reader->state, READER_FAILED);
+                lwarning("Reader %s could not be re-initialized, giving up.\n", reader->connstring);
+            } else {
+                reader->reinit_delay_ms *= 2;
+                if (reader->reinit_delay_ms > HEALTH_REINIT_MAX_DELAY_MS) reader->reinit_delay_ms = HEALTH_REINIT_MAX_DELAY_MS;
+                reader->next_reinit_us = now_us() + reader->reinit_delay_ms * 1000ull;
+                if (reader->next_reinit_us < next_wakeup) next_wakeup = reader->next_reinit_us;
+            }
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t sleep_us = next_wakeup > now_us() ? next_wakeup - now_us() : 0;
+        deadline.tv_sec += (time_t) (sleep_us / 1000000u);
+        deadline.tv_nsec += (long) (sleep_us % 1000000u) * 1000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool->wakeup, &pool->lock, &deadline);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Returns how many readers could be opened
+size_t reader_pool_open(struct reader_pool *pool, nfc_context *context) {
+    memset(pool, 0, sizeof(struct reader_pool));
+    pool->context = context;
+
+    // Search for readers
+    lverbose("Searching for readers... ");
+    nfc_connstring connstrings[MAX_DEVICE_COUNT] = {};
+    size_t num_readers = nfc_list_devices(context, connstrings, MAX_DEVICE_COUNT);
+    lverbose("found %zu.\n", num_readers);
+
+    size_t opened = 0;
+    for (size_t i = 0; i < num_readers; i++) {
+        struct pool_reader *reader = &pool->readers[pool->count++];
+        memcpy(reader->connstring, connstrings[i], sizeof(nfc_connstring));
+
+        // A reader unplugged for a moment gets the same re-init schedule as a quarantined one
+        bool ok = init_reader(context, reader);
+        atomic_init(&reader->state, READER_HEALTHY);
+        if (!ok) {
+            schedule_reinit(reader, "unable to open");
+        }
+        lverbose("%s [%zu] %s: %s\n", i == num_readers - 1 ? "└──" : "├──", i, reader->connstring,
+                ok ? nfc_device_get_name(reader->device) : "unable to open, retrying in the background");
+        if (ok) opened++;
+    }
+
+    // The clock of pthread_cond_timedwait() must match now_us()
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->wakeup, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool->running = true;
+    if (pthread_create(&pool->thread, NULL, reinit_main, pool) != 0) {
+        pool->running = false;
+    }
+
+    return opened;
+}
+
+/*
+ * Polls the healthy readers round robin until one of them selects a tag.
+ * Returns NULL once every reader has failed for good.
+ */
+struct pool_reader *reader_pool_wait_for_tag(struct reader_pool *pool) {
+    for (;;) {
+        bool alive = false;
+        if (cancel_requested()) {
+            return NULL;
+        }
+
+        for (size_t n = 0; n < pool->count; n++) {
+            struct pool_reader *reader = &pool->readers[pool->next];
+            pool->next = (pool->next + 1) % pool->count;
+
+            int state = atomic_load(&reader->state);
+            if (state == READER_QUARANTINED) alive = true;
+            if (state != READER_HEALTHY) {
+                continue;
+            }
+            alive = true;
+
+            telemetry_operation(reader->device, TELEMETRY_OP_WAITING);
+            int result = nfc_initiator_select_passive_target(reader->device, nmISO14443B2SR, NULL, 0, &reader->target);
+            if (result > 0) {
+                telemetry_operation(reader->device, TELEMETRY_OP_IDLE);
+                return reader;
+            }
+            if (result < 0 && result != NFC_ETIMEOUT) {
+                lverbose("nfc_initiator_select_passive_target(%s) => %s\n", reader->connstring, nfc_strerror(reader->device));
+                reader_pool_report(pool, reader, false);
+            }
+        }
+
+        if (!alive) {
+            return NULL;
+        }
+        usleep(POOL_POLL_INTERVAL_US);
+    }
+}
+
+void reader_pool_wait_for_removal(struct pool_reader *reader) {
+    printf("Remove tag...\n");
+    while (nfc_initiator_target_is_present(reader->device, &reader->target) == NFC_SUCCESS && !cancel_requested()) {
+        usleep(POOL_REMOVAL_POLL_US);
+    }
+}
+
+// Called after every tag, quarantines the reader when it looks unhealthy
+void reader_pool_report(struct reader_pool *pool, struct pool_reader *reader, bool ok) {
+    if (ok) {
+        reader->tags++;
+        reader->consecutive_errors = 0;
+    } else {
+        reader->errors++;
+        reader->consecutive_errors++;
+    }
+
+    struct rf_tuning *tuning = rf_tuning_get(reader->device);
+    const struct rf_command_stats *reads = tuning != NULL ? &tuning->commands[TUNING_READ_BLOCK] : NULL;
+
+    // First p99 of the session is the baseline
+    if (reads != NULL && reader->baseline_p99 == 0) {
+        reader->baseline_p99 = reads->rtt_p99;
+    }
+
+    if (reader->consecutive_errors >= HEALTH_MAX_CONSECUTIVE_ERRORS) {
+        quarantine(pool, reader, "too many consecutive errors");
+    } else if (reads != NULL && reads->failure_rate >= HEALTH_MAX_FAILURE_RATE) {
+        quarantine(pool, reader, "read failure rate too high");
+    } else if (reads != NULL && reader->baseline_p99 != 0 && reads->rtt_p99 > reader->baseline_p99 * HEALTH_MAX_LATENCY_DRIFT &&
+            reads->rtt_p99 - reader->baseline_p99 > HEALTH_MIN_LATENCY_DRIFT_US) {
+        quarantine(pool, reader, "read latency drifted");
+    }
+}
+
+// After an aborted command, quarantines the reader if it does not come back
+void reader_pool_recover(struct reader_pool *pool, struct pool_reader *reader) {
+    if (nfc_initiator_init(reader->device) < 0) {
+        lverbose("nfc_initiator_init(%s) => %s\n", reader->connstring, nfc_strerror(reader->device));
+        quarantine(pool, reader, "not responding after abort");
+        return;
+    }
+
+    nfc_device_set_property_bool(reader->device, NP_INFINITE_SELECT, false);
+    nfc_target target_key[MAX_TARGET_COUNT];
+    nfc_initiator_list_passive_targets(reader->device, nmISO14443B, target_key, MAX_TARGET_COUNT);
+}
+
+void reader_pool_print_health(struct reader_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    printf("Readers:\n");
+    for (size_t i = 0; i < pool->count; i++) {
+        struct pool_reader *reader = &pool->readers[i];
+        bool last = i == pool->count - 1;
+        int state = atomic_load(&reader->state);
+
+        printf("%s [%zu] %s: %s", last ? "└──" : "├──", i, reader->connstring, state_name(state));
+        if (state != READER_HEALTHY && reader->quarantine_reason[0] != '\0') {
+            printf(" (%s)", reader->quarantine_reason);
+        }
+        printf("\n");
+
+        // Stats of a quarantined reader may be gone with its device
+        struct rf_tuning *tuning = state == READER_HEALTHY ? rf_tuning_get(reader->device) : NULL;
+        const char *indent = last ? "    " : "│   ";
+        printf("%s├── tags: %" PRIu64 ", errors: %" PRIu64 "\n", indent, reader->tags, reader->errors);
+        if (tuning != NULL) {
+            const struct rf_command_stats *reads = &tuning->commands[TUNING_READ_BLOCK];
+            printf("%s├── read failure rate: %u%%, p99: %u us (baseline %u us)\n", indent,
+                    reads->failure_rate * 100 / 256, reads->rtt_p99, reader->baseline_p99);
+        }
+        printf("%s└── quarantines: %" PRIu64 ", re-inits: %" PRIu64 "\n", indent, reader->quarantines, reader->reinits);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void reader_pool_close(struct reader_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    bool running = pool->running;
+    pool->running = false;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    if (running) {
+        pthread_join(pool->thread, NULL);
+    }
+
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->readers[i].device != NULL) {
+            close_nfc(NULL, pool->readers[i].device);
+            pool->readers[i].device = NULL;
+        }
+    }
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+}
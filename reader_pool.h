@@ -0,0 +1,92 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_READER_POOL_H__
+#define __NFC_SRIX_READER_POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <nfc/nfc.h>
+#include "nfc_utils.h"
+
+/* Macros */
+#define HEALTH_MAX_CONSECUTIVE_ERRORS 3  // Failed tags in a row
+#define HEALTH_MAX_FAILURE_RATE 128      // Out of 256, see struct rf_command_stats
+#define HEALTH_MAX_LATENCY_DRIFT 4       // p99 against the baseline
+#define HEALTH_MIN_LATENCY_DRIFT_US 5000 // Below this drift is noise
+#define HEALTH_REINIT_BASE_DELAY_MS 500
+#define HEALTH_REINIT_MAX_DELAY_MS 30000
+#define HEALTH_MAX_REINIT_ATTEMPTS 8     // In a row, then the reader is given up
+#define POOL_POLL_INTERVAL_US 50000
+#define POOL_REMOVAL_POLL_US 100000
+
+/* Reader states */
+#define READER_HEALTHY 0
+#define READER_QUARANTINED 1 // Waiting for the background re-init
+#define READER_FAILED 2      // Could not be re-initialized, given up
+
+struct pool_reader {
+    nfc_connstring connstring;
+    nfc_device *device;
+    nfc_target target;
+    atomic_int state;
+
+    // Health
+    uint32_t baseline_p99;
+    unsigned int consecutive_errors;
+    uint64_t tags;
+    uint64_t errors;
+    uint64_t quarantines;
+    uint64_t reinits;
+    char quarantine_reason[48];
+
+    // Re-init backoff, only touched by the background thread
+    unsigned int reinit_attempts;
+    unsigned int reinit_delay_ms;
+    uint64_t next_reinit_us;
+};
+
+/*
+ * Every reader listed by nfc_list_devices(). Tags are polled on the healthy
+ * readers in turn, so work moves to whatever readers are still healthy. A
+ * reader that keeps failing, or could not be opened, is quarantined: the
+ * background thread closes, reopens and re-initializes it with exponential
+ * backoff, and it is polled again once that succeeds.
+ */
+struct reader_pool {
+    nfc_context *context;
+    struct pool_reader readers[MAX_DEVICE_COUNT];
+    size_t count;
+    size_t next;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool running;
+};
+
+size_t reader_pool_open(struct reader_pool *pool, nfc_context *context);
+struct pool_reader *reader_pool_wait_for_tag(struct reader_pool *pool);
+void reader_pool_wait_for_removal(struct pool_reader *reader);
+void reader_pool_report(struct reader_pool *pool, struct pool_reader *reader, bool ok);
+void reader_pool_recover(struct reader_pool *pool, struct pool_reader *reader);
+void reader_pool_print_health(struct reader_pool *pool);
+void reader_pool_close(struct reader_pool *pool);
+
+#endif // __NFC_SRIX_READER_POOL_H__
@@ -18,14 +18,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <nfc/nfc.h>
-#include <sys/stat.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
 #include "logging.h"
 #include "nfc_utils.h"
+#include "dump_utils.h"
+#include "readback.h"
+#include "write_plan.h"
+#include "srix_image.h"
+#include "cancel.h"
+#include "command_plan.h"
+#include "reader_pool.h"
+#include "spool.h"
+#include "telemetry.h"
+#include "history.h"
+
+// Write history, NULL unless --history was given
+static struct history *history = NULL;
 
 static void print_usage(const char *executable) {
-    printf("Usage: %s <dump.bin> [-h] [-v] [-y] [-t x4k|512]\n", executable);
+    printf("Usage: %s <dump.bin> [-h] [-v] [-y] [-t x4k|512] [--deadline-ms ms] [--history log] [--plan] [--current current.bin] [--latency-us uid,read,write]\n", executable);
+    printf("       %s --spool dir [--match uid|fifo] [-h] [-v] [-y] [-t x4k|512] [--deadline-ms ms] [--history log]\n", executable);
     printf("\nNecessary arguments:\n");
     printf("  <dump.bin>   path to the dump file\n");
     printf("\nOptions:\n");
@@ -33,17 +49,373 @@ static void print_usage(const char *executable) {
     printf("  -v           enable verbose - print debugging data\n");
     printf("  -y           answer YES to all questions\n");
     printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  --deadline-ms ms\n");
+    printf("               give up after this long, time spent on questions excluded\n");
+    printf("  --history log\n");
+    printf("               append every write to this history log, see srix-history\n");
+    printf("  --plan       print the RF commands and the expected time as JSON, write nothing\n");
+    printf("  --current current.bin\n");
+    printf("               plan against this dump instead of the tag on the reader\n");
+    printf("  --latency-us uid,read,write\n");
+    printf("               command times used by --plan [default: measured on the tag, or %d,%d,%d]\n",
+            COMMAND_GET_UID_TIME_US, PLAN_READ_TIME_US, PLAN_WRITE_TIME_US);
+    printf("  --spool dir  restore every dump dropped in dir to its tag, until interrupted\n");
+    printf("  --match uid|fifo\n");
+    printf("               give each tag the job named after its UID, or the oldest job [default: uid]\n");
+}
+
+static void load_image(struct srix_image *image, const char *file_path) {
+    lverbose("Reading \"%s\"...\n", file_path);
+    size_t file_size = 0;
+    int load_result = srix_image_load(image, file_path, &file_size);
+    if (load_result == DUMP_EOPEN) {
+        lerror("Cannot open \"%s\". Exiting...\n", file_path);
+        exit(1);
+    } else if (load_result == DUMP_ESIZE) {
+        lerror("File wrong size, expected %zu but read %zu. Exiting...\n", srix_image_size(image), file_size);
+        exit(1);
+    } else if (load_result != DUMP_SUCCESS) {
+        lerror("Error encountered while reading file: %s. Exiting...\n", srix_dump_strerror(load_result));
+        exit(1);
+    }
+}
+
+// Same commands as a run with -y: read everything, write in plan order, verify
+static void print_plan(const struct srix_image *tag, const struct srix_image *dump, const struct plan_latency *latency, const char *source) {
+    struct command_plan *commands = malloc(sizeof(struct command_plan));
+    if (commands == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+    command_plan_init(commands);
+    for (uint8_t i = 0; i < tag->blocks; i++) {
+        command_plan_add(commands, COMMAND_READ, i, 0);
+    }
+    command_plan_add(commands, COMMAND_READ, SRIX_SYSTEM_BLOCK, 0);
+
+    const char *outcome = "already_restored";
+    struct write_plan plan = {};
+    if (memcmp(dump->bytes, tag->bytes, srix_image_size(tag)) != 0) {
+        srix_plan_writes(&plan, tag, dump, true);
+        command_plan_add_writes(commands, &plan);
+        outcome = plan.writes > 0 ? "restore" : "nothing_to_write";
+    }
+
+    log_flush();
+    command_plan_print_json(commands, latency, source, outcome, &plan);
+    free(commands);
+}
+
+// Every block and the system block for the lock bits
+static bool read_tag(nfc_device *reader, struct srix_image *tag) {
+    lverbose("Reading %d blocks...\n", tag->blocks);
+    uint8_t blocks_read = nfc_srix_read_blocks(reader, tag->bytes, 0, tag->blocks);
+    for (uint8_t i = 0; i < blocks_read; i++) {
+        srix_image_mark_present(tag, i);
+    }
+
+    // Check for errors
+    if (blocks_read != tag->blocks) {
+        if (!cancel_requested()) lerror("Error while reading block %d.\n", blocks_read);
+        return false;
+    }
+
+    uint8_t system_block_bytes_read = nfc_srix_read_block(reader, tag->system_block, SRIX_SYSTEM_BLOCK);
+    if (system_block_bytes_read != 4) {
+        if (!cancel_requested()) lerror("Error while reading block %d.\n", SRIX_SYSTEM_BLOCK);
+        lverbose("Received %d bytes instead of 4.\n", system_block_bytes_read);
+        return false;
+    }
+    tag->has_system_block = true;
+
+    return true;
+}
+
+// Writes in plan order, nothing is started once cancelled. Returns how many blocks still differ.
+static size_t write_and_verify(nfc_device *reader, const struct write_plan *plan, struct srix_write *writes, size_t *writes_count) {
+    *writes_count = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct plan_entry *entry = &plan->entries[i];
+        if (entry->action != PLAN_WRITE) {
+            continue;
+        }
+        if (cancel_requested()) {
+            return *writes_count;
+        }
+
+        nfc_write_block(reader, entry->to, entry->block);
+        srix_write_init(&writes[(*writes_count)++], entry->block, entry->to);
+    }
+
+    // Read back only what was written
+    return srix_readback_verify(reader, writes, *writes_count, READBACK_MAX_RETRIES, READBACK_BASE_DELAY_US);
+}
+
+// Every attempted write is recorded, failed and cancelled ones included
+static void record_history(nfc_device *reader, const struct srix_image *tag, const struct write_plan *plan, const struct srix_write *writes, size_t writes_count, size_t failed) {
+    if (history == NULL || writes_count == 0) {
+        return;
+    }
+
+    static struct history_entry entry;
+    history_entry_init(&entry, HISTORY_TOOL_RESTORE, tag->uid, nfc_device_get_connstring(reader));
+    for (size_t i = 0; i < writes_count; i++) {
+        history_entry_add_write(&entry, &writes[i], srix_image_block(tag, writes[i].block));
+    }
+
+    if (cancel_requested()) {
+        entry.outcome = HISTORY_OUTCOME_CANCELLED;
+    } else if (failed > 0) {
+        entry.outcome = HISTORY_OUTCOME_FAILED;
+    } else if (plan->skipped_impossible > 0) {
+        entry.outcome = HISTORY_OUTCOME_INCOMPLETE;
+    }
+    history_record(history, &entry);
+}
+
+static void close_history(void) {
+    int result = history_close(history);
+    if (result != HISTORY_SUCCESS) {
+        lwarning("History incomplete: %s.\n", history_strerror(result));
+    }
+}
+
+static bool read_uid(nfc_device *reader, struct srix_image *tag) {
+    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
+    if (nfc_srix_get_uid(reader, uid_rx_bytes) != 8) {
+        if (!cancel_requested()) lerror("Error while reading UID.\n");
+        return false;
+    }
+
+    srix_image_set_uid_bytes(tag, uid_rx_bytes);
+    log_flush();
+    printf("UID: %016" PRIX64 "\n", tag->uid);
+    return true;
+}
+
+static void exit_cancelled(nfc_context *context, nfc_device *reader, const struct srix_image *tag, const struct srix_write *writes, size_t writes_count) {
+    uint8_t written[PLAN_MAX_ENTRIES];
+    for (size_t i = 0; i < writes_count; i++) {
+        written[i] = writes[i].block;
+    }
+
+    cancel_print_partial(tag, written, writes_count);
+    int exit_code = cancel_exit_code();
+    cancel_disarm();
+    close_nfc(context, reader);
+    exit(exit_code);
+}
+
+static bool ask_confirmation(void) {
+    cancel_pause();
+    char c = 'n';
+    scanf(" %c", &c);
+    cancel_resume();
+    return c == 'Y' || c == 'y';
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+// Returns false when nothing was written and the job can go to another tag
+static bool restore_job(nfc_device *reader, const struct srix_image *tag, struct spool_job *job) {
+    job->tag_uid = tag->uid;
+    if (memcmp(job->image.bytes, tag->bytes, srix_image_size(tag)) == 0) {
+        printf("Tag already restored.\n");
+        job->ok = true;
+        job->status = "already_restored";
+        return true;
+    }
+
+    // Unattended, the job is the whole image
+    struct write_plan plan;
+    srix_plan_writes(&plan, tag, &job->image, true);
+    srix_plan_print(&plan);
+    log_flush();
+
+    struct srix_write writes[PLAN_MAX_ENTRIES];
+    size_t writes_count = 0;
+    size_t failed = write_and_verify(reader, &plan, writes, &writes_count);
+    record_history(reader, tag, &plan, writes, writes_count, failed);
+    job->writes = writes_count;
+    job->failed_blocks = failed;
+    if (cancel_requested() && writes_count == 0) {
+        return false;
+    }
+    log_flush();
+    srix_readback_print_summary(writes, writes_count);
+
+    if (cancel_requested()) {
+        job->status = "cancelled";
+        snprintf(job->detail, sizeof(job->detail), "%s after %zu writes", cancel_reason() == CANCEL_DEADLINE ? "deadline" : "signal", writes_count);
+    } else if (failed > 0) {
+        job->status = "failed";
+        snprintf(job->detail, sizeof(job->detail), "%zu blocks could not be written", failed);
+    } else if (plan.skipped_impossible > 0) {
+        job->status = "failed";
+        snprintf(job->detail, sizeof(job->detail), "%zu blocks need OTP bits back to 1 or a counter to count up", plan.skipped_impossible);
+    } else {
+        job->ok = true;
+        job->status = "restored";
+        if (plan.skipped_locked > 0) {
+            snprintf(job->detail, sizeof(job->detail), "%zu locked blocks skipped", plan.skipped_locked);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Spool mode: one session on every reader, each presented tag gets its job.
+ * Jobs are loaded by the spool thread before the tag shows up and moved by
+ * it once finished, this thread only talks to the readers.
+ */
+static int run_spool(const char *spool_path, int match, uint8_t eeprom_blocks_amount, unsigned int deadline_ms, bool skip_confirmation) {
+    static struct spool spool;
+
+    // The only question is asked once, before the first tag
+    if (!skip_confirmation) {
+        printf("Every job in \"%s\" will be written to its tag, blocks 00-06 included.\n", spool_path);
+        printf("This action is irreversible.\n");
+        printf("Are you sure? [Y/N] ");
+        if (!ask_confirmation()) {
+            printf("Exiting...\n");
+            return 0;
+        }
+    }
+
+    int spool_result = spool_open(&spool, spool_path, eeprom_blocks_amount, match);
+    if (spool_result != SPOOL_SUCCESS) {
+        lerror("Cannot open spool \"%s\": %s. Exiting...\n", spool_path, spool_strerror(spool_result));
+        return 1;
+    }
+
+    // Initialize NFC
+    nfc_context *context = NULL;
+    nfc_init(&context);
+    if (context == NULL) {
+        lerror("Unable to init libnfc. Exiting...\n");
+        spool_close(&spool);
+        return 1;
+    }
+    lverbose("libnfc version: %s\n", nfc_version());
+
+    // Open every reader
+    struct reader_pool pool;
+    if (reader_pool_open(&pool, context) == 0) {
+        lerror("No readers available. Exiting...\n");
+        reader_pool_close(&pool);
+        close_nfc(context, NULL);
+        spool_close(&spool);
+        return 1;
+    }
+
+    unsigned int unmatched = 0;
+    bool readers_failed = false;
+    while (!cancel_requested()) {
+        // In FIFO order a tag is only worth waiting for with a job ready
+        if (match == SPOOL_MATCH_FIFO && !spool_wait(&spool, 0)) {
+            log_flush();
+            printf("Waiting for jobs...\n");
+            while (!spool_wait(&spool, SPOOL_POLL_INTERVAL_MS) && !cancel_requested());
+            if (cancel_requested()) break;
+        }
+
+        log_flush();
+        printf("Waiting for tag...\n");
+        struct pool_reader *reader = reader_pool_wait_for_tag(&pool);
+        if (reader == NULL) {
+            if (!cancel_requested()) {
+                lerror("Every reader has failed.\n");
+                readers_failed = true;
+            }
+            break;
+        }
+        lverbose("Tag on %s.\n", reader->connstring);
+
+        // The deadline is per tag
+        uint64_t start_us = now_us();
+        cancel_arm(reader->device, deadline_ms);
+        struct srix_image *tag = srix_image_acquire(eeprom_blocks_amount);
+        struct spool_job *job = NULL;
+        bool ok = true;
+
+        ok = read_uid(reader->device, tag) && read_tag(reader->device, tag);
+
+        if (ok && (job = spool_take(&spool, tag->uid)) == NULL) {
+            printf("No job for this tag.\n");
+            unmatched++;
+        }
+        if (job != NULL) {
+            printf("Job: %s\n", job->name);
+            if (restore_job(reader->device, tag, job)) {
+                job->elapsed_ms = (now_us() - start_us) / 1000u;
+                ok = job->failed_blocks == 0;
+                spool_finish(&spool, job);
+            } else {
+                spool_return(&spool, job);
+            }
+        }
+        bool cancelled = cancel_requested();
+        cancel_disarm();
+        srix_image_release(tag);
+        telemetry_tag_done(reader->device);
+
+        // Aborted commands leave the reader idle, make sure it still answers
+        if (cancelled) {
+            reader_pool_recover(&pool, reader);
+        }
+        if (!cancel_requested()) {
+            log_flush();
+            reader_pool_wait_for_removal(reader);
+        }
+        reader_pool_report(&pool, reader, ok || cancelled);
+    }
+
+    // Jobs still finishing are moved before the totals
+    spool_close(&spool);
+    log_flush();
+    printf("Jobs: %u done, %u failed, %u invalid, %u tags without a job.\n", spool.done, spool.failed, spool.invalid, unmatched);
+    reader_pool_print_health(&pool);
+
+    reader_pool_close(&pool);
+    close_nfc(context, NULL);
+
+    if (cancel_reason() == CANCEL_SIGNAL) {
+        return cancel_exit_code();
+    }
+    return spool.failed > 0 || spool.invalid > 0 || readers_failed ? 1 : 0;
 }
 
 int main(int argc, char *argv[], char *envp[]) {
     // Options
-    uint16_t eeprom_size = SRIX4K_EEPROM_SIZE;
     uint8_t eeprom_blocks_amount = SRIX4K_EEPROM_BLOCKS;
     bool skip_confirmation = false;
+    unsigned int deadline_ms = 0;
+    bool plan_only = false;
+    char *current_path = NULL;
+    char *spool_path = NULL;
+    int match = SPOOL_MATCH_UID;
+    char *history_path = NULL;
+    struct plan_latency latency;
+    plan_latency_init(&latency);
 
     // Parse options
+    static const struct option long_options[] = {
+            {"deadline-ms", required_argument, NULL, 'D'},
+            {"plan", no_argument, NULL, 'P'},
+            {"current", required_argument, NULL, 'C'},
+            {"latency-us", required_argument, NULL, 'L'},
+            {"spool", required_argument, NULL, 'S'},
+            {"match", required_argument, NULL, 'M'},
+            {"history", required_argument, NULL, 'W'},
+            {NULL, 0, NULL, 0},
+    };
     int opt = 0;
-    while ((opt = getopt(argc, argv, "hvyt:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvyt:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'v':
                 set_verbose(true);
@@ -53,10 +425,41 @@ int main(int argc, char *argv[], char *envp[]) {
                 break;
             case 't':
                 if (strcmp(optarg, "512") == 0) {
-                    eeprom_size = SRI512_EEPROM_SIZE;
                     eeprom_blocks_amount = SRI512_EEPROM_BLOCKS;
                 }
                 break;
+            case 'D':
+                deadline_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                plan_only = true;
+                break;
+            case 'C':
+                current_path = optarg;
+                plan_only = true;
+                break;
+            case 'L':
+                if (!plan_latency_parse(&latency, optarg)) {
+                    lerror("Invalid latencies \"%s\", expected uid,read,write in us.\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                spool_path = optarg;
+                break;
+            case 'W':
+                history_path = optarg;
+                break;
+            case 'M':
+                if (strcmp(optarg, "fifo") == 0) {
+                    match = SPOOL_MATCH_FIFO;
+                } else if (strcmp(optarg, "uid") != 0) {
+                    lerror("Invalid match \"%s\", expected uid or fifo.\n\n", optarg);
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
             default:
             case 'h':
                 print_usage(argv[0]);
@@ -65,13 +468,52 @@ int main(int argc, char *argv[], char *envp[]) {
     }
 
     // Check arguments
-    if ((argc - optind) < 1) {
+    if (spool_path != NULL && plan_only) {
+        lerror("--plan cannot be used in spool mode.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+    if (spool_path == NULL && (argc - optind) < 1) {
         lerror("You need to specify a path for <dump.bin>.\n\n");
         print_usage(argv[0]);
         exit(1);
     }
 
+    // Start background logging
+    log_start();
+    cancel_init();
+
+    // Flushed on every exit, after the last write
+    static struct history history_log;
+    if (history_path != NULL && !plan_only) {
+        int history_result = history_open(&history_log, history_path);
+        if (history_result != HISTORY_SUCCESS) {
+            lerror("Cannot open \"%s\": %s. Exiting...\n", history_path, history_strerror(history_result));
+            exit(1);
+        }
+        history = &history_log;
+        atexit(close_history);
+    }
+
+    // Spool mode takes its dumps from the directory
+    if (spool_path != NULL) {
+        telemetry_open("srix-restore");
+        return run_spool(spool_path, match, eeprom_blocks_amount, deadline_ms, skip_confirmation);
+    }
+
+    // Planning against a dump needs no reader
+    char *file_path = argv[optind];
+    struct srix_image *dump = srix_image_acquire(eeprom_blocks_amount);
+    if (current_path != NULL) {
+        struct srix_image *current = srix_image_acquire(eeprom_blocks_amount);
+        load_image(dump, file_path);
+        load_image(current, current_path);
+        print_plan(current, dump, &latency, "dump");
+        exit(0);
+    }
+
     // Initialize NFC
+    telemetry_open("srix-restore");
     nfc_context *context = NULL;
     nfc_device *reader = NULL;
     nfc_init(&context);
@@ -124,6 +566,9 @@ int main(int argc, char *argv[], char *envp[]) {
 
     lverbose("NFC reader: %s\n", nfc_device_get_name(reader));
 
+    // Deadline covers waiting for the tag too
+    cancel_arm(reader, deadline_ms);
+
     nfc_target target_key[MAX_TARGET_COUNT];
 
     /*
@@ -132,7 +577,8 @@ int main(int argc, char *argv[], char *envp[]) {
      *
      * https://github.com/nfc-tools/libnfc/issues/436#issuecomment-326686914
      */
-    lverbose("Searching for ISO14443B targets... found %d.\n", nfc_initiator_list_passive_targets(reader, nmISO14443B, target_key, MAX_TARGET_COUNT));
+    int ISO14443B_targets = nfc_initiator_list_passive_targets(reader, nmISO14443B, target_key, MAX_TARGET_COUNT);
+    lverbose("Searching for ISO14443B targets... found %d.\n", ISO14443B_targets);
 
     lverbose("Searching for ISO14443B2SR targets...");
     int ISO14443B2SR_targets = nfc_initiator_list_passive_targets(reader, nmISO14443B2SR, target_key, MAX_TARGET_COUNT);
@@ -140,120 +586,109 @@ int main(int argc, char *argv[], char *envp[]) {
 
     // Check for tags
     if (ISO14443B2SR_targets == 0) {
-        printf("Waiting for tag...\n");
+        // With --plan stdout is left to the plan
+        if (!plan_only) {
+            log_flush();
+            printf("Waiting for tag...\n");
+        }
 
         // Infinite select for tag
+        telemetry_operation(reader, TELEMETRY_OP_WAITING);
         if (nfc_initiator_select_passive_target(reader, nmISO14443B2SR, NULL, 0, target_key) <= 0) {
+            if (cancel_requested()) exit_cancelled(context, reader, NULL, NULL, 0);
             lerror("nfc_initiator_select_passive_target => %s\n", nfc_strerror(reader));
             close_nfc(context, reader);
             exit(1);
         }
     }
 
-    char *file_path = argv[optind];
-    uint8_t *dump_bytes = malloc(sizeof(uint8_t) * eeprom_size);
+    // Load file
+    load_image(dump, file_path);
 
-    // Open file
-    lverbose("Reading \"%s\"...\n", file_path);
-    FILE *fp = fopen(file_path, "rb");
-    if (fp == NULL) {
-        lerror("Cannot open \"%s\". Exiting...\n", file_path);
+    // Read EEPROM, the history is keyed by UID
+    struct srix_image *tag = srix_image_acquire(eeprom_blocks_amount);
+    if ((history != NULL && !read_uid(reader, tag)) || !read_tag(reader, tag)) {
+        if (cancel_requested()) exit_cancelled(context, reader, tag, NULL, 0);
+        close_nfc(context, reader);
         exit(1);
     }
+    log_flush();
 
-    // Check file size
-    int fd = fileno(fp);
-    struct stat file_stat;
-    if (fstat(fd, &file_stat) < 0) {
-        lerror("Error doing fstat. Exiting...\n");
-        exit(1);
-    }
-    if (file_stat.st_size < eeprom_size) {
-        lerror("File wrong size, expected %llu but read %llu. Exiting...\n", eeprom_size, file_stat.st_size);
-        exit(1);
+    // Timings of the reads just done are the best guess for the real run
+    if (plan_only) {
+        cancel_disarm();
+        if (strcmp(latency.source, "configured") != 0) {
+            plan_latency_measure(&latency, reader);
+        }
+        print_plan(tag, dump, &latency, "tag");
+        close_nfc(context, reader);
+        exit(0);
     }
 
-    // Read file
-    fseek(fp, 0, SEEK_SET);
-    if (fread(dump_bytes, eeprom_size, 1, fp) != 1) {
-        lerror("Error encountered while reading file. Exiting...\n");
-        exit(1);
+    if (memcmp(dump->bytes, tag->bytes, srix_image_size(tag)) == 0) {
+        telemetry_tag_done(reader);
+        printf("Tag already restored.\n");
+        close_nfc(context, reader);
+        exit(0);
     }
-    fclose(fp);
 
-    // Read EEPROM
-    uint8_t *eeprom_bytes = malloc(sizeof(uint8_t) * eeprom_size);
-    lverbose("Reading %d blocks...\n", eeprom_blocks_amount);
-    for (int i = 0; i < eeprom_blocks_amount; i++) {
-        uint8_t *current_block = eeprom_bytes + (i * 4);
-        uint8_t block_bytes_read = nfc_srix_read_block(reader, current_block, i);
-
-        // Check for errors
-        if (block_bytes_read != 4) {
-            lerror("Error while reading block %d. Exiting...\n", i);
-            lverbose("Received %d bytes instead of 4.\n", block_bytes_read);
-            close_nfc(context, reader);
-            exit(1);
-        }
+    // Ask for OTP area
+    bool write_otp_area = true;
+    if (srix_plan_touches_otp_area(tag, dump) && !skip_confirmation) {
+        printf("The dump differs in the OTP and counter area (blocks 00-06).\n");
+        printf("Do you want to write those blocks too? [Y/N] ");
+        write_otp_area = ask_confirmation();
     }
+    if (cancel_requested()) exit_cancelled(context, reader, tag, NULL, 0);
 
     // Preview write
-    bool is_equal = true;
-    for (uint8_t i = 7; i < eeprom_blocks_amount; i++) {
-        uint32_t dump_block = dump_bytes[(i*4)+0] << 24u | dump_bytes[(i*4)+1] << 16u | dump_bytes[(i*4)+2] << 8u | dump_bytes[(i*4)+3];
-        uint32_t eeprom_block = eeprom_bytes[(i*4)+0] << 24u | eeprom_bytes[(i*4)+1] << 16u | eeprom_bytes[(i*4)+2] << 8u | eeprom_bytes[(i*4)+3];
-
-        if (dump_block != eeprom_block) {
-            is_equal = false;
-            printf("[%02X] %08X -> %08X\n", i, dump_block, eeprom_block);
-        }
-    }
+    struct write_plan plan;
+    srix_plan_writes(&plan, tag, dump, write_otp_area);
+    srix_plan_print(&plan);
+    log_flush();
 
-    if (!is_equal) {
-        // Ask for confirmation
-        if (!skip_confirmation) {
-            printf("This action is irreversible.\n");
-            printf("Are you sure? [Y/N] ");
-            char c = 'n';
-            scanf(" %c", &c);
-            if (c != 'Y' && c != 'y') {
-                printf("Exiting...\n");
-                exit(0);
-            }
-        }
+    if (plan.writes == 0) {
+        printf("Nothing to write.\n");
+        close_nfc(context, reader);
+        exit(plan.skipped_impossible > 0 ? 1 : 0);
+    }
 
-        // Ask for OTP area
-        bool write_otp_area = true;
-        if (!skip_confirmation) {
-            printf("This action is irreversible.\n");
-            printf("Are you sure? [Y/N] ");
-            char c = 'n';
-            scanf(" %c", &c);
-            if (c != 'Y' && c != 'y') {
-                write_otp_area = false;
-            }
+    // Ask for confirmation
+    if (!skip_confirmation) {
+        printf("This action is irreversible.\n");
+        printf("Are you sure? [Y/N] ");
+        if (!ask_confirmation()) {
+            if (cancel_requested()) exit_cancelled(context, reader, tag, NULL, 0);
+            printf("Exiting...\n");
+            close_nfc(context, reader);
+            exit(0);
         }
+    }
 
+    struct srix_write writes[PLAN_MAX_ENTRIES];
+    size_t writes_count = 0;
+    size_t failed = write_and_verify(reader, &plan, writes, &writes_count);
+    record_history(reader, tag, &plan, writes, writes_count, failed);
+    if (cancel_requested()) exit_cancelled(context, reader, tag, writes, writes_count);
+    cancel_disarm();
+    log_flush();
+    srix_readback_print_summary(writes, writes_count);
+    telemetry_tag_done(reader);
+    if (failed > 0) {
+        lerror("%zu blocks could not be written. Exiting...\n", failed);
+        close_nfc(context, reader);
+        exit(1);
+    }
 
-
-        for (uint8_t i = 0; i < eeprom_blocks_amount; i++) {
-            // Skip critical sectors
-            if (!write_otp_area) {
-                continue;
-            }
-
-            uint32_t dump_block = dump_bytes[(i*4)+0] << 24u | dump_bytes[(i*4)+1] << 16u | dump_bytes[(i*4)+2] << 8u | dump_bytes[(i*4)+3];
-            uint32_t eeprom_block = eeprom_bytes[(i*4)+0] << 24u | eeprom_bytes[(i*4)+1] << 16u | eeprom_bytes[(i*4)+2] << 8u | eeprom_bytes[(i*4)+3];
-
-            if (dump_block != eeprom_block) {
-                nfc_write_block(reader, dump_block, i);
-            }
-        }
-    } else {
-        printf("Tag already restored.\n");
+    // Impossible writes were reported with the plan
+    if (plan.skipped_impossible > 0) {
+        close_nfc(context, reader);
+        exit(1);
     }
 
     // Close NFC
+    srix_image_release(dump);
+    srix_image_release(tag);
     close_nfc(context, reader);
 
     return 0;
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <nfc/nfc.h>
+#include "rf_tuning.h"
+#include "nfc_utils.h"
+#include "logging.h"
+
+// One session per opened reader
+static struct rf_tuning sessions[MAX_DEVICE_COUNT];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *command_names[TUNING_COMMAND_TYPES] = {"GET_UID", "READ_BLOCK", "WRITE_BLOCK", "OTHER"};
+
+// Expected answer length, 0 when the tag does not answer
+static const size_t command_rx_size[TUNING_COMMAND_TYPES] = {8, 4, 0, 0};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static unsigned int command_type(const uint8_t *tx_data, size_t tx_size) {
+    if (tx_size == 1 && tx_data[0] == SR_GET_UID_COMMAND) return TUNING_GET_UID;
+    if (tx_size == 2 && tx_data[0] == SR_READ_BLOCK_COMMAND) return TUNING_READ_BLOCK;
+    if (tx_size == 6 && tx_data[0] == SR_WRITE_BLOCK_COMMAND) return TUNING_WRITE_BLOCK;
+    return TUNING_OTHER;
+}
+
+const char *rf_tuning_command_name(unsigned int type) {
+    return type < TUNING_COMMAND_TYPES ? command_names[type] : "?";
+}
+
+struct rf_tuning *rf_tuning_get(nfc_device *reader) {
+    for (int i = 0; i < MAX_DEVICE_COUNT; i++) {
+        if (sessions[i].reader == reader) {
+            return &sessions[i];
+        }
+    }
+
+    struct rf_tuning *tuning = NULL;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_DEVICE_COUNT; i++) {
+        if (sessions[i].reader == NULL) {
+            tuning = &sessions[i];
+            memset(tuning, 0, sizeof(struct rf_tuning));
+            tuning->reader = reader;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    return tuning;
+}
+
+// Prints the final settings in verbose mode and frees the session
+void rf_tuning_close(nfc_device *reader) {
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_DEVICE_COUNT; i++) {
+        if (sessions[i].reader == reader) {
+            rf_tuning_print(&sessions[i]);
+            sessions[i].reader = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// 0 until the first successful command
+uint32_t rf_tuning_median_us(const struct rf_command_stats *stats) {
+    uint32_t count = stats->rtt_count < TUNING_RTT_SAMPLES ? stats->rtt_count : TUNING_RTT_SAMPLES;
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t sorted[TUNING_RTT_SAMPLES];
+    memcpy(sorted, stats->rtt, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), compare_u32);
+    return sorted[count / 2];
+}
+
+static void update_timeout(struct rf_command_stats *stats, unsigned int type) {
+    uint32_t count = stats->rtt_count < TUNING_RTT_SAMPLES ? stats->rtt_count : TUNING_RTT_SAMPLES;
+    if (count < TUNING_WARMUP_SAMPLES) {
+        return;
+    }
+
+    uint32_t sorted[TUNING_RTT_SAMPLES];
+    memcpy(sorted, stats->rtt, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), compare_u32);
+    stats->rtt_p99 = sorted[(count * 99 + 99) / 100 - 1];
+
+    uint32_t timeout_us = stats->rtt_p99 + stats->rtt_p99 / 4 + TUNING_MARGIN_US;
+    int timeout_ms = (int) ((timeout_us + 999) / 1000);
+    if (timeout_ms < TUNING_MIN_TIMEOUT_MS) timeout_ms = TUNING_MIN_TIMEOUT_MS;
+    if (timeout_ms > TUNING_MAX_TIMEOUT_MS) timeout_ms = TUNING_MAX_TIMEOUT_MS;
+
+    if (timeout_ms != stats->timeout_ms) {
+        lverbose("%s timeout %d -> %d ms (p99 %u us, %u%% failures)\n", command_names[type], stats->timeout_ms, timeout_ms,
+                stats->rtt_p99, stats->failure_rate * 100 / 256);
+        stats->timeout_ms = timeout_ms;
+    }
+}
+
+static void record_success(struct rf_command_stats *stats, unsigned int type, uint32_t rtt_us) {
+    stats->rtt[stats->rtt_count % TUNING_RTT_SAMPLES] = rtt_us;
+    stats->rtt_count++;
+    stats->failure_rate -= stats->failure_rate / 16;
+    stats->consecutive_failures = 0;
+
+    // Sorting 64 samples on every command is not worth it
+    if (stats->rtt_count <= TUNING_WARMUP_SAMPLES || stats->rtt_count % TUNING_WARMUP_SAMPLES == 0) {
+        update_timeout(stats, type);
+    }
+}
+
+static void record_failure(struct rf_command_stats *stats, unsigned int type, int result) {
+    stats->failures++;
+    stats->failure_rate += (256 - stats->failure_rate) / 16;
+    stats->consecutive_failures++;
+
+    // A timeout may just mean p99 was underestimated, widen it until the next update
+    if (result == NFC_ETIMEOUT && stats->timeout_ms > 0 && stats->timeout_ms < TUNING_MAX_TIMEOUT_MS) {
+        int timeout_ms = stats->timeout_ms * 2;
+        stats->timeout_ms = timeout_ms < TUNING_MAX_TIMEOUT_MS ? timeout_ms : TUNING_MAX_TIMEOUT_MS;
+        lverbose("%s timed out, timeout -> %d ms\n", command_names[type], stats->timeout_ms);
+    }
+}
+
+static bool is_transient(int result) {
+    return result == NFC_ETIMEOUT || result == NFC_ERFTRANS || result == NFC_EIO || result >= 0;
+}
+
+int rf_tuning_transceive(nfc_device *reader, const uint8_t *tx_data, size_t tx_size, uint8_t *rx_data, size_t rx_size) {
+    unsigned int type = command_type(tx_data, tx_size);
+    struct rf_tuning *tuning = rf_tuning_get(reader);
+
+    // No session left or nothing to tune, behave like libnfc
+    if (tuning == NULL || type == TUNING_WRITE_BLOCK || type == TUNING_OTHER) {
+        if (tuning != NULL) tuning->commands[type].commands++;
+        return nfc_initiator_transceive_bytes(reader, tx_data, tx_size, rx_data, rx_size, 0);
+    }
+
+    struct rf_command_stats *stats = &tuning->commands[type];
+    int result = NFC_ETIMEOUT;
+    for (unsigned int attempt = 0; attempt <= TUNING_MAX_RETRIES; attempt++) {
+        if (attempt > 0) {
+            stats->retries++;
+
+            // Unstable field, give it time to settle
+            if (stats->failure_rate > TUNING_UNSTABLE_RATE) {
+                unsigned int shift = stats->consecutive_failures < 6 ? stats->consecutive_failures : 6;
+                unsigned int delay_us = TUNING_BACKOFF_BASE_US << shift;
+                usleep(delay_us < TUNING_BACKOFF_MAX_US ? delay_us : TUNING_BACKOFF_MAX_US);
+            }
+        }
+
+        stats->commands++;
+        uint64_t start = now_us();
+        result = nfc_initiator_transceive_bytes(reader, tx_data, tx_size, rx_data, rx_size, stats->timeout_ms);
+        uint32_t rtt_us = (uint32_t) (now_us() - start);
+
+        if (result >= 0 && (size_t) result == command_rx_size[type]) {
+            record_success(stats, type, rtt_us);
+            return result;
+        }
+
+        // Cancelled on purpose, says nothing about the field
+        if (result == NFC_EOPABORTED) {
+            break;
+        }
+
+        // Short frames count as failures too
+        lverbose("%s failed (%d) after %u us, attempt %u\n", command_names[type], result, rtt_us, attempt + 1);
+        record_failure(stats, type, result);
+        if (!is_transient(result)) {
+            break;
+        }
+    }
+
+    return result;
+}
+
+void rf_tuning_print(const struct rf_tuning *tuning) {
+    lverbose("RF timeouts:\n");
+    for (unsigned int type = 0; type < TUNING_COMMAND_TYPES; type++) {
+        const struct rf_command_stats *stats = &tuning->commands[type];
+        char timeout[16] = "default";
+        if (stats->timeout_ms != 0) {
+            snprintf(timeout, sizeof(timeout), "%d ms", stats->timeout_ms);
+        }
+        lverbose("%s %-11s %s, p99 %u us, %" PRIu64 " commands, %" PRIu64 " failures, %" PRIu64 " retries\n",
+                type == TUNING_COMMAND_TYPES - 1 ? "└──" : "├──", command_names[type], timeout,
+                stats->rtt_p99, stats->commands, stats->failures, stats->retries);
+    }
+
+    // Every attempt is a host round trip, rtt_count only counts answered ones
+    const struct rf_command_stats *reads = &tuning->commands[TUNING_READ_BLOCK];
+    if (reads->rtt_count > 0) {
+        lverbose("Host round trips per block read: %.2f\n", (double) reads->commands / (double) reads->rtt_count);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_RF_TUNING_H__
+#define __NFC_SRIX_RF_TUNING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <nfc/nfc.h>
+
+/* Macros */
+#define TUNING_RTT_SAMPLES 64      // Window used for the p99, must be a power of two
+#define TUNING_WARMUP_SAMPLES 8    // libnfc default timeout until then
+#define TUNING_MIN_TIMEOUT_MS 5
+#define TUNING_MAX_TIMEOUT_MS 500
+#define TUNING_MARGIN_US 2000      // Added to p99 + 25%
+#define TUNING_MAX_RETRIES 3
+#define TUNING_UNSTABLE_RATE 64    // Failure rate (out of 256) above which retries back off
+#define TUNING_BACKOFF_BASE_US 2000
+#define TUNING_BACKOFF_MAX_US 64000
+
+/* Command types */
+#define TUNING_GET_UID 0
+#define TUNING_READ_BLOCK 1
+#define TUNING_WRITE_BLOCK 2
+#define TUNING_OTHER 3
+#define TUNING_COMMAND_TYPES 4
+
+struct rf_command_stats {
+    // Last round trips of successful commands, in us
+    uint32_t rtt[TUNING_RTT_SAMPLES];
+    uint32_t rtt_count;
+    uint32_t rtt_p99;
+
+    // Exponential moving average, 0 = never fails, 256 = always fails
+    uint32_t failure_rate;
+    uint32_t consecutive_failures;
+
+    int timeout_ms; // Passed to nfc_initiator_transceive_bytes()
+    uint64_t commands;
+    uint64_t failures;
+    uint64_t retries;
+};
+
+/*
+ * Per reader session controller. Idempotent commands (GET_UID, READ_BLOCK)
+ * get a timeout just above the observed p99 and are retried on transient
+ * failures: right away while the field is stable, with exponential backoff
+ * once the failure rate climbs. WRITE_BLOCK gets no answer from the tag, so
+ * it keeps the libnfc default timeout and is never retried.
+ */
+struct rf_tuning {
+    nfc_device *reader;
+    struct rf_command_stats commands[TUNING_COMMAND_TYPES];
+};
+
+struct rf_tuning *rf_tuning_get(nfc_device *reader);
+void rf_tuning_close(nfc_device *reader);
+int rf_tuning_transceive(nfc_device *reader, const uint8_t *tx_data, size_t tx_size, uint8_t *rx_data, size_t rx_size);
+uint32_t rf_tuning_median_us(const struct rf_command_stats *stats);
+void rf_tuning_print(const struct rf_tuning *tuning);
+const char *rf_tuning_command_name(unsigned int type);
+
+#endif // __NFC_SRIX_RF_TUNING_H__
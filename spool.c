@@ -0,0 +1,505 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "spool.h"
+#include "dump_utils.h"
+#include "logging.h"
+
+// Files changed this recently may still be written, scans leave them alone
+#define SPOOL_SETTLE_SECONDS 2
+
+// Longest path under the spool directory: <path>/failed/<name>.json.tmp
+#define SPOOL_JOB_PATH_EXTRA (sizeof("/" SPOOL_FAILED_DIR "/" SPOOL_RESULT_SUFFIX ".tmp") - 1 + SPOOL_NAME_SIZE - 1)
+
+static void write_json_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fp, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char) *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Written next to the job file and renamed in place, a record is always complete
+static void write_record(const struct spool *spool, const struct spool_job *job, const char *dir) {
+    char path[SPOOL_PATH_SIZE], tmp_path[SPOOL_PATH_SIZE];
+    if (snprintf(path, sizeof(path), "%s/%s/%s" SPOOL_RESULT_SUFFIX, spool->path, dir, job->name) >= (int) sizeof(path) ||
+            snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        lwarning("Cannot write the record of \"%s\": path too long.\n", job->name);
+        return;
+    }
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        lwarning("Cannot write \"%s\".\n", tmp_path);
+        return;
+    }
+
+    fprintf(fp, "{\"job\": ");
+    write_json_string(fp, job->name);
+    fprintf(fp, ", \"status\": \"%s\"", job->status);
+    if (job->tag_uid != 0) {
+        fprintf(fp, ", \"uid\": \"%016" PRIX64 "\"", job->tag_uid);
+        fprintf(fp, ", \"writes\": %zu, \"failed_blocks\": %zu, \"elapsed_ms\": %" PRIu64, job->writes, job->failed_blocks, job->elapsed_ms);
+    }
+    if (job->detail[0] != '\0') {
+        fprintf(fp, ", \"detail\": ");
+        write_json_string(fp, job->detail);
+    }
+    fprintf(fp, "}\n");
+
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        lwarning("Cannot write \"%s\".\n", path);
+        remove(tmp_path);
+    }
+}
+
+static void move_job(struct spool *spool, const struct spool_job *job) {
+    const char *dir = job->ok ? SPOOL_DONE_DIR : SPOOL_FAILED_DIR;
+    char from[SPOOL_PATH_SIZE], to[SPOOL_PATH_SIZE];
+    if (snprintf(from, sizeof(from), "%s/%s", spool->path, job->name) >= (int) sizeof(from) ||
+            snprintf(to, sizeof(to), "%s/%s/%s", spool->path, dir, job->name) >= (int) sizeof(to)) {
+        lwarning("Cannot move \"%s\" to %s/: path too long.\n", job->name, dir);
+    } else if (rename(from, to) != 0) {
+        lwarning("Cannot move \"%s\" to %s/: %s.\n", job->name, dir, strerror(errno));
+    }
+    write_record(spool, job, dir);
+    lverbose("Job %s: %s.\n", job->name, job->status);
+}
+
+static bool is_known(struct spool *spool, const char *name) {
+    bool known = false;
+
+    pthread_mutex_lock(&spool->lock);
+    for (int i = 0; i < SPOOL_MAX_JOBS; i++) {
+        if (spool->jobs[i].state != JOB_FREE && strcmp(spool->jobs[i].name, name) == 0) {
+            known = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return known;
+}
+
+// Free slots are only ever filled by the spool thread, no lock needed until published
+static struct spool_job *free_slot(struct spool *spool) {
+    pthread_mutex_lock(&spool->lock);
+    struct spool_job *job = NULL;
+    for (int i = 0; i < SPOOL_MAX_JOBS; i++) {
+        if (spool->jobs[i].state == JOB_FREE) {
+            job = &spool->jobs[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return job;
+}
+
+static void reject_job(struct spool *spool, struct spool_job *job) {
+    job->ok = false;
+    job->status = "invalid";
+    move_job(spool, job);
+
+    pthread_mutex_lock(&spool->lock);
+    spool->invalid++;
+    pthread_mutex_unlock(&spool->lock);
+}
+
+static void load_job(struct spool *spool, const char *name, bool from_event) {
+    if (name[0] == '.' || strlen(name) >= SPOOL_NAME_SIZE || is_known(spool, name)) {
+        return;
+    }
+
+    // Cannot happen with the length checked by spool_open(), and the file could not be moved to failed/
+    char path[SPOOL_PATH_SIZE];
+    if (snprintf(path, sizeof(path), "%s/%s", spool->path, name) >= (int) sizeof(path)) {
+        lwarning("Skipping \"%s\": path too long.\n", name);
+        pthread_mutex_lock(&spool->lock);
+        spool->invalid++;
+        pthread_mutex_unlock(&spool->lock);
+        return;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    // Record files are never jobs
+    size_t name_len = strlen(name), suffix_len = strlen(SPOOL_RESULT_SUFFIX);
+    if (name_len > suffix_len && strcmp(name + name_len - suffix_len, SPOOL_RESULT_SUFFIX) == 0) {
+        return;
+    }
+
+    struct spool_job *job = free_slot(spool);
+    if (job == NULL) {
+        spool->rescan = true;
+        return;
+    }
+
+    memset(job->name, 0, sizeof(job->name));
+    strcpy(job->name, name);
+    job->has_uid = srix_uid_from_name(name, &job->uid);
+    job->ok = false;
+    job->status = NULL;
+    job->detail[0] = '\0';
+    job->tag_uid = 0;
+    job->writes = 0;
+    job->failed_blocks = 0;
+    job->elapsed_ms = 0;
+
+    // Load and validate
+    srix_image_init(&job->image, spool->blocks);
+    size_t file_size = 0, size = srix_image_size(&job->image);
+    int load_result = srix_image_load(&job->image, path, &file_size);
+    if (load_result == DUMP_SUCCESS && file_size != size && file_size != size + DUMP_SYSTEM_BLOCK_SIZE) {
+        load_result = DUMP_ESIZE;
+    }
+
+    if (load_result == DUMP_ESIZE && !from_event && st.st_mtime + SPOOL_SETTLE_SECONDS > time(NULL)) {
+        spool->rescan = true;
+        return;
+    }
+    if (load_result == DUMP_ESIZE) {
+        snprintf(job->detail, sizeof(job->detail), "file wrong size, expected %zu but read %zu", size, file_size);
+        reject_job(spool, job);
+        return;
+    }
+    if (load_result != DUMP_SUCCESS) {
+        snprintf(job->detail, sizeof(job->detail), "%s", srix_dump_strerror(load_result));
+        reject_job(spool, job);
+        return;
+    }
+    if (spool->match == SPOOL_MATCH_UID && !job->has_uid) {
+        snprintf(job->detail, sizeof(job->detail), "file name does not start with a UID");
+        reject_job(spool, job);
+        return;
+    }
+
+    // Publish
+    pthread_mutex_lock(&spool->lock);
+    job->sequence = spool->next_sequence++;
+    job->state = JOB_READY;
+    spool->loaded++;
+    pthread_cond_broadcast(&spool->ready);
+    pthread_mutex_unlock(&spool->lock);
+
+    lverbose("Job %s loaded.\n", name);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Files already there when the spool is opened, or left behind, in name order
+static void scan_directory(struct spool *spool) {
+    spool->rescan = false;
+
+    DIR *dir = opendir(spool->path);
+    if (dir == NULL) {
+        return;
+    }
+
+    char **names = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (grown == NULL) break;
+            names = grown;
+        }
+        if ((names[count] = strdup(entry->d_name)) == NULL) break;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < count; i++) {
+        load_job(spool, names[i], false);
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void read_events(struct spool *spool) {
+    _Alignas(struct inotify_event) char buffer[4096];
+
+    for (;;) {
+        ssize_t length = read(spool->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            return;
+        }
+
+        for (char *p = buffer; p < buffer + length;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                spool->rescan = true;
+            } else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                load_job(spool, event->name, true);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void move_finished(struct spool *spool) {
+    for (int i = 0; i < SPOOL_MAX_JOBS; i++) {
+        struct spool_job *job = &spool->jobs[i];
+
+        pthread_mutex_lock(&spool->lock);
+        bool finished = job->state == JOB_FINISHED;
+        pthread_mutex_unlock(&spool->lock);
+        if (!finished) {
+            continue;
+        }
+
+        move_job(spool, job);
+
+        pthread_mutex_lock(&spool->lock);
+        job->state = JOB_FREE;
+        pthread_mutex_unlock(&spool->lock);
+    }
+}
+
+static void *spool_main(void *arg) {
+    struct spool *spool = arg;
+
+    scan_directory(spool);
+    for (;;) {
+        pthread_mutex_lock(&spool->lock);
+        bool running = spool->running;
+        pthread_mutex_unlock(&spool->lock);
+        if (!running) {
+            break;
+        }
+
+        struct pollfd fds[2] = {
+                {.fd = spool->inotify_fd, .events = POLLIN},
+                {.fd = spool->wakeup_fd, .events = POLLIN},
+        };
+        poll(fds, 2, SPOOL_POLL_INTERVAL_MS);
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t value;
+            read(spool->wakeup_fd, &value, sizeof(value));
+        }
+        move_finished(spool);
+        if (fds[0].revents & POLLIN) {
+            read_events(spool);
+        }
+        if (spool->rescan) {
+            scan_directory(spool);
+        }
+    }
+
+    // Nothing finished is left in the spool
+    move_finished(spool);
+    return NULL;
+}
+
+static int make_dir(const char *spool_path, const char *name) {
+    char path[SPOOL_PATH_SIZE];
+    if (snprintf(path, sizeof(path), "%s/%s", spool_path, name) >= (int) sizeof(path)) {
+        return SPOOL_ETOOLONG;
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST ? SPOOL_SUCCESS : SPOOL_EMKDIR;
+}
+
+int spool_open(struct spool *spool, const char *path, uint8_t blocks, int match) {
+    memset(spool, 0, sizeof(struct spool));
+    spool->blocks = blocks;
+    spool->match = match;
+    spool->inotify_fd = -1;
+    spool->wakeup_fd = -1;
+
+    // Every job, result and temporary path has to fit, whatever the job name
+    if (strlen(path) + SPOOL_JOB_PATH_EXTRA >= SPOOL_PATH_SIZE) {
+        return SPOOL_ETOOLONG;
+    }
+    strcpy(spool->path, path);
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return SPOOL_EOPEN;
+    }
+    int result = make_dir(path, SPOOL_DONE_DIR);
+    if (result == SPOOL_SUCCESS) {
+        result = make_dir(path, SPOOL_FAILED_DIR);
+    }
+    if (result != SPOOL_SUCCESS) {
+        return result;
+    }
+
+    // Watch before the first scan, so no file falls in between
+    spool->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (spool->inotify_fd < 0 || inotify_add_watch(spool->inotify_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        spool_close(spool);
+        return SPOOL_EINOTIFY;
+    }
+    spool->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (spool->wakeup_fd < 0) {
+        spool_close(spool);
+        return SPOOL_EINOTIFY;
+    }
+
+    // The clock of pthread_cond_timedwait() must match spool_wait()
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&spool->ready, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&spool->lock, NULL);
+
+    spool->running = true;
+    if (pthread_create(&spool->thread, NULL, spool_main, spool) != 0) {
+        spool->running = false;
+        spool_close(spool);
+        return SPOOL_ETHREAD;
+    }
+
+    return SPOOL_SUCCESS;
+}
+
+// Waits until a job is ready, returns false on timeout
+bool spool_wait(struct spool *spool, unsigned int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) (timeout_ms / 1000u);
+    deadline.tv_nsec += (long) (timeout_ms % 1000u) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&spool->lock);
+    bool ready = false;
+    for (;;) {
+        for (int i = 0; i < SPOOL_MAX_JOBS && !ready; i++) {
+            ready = spool->jobs[i].state == JOB_READY;
+        }
+        if (ready || pthread_cond_timedwait(&spool->ready, &spool->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return ready;
+}
+
+/*
+ * Oldest ready job for the tag: the one named after its UID, or any job in
+ * FIFO mode. Returns NULL when there is none.
+ */
+struct spool_job *spool_take(struct spool *spool, uint64_t uid) {
+    pthread_mutex_lock(&spool->lock);
+    struct spool_job *best = NULL;
+    for (int i = 0; i < SPOOL_MAX_JOBS; i++) {
+        struct spool_job *job = &spool->jobs[i];
+        if (job->state != JOB_READY) continue;
+        if (spool->match == SPOOL_MATCH_UID && (!job->has_uid || job->uid != uid)) continue;
+        if (best == NULL || job->sequence < best->sequence) best = job;
+    }
+    if (best != NULL) {
+        best->state = JOB_TAKEN;
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    return best;
+}
+
+// Puts back a job nothing was written for, it keeps its place in the queue
+void spool_return(struct spool *spool, struct spool_job *job) {
+    pthread_mutex_lock(&spool->lock);
+    job->state = JOB_READY;
+    pthread_cond_broadcast(&spool->ready);
+    pthread_mutex_unlock(&spool->lock);
+}
+
+// Hands the job back to the spool thread, which moves it and writes the record
+void spool_finish(struct spool *spool, struct spool_job *job) {
+    pthread_mutex_lock(&spool->lock);
+    job->state = JOB_FINISHED;
+    if (job->ok) {
+        spool->done++;
+    } else {
+        spool->failed++;
+    }
+    pthread_mutex_unlock(&spool->lock);
+
+    uint64_t value = 1;
+    write(spool->wakeup_fd, &value, sizeof(value));
+}
+
+void spool_close(struct spool *spool) {
+    if (spool->running) {
+        pthread_mutex_lock(&spool->lock);
+        spool->running = false;
+        pthread_mutex_unlock(&spool->lock);
+
+        uint64_t value = 1;
+        write(spool->wakeup_fd, &value, sizeof(value));
+        pthread_join(spool->thread, NULL);
+    }
+
+    if (spool->inotify_fd >= 0) close(spool->inotify_fd);
+    if (spool->wakeup_fd >= 0) close(spool->wakeup_fd);
+    spool->inotify_fd = -1;
+    spool->wakeup_fd = -1;
+}
+
+const char *spool_strerror(int result) {
+    switch (result) {
+        case SPOOL_SUCCESS:
+            return "success";
+        case SPOOL_EOPEN:
+            return "not a directory";
+        case SPOOL_EMKDIR:
+            return "cannot create " SPOOL_DONE_DIR "/ and " SPOOL_FAILED_DIR "/";
+        case SPOOL_EINOTIFY:
+            return "cannot watch directory";
+        case SPOOL_ETHREAD:
+            return "cannot start spool thread";
+        case SPOOL_ETOOLONG:
+            return "path too long";
+        default:
+            return "unknown error";
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_SPOOL_H__
+#define __NFC_SRIX_SPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "srix_image.h"
+
+/* Macros */
+#define SPOOL_MAX_JOBS 64          // Loaded ahead of time, more files wait on disk
+#define SPOOL_NAME_SIZE 256
+#define SPOOL_PATH_SIZE 4096
+#define SPOOL_DONE_DIR "done"
+#define SPOOL_FAILED_DIR "failed"
+#define SPOOL_RESULT_SUFFIX ".json"
+#define SPOOL_POLL_INTERVAL_MS 1000
+
+/* Return values */
+#define SPOOL_SUCCESS 0
+#define SPOOL_EOPEN -1
+#define SPOOL_EMKDIR -2
+#define SPOOL_EINOTIFY -3
+#define SPOOL_ETHREAD -4
+#define SPOOL_ETOOLONG -5 // A job path would not fit in SPOOL_PATH_SIZE
+
+/* Match modes */
+#define SPOOL_MATCH_UID 0  // Job file name starts with the 16 hex digits UID
+#define SPOOL_MATCH_FIFO 1 // Oldest job goes to the next tag
+
+/* Job states */
+#define JOB_FREE 0
+#define JOB_READY 1    // Loaded and validated
+#define JOB_TAKEN 2    // Being restored
+#define JOB_FINISHED 3 // Waiting to be moved to done/ or failed/
+
+/*
+ * One job file. Everything from status on is filled by the restore side
+ * before spool_finish() and ends up in the result record.
+ */
+struct spool_job {
+    struct srix_image image;
+    char name[SPOOL_NAME_SIZE];
+    uint64_t sequence; // Arrival order
+    uint64_t uid;      // From the file name
+    bool has_uid;
+    int state;
+
+    // Result
+    bool ok;
+    const char *status;
+    char detail[128];
+    uint64_t tag_uid;
+    size_t writes;
+    size_t failed_blocks;
+    uint64_t elapsed_ms;
+};
+
+/*
+ * Directory of dumps dropped by another program. A background thread
+ * watches it with inotify, loads and validates every new file ahead of time
+ * and moves finished jobs to done/ or failed/ next to a result record, so
+ * the thread talking to the reader never touches the disk. Invalid files
+ * go straight to failed/. Files are only picked up once closed after
+ * writing or moved in, names starting with a dot are ignored.
+ */
+struct spool {
+    char path[SPOOL_PATH_SIZE];
+    uint8_t blocks;
+    int match;
+
+    struct spool_job jobs[SPOOL_MAX_JOBS];
+    uint64_t next_sequence;
+    bool rescan; // Files were left on disk while every slot was in use
+
+    int inotify_fd;
+    int wakeup_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool running;
+
+    // Totals, under lock
+    unsigned int loaded;
+    unsigned int invalid;
+    unsigned int done;
+    unsigned int failed;
+};
+
+int spool_open(struct spool *spool, const char *path, uint8_t blocks, int match);
+bool spool_wait(struct spool *spool, unsigned int timeout_ms);
+struct spool_job *spool_take(struct spool *spool, uint64_t uid);
+void spool_return(struct spool *spool, struct spool_job *job);
+void spool_finish(struct spool *spool, struct spool_job *job);
+void spool_close(struct spool *spool);
+const char *spool_strerror(int result);
+
+#endif // __NFC_SRIX_SPOOL_H__
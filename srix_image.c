@@ -0,0 +1,106 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "srix_image.h"
+#include "logging.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define be32_to_host(x) __builtin_bswap32(x)
+#else
+#define be32_to_host(x) (x)
+#endif
+
+// Pool, one bit per image in use
+static struct srix_image image_pool[SRIX_IMAGE_POOL_SIZE];
+static atomic_uint_fast32_t image_pool_used;
+
+_Static_assert(SRIX_IMAGE_POOL_SIZE <= 32, "pool bitmap is 32 bits wide");
+
+struct srix_image *srix_image_acquire(uint8_t blocks) {
+    uint_fast32_t used = atomic_load(&image_pool_used);
+
+    for (;;) {
+        // Find a free slot
+        int slot = -1;
+        for (int i = 0; i < SRIX_IMAGE_POOL_SIZE; i++) {
+            if (!((used >> i) & 1u)) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) {
+            lerror("Out of tag images, all %d are in use. Exiting...\n", SRIX_IMAGE_POOL_SIZE);
+            exit(1);
+        }
+
+        if (atomic_compare_exchange_weak(&image_pool_used, &used, used | (1u << slot))) {
+            struct srix_image *image = &image_pool[slot];
+            srix_image_init(image, blocks);
+            return image;
+        }
+    }
+}
+
+void srix_image_release(struct srix_image *image) {
+    if (image == NULL) {
+        return;
+    }
+
+    size_t slot = image - image_pool;
+    atomic_fetch_and(&image_pool_used, ~(1u << slot));
+}
+
+// Swaps every block between raw and reversed order
+void srix_image_reverse(struct srix_image *image) {
+    uint32_t words[SRIX_IMAGE_MAX_BLOCKS];
+    size_t size = srix_image_size(image);
+
+    memcpy(words, image->bytes, size);
+    for (size_t i = 0; i < image->blocks; i++) {
+        words[i] = __builtin_bswap32(words[i]);
+    }
+    memcpy(image->bytes, words, size);
+
+    image->order = image->order == SRIX_ORDER_RAW ? SRIX_ORDER_REVERSED : SRIX_ORDER_RAW;
+}
+
+// Same values as srix_image_block(), for every block
+void srix_image_to_blocks(const struct srix_image *image, uint32_t *blocks) {
+    memcpy(blocks, image->bytes, srix_image_size(image));
+    for (size_t i = 0; i < image->blocks; i++) {
+        blocks[i] = be32_to_host(blocks[i]);
+    }
+}
+
+void srix_image_from_blocks(struct srix_image *image, const uint32_t *blocks, uint8_t count) {
+    uint32_t words[SRIX_IMAGE_MAX_BLOCKS];
+
+    for (size_t i = 0; i < count; i++) {
+        words[i] = be32_to_host(blocks[i]);
+    }
+    memcpy(image->bytes, words, (size_t) count * 4);
+}
+
+// GET_UID answers LSB first
+void srix_image_set_uid_bytes(struct srix_image *image, const uint8_t *uid_bytes) {
+    image->uid = 0;
+    for (int i = 7; i >= 0; i--) {
+        image->uid = image->uid << 8u | uid_bytes[i];
+    }
+    image->has_uid = true;
+}
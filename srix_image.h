@@ -0,0 +1,126 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_IMAGE_H__
+#define __NFC_SRIX_IMAGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Macros */
+#define SRIX_IMAGE_MAX_BLOCKS 128 // SRIX4K
+#define SRIX_IMAGE_MAX_SIZE (SRIX_IMAGE_MAX_BLOCKS * 4)
+#define SRIX_IMAGE_ALIGNMENT 64
+#define SRIX_IMAGE_POOL_SIZE 16
+
+/* Byte order of bytes[] */
+#define SRIX_ORDER_RAW 0      // As transmitted by the tag and stored in dump files
+#define SRIX_ORDER_REVERSED 1 // Each block reversed, as printed by srix-dump -r
+
+/*
+ * Tag image with a fixed layout, big enough for any supported tag. Images are
+ * taken from a preallocated pool so loop and batch modes never hit the heap.
+ * srix_image_acquire() never returns NULL, running out of images exits.
+ */
+struct srix_image {
+    _Alignas(SRIX_IMAGE_ALIGNMENT) uint8_t bytes[SRIX_IMAGE_MAX_SIZE];
+    uint64_t present[SRIX_IMAGE_MAX_BLOCKS / 64];
+    uint64_t uid;
+    uint8_t system_block[4];
+    uint8_t blocks;
+    uint8_t order;
+    bool has_uid;
+    bool has_system_block;
+};
+
+/* Pool */
+struct srix_image *srix_image_acquire(uint8_t blocks);
+void srix_image_release(struct srix_image *image);
+
+/* Bulk conversion */
+void srix_image_reverse(struct srix_image *image);
+void srix_image_to_blocks(const struct srix_image *image, uint32_t *blocks);
+void srix_image_from_blocks(struct srix_image *image, const uint32_t *blocks, uint8_t count);
+void srix_image_set_uid_bytes(struct srix_image *image, const uint8_t *uid_bytes);
+
+/* Accessors */
+static inline void srix_image_init(struct srix_image *image, uint8_t blocks) {
+    memset(image->present, 0, sizeof(image->present));
+    image->uid = 0;
+    image->blocks = blocks;
+    image->order = SRIX_ORDER_RAW;
+    image->has_uid = false;
+    image->has_system_block = false;
+}
+
+static inline size_t srix_image_size(const struct srix_image *image) {
+    return (size_t) image->blocks * 4;
+}
+
+static inline uint8_t *srix_image_block_bytes(struct srix_image *image, uint8_t block) {
+    return image->bytes + (block * 4);
+}
+
+static inline const uint8_t *srix_image_block_bytes_const(const struct srix_image *image, uint8_t block) {
+    return image->bytes + (block * 4);
+}
+
+// Bytes in storage order, as written by nfc_write_block()
+static inline uint32_t srix_image_block(const struct srix_image *image, uint8_t block) {
+    const uint8_t *bytes = srix_image_block_bytes_const(image, block);
+    return (uint32_t) bytes[0] << 24u | (uint32_t) bytes[1] << 16u | (uint32_t) bytes[2] << 8u | bytes[3];
+}
+
+static inline void srix_image_set_block(struct srix_image *image, uint8_t block, uint32_t value) {
+    uint8_t *bytes = srix_image_block_bytes(image, block);
+    bytes[0] = value >> 24u;
+    bytes[1] = value >> 16u;
+    bytes[2] = value >> 8u;
+    bytes[3] = value >> 0u;
+}
+
+// Value as the datasheet describes it (LSB first on a raw image)
+static inline uint32_t srix_image_value(const struct srix_image *image, uint8_t block) {
+    uint32_t value = srix_image_block(image, block);
+    return image->order == SRIX_ORDER_RAW ? __builtin_bswap32(value) : value;
+}
+
+static inline void srix_image_set_value(struct srix_image *image, uint8_t block, uint32_t value) {
+    srix_image_set_block(image, block, image->order == SRIX_ORDER_RAW ? __builtin_bswap32(value) : value);
+}
+
+static inline uint32_t srix_image_system_value(const struct srix_image *image) {
+    const uint8_t *bytes = image->system_block;
+    return (uint32_t) bytes[3] << 24u | (uint32_t) bytes[2] << 16u | (uint32_t) bytes[1] << 8u | bytes[0];
+}
+
+static inline void srix_image_mark_present(struct srix_image *image, uint8_t block) {
+    image->present[block / 64] |= 1ull << (block % 64);
+}
+
+static inline bool srix_image_is_present(const struct srix_image *image, uint8_t block) {
+    return (image->present[block / 64] >> (block % 64)) & 1u;
+}
+
+static inline void srix_image_mark_all_present(struct srix_image *image) {
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        srix_image_mark_present(image, i);
+    }
+}
+
+#endif // __NFC_SRIX_IMAGE_H__
@@ -0,0 +1,1011 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <time.h>
+#include <nfc/nfc.h>
+#include <inttypes.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "readback.h"
+#include "srix_image.h"
+#include "write_plan.h"
+#include "reader_pool.h"
+#include "cancel.h"
+#include "dump_utils.h"
+#include "telemetry.h"
+#include "history.h"
+
+/* Macros */
+#define SHELL_DEFAULT_RESERVE 1
+#define SHELL_PROMPT "srix> "
+#define SHELL_TEXT_SIZE 40 // Command text kept for the timings
+
+/* Commands */
+#define SHELL_UID 0
+#define SHELL_READ 1
+#define SHELL_WRITE 2
+#define SHELL_DIFF 3
+#define SHELL_RESET_OTP 4
+#define SHELL_RESTORE 5
+#define SHELL_WAIT_FOR_TAG 6
+
+/* Command results */
+#define SHELL_NOT_RUN 0
+#define SHELL_OK 1
+#define SHELL_FAILED 2
+
+struct shell_command {
+    int op;
+    uint8_t first;
+    uint8_t last;
+    bool system_block;
+    uint32_t value;
+    struct srix_image *image; // Dump of diff and restore, loaded when compiling
+
+    unsigned int line;
+    char text[SHELL_TEXT_SIZE];
+    int result;
+    uint64_t elapsed_us;
+};
+
+/*
+ * A script is compiled as a whole before the first command runs: every line
+ * is parsed, every dump is loaded and a script that writes is confirmed once.
+ * Mistakes are reported with their line and never leave a tag half done.
+ */
+struct shell_script {
+    struct shell_command *commands;
+    size_t count;
+    size_t capacity;
+    bool writes;
+};
+
+struct shell_session {
+    struct reader_pool pool;
+    struct pool_reader *reader; // NULL until a tag is selected
+    bool rf_errors;
+
+    uint8_t blocks;
+    uint32_t reserve;
+    unsigned int deadline_ms;
+    bool confirm;
+    uint64_t paused_us; // Spent on questions, not part of the timings
+    bool deadline_reached;
+};
+
+// Write history, NULL unless --history was given
+static struct history *history = NULL;
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s [script] [-h] [-v] [-y] [-t x4k|512] [-k resets] [--deadline-ms ms] [--history log]\n", executable);
+    printf("\nOptional arguments:\n");
+    printf("  [script]     run the commands in this file, - for stdin [default: prompt on a terminal, stdin otherwise]\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -y           answer YES to all questions\n");
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  -k resets    reset-otp refuses tags that would be left with less resets [default: %d]\n", SHELL_DEFAULT_RESERVE);
+    printf("  --deadline-ms ms\n");
+    printf("               give up on a command after this long, time spent on questions excluded\n");
+    printf("  --history log\n");
+    printf("               append every write to this history log, see srix-history\n");
+}
+
+static void print_commands(void) {
+    printf("Commands:\n");
+    printf("  uid                    print the UID\n");
+    printf("  read [xx[-yy]|system]  print blocks, in hex [default: every block]\n");
+    printf("  write xx value         write value, 8 hex digits as printed by read, to block xx\n");
+    printf("  diff dump.bin          compare the tag with a dump, fails when they differ\n");
+    printf("  reset-otp              reset the OTP area, like srix-reset\n");
+    printf("  restore dump.bin       write the blocks that differ from a dump, like srix-restore -y\n");
+    printf("  wait-for-tag           wait for the tag to be removed and for the next one\n");
+    printf("  help, quit             interactive only\n");
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+/*
+ * Compiling
+ */
+
+static void compile_error(const char *source, unsigned int line, const char *format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (source != NULL) {
+        lerror("%s:%u: %s\n", source, line, message);
+    } else {
+        lerror("%s\n", message);
+    }
+}
+
+static bool parse_hex(const char *text, size_t max_digits, uint32_t *value) {
+    size_t length = strlen(text);
+    if (length == 0 || length > max_digits) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isxdigit((unsigned char) text[i])) {
+            return false;
+        }
+    }
+
+    *value = (uint32_t) strtoul(text, NULL, 16);
+    return true;
+}
+
+static bool parse_block(const char *text, uint8_t blocks, uint8_t *block) {
+    uint32_t value;
+    if (!parse_hex(text, 2, &value) || value >= blocks) {
+        return false;
+    }
+
+    *block = value;
+    return true;
+}
+
+static struct shell_command *script_add(struct shell_script *script) {
+    if (script->count == script->capacity) {
+        size_t capacity = script->capacity == 0 ? 16 : script->capacity * 2;
+        struct shell_command *commands = realloc(script->commands, capacity * sizeof(struct shell_command));
+        if (commands == NULL) {
+            lerror("Out of memory. Exiting...\n");
+            exit(1);
+        }
+        script->commands = commands;
+        script->capacity = capacity;
+    }
+
+    struct shell_command *command = &script->commands[script->count++];
+    memset(command, 0, sizeof(*command));
+    return command;
+}
+
+static void script_free(struct shell_script *script) {
+    for (size_t i = 0; i < script->count; i++) {
+        free(script->commands[i].image);
+    }
+    free(script->commands);
+    memset(script, 0, sizeof(*script));
+}
+
+static struct srix_image *load_dump(const char *source, unsigned int line, const char *path, uint8_t blocks) {
+    struct srix_image *image = aligned_alloc(SRIX_IMAGE_ALIGNMENT, sizeof(struct srix_image));
+    if (image == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(1);
+    }
+
+    srix_image_init(image, blocks);
+    size_t file_size = 0;
+    int load_result = srix_image_load(image, path, &file_size);
+    if (load_result == DUMP_ESIZE) {
+        compile_error(source, line, "\"%s\" is the wrong size, expected %zu but read %zu.", path, srix_image_size(image), file_size);
+    } else if (load_result != DUMP_SUCCESS) {
+        compile_error(source, line, "Cannot load \"%s\": %s.", path, srix_dump_strerror(load_result));
+    }
+    if (load_result != DUMP_SUCCESS) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+// Returns false on a mistake, blank lines and comments add nothing
+static bool compile_line(struct shell_script *script, const char *source, unsigned int line_number, const char *line, uint8_t blocks) {
+    // Trim
+    while (isspace((unsigned char) *line)) line++;
+    size_t length = strlen(line);
+    while (length > 0 && isspace((unsigned char) line[length - 1])) length--;
+    if (length == 0 || line[0] == '#') {
+        return true;
+    }
+
+    char text[256];
+    if (length >= sizeof(text)) {
+        compile_error(source, line_number, "Line too long.");
+        return false;
+    }
+    memcpy(text, line, length);
+    text[length] = '\0';
+
+    // Command word, the rest is its argument
+    char *argument = text;
+    while (*argument != '\0' && !isspace((unsigned char) *argument)) argument++;
+    if (*argument != '\0') {
+        *argument++ = '\0';
+        while (isspace((unsigned char) *argument)) argument++;
+    }
+
+    struct shell_command command = {.line = line_number};
+    if (strcmp(text, "uid") == 0 || strcmp(text, "reset-otp") == 0 || strcmp(text, "wait-for-tag") == 0) {
+        if (*argument != '\0') {
+            compile_error(source, line_number, "\"%s\" takes no arguments.", text);
+            return false;
+        }
+        command.op = text[0] == 'u' ? SHELL_UID : text[0] == 'r' ? SHELL_RESET_OTP : SHELL_WAIT_FOR_TAG;
+    } else if (strcmp(text, "read") == 0) {
+        command.op = SHELL_READ;
+        command.first = 0;
+        command.last = blocks - 1;
+
+        char *dash = strchr(argument, '-');
+        if (dash != NULL) *dash = '\0';
+        if (strcasecmp(argument, "system") == 0 || strcasecmp(argument, "FF") == 0) {
+            command.system_block = true;
+        } else if (*argument != '\0') {
+            if (!parse_block(argument, blocks, &command.first) || (dash != NULL && !parse_block(dash + 1, blocks, &command.last)) || command.last < command.first) {
+                if (dash != NULL) *dash = '-';
+                compile_error(source, line_number, "Invalid range \"%s\", expected blocks 00-%02X.", argument, blocks - 1);
+                return false;
+            }
+            if (dash == NULL) command.last = command.first;
+        }
+        if (command.system_block && dash != NULL) {
+            compile_error(source, line_number, "The system block is not part of a range.");
+            return false;
+        }
+    } else if (strcmp(text, "write") == 0) {
+        command.op = SHELL_WRITE;
+        char *block = strtok(argument, " \t");
+        char *value = strtok(NULL, " \t");
+        if (block == NULL || value == NULL || strtok(NULL, " \t") != NULL) {
+            compile_error(source, line_number, "Expected \"write <block> <value>\".");
+            return false;
+        }
+        if (!parse_block(block, blocks, &command.first)) {
+            compile_error(source, line_number, "Invalid block \"%s\", expected 00-%02X.", block, blocks - 1);
+            return false;
+        }
+        if (strlen(value) != 8 || !parse_hex(value, 8, &command.value)) {
+            compile_error(source, line_number, "Invalid value \"%s\", expected 8 hex digits.", value);
+            return false;
+        }
+        script->writes = true;
+    } else if (strcmp(text, "diff") == 0 || strcmp(text, "restore") == 0) {
+        command.op = text[0] == 'd' ? SHELL_DIFF : SHELL_RESTORE;
+        if (*argument == '\0') {
+            compile_error(source, line_number, "Expected \"%s <dump.bin>\".", text);
+            return false;
+        }
+        command.image = load_dump(source, line_number, argument, blocks);
+        if (command.image == NULL) {
+            return false;
+        }
+    } else {
+        compile_error(source, line_number, "Unknown command \"%s\".", text);
+        return false;
+    }
+
+    if (command.op == SHELL_RESET_OTP || command.op == SHELL_RESTORE) {
+        script->writes = true;
+    }
+
+    // Text for the timings
+    snprintf(command.text, sizeof(command.text), "%.*s", (int) (length < sizeof(command.text) ? length : sizeof(command.text) - 1), line);
+    if (command.op == SHELL_WRITE) {
+        snprintf(command.text, sizeof(command.text), "write %02X %08X", command.first, command.value);
+    }
+    *script_add(script) = command;
+    return true;
+}
+
+// Every mistake is reported, not only the first one
+static bool compile_script(struct shell_script *script, FILE *file, const char *source, uint8_t blocks) {
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int line_number = 0;
+    bool ok = true;
+
+    while (getline(&line, &line_size, file) != -1) {
+        line_number++;
+        if (!compile_line(script, source, line_number, line, blocks)) {
+            ok = false;
+        }
+    }
+    free(line);
+
+    if (ferror(file)) {
+        lerror("Error while reading \"%s\".\n", source);
+        ok = false;
+    }
+
+    return ok;
+}
+
+/*
+ * Running
+ */
+
+// Questions are answered on a line of their own, the prompt reads lines too
+static bool ask_confirmation(struct shell_session *session, const char *message) {
+    printf("%s\n", message);
+    log_flush();
+    printf("Are you sure? [Y/N] ");
+    fflush(stdout);
+
+    uint64_t start_us = now_us();
+    cancel_pause();
+    char answer[16] = "";
+    if (fgets(answer, sizeof(answer), stdin) == NULL) {
+        answer[0] = '\0';
+    }
+    cancel_resume();
+    session->paused_us += now_us() - start_us;
+
+    char *c = answer;
+    while (isspace((unsigned char) *c)) c++;
+    return *c == 'Y' || *c == 'y';
+}
+
+static bool select_tag(struct shell_session *session) {
+    if (session->reader != NULL) {
+        return true;
+    }
+
+    log_flush();
+    printf("Waiting for tag...\n");
+    session->reader = reader_pool_wait_for_tag(&session->pool);
+    if (session->reader == NULL) {
+        if (!cancel_requested()) lerror("Every reader has failed.\n");
+        return false;
+    }
+
+    lverbose("Tag on %s.\n", session->reader->connstring);
+    session->rf_errors = false;
+    return true;
+}
+
+// Only RF errors count against the reader
+static void release_tag(struct shell_session *session) {
+    if (session->reader == NULL) {
+        return;
+    }
+
+    telemetry_tag_done(session->reader->device);
+    reader_pool_report(&session->pool, session->reader, !session->rf_errors);
+    session->reader = NULL;
+}
+
+static bool rf_error(struct shell_session *session, const char *format, ...) {
+    if (cancel_requested()) {
+        return false;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vllog(LOG_LEVEL_ERROR, format, args);
+    va_end(args);
+    log_flush();
+
+    session->rf_errors = true;
+    return false;
+}
+
+static bool read_uid(struct shell_session *session, struct srix_image *image) {
+    uint8_t uid_rx_bytes[MAX_RESPONSE_LEN] = {};
+    uint8_t uid_bytes_read = nfc_srix_get_uid(session->reader->device, uid_rx_bytes);
+    if (uid_bytes_read != 8) {
+        lverbose("Received %d bytes instead of 8.\n", uid_bytes_read);
+        return rf_error(session, "Error while reading UID.\n");
+    }
+
+    srix_image_set_uid_bytes(image, uid_rx_bytes);
+    return true;
+}
+
+static bool read_range(struct shell_session *session, struct srix_image *image, uint8_t start, uint8_t count) {
+    uint8_t blocks_read = nfc_srix_read_blocks(session->reader->device, srix_image_block_bytes(image, start), start, count);
+    for (uint8_t i = start; i < start + blocks_read; i++) {
+        srix_image_mark_present(image, i);
+    }
+
+    if (blocks_read != count) {
+        return rf_error(session, "Error while reading block %02X.\n", start + blocks_read);
+    }
+    return true;
+}
+
+static bool read_system_block(struct shell_session *session, struct srix_image *image) {
+    uint8_t system_block_bytes[MAX_RESPONSE_LEN] = {};
+    uint8_t system_block_bytes_read = nfc_srix_read_block(session->reader->device, system_block_bytes, SRIX_SYSTEM_BLOCK);
+    if (system_block_bytes_read != 4) {
+        lverbose("Received %d bytes instead of 4.\n", system_block_bytes_read);
+        return rf_error(session, "Error while reading block %02X.\n", SRIX_SYSTEM_BLOCK);
+    }
+
+    memcpy(image->system_block, system_block_bytes, 4);
+    image->has_system_block = true;
+    return true;
+}
+
+// Every attempted write is recorded, failed and cancelled ones included
+static void record_history(struct shell_session *session, uint8_t tool, const struct srix_image *before, const struct srix_write *writes, size_t writes_count, size_t failed, bool incomplete) {
+    if (history == NULL || writes_count == 0) {
+        return;
+    }
+
+    static struct history_entry entry;
+    history_entry_init(&entry, tool, before->uid, session->reader->connstring);
+    for (size_t i = 0; i < writes_count; i++) {
+        history_entry_add_write(&entry, &writes[i], srix_image_block(before, writes[i].block));
+    }
+
+    if (cancel_requested()) {
+        entry.outcome = HISTORY_OUTCOME_CANCELLED;
+    } else if (failed > 0) {
+        entry.outcome = HISTORY_OUTCOME_FAILED;
+    } else if (incomplete) {
+        entry.outcome = HISTORY_OUTCOME_INCOMPLETE;
+    }
+    history_record(history, &entry);
+}
+
+static void close_history(void) {
+    int result = history_close(history);
+    if (result != HISTORY_SUCCESS) {
+        lwarning("History incomplete: %s.\n", history_strerror(result));
+    }
+}
+
+static bool verify_writes(struct srix_write *writes, size_t writes_count, size_t failed) {
+    if (cancel_requested()) {
+        return false;
+    }
+
+    log_flush();
+    srix_readback_print_summary(writes, writes_count);
+    if (failed > 0) {
+        lerror("%zu blocks could not be written.\n", failed);
+        return false;
+    }
+    return true;
+}
+
+static bool run_uid(struct shell_session *session, struct srix_image *image) {
+    if (!read_uid(session, image)) {
+        return false;
+    }
+
+    log_flush();
+    printf("UID: %016" PRIX64 "\n", image->uid);
+    return true;
+}
+
+static bool run_read(struct shell_session *session, const struct shell_command *command, struct srix_image *image) {
+    if (command->system_block) {
+        if (!read_system_block(session, image)) {
+            return false;
+        }
+
+        uint32_t system_block = srix_image_system_value(image);
+        log_flush();
+        printf("System block: %02X %02X %02X %02X\n", image->system_block[3], image->system_block[2], image->system_block[1], image->system_block[0]);
+        printf("Locked blocks:");
+        bool locked = false;
+        for (uint8_t i = 7; i < 16; i++) {
+            if (srix_block_is_locked(system_block, i)) {
+                printf(" %02X", i);
+                locked = true;
+            }
+        }
+        printf(locked ? "\n" : " none\n");
+        return true;
+    }
+
+    bool ok = read_range(session, image, command->first, command->last - command->first + 1);
+    log_flush();
+    for (uint8_t i = command->first; i <= command->last && srix_image_is_present(image, i); i++) {
+        const uint8_t *bytes = srix_image_block_bytes(image, i);
+        printf("[%02X] %02X %02X %02X %02X" DIM " --- %s\n" RESET, i, bytes[0], bytes[1], bytes[2], bytes[3], srix_get_block_type(i));
+    }
+    return ok;
+}
+
+static bool run_write(struct shell_session *session, const struct shell_command *command, struct srix_image *image) {
+    if ((history != NULL && !read_uid(session, image)) || !read_range(session, image, command->first, 1)) {
+        return false;
+    }
+
+    uint32_t current = srix_image_block(image, command->first);
+    log_flush();
+    printf("[%02X] %08X -> %08X\n", command->first, current, command->value);
+    if (current == command->value) {
+        printf("Block already holds that value.\n");
+        return true;
+    }
+    if (session->confirm && !ask_confirmation(session, "This action is irreversible.")) {
+        printf("Skipped.\n");
+        return true;
+    }
+    if (cancel_requested()) {
+        return false;
+    }
+
+    struct srix_write write;
+    nfc_write_block(session->reader->device, command->value, command->first);
+    srix_write_init(&write, command->first, command->value);
+    size_t failed = srix_readback_verify(session->reader->device, &write, 1, READBACK_MAX_RETRIES, READBACK_BASE_DELAY_US);
+    record_history(session, HISTORY_TOOL_WRITE, image, &write, 1, failed, false);
+    if (failed > 0) session->rf_errors = true;
+
+    return verify_writes(&write, 1, failed);
+}
+
+static bool run_diff(struct shell_session *session, const struct shell_command *command, struct srix_image *image) {
+    const struct srix_image *dump = command->image;
+    if (!read_range(session, image, 0, image->blocks) || (dump->has_system_block && !read_system_block(session, image))) {
+        return false;
+    }
+
+    log_flush();
+    unsigned int differences = 0;
+    for (uint8_t i = 0; i < image->blocks; i++) {
+        uint32_t tag_block = srix_image_block(image, i);
+        uint32_t dump_block = srix_image_block(dump, i);
+        if (tag_block != dump_block) {
+            printf("[%02X] %08X -> %08X" DIM " --- %s\n" RESET, i, tag_block, dump_block, srix_get_block_type(i));
+            differences++;
+        }
+    }
+    if (dump->has_system_block && memcmp(image->system_block, dump->system_block, DUMP_SYSTEM_BLOCK_SIZE) != 0) {
+        printf("[%02X] %08X -> %08X" DIM " --- System block\n" RESET, SRIX_SYSTEM_BLOCK, srix_image_system_value(image), srix_image_system_value(dump));
+        differences++;
+    }
+
+    if (differences == 0) {
+        printf("Tag matches the dump.\n");
+        return true;
+    }
+    printf("%u blocks differ.\n", differences);
+    return false;
+}
+
+// Same decisions as srix-reset on one tag
+static bool run_reset_otp(struct shell_session *session, struct srix_image *image) {
+    if ((history != NULL && !read_uid(session, image)) || !read_range(session, image, 0, 7)) {
+        return false;
+    }
+
+    // Check if already reset
+    bool otp_already_reset = true;
+    for (uint8_t i = 0; i < 5; i++) {
+        if (srix_image_block(image, i) != 0xFFFFFFFF) otp_already_reset = false;
+    }
+
+    log_flush();
+    if (otp_already_reset) {
+        printf("OTP area already reset.\n");
+        return true;
+    }
+
+    // Keep the reserve
+    uint32_t block_6 = srix_image_value(image, 6);
+    uint32_t resets_available = srix_otp_resets_remaining(block_6);
+    printf("OTP resets available: %u\n", resets_available);
+    if (resets_available < session->reserve + 1) {
+        lerror("Only %u resets left and %u must be kept.\n", resets_available, session->reserve);
+        return false;
+    }
+
+    block_6 -= (1u << SRIX_OTP_RESETS_SHIFT);
+    printf("OTP resets remaining after this operation: %u\n", srix_otp_resets_remaining(block_6));
+
+    // Back to the order it is written in, the old value of block 06 stays in image for the history
+    uint32_t new_block_6 = __builtin_bswap32(block_6);
+
+    // Show differences
+    for (uint8_t i = 0; i < 5; i++) {
+        printf("[%02X] %08X -> FFFFFFFF\n", i, srix_image_block(image, i));
+    }
+    printf("[%02X] %08X -> %08X\n", 0x06, srix_image_block(image, 6), new_block_6);
+
+    if (session->confirm && !ask_confirmation(session, "This action is irreversible.")) {
+        printf("Skipped.\n");
+        return true;
+    }
+
+    // Write Block 06 first to trigger an Auto erase cycle
+    struct srix_write writes[6];
+    size_t writes_count = 0;
+    for (int i = -1; i < 5 && !cancel_requested(); i++) {
+        uint8_t block = i < 0 ? 0x06 : i;
+        uint32_t value = i < 0 ? new_block_6 : 0xFFFFFFFF;
+        nfc_write_block(session->reader->device, value, block);
+        srix_write_init(&writes[writes_count++], block, value);
+    }
+
+    size_t failed = srix_readback_verify(session->reader->device, writes, writes_count, READBACK_MAX_RETRIES, READBACK_BASE_DELAY_US);
+    record_history(session, HISTORY_TOOL_RESET, image, writes, writes_count, failed, false);
+    if (failed > 0) session->rf_errors = true;
+
+    return verify_writes(writes, writes_count, failed);
+}
+
+// Same plan as srix-restore -y, OTP area included
+static bool run_restore(struct shell_session *session, const struct shell_command *command, struct srix_image *image) {
+    if ((history != NULL && !read_uid(session, image)) || !read_range(session, image, 0, image->blocks) || !read_system_block(session, image)) {
+        return false;
+    }
+
+    log_flush();
+    if (memcmp(command->image->bytes, image->bytes, srix_image_size(image)) == 0) {
+        printf("Tag already restored.\n");
+        return true;
+    }
+
+    static struct write_plan plan;
+    srix_plan_writes(&plan, image, command->image, true);
+    srix_plan_print(&plan);
+    log_flush();
+
+    if (plan.writes == 0) {
+        printf("Nothing to write.\n");
+        return plan.skipped_impossible == 0;
+    }
+    if (session->confirm && !ask_confirmation(session, "This action is irreversible.")) {
+        printf("Skipped.\n");
+        return true;
+    }
+
+    // Writes in plan order, nothing is started once cancelled
+    struct srix_write writes[PLAN_MAX_ENTRIES];
+    size_t writes_count = 0;
+    for (size_t i = 0; i < plan.count && !cancel_requested(); i++) {
+        const struct plan_entry *entry = &plan.entries[i];
+        if (entry->action == PLAN_WRITE) {
+            nfc_write_block(session->reader->device, entry->to, entry->block);
+            srix_write_init(&writes[writes_count++], entry->block, entry->to);
+        }
+    }
+
+    size_t failed = srix_readback_verify(session->reader->device, writes, writes_count, READBACK_MAX_RETRIES, READBACK_BASE_DELAY_US);
+    record_history(session, HISTORY_TOOL_RESTORE, image, writes, writes_count, failed, plan.skipped_impossible > 0);
+    if (failed > 0) session->rf_errors = true;
+
+    // Impossible writes were reported with the plan
+    return verify_writes(writes, writes_count, failed) && plan.skipped_impossible == 0;
+}
+
+static bool run_wait_for_tag(struct shell_session *session) {
+    if (session->reader != NULL) {
+        log_flush();
+        reader_pool_wait_for_removal(session->reader);
+        if (cancel_requested()) {
+            return false;
+        }
+
+        // The watchdog must not abort a released reader
+        cancel_disarm();
+        release_tag(session);
+    }
+
+    if (!select_tag(session)) {
+        return false;
+    }
+    cancel_arm(session->reader->device, session->deadline_ms);
+    return true;
+}
+
+static bool run_command(struct shell_session *session, struct shell_command *command) {
+    // The first tag is waited for outside of the timings
+    if (command->op != SHELL_WAIT_FOR_TAG && !select_tag(session)) {
+        command->result = SHELL_FAILED;
+        return false;
+    }
+
+    session->paused_us = 0;
+    uint64_t start_us = now_us();
+    if (session->reader != NULL) {
+        cancel_arm(session->reader->device, session->deadline_ms);
+    }
+
+    bool ok = false;
+    struct srix_image *image = srix_image_acquire(session->blocks);
+    switch (command->op) {
+        case SHELL_UID:
+            ok = run_uid(session, image);
+            break;
+        case SHELL_READ:
+            ok = run_read(session, command, image);
+            break;
+        case SHELL_WRITE:
+            ok = run_write(session, command, image);
+            break;
+        case SHELL_DIFF:
+            ok = run_diff(session, command, image);
+            break;
+        case SHELL_RESET_OTP:
+            ok = run_reset_otp(session, image);
+            break;
+        case SHELL_RESTORE:
+            ok = run_restore(session, command, image);
+            break;
+        case SHELL_WAIT_FOR_TAG:
+            ok = run_wait_for_tag(session);
+            break;
+    }
+    srix_image_release(image);
+
+    // Aborted commands leave the reader idle, make sure it still answers
+    if (cancel_requested()) {
+        log_flush();
+        printf("Cancelled by %s.\n", cancel_reason() == CANCEL_DEADLINE ? "deadline" : "signal");
+        session->deadline_reached |= cancel_reason() == CANCEL_DEADLINE;
+        if (session->reader != NULL) {
+            reader_pool_recover(&session->pool, session->reader);
+        }
+        ok = false;
+    }
+    cancel_disarm();
+
+    command->elapsed_us = now_us() - start_us - session->paused_us;
+    command->result = ok ? SHELL_OK : SHELL_FAILED;
+    return ok;
+}
+
+static void print_timings(const struct shell_script *script) {
+    uint64_t total_us = 0;
+
+    log_flush();
+    printf("Timings:\n");
+    for (size_t i = 0; i < script->count; i++) {
+        const struct shell_command *command = &script->commands[i];
+        printf("├── %4u  %-*s ", command->line, SHELL_TEXT_SIZE - 1, command->text);
+        if (command->result == SHELL_NOT_RUN) {
+            printf(DIM "%12s\n" RESET, "not run");
+            continue;
+        }
+
+        printf("%9.1f ms", command->elapsed_us / 1000.0);
+        printf(command->result == SHELL_FAILED ? RED " FAILED\n" RESET : "\n");
+        total_us += command->elapsed_us;
+    }
+    printf("└── %-*s %9.1f ms\n", SHELL_TEXT_SIZE + 5, "total", total_us / 1000.0);
+}
+
+// Back to back, until the first command that fails
+static bool run_script(struct shell_session *session, struct shell_script *script) {
+    bool ok = true;
+
+    for (size_t i = 0; i < script->count && ok && !cancel_requested(); i++) {
+        struct shell_command *command = &script->commands[i];
+        log_flush();
+        printf(BOLD SHELL_PROMPT "%s\n" RESET, command->text);
+        ok = run_command(session, command);
+        if (!ok && !cancel_requested()) {
+            log_flush();
+            fflush(stdout);
+            lerror("Line %u failed, stopping.\n", command->line);
+        }
+    }
+
+    print_timings(script);
+    return ok;
+}
+
+static void run_interactive(struct shell_session *session) {
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int line_number = 0;
+
+    print_commands();
+    for (;;) {
+        log_flush();
+        printf(SHELL_PROMPT);
+        fflush(stdout);
+        if (getline(&line, &line_size, stdin) == -1) {
+            printf("\n");
+            break;
+        }
+        line_number++;
+
+        char word[16] = "";
+        sscanf(line, "%15s", word);
+        if (strcmp(word, "quit") == 0 || strcmp(word, "exit") == 0) {
+            break;
+        }
+        if (strcmp(word, "help") == 0) {
+            print_commands();
+            continue;
+        }
+        // Every line is a script of its own
+        struct shell_script script = {};
+        if (compile_line(&script, NULL, line_number, line, session->blocks) && script.count == 1) {
+            run_command(session, &script.commands[0]);
+            log_flush();
+            printf(DIM "%.1f ms\n" RESET, script.commands[0].elapsed_us / 1000.0);
+        }
+        script_free(&script);
+
+        // A signal ends the session, a deadline only the command
+        if (cancel_requested()) {
+            break;
+        }
+    }
+    free(line);
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    bool skip_confirmation = false;
+    uint8_t eeprom_blocks_amount = SRIX4K_EEPROM_BLOCKS;
+    uint32_t reserve = SHELL_DEFAULT_RESERVE;
+    unsigned int deadline_ms = 0;
+    char *history_path = NULL;
+
+    // Parse options
+    static const struct option long_options[] = {
+            {"deadline-ms", required_argument, NULL, 'D'},
+            {"history", required_argument, NULL, 'W'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hvyt:k:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'y':
+                skip_confirmation = true;
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks_amount = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            case 'k':
+                reserve = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                deadline_ms = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'W':
+                history_path = optarg;
+                break;
+            default:
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) > 1) {
+        lerror("Too many arguments.\n\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    // Start background logging
+    log_start();
+    cancel_init();
+
+    // A script is compiled whole before the reader is opened
+    const char *script_path = argc - optind == 1 ? argv[optind] : NULL;
+    bool interactive = script_path == NULL && isatty(STDIN_FILENO);
+    bool script_from_stdin = !interactive && (script_path == NULL || strcmp(script_path, "-") == 0);
+    struct shell_script script = {};
+    if (!interactive) {
+        const char *source = script_from_stdin ? "stdin" : script_path;
+        FILE *file = script_from_stdin ? stdin : fopen(script_path, "r");
+        if (file == NULL) {
+            lerror("Cannot open \"%s\". Exiting...\n", script_path);
+            exit(1);
+        }
+
+        bool compiled = compile_script(&script, file, source, eeprom_blocks_amount);
+        if (file != stdin) {
+            fclose(file);
+        }
+        if (!compiled) {
+            lerror("Nothing was run. Exiting...\n");
+            exit(1);
+        }
+        lverbose("Compiled %zu commands from \"%s\".\n", script.count, source);
+
+        // Scripts are confirmed once, the answer comes from the terminal
+        if (script.writes && !skip_confirmation) {
+            if (script_from_stdin) {
+                lerror("A script read from stdin that writes needs -y. Exiting...\n");
+                exit(1);
+            }
+            struct shell_session asking = {};
+            if (!ask_confirmation(&asking, "This script writes to the tag.")) {
+                printf("Exiting...\n");
+                exit(0);
+            }
+        }
+        skip_confirmation = true;
+    }
+
+    // Flushed on every exit, after the last write
+    static struct history history_log;
+    if (history_path != NULL) {
+        int history_result = history_open(&history_log, history_path);
+        if (history_result != HISTORY_SUCCESS) {
+            lerror("Cannot open \"%s\": %s. Exiting...\n", history_path, history_strerror(history_result));
+            exit(1);
+        }
+        history = &history_log;
+        atexit(close_history);
+    }
+
+    // Initialize NFC
+    telemetry_open("srix-shell");
+    nfc_context *context = NULL;
+    nfc_init(&context);
+    if (context == NULL) {
+        lerror("Unable to init libnfc. Exiting...\n");
+        exit(1);
+    }
+
+    // Display libnfc version
+    lverbose("libnfc version: %s\n", nfc_version());
+
+    // One session for every command
+    static struct shell_session session;
+    session.blocks = eeprom_blocks_amount;
+    session.reserve = reserve;
+    session.deadline_ms = deadline_ms;
+    session.confirm = !skip_confirmation;
+    if (reader_pool_open(&session.pool, context) == 0) {
+        lerror("No readers available. Exiting...\n");
+        reader_pool_close(&session.pool);
+        close_nfc(context, NULL);
+        exit(1);
+    }
+
+    bool ok = true;
+    if (interactive) {
+        run_interactive(&session);
+    } else {
+        ok = run_script(&session, &script);
+    }
+    release_tag(&session);
+    script_free(&script);
+
+    // Close NFC
+    reader_pool_close(&session.pool);
+    close_nfc(context, NULL);
+
+    if (cancel_requested()) {
+        return cancel_exit_code();
+    }
+    if (!ok && session.deadline_reached) {
+        return CANCEL_EXIT_DEADLINE;
+    }
+    return ok ? 0 : 1;
+}
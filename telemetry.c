@@ -0,0 +1,226 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+#include "nfc_utils.h"
+#include "logging.h"
+
+static const char *operation_names[TELEMETRY_OPERATIONS] = {"idle", "waiting", "GET_UID", "READ_BLOCK", "WRITE_BLOCK", "other", "closed"};
+
+// Publisher state, NULL when the segment could not be created
+static struct telemetry_segment *segment;
+static char segment_name[64];
+static nfc_device *slot_devices[TELEMETRY_MAX_READERS];
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void remove_segment(void) {
+    shm_unlink(segment_name);
+}
+
+// Best effort, the tools work the same without a segment
+void telemetry_open(const char *tool) {
+    snprintf(segment_name, sizeof(segment_name), "/" TELEMETRY_NAME_PREFIX "%d", (int) getpid());
+    int fd = shm_open(segment_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        lverbose("Cannot create telemetry segment %s.\n", segment_name);
+        return;
+    }
+
+    void *mapped = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct telemetry_segment)) == 0) {
+        mapped = mmap(NULL, sizeof(struct telemetry_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        lverbose("Cannot map telemetry segment %s.\n", segment_name);
+        shm_unlink(segment_name);
+        return;
+    }
+
+    // ftruncate() zeroed every counter
+    struct telemetry_segment *created = mapped;
+    created->version = TELEMETRY_VERSION;
+    created->segment_size = sizeof(struct telemetry_segment);
+    created->reader_size = sizeof(struct telemetry_reader);
+    created->pid = (int32_t) getpid();
+    snprintf(created->tool, sizeof(created->tool), "%s", tool);
+    created->started_unix = (uint64_t) time(NULL);
+    atomic_thread_fence(memory_order_release);
+    created->magic = TELEMETRY_MAGIC;
+
+    segment = created;
+    atexit(remove_segment);
+    lverbose("Telemetry: %s\n", segment_name);
+}
+
+/*
+ * Slots are keyed by connstring, so a reader that is closed and reopened
+ * keeps its counters. The device pointer of each slot is cached, the common
+ * case is a scan of 16 pointers without any lock.
+ */
+static struct telemetry_reader *find_slot(nfc_device *reader) {
+    if (segment == NULL || reader == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < TELEMETRY_MAX_READERS; i++) {
+        if (slot_devices[i] == reader) {
+            return &segment->readers[i];
+        }
+    }
+
+    const char *connstring = nfc_device_get_connstring(reader);
+    struct telemetry_reader *slot = NULL;
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < TELEMETRY_MAX_READERS && slot == NULL; i++) {
+        struct telemetry_reader *candidate = &segment->readers[i];
+        if (atomic_load(&candidate->in_use) && strncmp(candidate->connstring, connstring, TELEMETRY_CONNSTRING_SIZE - 1) == 0) {
+            slot = candidate;
+            slot_devices[i] = reader;
+        }
+    }
+    for (int i = 0; i < TELEMETRY_MAX_READERS && slot == NULL; i++) {
+        struct telemetry_reader *candidate = &segment->readers[i];
+        if (!atomic_load(&candidate->in_use)) {
+            snprintf(candidate->connstring, TELEMETRY_CONNSTRING_SIZE, "%s", connstring);
+            atomic_store(&candidate->in_use, 1);
+            slot = candidate;
+            slot_devices[i] = reader;
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+
+    return slot;
+}
+
+static uint32_t operation_of(const uint8_t *tx_data, size_t tx_size) {
+    if (tx_size == 1 && tx_data[0] == SR_GET_UID_COMMAND) return TELEMETRY_OP_GET_UID;
+    if (tx_size == 2 && tx_data[0] == SR_READ_BLOCK_COMMAND) return TELEMETRY_OP_READ_BLOCK;
+    if (tx_size == 6 && tx_data[0] == SR_WRITE_BLOCK_COMMAND) return TELEMETRY_OP_WRITE_BLOCK;
+    return TELEMETRY_OP_OTHER;
+}
+
+struct telemetry_reader *telemetry_command_start(nfc_device *reader, const uint8_t *tx_data, size_t tx_size) {
+    struct telemetry_reader *slot = find_slot(reader);
+    if (slot != NULL) {
+        atomic_store_explicit(&slot->operation, operation_of(tx_data, tx_size), memory_order_relaxed);
+    }
+
+    return slot;
+}
+
+// WRITE_BLOCK gets no answer, it is counted as written once sent
+void telemetry_command_end(struct telemetry_reader *slot, const uint8_t *tx_data, size_t tx_size, size_t rx_size, uint32_t rtt_us) {
+    if (slot == NULL) {
+        return;
+    }
+
+    unsigned int bucket = 0;
+    while (rtt_us != 0 && bucket < TELEMETRY_LATENCY_BUCKETS - 1) {
+        bucket++;
+        rtt_us >>= 1u;
+    }
+
+    uint32_t operation = operation_of(tx_data, tx_size);
+    atomic_fetch_add_explicit(&slot->commands, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->latency_us[bucket], 1, memory_order_relaxed);
+    if (operation == TELEMETRY_OP_WRITE_BLOCK) {
+        atomic_fetch_add_explicit(&slot->blocks_written, 1, memory_order_relaxed);
+    } else if (operation == TELEMETRY_OP_READ_BLOCK && rx_size == 4) {
+        atomic_fetch_add_explicit(&slot->blocks_read, 1, memory_order_relaxed);
+    } else if (operation != TELEMETRY_OP_GET_UID || rx_size != 8) {
+        atomic_fetch_add_explicit(&slot->errors, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&slot->operation, TELEMETRY_OP_IDLE, memory_order_relaxed);
+}
+
+void telemetry_operation(nfc_device *reader, uint32_t operation) {
+    struct telemetry_reader *slot = find_slot(reader);
+    if (slot != NULL) {
+        atomic_store_explicit(&slot->operation, operation, memory_order_relaxed);
+    }
+}
+
+void telemetry_tag_done(nfc_device *reader) {
+    struct telemetry_reader *slot = find_slot(reader);
+    if (slot != NULL) {
+        atomic_fetch_add_explicit(&slot->tags, 1, memory_order_relaxed);
+    }
+}
+
+void telemetry_close_reader(nfc_device *reader) {
+    if (segment == NULL || reader == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < TELEMETRY_MAX_READERS; i++) {
+        if (slot_devices[i] == reader) {
+            atomic_store(&segment->readers[i].operation, TELEMETRY_OP_CLOSED);
+            slot_devices[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+}
+
+// Read only, NULL unless the segment exists and has this exact layout
+const struct telemetry_segment *telemetry_attach(pid_t pid) {
+    char name[64];
+    snprintf(name, sizeof(name), "/" TELEMETRY_NAME_PREFIX "%d", (int) pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == sizeof(struct telemetry_segment)) {
+        mapped = mmap(NULL, sizeof(struct telemetry_segment), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct telemetry_segment *attached = mapped;
+    if (attached->magic != TELEMETRY_MAGIC || attached->version != TELEMETRY_VERSION ||
+            attached->segment_size != sizeof(struct telemetry_segment) || attached->reader_size != sizeof(struct telemetry_reader)) {
+        munmap(mapped, sizeof(struct telemetry_segment));
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    return attached;
+}
+
+void telemetry_detach(const struct telemetry_segment *attached) {
+    if (attached != NULL) {
+        munmap((void *) attached, sizeof(struct telemetry_segment));
+    }
+}
+
+const char *telemetry_operation_name(uint32_t operation) {
+    return operation < TELEMETRY_OPERATIONS ? operation_names[operation] : "?";
+}
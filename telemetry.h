@@ -0,0 +1,95 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __NFC_SRIX_TELEMETRY_H__
+#define __NFC_SRIX_TELEMETRY_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <nfc/nfc.h>
+
+/* Macros */
+#define TELEMETRY_MAGIC 0x54585253 // "SRXT"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_NAME_PREFIX "srix-telemetry."
+#define TELEMETRY_MAX_READERS 16
+#define TELEMETRY_LATENCY_BUCKETS 24 // log2 of the round trip in us, up to 8 s
+#define TELEMETRY_CONNSTRING_SIZE 64
+
+/* Operations */
+#define TELEMETRY_OP_IDLE 0
+#define TELEMETRY_OP_WAITING 1 // Selecting a tag
+#define TELEMETRY_OP_GET_UID 2
+#define TELEMETRY_OP_READ_BLOCK 3
+#define TELEMETRY_OP_WRITE_BLOCK 4
+#define TELEMETRY_OP_OTHER 5
+#define TELEMETRY_OP_CLOSED 6
+#define TELEMETRY_OPERATIONS 7
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "telemetry counters must be lock free");
+
+/*
+ * Counters of one reader. Only the process owning the segment writes them,
+ * with relaxed atomics; readers may see a command counted in commands before
+ * its latency bucket, never a torn value.
+ */
+struct telemetry_reader {
+    char connstring[TELEMETRY_CONNSTRING_SIZE]; // Set before in_use
+    _Atomic uint32_t in_use;
+    _Atomic uint32_t operation;
+    _Atomic uint64_t tags;
+    _Atomic uint64_t commands;
+    _Atomic uint64_t blocks_read;
+    _Atomic uint64_t blocks_written;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t latency_us[TELEMETRY_LATENCY_BUCKETS];
+};
+
+/*
+ * POSIX shared memory segment "/srix-telemetry.<pid>", created by every tool
+ * that talks to readers and removed when it exits. The header never changes
+ * after creation; a new layout bumps TELEMETRY_VERSION, and monitors check
+ * magic, version and sizes before trusting anything else.
+ */
+struct telemetry_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment_size;
+    uint32_t reader_size;
+    int32_t pid;
+    char tool[28];
+    uint64_t started_unix;
+    struct telemetry_reader readers[TELEMETRY_MAX_READERS];
+};
+
+/* Publisher */
+void telemetry_open(const char *tool);
+struct telemetry_reader *telemetry_command_start(nfc_device *reader, const uint8_t *tx_data, size_t tx_size);
+void telemetry_command_end(struct telemetry_reader *slot, const uint8_t *tx_data, size_t tx_size, size_t rx_size, uint32_t rtt_us);
+void telemetry_operation(nfc_device *reader, uint32_t operation);
+void telemetry_tag_done(nfc_device *reader);
+void telemetry_close_reader(nfc_device *reader);
+
+/* Monitor */
+const struct telemetry_segment *telemetry_attach(pid_t pid);
+void telemetry_detach(const struct telemetry_segment *segment);
+const char *telemetry_operation_name(uint32_t operation);
+
+#endif // __NFC_SRIX_TELEMETRY_H__
@@ -0,0 +1,363 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "logging.h"
+#include "nfc_utils.h"
+#include "dump_utils.h"
+#include "corpus.h"
+#include "partial.h"
+#include "crc32c.h"
+
+/* Exit codes */
+#define VERIFY_EXIT_PASS 0
+#define VERIFY_EXIT_FAIL 1
+#define VERIFY_EXIT_ERROR 2
+
+/* Macros */
+#define VERIFY_PARTIAL_TOOL "srix-verify"
+
+/* Partial counters */
+#define VERIFY_COUNTER_PASSED 0
+#define VERIFY_COUNTER_FAILED 1
+#define VERIFY_COUNTER_ERRORS 2
+#define VERIFY_COUNTERS 3
+
+/* Partial entries */
+#define VERIFY_ENTRY_ERROR 0 // value = load result
+#define VERIFY_ENTRY_FAIL 1  // value = mismatching blocks
+
+/* Partial config words */
+#define VERIFY_CONFIG_EEPROM_BLOCKS 0
+#define VERIFY_CONFIG_TEMPLATE_CRC 1
+#define VERIFY_CONFIG_MASK_CRC 2
+
+struct verify_result {
+    int load_result;
+    unsigned int mismatch_count;
+    uint64_t mismatches[DUMP_BITMAP_WORDS];
+    struct srix_image image;
+};
+
+struct verify_context {
+    struct srix_image reference;
+    _Alignas(SRIX_IMAGE_ALIGNMENT) uint8_t mask[SRIX_IMAGE_MAX_SIZE];
+    uint8_t eeprom_blocks;
+    struct verify_result *results;
+    struct partial *partial; // NULL unless -o was given
+
+    // Totals, only touched by the calling thread
+    size_t passed;
+    size_t failed;
+    size_t errors;
+};
+
+static void print_usage(const char *executable) {
+    printf("Usage: %s <template.bin> <mask.bin> <dump.bin|dir>... [-h] [-v] [-j threads] [-t x4k|512] [--shard i/N] [-o partial]\n", executable);
+    printf("       %s merge <partial>... [-h]\n", executable);
+    printf("\nNecessary arguments:\n");
+    printf("  <template.bin>  golden dump to compare against\n");
+    printf("  <mask.bin>      byte mask, only bits set to 1 are compared\n");
+    printf("  <dump.bin|dir>  dumps to verify, directories are walked recursively\n");
+    printf("  <partial>       partial results written with -o, one per shard\n");
+    printf("\nOptions:\n");
+    printf("  -h           show this help message\n");
+    printf("  -v           enable verbose - print debugging data\n");
+    printf("  -j threads   number of worker threads [default: number of CPUs]\n");
+    printf("  -t x4k|512   select SRIX4K or SRI512 tag type [default: x4k]\n");
+    printf("  --shard i/N  only verify shard i of N, dumps are split by UID\n");
+    printf("  -o partial   write partial results to be merged instead of the failures\n");
+    printf("\nExit status:\n");
+    printf("  %d            every dump matches the template\n", VERIFY_EXIT_PASS);
+    printf("  %d            at least one dump does not match\n", VERIFY_EXIT_FAIL);
+    printf("  %d            invalid arguments or unreadable files\n", VERIFY_EXIT_ERROR);
+}
+
+static void verify_process(const char *path, size_t slot, unsigned int worker, void *arg) {
+    struct verify_context *context = arg;
+    struct verify_result *result = &context->results[slot];
+
+    result->mismatch_count = 0;
+    srix_image_init(&result->image, context->eeprom_blocks);
+    result->load_result = srix_image_load(&result->image, path, NULL);
+    if (result->load_result != DUMP_SUCCESS) {
+        return;
+    }
+
+    result->mismatch_count = srix_masked_compare(result->image.bytes, context->reference.bytes, context->mask, srix_image_size(&result->image), result->mismatches);
+}
+
+static void print_masked_bytes(const uint8_t *bytes, const uint8_t *mask) {
+    for (int i = 0; i < 4; i++) {
+        if (mask[i] == 0) {
+            printf(" --");
+        } else {
+            printf(" %02X", bytes[i]);
+        }
+    }
+}
+
+static void record_entry(struct partial *partial, const char *path, uint32_t kind, uint32_t value) {
+    int result = partial_add_entry(partial, path, kind, value);
+    if (result != PARTIAL_SUCCESS) {
+        lerror("Cannot record \"%s\": %s. Exiting...\n", path, partial_strerror(result));
+        exit(VERIFY_EXIT_ERROR);
+    }
+}
+
+static void verify_chunk_done(char *const *paths, size_t count, void *arg) {
+    struct verify_context *context = arg;
+
+    // Only failures are printed, in walk order
+    for (size_t i = 0; i < count; i++) {
+        struct verify_result *result = &context->results[i];
+
+        if (result->load_result != DUMP_SUCCESS) {
+            context->errors++;
+            if (context->partial != NULL) {
+                record_entry(context->partial, paths[i], VERIFY_ENTRY_ERROR, (uint32_t) result->load_result);
+            } else {
+                printf("%s: ERROR %s\n", paths[i], srix_dump_strerror(result->load_result));
+            }
+            continue;
+        }
+
+        if (result->mismatch_count == 0) {
+            context->passed++;
+            continue;
+        }
+
+        context->failed++;
+        if (context->partial != NULL) {
+            // Block details need the dump, merge only lists it
+            record_entry(context->partial, paths[i], VERIFY_ENTRY_FAIL, result->mismatch_count);
+            continue;
+        }
+
+        printf("%s: FAIL %u blocks\n", paths[i], result->mismatch_count);
+        for (uint8_t block = 0; block < context->eeprom_blocks; block++) {
+            if (!srix_bitmap_test(result->mismatches, block)) {
+                continue;
+            }
+
+            printf("  [%02X] expected", block);
+            print_masked_bytes(srix_image_block_bytes(&context->reference, block), context->mask + block * 4);
+            printf(", got");
+            print_masked_bytes(srix_image_block_bytes(&result->image, block), context->mask + block * 4);
+            printf(DIM " --- %s\n" RESET, srix_get_block_type(block));
+        }
+    }
+
+    fflush(stdout);
+}
+
+static bool load_reference(const char *path, uint8_t *bytes, uint32_t size) {
+    size_t file_size = 0;
+    int load_result = srix_load_dump(path, bytes, size, &file_size);
+    if (load_result == DUMP_ESIZE) {
+        lerror("\"%s\" wrong size, expected %u but read %zu.\n", path, size, file_size);
+        return false;
+    } else if (load_result != DUMP_SUCCESS) {
+        lerror("Cannot load \"%s\": %s.\n", path, srix_dump_strerror(load_result));
+        return false;
+    }
+
+    return true;
+}
+
+static int exit_status(uint64_t failed, uint64_t errors) {
+    if (errors > 0) {
+        return VERIFY_EXIT_ERROR;
+    }
+    if (failed > 0) {
+        return VERIFY_EXIT_FAIL;
+    }
+    return VERIFY_EXIT_PASS;
+}
+
+/*
+ * Combines the partials of every shard. Failures come out sorted by path, so
+ * the output is the same however the corpus was split.
+ */
+static int run_merge(int argc, char *argv[]) {
+    // Parse options
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "hv")) != -1) {
+        switch (opt) {
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(VERIFY_EXIT_PASS);
+            default:
+                print_usage(argv[0]);
+                exit(VERIFY_EXIT_ERROR);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 1) {
+        lerror("You need to specify at least one partial result.\n\n");
+        print_usage(argv[0]);
+        exit(VERIFY_EXIT_ERROR);
+    }
+
+    struct partial merged;
+    int merge_result = partial_merge(&merged, VERIFY_PARTIAL_TOOL, VERIFY_COUNTERS, argv + optind, argc - optind);
+    if (merge_result != PARTIAL_SUCCESS) {
+        lerror("Cannot merge partial results: %s.\n", partial_strerror(merge_result));
+        exit(VERIFY_EXIT_ERROR);
+    }
+
+    for (size_t i = 0; i < merged.entry_count; i++) {
+        struct partial_entry *entry = &merged.entries[i];
+        if (entry->kind == VERIFY_ENTRY_ERROR) {
+            printf("%s: ERROR %s\n", entry->path, srix_dump_strerror((int32_t) entry->value));
+        } else {
+            printf("%s: FAIL %" PRIu32 " blocks\n", entry->path, entry->value);
+        }
+    }
+
+    uint64_t *counters = merged.counters;
+    lverbose("Merged %" PRIu32 " shards: %" PRIu64 " passed, %" PRIu64 " failed, %" PRIu64 " errors.\n", merged.shard_count,
+             counters[VERIFY_COUNTER_PASSED], counters[VERIFY_COUNTER_FAILED], counters[VERIFY_COUNTER_ERRORS]);
+
+    int status = exit_status(counters[VERIFY_COUNTER_FAILED], counters[VERIFY_COUNTER_ERRORS]);
+    partial_free(&merged);
+    return status;
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        // Keep the executable name for the usage message
+        argv[1] = argv[0];
+        return run_merge(argc - 1, argv + 1);
+    }
+
+    // Options
+    unsigned int threads = 0;
+    uint8_t eeprom_blocks = SRIX4K_EEPROM_BLOCKS;
+    unsigned int shard_index = 0;
+    unsigned int shard_count = 0;
+    char *partial_path = NULL;
+
+    // Parse options
+    static const struct option long_options[] = {
+            {"shard", required_argument, NULL, 'H'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "hvj:t:o:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                if (!corpus_parse_shard(optarg, &shard_index, &shard_count)) {
+                    lerror("Invalid shard \"%s\", expected i/N with i < N.\n", optarg);
+                    exit(VERIFY_EXIT_ERROR);
+                }
+                break;
+            case 'o':
+                partial_path = optarg;
+                break;
+            case 'v':
+                set_verbose(true);
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp(optarg, "512") == 0) {
+                    eeprom_blocks = SRI512_EEPROM_BLOCKS;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(VERIFY_EXIT_PASS);
+            default:
+                print_usage(argv[0]);
+                exit(VERIFY_EXIT_ERROR);
+        }
+    }
+
+    // Check arguments
+    if ((argc - optind) < 3) {
+        lerror("You need to specify <template.bin>, <mask.bin> and at least one dump.\n\n");
+        print_usage(argv[0]);
+        exit(VERIFY_EXIT_ERROR);
+    }
+
+    size_t chunk_size = CORPUS_DEFAULT_CHUNK_SIZE;
+    struct verify_context *context = calloc(1, sizeof(struct verify_context));
+    if (context == NULL || (context->results = malloc(sizeof(struct verify_result) * chunk_size)) == NULL) {
+        lerror("Out of memory. Exiting...\n");
+        exit(VERIFY_EXIT_ERROR);
+    }
+    context->eeprom_blocks = eeprom_blocks;
+    srix_image_init(&context->reference, eeprom_blocks);
+
+    // Load template and mask
+    if (!load_reference(argv[optind], context->reference.bytes, eeprom_blocks * 4) || !load_reference(argv[optind + 1], context->mask, eeprom_blocks * 4)) {
+        exit(VERIFY_EXIT_ERROR);
+    }
+
+    struct partial partial;
+    if (partial_path != NULL) {
+        if (partial_init(&partial, VERIFY_PARTIAL_TOOL, VERIFY_COUNTERS) != PARTIAL_SUCCESS) {
+            lerror("Out of memory. Exiting...\n");
+            exit(VERIFY_EXIT_ERROR);
+        }
+        partial.shard_index = shard_index;
+        partial.shard_count = shard_count > 0 ? shard_count : 1;
+        partial.config[VERIFY_CONFIG_EEPROM_BLOCKS] = eeprom_blocks;
+        partial.config[VERIFY_CONFIG_TEMPLATE_CRC] = crc32c(0, context->reference.bytes, eeprom_blocks * 4);
+        partial.config[VERIFY_CONFIG_MASK_CRC] = crc32c(0, context->mask, eeprom_blocks * 4);
+        context->partial = &partial;
+    }
+
+    struct corpus_job job = {
+            .threads = threads,
+            .chunk_size = chunk_size,
+            .process = verify_process,
+            .chunk_done = verify_chunk_done,
+            .arg = context,
+            .shard_index = shard_index,
+            .shard_count = shard_count,
+    };
+    size_t total = corpus_run(&job, argv + optind + 2, argc - optind - 2);
+
+    lverbose("Verified %zu dumps: %zu passed, %zu failed, %zu errors.\n", total, context->passed, context->failed, context->errors);
+
+    if (partial_path != NULL) {
+        partial.counters[VERIFY_COUNTER_PASSED] = context->passed;
+        partial.counters[VERIFY_COUNTER_FAILED] = context->failed;
+        partial.counters[VERIFY_COUNTER_ERRORS] = context->errors;
+        int write_result = partial_write(&partial, partial_path);
+        if (write_result != PARTIAL_SUCCESS) {
+            lerror("Cannot write \"%s\": %s.\n", partial_path, partial_strerror(write_result));
+            exit(VERIFY_EXIT_ERROR);
+        }
+        partial_free(&partial);
+    }
+
+    return exit_status(context->failed, context->errors);
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <nfc/nfc.h>
+#include "write_plan.h"
+#include "nfc_utils.h"
+#include "logging.h"
+
+static void plan_add(struct write_plan *plan, uint8_t block, uint32_t from, uint32_t to, int action) {
+    struct plan_entry *entry = &plan->entries[plan->count++];
+    entry->block = block;
+    entry->from = from;
+    entry->to = to;
+    entry->action = action;
+
+    switch (action) {
+        case PLAN_WRITE:
+            plan->writes++;
+            break;
+        case PLAN_SKIP_LOCKED:
+            plan->skipped_locked++;
+            break;
+        case PLAN_SKIP_IMPOSSIBLE:
+            plan->skipped_impossible++;
+            break;
+        case PLAN_SKIP_EXCLUDED:
+            plan->skipped_excluded++;
+            break;
+    }
+}
+
+// Blocks 05 and 06 count down, the tag ignores writes of a higher value
+static bool counter_increments(const struct srix_image *current, const struct srix_image *target, uint8_t block) {
+    return srix_image_value(target, block) > srix_image_value(current, block);
+}
+
+bool srix_plan_touches_otp_area(const struct srix_image *current, const struct srix_image *target) {
+    return memcmp(current->bytes, target->bytes, 7 * 4) != 0;
+}
+
+void srix_plan_writes(struct write_plan *plan, const struct srix_image *current, const struct srix_image *target, bool include_otp_area) {
+    memset(plan, 0, sizeof(struct write_plan));
+
+    // Only blocks both images have, a short target is not a diff against zeros
+    uint8_t blocks = current->blocks < target->blocks ? current->blocks : target->blocks;
+    if (blocks < 7) {
+        return;
+    }
+    uint32_t system_block = current->has_system_block ? srix_image_system_value(current) : 0xFFFFFFFF;
+
+    // Block 06 first, lowering its reload counter starts the auto erase cycle of blocks 00-04
+    uint32_t current_6 = srix_image_block(current, 6);
+    uint32_t target_6 = srix_image_block(target, 6);
+    if (current_6 != target_6) {
+        if (!include_otp_area) {
+            plan_add(plan, 6, current_6, target_6, PLAN_SKIP_EXCLUDED);
+        } else if (counter_increments(current, target, 6)) {
+            plan_add(plan, 6, current_6, target_6, PLAN_SKIP_IMPOSSIBLE);
+        } else {
+            plan_add(plan, 6, current_6, target_6, PLAN_WRITE);
+            plan->erase_cycle = srix_otp_resets_remaining(srix_image_value(target, 6)) < srix_otp_resets_remaining(srix_image_value(current, 6));
+        }
+    }
+
+    // OTP blocks
+    for (uint8_t i = 0; i < 5; i++) {
+        uint32_t from = plan->erase_cycle ? 0xFFFFFFFF : srix_image_block(current, i);
+        uint32_t to = srix_image_block(target, i);
+        if (from == to) {
+            continue;
+        }
+
+        if (!include_otp_area) {
+            plan_add(plan, i, from, to, PLAN_SKIP_EXCLUDED);
+        } else if ((to & ~from) != 0) {
+            plan_add(plan, i, from, to, PLAN_SKIP_IMPOSSIBLE);
+        } else {
+            plan_add(plan, i, from, to, PLAN_WRITE);
+        }
+    }
+
+    // Everything else in ascending order
+    for (uint8_t i = 5; i < blocks; i++) {
+        if (i == 6) {
+            continue;
+        }
+
+        uint32_t from = srix_image_block(current, i);
+        uint32_t to = srix_image_block(target, i);
+        if (from == to) {
+            continue;
+        }
+
+        if (i < 7 && !include_otp_area) {
+            plan_add(plan, i, from, to, PLAN_SKIP_EXCLUDED);
+        } else if (srix_block_is_locked(system_block, i)) {
+            plan_add(plan, i, from, to, PLAN_SKIP_LOCKED);
+        } else if (i == 5 && counter_increments(current, target, 5)) {
+            plan_add(plan, i, from, to, PLAN_SKIP_IMPOSSIBLE);
+        } else {
+            plan_add(plan, i, from, to, PLAN_WRITE);
+        }
+    }
+}
+
+// Every write is followed by its verification read
+uint64_t srix_plan_estimate_us(const struct write_plan *plan) {
+    return (uint64_t) plan->writes * (PLAN_WRITE_TIME_US + PLAN_READ_TIME_US);
+}
+
+void srix_plan_print(const struct write_plan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct plan_entry *entry = &plan->entries[i];
+
+        printf("[%02X] %08X -> %08X", entry->block, entry->from, entry->to);
+        switch (entry->action) {
+            case PLAN_WRITE:
+                if (entry->block == 6 && plan->erase_cycle) {
+                    printf(DIM " --- auto erase cycle of blocks 00-04" RESET);
+                }
+                break;
+            case PLAN_SKIP_LOCKED:
+                printf(RED " LOCKED" RESET DIM " --- skipped" RESET);
+                break;
+            case PLAN_SKIP_IMPOSSIBLE:
+                printf(RED " IMPOSSIBLE" RESET DIM " --- skipped" RESET);
+                break;
+            case PLAN_SKIP_EXCLUDED:
+                printf(DIM " --- skipped" RESET);
+                break;
+        }
+        printf("\n");
+    }
+
+    // OTP bits can only be cleared and counters only count down, report what cannot be done
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct plan_entry *entry = &plan->entries[i];
+        if (entry->action != PLAN_SKIP_IMPOSSIBLE) {
+            continue;
+        }
+        if (entry->block == 5 || entry->block == 6) {
+            lerror("Block %02X cannot be written: it is a count down counter and %08X is higher than %08X.\n",
+                    entry->block, entry->to, entry->from);
+        } else {
+            lerror("Block %02X cannot be written: bits %08X would go from 0 to 1 without an auto erase cycle.\n",
+                    entry->block, entry->to & ~entry->from);
+        }
+    }
+
+    uint64_t estimate_us = srix_plan_estimate_us(plan);
+    printf("Planned writes: %zu", plan->writes);
+    if (plan->skipped_locked + plan->skipped_impossible + plan->skipped_excluded > 0) {
+        printf(" (skipped: %zu locked, %zu impossible, %zu excluded)",
+                plan->skipped_locked, plan->skipped_impossible, plan->skipped_excluded);
+    }
+    printf(", estimated time: %" PRIu64 ".%03" PRIu64 " s\n", estimate_us / 1000000, (estimate_us / 1000) % 1000);
+}
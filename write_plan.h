@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019-2020 Giacomo Ferretti
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __NFC_SRIX_WRITE_PLAN_H__
+#define __NFC_SRIX_WRITE_PLAN_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "srix_image.h"
+
+/* Macros */
+#define PLAN_MAX_ENTRIES 128
+#define PLAN_READ_TIME_US 2500  // READ_BLOCK round trip
+#define PLAN_WRITE_TIME_US 7000 // WRITE_BLOCK frame + EEPROM programming time
+
+/* Actions */
+#define PLAN_WRITE 0
+#define PLAN_SKIP_LOCKED 1     // Locked by OTP_Lock_Reg
+#define PLAN_SKIP_IMPOSSIBLE 2 // OTP bits can only go from 1 to 0, counters can only count down
+#define PLAN_SKIP_EXCLUDED 3   // Blocks 00-06 not requested
+
+struct plan_entry {
+    uint8_t block;
+    uint32_t from;
+    uint32_t to;
+    int action;
+};
+
+/*
+ * Ordered list of the blocks that differ. Block 06 always comes first: when
+ * the write lowers its reload counter (b31-b21) the auto erase cycle resets
+ * blocks 00-04 and the OTP blocks are planned against their erased value.
+ * Counters are compared as the datasheet values. Lock bits come from the
+ * system block of current, when it has one.
+ */
+struct write_plan {
+    struct plan_entry entries[PLAN_MAX_ENTRIES];
+    size_t count;
+
+    size_t writes;
+    size_t skipped_locked;
+    size_t skipped_impossible;
+    size_t skipped_excluded;
+    bool erase_cycle;
+};
+
+void srix_plan_writes(struct write_plan *plan, const struct srix_image *current, const struct srix_image *target, bool include_otp_area);
+bool srix_plan_touches_otp_area(const struct srix_image *current, const struct srix_image *target);
+uint64_t srix_plan_estimate_us(const struct write_plan *plan);
+void srix_plan_print(const struct write_plan *plan);
+
+#endif // __NFC_SRIX_WRITE_PLAN_H__